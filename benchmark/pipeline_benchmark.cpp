@@ -0,0 +1,561 @@
+#include <benchmark/benchmark.h>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/common/transforms.h>
+#include <pcl/filters/voxel_grid.h>
+#include <pcl/registration/ndt.h>
+#include <pcl/registration/gicp.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+#include <pclomp/ndt_omp.h>
+#include <pclomp/ndt_omp_impl.hpp>
+#include <pclomp/voxel_grid_covariance_omp.h>
+#include <pclomp/voxel_grid_covariance_omp_impl.hpp>
+#include <pclomp/gicp_omp.h>
+#include <pclomp/gicp_omp_impl.hpp>
+
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "sensor_msgs/msg/point_cloud2.hpp"
+
+#include "lidar_localization/lazy_ndt.hpp"
+#include "lidar_localization/lidar_undistortion.hpp"
+#include "lidar_localization/loam_features.hpp"
+#include "lidar_localization/loam_registration.hpp"
+#include "lidar_localization/organized_scan.hpp"
+#include "lidar_localization/point_kernels.hpp"
+#include "lidar_localization/range_adaptive_downsampler.hpp"
+#include "lidar_localization/synthetic_lidar.hpp"
+#include "lidar_localization/voxel_grid_filter.hpp"
+
+// Micro-benchmarks of the stages of PCLLocalization::cloudReceived, on scans raycast from a
+// procedural scene so that no dataset is needed. The scan size is set by the number of
+// columns of a 16 channel sensor (450 columns ~ 7k points, 1800 ~ 29k).
+namespace
+{
+
+using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+using Registration = pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>;
+
+const double kVoxelLeafSize = 0.2;  /*[m]*/
+const double kScanPeriod = 0.1;  /*[sec]*/
+const int kSpeedupRuns = 20;
+
+// ground and rows of buildings on both sides of a 100 m street
+const Cloud & scene()
+{
+  static const Cloud cloud = []() {
+      Cloud c;
+      std::mt19937 rng(0);
+      std::uniform_real_distribution<double> height(4.0, 15.0);
+      auto add = [&c](const double x, const double y, const double z) {
+          pcl::PointXYZI p;
+          p.x = static_cast<float>(x);
+          p.y = static_cast<float>(y);
+          p.z = static_cast<float>(z);
+          p.intensity = 50.0f;
+          c.push_back(p);
+        };
+      const double spacing = 0.1;
+      for (double x = -60.0; x < 60.0; x += spacing) {
+        for (double y = -30.0; y < 30.0; y += spacing) {
+          add(x, y, 0.0);
+        }
+      }
+      for (double x0 = -60.0; x0 < 60.0; x0 += 15.0) {
+        for (const double y : {-12.0, 12.0}) {
+          const double h = height(rng);
+          for (double x = x0; x < x0 + 12.0; x += spacing) {
+            for (double z = 0.0; z < h; z += spacing) {
+              add(x, y, z);
+            }
+          }
+        }
+      }
+      return c;
+    }();
+  return cloud;
+}
+
+Eigen::Isometry3d sensorPose(const double time)
+{
+  // 10 m/s along the street while turning slowly, so the sweep is distorted
+  Eigen::Isometry3d pose = Eigen::Isometry3d::Identity();
+  pose.translation() = Eigen::Vector3d(10.0 * time, 0.0, 1.8);
+  pose.linear() = Eigen::AngleAxisd(0.2 * time, Eigen::Vector3d::UnitZ()).toRotationMatrix();
+  return pose;
+}
+
+const Cloud::Ptr & scan(const int columns, const bool organized = false)
+{
+  static std::map<std::pair<int, bool>, Cloud::Ptr> scans;
+  Cloud::Ptr & cloud = scans[std::make_pair(columns, organized)];
+  if (!cloud) {
+    SyntheticLidar lidar;
+    SyntheticLidar::BeamModel beam_model;
+    beam_model.columns = columns;
+    beam_model.organized = organized;
+    lidar.setBeamModel(beam_model);
+    lidar.setMap(scene(), 0.1);
+    std::mt19937 rng(0);
+    cloud = lidar.scan(sensorPose, 0.0, kScanPeriod, rng);
+  }
+  return cloud;
+}
+
+Cloud::Ptr downsample(const Cloud::Ptr & cloud)
+{
+  Cloud::Ptr filtered(new Cloud);
+  VoxelGridFilter voxel_grid_filter;
+  voxel_grid_filter.setLeafSize(kVoxelLeafSize);
+  voxel_grid_filter.filter(*cloud, *filtered);
+  return filtered;
+}
+
+void setPointCounters(benchmark::State & state, const size_t num_points)
+{
+  state.SetItemsProcessed(state.iterations() * num_points);
+  state.counters["points"] = static_cast<double>(num_points);
+}
+
+void BM_FromROSMsg(benchmark::State & state)
+{
+  sensor_msgs::msg::PointCloud2 msg;
+  pcl::toROSMsg(*scan(state.range(0)), msg);
+  Cloud cloud;
+  for (auto _ : state) {
+    pcl::fromROSMsg(msg, cloud);
+    benchmark::DoNotOptimize(cloud.points.data());
+  }
+  setPointCounters(state, cloud.size());
+}
+
+
+// range(1): max points per NDT cell, 0 for none
+void BM_RangeAdaptiveDownsampler(benchmark::State & state)
+{
+  const Cloud::Ptr & input = scan(state.range(0));
+  RangeAdaptiveDownsampler downsampler;
+  downsampler.setLeafSize(kVoxelLeafSize);
+  downsampler.setMaxLeafSize(8 * kVoxelLeafSize);
+  downsampler.setReferenceRange(20.0);
+  downsampler.setCellSize(1.0, static_cast<int>(state.range(1)));
+  Cloud output;
+  for (auto _ : state) {
+    downsampler.filter(*input, output);
+    benchmark::DoNotOptimize(output.points.data());
+  }
+  setPointCounters(state, input->size());
+  state.counters["output_points"] = output.size();
+}
+
+// range crop, ground detection and GICP covariances, without the voxel grid filter
+void BM_OrganizedScanProcessor(benchmark::State & state)
+{
+  const Cloud::Ptr & input = scan(state.range(0), true);
+  OrganizedScanProcessor processor;
+  processor.setRange(1.0, 100.0);
+  processor.setColumnStride(2, 8);
+  Cloud output;
+  OrganizedScanProcessor::Covariances covariances;
+  for (auto _ : state) {
+    processor.filter(*input, output, covariances);
+    benchmark::DoNotOptimize(covariances.data());
+  }
+  setPointCounters(state, input->size());
+  state.counters["output_points"] = output.size();
+}
+
+void BM_LoamFeatureExtractor(benchmark::State & state)
+{
+  const Cloud::Ptr & input = scan(state.range(0), true);
+  LoamFeatureExtractor extractor;
+  extractor.setRange(1.0, 100.0);
+  Cloud edges;
+  Cloud planes;
+  for (auto _ : state) {
+    extractor.extract(*input, edges, planes);
+    benchmark::DoNotOptimize(planes.points.data());
+  }
+  setPointCounters(state, input->size());
+  state.counters["edges"] = edges.size();
+  state.counters["planes"] = planes.size();
+}
+
+// Speedup of a PointKernels kernel over its scalar reference, labelled with the instruction
+// set, so that a run on the target board reports it directly. Both are timed after the
+// benchmark loop, best of kSpeedupRuns.
+template<typename Scalar, typename Kernel>
+void setSpeedupCounter(benchmark::State & state, Scalar scalar, Kernel kernel)
+{
+  const auto best_time = [](auto & function) {
+      double best = std::numeric_limits<double>::max();
+      for (int run = 0; run < kSpeedupRuns; ++run) {
+        const auto start = std::chrono::steady_clock::now();
+        function();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+      }
+      return best;
+    };
+  state.counters["speedup"] = best_time(scalar) / best_time(kernel);
+  state.SetLabel(PointKernels::isa());
+}
+
+// same crop as cloudReceived
+void BM_RangeCrop(benchmark::State & state)
+{
+  const Cloud::Ptr & input = scan(state.range(0));
+  const double scan_min_range = 1.0;
+  const double scan_max_range = 100.0;
+  Cloud tmp;
+  for (auto _ : state) {
+    tmp.clear();
+    PointKernels::cropRange(*input, scan_min_range, scan_max_range, tmp);
+    benchmark::DoNotOptimize(tmp.points.data());
+  }
+  setPointCounters(state, input->size());
+  setSpeedupCounter(
+    state,
+    [&]() {
+      tmp.clear();
+      PointKernels::cropRangeScalar(*input, scan_min_range, scan_max_range, tmp);
+      benchmark::DoNotOptimize(tmp.points.data());
+    },
+    [&]() {
+      tmp.clear();
+      PointKernels::cropRange(*input, scan_min_range, scan_max_range, tmp);
+      benchmark::DoNotOptimize(tmp.points.data());
+    });
+}
+
+// keys of ParallelMapLoader::voxelFilter
+void BM_VoxelKeys(benchmark::State & state)
+{
+  const Cloud::Ptr & input = scan(state.range(0));
+  const double inv_leaf_size = 1.0 / kVoxelLeafSize;
+  std::vector<uint64_t> keys(input->size());
+  for (auto _ : state) {
+    PointKernels::voxelKeys(input->points.data(), input->size(), inv_leaf_size, keys.data());
+    benchmark::DoNotOptimize(keys.data());
+  }
+  setPointCounters(state, input->size());
+  setSpeedupCounter(
+    state,
+    [&]() {
+      PointKernels::voxelKeysScalar(
+        input->points.data(), input->size(), inv_leaf_size, keys.data());
+      benchmark::DoNotOptimize(keys.data());
+    },
+    [&]() {
+      PointKernels::voxelKeys(input->points.data(), input->size(), inv_leaf_size, keys.data());
+      benchmark::DoNotOptimize(keys.data());
+    });
+}
+
+// scan voxel grid of cloudReceived, the speedup being over pcl::VoxelGrid
+void BM_VoxelGridFilter(benchmark::State & state)
+{
+  const Cloud::Ptr & input = scan(state.range(0));
+  VoxelGridFilter voxel_grid_filter;
+  voxel_grid_filter.setLeafSize(kVoxelLeafSize);
+  Cloud output;
+  for (auto _ : state) {
+    voxel_grid_filter.filter(*input, output);
+    benchmark::DoNotOptimize(output.points.data());
+  }
+  setPointCounters(state, input->size());
+  pcl::VoxelGrid<pcl::PointXYZI> pcl_voxel_grid_filter;
+  pcl_voxel_grid_filter.setLeafSize(kVoxelLeafSize, kVoxelLeafSize, kVoxelLeafSize);
+  pcl_voxel_grid_filter.setInputCloud(input);
+  setSpeedupCounter(
+    state,
+    [&]() {
+      pcl_voxel_grid_filter.filter(output);
+      benchmark::DoNotOptimize(output.points.data());
+    },
+    [&]() {
+      voxel_grid_filter.filter(*input, output);
+      benchmark::DoNotOptimize(output.points.data());
+    });
+}
+
+void BM_TransformPointCloud(benchmark::State & state)
+{
+  const Cloud::Ptr & input = scan(state.range(0));
+  const Eigen::Matrix4f transform = sensorPose(0.05).matrix().cast<float>();
+  Cloud output;
+  for (auto _ : state) {
+    PointKernels::transform(*input, transform, output);
+    benchmark::DoNotOptimize(output.points.data());
+  }
+  setPointCounters(state, input->size());
+  setSpeedupCounter(
+    state,
+    [&]() {
+      PointKernels::transformScalar(*input, transform, output);
+      benchmark::DoNotOptimize(output.points.data());
+    },
+    [&]() {
+      PointKernels::transform(*input, transform, output);
+      benchmark::DoNotOptimize(output.points.data());
+    });
+}
+
+// one batch of LazyNDT correspondences
+void BM_NdtDerivatives(benchmark::State & state)
+{
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+  PointKernels::NdtTerms terms;
+  while (terms.size < PointKernels::kNdtBatchSize) {
+    const Eigen::Vector3d q(30.0 * uniform(rng), 30.0 * uniform(rng), 3.0 * uniform(rng));
+    const Eigen::Vector3d d(uniform(rng), uniform(rng), uniform(rng));
+    const Eigen::Matrix3d icov = Eigen::Vector3d(1.0, 1.0, 100.0).asDiagonal();
+    terms.add(uniform(rng), q, icov, icov * d);
+  }
+  double sums[PointKernels::kNdtSums] = {};
+  for (auto _ : state) {
+    PointKernels::accumulateNdt(terms, 0.5, sums);
+    benchmark::DoNotOptimize(sums);
+  }
+  state.SetItemsProcessed(state.iterations() * terms.size);
+  setSpeedupCounter(
+    state,
+    [&]() {
+      for (int i = 0; i < 1000; ++i) {
+        PointKernels::accumulateNdtScalar(terms, 0.5, sums);
+      }
+      benchmark::DoNotOptimize(sums);
+    },
+    [&]() {
+      for (int i = 0; i < 1000; ++i) {
+        PointKernels::accumulateNdt(terms, 0.5, sums);
+      }
+      benchmark::DoNotOptimize(sums);
+    });
+}
+
+// azimuths of LidarUndistortion::adjustDistortion
+void BM_Azimuths(benchmark::State & state)
+{
+  const Cloud::Ptr & input = scan(state.range(0));
+  std::vector<float> azimuths(input->size());
+  for (auto _ : state) {
+    PointKernels::azimuths(input->points.data(), input->size(), azimuths.data());
+    benchmark::DoNotOptimize(azimuths.data());
+  }
+  setPointCounters(state, input->size());
+  setSpeedupCounter(
+    state,
+    [&]() {
+      PointKernels::azimuthsScalar(input->points.data(), input->size(), azimuths.data());
+      benchmark::DoNotOptimize(azimuths.data());
+    },
+    [&]() {
+      PointKernels::azimuths(input->points.data(), input->size(), azimuths.data());
+      benchmark::DoNotOptimize(azimuths.data());
+    });
+}
+
+void BM_UndistortionGetImu(benchmark::State & state)
+{
+  LidarUndistortion lidar_undistortion;
+  lidar_undistortion.setScanPeriod(kScanPeriod);
+  const Eigen::Vector3f angular_velo(0.0f, 0.0f, 0.2f);
+  const Eigen::Vector3f acc(0.0f, 0.0f, 9.8f);
+  double imu_time = 0.0;
+  for (auto _ : state) {
+    const Eigen::Quaternionf quat(Eigen::AngleAxisf(0.2f * imu_time, Eigen::Vector3f::UnitZ()));
+    lidar_undistortion.getImu(angular_velo, acc, quat, imu_time);
+    imu_time += 0.005;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_AdjustDistortion(benchmark::State & state)
+{
+  const Cloud::Ptr & input = scan(state.range(0));
+  LidarUndistortion lidar_undistortion;
+  lidar_undistortion.setScanPeriod(kScanPeriod);
+  for (double imu_time = -0.1; imu_time < 0.2; imu_time += 0.005) {
+    const Eigen::Quaternionf quat(Eigen::AngleAxisf(0.2f * imu_time, Eigen::Vector3f::UnitZ()));
+    lidar_undistortion.getImu(
+      Eigen::Vector3f(0.0f, 0.0f, 0.2f), Eigen::Vector3f(0.0f, 0.0f, 9.8f), quat, imu_time);
+  }
+  for (auto _ : state) {
+    state.PauseTiming();
+    Cloud::Ptr cloud(new Cloud(*input));
+    state.ResumeTiming();
+    lidar_undistortion.adjustDistortion(cloud, 0.0);
+    benchmark::DoNotOptimize(cloud->points.data());
+  }
+  setPointCounters(state, input->size());
+}
+
+enum Method { NDT, NDT_OMP, NDT_LAZY, GICP, GICP_OMP, LOAM };
+
+boost::shared_ptr<Registration> createRegistration(const Method method, const int num_threads)
+{
+  boost::shared_ptr<Registration> registration;
+  switch (method) {
+    case NDT: {
+        boost::shared_ptr<pcl::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI>> ndt(
+          new pcl::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI>());
+        ndt->setStepSize(0.1);
+        ndt->setResolution(2.0);
+        registration = ndt;
+        break;
+      }
+    case NDT_OMP: {
+        pclomp::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI>::Ptr ndt_omp(
+          new pclomp::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI>());
+        ndt_omp->setStepSize(0.1);
+        ndt_omp->setResolution(2.0);
+        ndt_omp->setNumThreads(num_threads);
+        registration = ndt_omp;
+        break;
+      }
+    case NDT_LAZY: {
+        LazyNDT::Ptr ndt_lazy(new LazyNDT());
+        ndt_lazy->setStepSize(0.1);
+        ndt_lazy->setResolution(2.0);
+        ndt_lazy->setNumThreads(num_threads);
+        registration = ndt_lazy;
+        break;
+      }
+    case LOAM: {
+        LoamRegistration::Ptr loam(new LoamRegistration());
+        loam->setResolution(1.0);
+        loam->setNumThreads(num_threads);
+        registration = loam;
+        break;
+      }
+    case GICP: {
+        registration.reset(
+          new pcl::GeneralizedIterativeClosestPoint<pcl::PointXYZI, pcl::PointXYZI>());
+        break;
+      }
+    case GICP_OMP: {
+        registration.reset(
+          new pclomp::GeneralizedIterativeClosestPoint<pcl::PointXYZI, pcl::PointXYZI>());
+        // gicp_omp takes its threads from OpenMP
+        omp_set_num_threads(num_threads);
+        break;
+      }
+  }
+  registration->setTransformationEpsilon(0.01);
+  registration->setMaximumIterations(35);
+  return registration;
+}
+
+// range(0): scan columns, range(1): threads (ignored by NDT and GICP)
+void BM_Align(benchmark::State & state, const Method method)
+{
+  const Cloud::Ptr source = downsample(scan(state.range(0)));
+  static const Cloud::Ptr target = downsample(Cloud::Ptr(new Cloud(scene())));
+  const bool is_gicp = method == GICP || method == GICP_OMP;
+  auto registration = createRegistration(method, static_cast<int>(state.range(1)));
+  // GICP aligns against the downsampled map, as in the node
+  registration->setInputTarget(
+    is_gicp ? target : Cloud::Ptr(new Cloud(scene())));
+  registration->setInputSource(source);
+  size_t num_points = source->size();
+  if (method == LOAM) {
+    // the features of the same sweep, organized
+    LoamFeatureExtractor extractor;
+    Cloud edges;
+    Cloud planes;
+    extractor.extract(*scan(state.range(0), true), edges, planes);
+    boost::static_pointer_cast<LoamRegistration>(registration)->setInputFeatures(edges, planes);
+    num_points = edges.size() + planes.size();
+  }
+
+  // start 0.3 m and 1 degree away from the pose at the start of the sweep
+  Eigen::Matrix4f init_guess = sensorPose(0.0).matrix().cast<float>();
+  init_guess.block<3, 3>(0, 0) *=
+    Eigen::AngleAxisf(M_PI / 180.0, Eigen::Vector3f::UnitZ()).toRotationMatrix();
+  init_guess(0, 3) += 0.3f;
+
+  Cloud output;
+  bool has_converged = true;
+  for (auto _ : state) {
+    registration->align(output, init_guess);
+    has_converged = has_converged && registration->hasConverged();
+  }
+  setPointCounters(state, num_points);
+  state.counters["converged"] = has_converged ? 1.0 : 0.0;
+  state.counters["fitness"] = registration->getFitnessScore();
+}
+
+void scanSizes(benchmark::internal::Benchmark * b)
+{
+  for (const int columns : {450, 900, 1800}) {
+    b->Arg(columns);
+  }
+}
+
+void scanSizesAndThreads(benchmark::internal::Benchmark * b)
+{
+  const int max_threads = omp_get_max_threads();
+  for (const int columns : {450, 900, 1800}) {
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+      b->Args({columns, threads});
+    }
+  }
+}
+
+void scanSizesAndCellLimits(benchmark::internal::Benchmark * b)
+{
+  for (const int columns : {450, 900, 1800}) {
+    for (const int max_points_per_cell : {0, 3}) {
+      b->Args({columns, max_points_per_cell});
+    }
+  }
+}
+
+void scanSizesSingleThread(benchmark::internal::Benchmark * b)
+{
+  for (const int columns : {450, 900, 1800}) {
+    b->Args({columns, 1});
+  }
+}
+
+}  // namespace
+
+BENCHMARK(BM_FromROSMsg)->Apply(scanSizes);
+BENCHMARK(BM_TransformPointCloud)->Apply(scanSizes);
+BENCHMARK(BM_VoxelGridFilter)->Apply(scanSizes);
+BENCHMARK(BM_RangeAdaptiveDownsampler)->Apply(scanSizesAndCellLimits);
+BENCHMARK(BM_OrganizedScanProcessor)->Apply(scanSizes);
+BENCHMARK(BM_LoamFeatureExtractor)->Apply(scanSizes);
+BENCHMARK(BM_RangeCrop)->Apply(scanSizes);
+BENCHMARK(BM_VoxelKeys)->Apply(scanSizes);
+BENCHMARK(BM_Azimuths)->Apply(scanSizes);
+BENCHMARK(BM_NdtDerivatives);
+BENCHMARK(BM_UndistortionGetImu);
+BENCHMARK(BM_AdjustDistortion)->Apply(scanSizes);
+BENCHMARK_CAPTURE(BM_Align, NDT, NDT)->Apply(scanSizesSingleThread)
+->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Align, NDT_OMP, NDT_OMP)->Apply(scanSizesAndThreads)
+->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_Align, NDT_LAZY, NDT_LAZY)->Apply(scanSizesAndThreads)
+->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_Align, LOAM, LOAM)->Apply(scanSizesAndThreads)
+->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_Align, GICP, GICP)->Apply(scanSizesSingleThread)
+->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Align, GICP_OMP, GICP_OMP)->Apply(scanSizesAndThreads)
+->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
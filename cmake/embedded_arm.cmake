@@ -0,0 +1,9 @@
+# Initial cache of the embedded ARM build profile (Jetson, RK3588), built on the board from the
+# workspace root:
+#   colcon build --packages-select lidar_localization_ros2 \
+#     --cmake-args -C $(pwd)/src/lidar_localization_ros2/cmake/embedded_arm.cmake
+# Add -DPGO=GENERATE / -DPGO=USE for profile-guided optimization (see README).
+set(CMAKE_BUILD_TYPE Release CACHE STRING "")
+set(CMAKE_CXX_FLAGS_RELEASE "-O3 -DNDEBUG" CACHE STRING "")
+set(LIDAR_LOCALIZATION_CPU native CACHE STRING "")
+set(ENABLE_LTO ON CACHE BOOL "")
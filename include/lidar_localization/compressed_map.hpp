@@ -0,0 +1,331 @@
+#ifndef COMPRESSED_MAP_HPP_
+#define COMPRESSED_MAP_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <zstd.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Map stored as independently compressed xy tiles, so that only the tiles around the robot
+// have to be read and decompressed.
+//
+// file: "LMTC" | version u32 | tile_size f64 | quantization f64 | num_tiles u64 |
+//       num_tiles x {key u64, offset u64, compressed_size u64, num_points u64} | zstd blobs
+// tile (before zstd): origin 4 x f64 (x, y, z, intensity) | step 4 x f64 |
+//       x, y, z, intensity as u16 byte planes (low bytes, then high bytes)
+// Points are sorted by their quantized x and x is delta coded, which with the byte planes
+// leaves mostly zero high bytes for zstd.
+// Tile keys are the same as MapTiles::getKey for the same tile size. A NaN intensity is stored
+// as the lowest intensity of its tile and infinite ones are clamped to the tile's range.
+class CompressedMap
+{
+public:
+  using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+
+  struct TileInfo
+  {
+    uint64_t key;
+    uint64_t offset;
+    uint64_t compressed_size;
+    uint64_t num_points;
+  };
+
+  CompressedMap() {}
+
+  static uint64_t getKey(const int64_t ix, const int64_t iy)
+  {
+    return (static_cast<uint64_t>(ix) << 32) | (static_cast<uint64_t>(iy) & 0xffffffffULL);
+  }
+
+  static void getIndex(const uint64_t key, int64_t & ix, int64_t & iy)
+  {
+    ix = static_cast<int32_t>(static_cast<uint32_t>(key >> 32));
+    iy = static_cast<int32_t>(static_cast<uint32_t>(key & 0xffffffffULL));
+  }
+
+  // quantization is the coarsest step allowed for x, y, z. Tiles whose extent does not fit in
+  // 16 bits at that step fall back to a coarser step.
+  static bool write(
+    const std::string & path, const Cloud & cloud, const double tile_size /*[m]*/,
+    const double quantization /*[m]*/, const int compression_level = 3)
+  {
+    std::unordered_map<uint64_t, Cloud> tiles;
+    for (const auto & p : cloud.points) {
+      if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+      const int64_t ix = static_cast<int64_t>(std::floor(p.x / tile_size));
+      const int64_t iy = static_cast<int64_t>(std::floor(p.y / tile_size));
+      tiles[getKey(ix, iy)].push_back(p);
+    }
+
+    std::vector<uint64_t> keys;
+    for (const auto & tile : tiles) {
+      keys.push_back(tile.first);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<std::vector<char>> blobs(keys.size());
+    std::vector<TileInfo> index(keys.size());
+    uint64_t offset = headerSize() + keys.size() * sizeof(TileInfo);
+    for (size_t i = 0; i < keys.size(); ++i) {
+      const Cloud & tile = tiles[keys[i]];
+      if (!encodeTile(tile, quantization, compression_level, blobs[i])) {return false;}
+      index[i].key = keys[i];
+      index[i].offset = offset;
+      index[i].compressed_size = blobs[i].size();
+      index[i].num_points = tile.size();
+      offset += blobs[i].size();
+    }
+
+    std::ofstream ofs(path, std::ios::binary);
+    if (!ofs) {return false;}
+    const uint32_t version = 1;
+    const uint64_t num_tiles = keys.size();
+    ofs.write(magic(), 4);
+    ofs.write(reinterpret_cast<const char *>(&version), sizeof(version));
+    ofs.write(reinterpret_cast<const char *>(&tile_size), sizeof(tile_size));
+    ofs.write(reinterpret_cast<const char *>(&quantization), sizeof(quantization));
+    ofs.write(reinterpret_cast<const char *>(&num_tiles), sizeof(num_tiles));
+    ofs.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(TileInfo));
+    for (const auto & blob : blobs) {
+      ofs.write(blob.data(), blob.size());
+    }
+    return static_cast<bool>(ofs);
+  }
+
+  // Reads the header and the tile index only. The index is checked against the file size, so a
+  // truncated or corrupt file fails here rather than in readTile.
+  bool open(const std::string & path)
+  {
+    std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+    if (!ifs) {return false;}
+    const uint64_t file_size = static_cast<uint64_t>(ifs.tellg());
+    ifs.seekg(0);
+    double tile_size, quantization;
+    char file_magic[4];
+    uint32_t version;
+    uint64_t num_tiles;
+    ifs.read(file_magic, 4);
+    ifs.read(reinterpret_cast<char *>(&version), sizeof(version));
+    ifs.read(reinterpret_cast<char *>(&tile_size), sizeof(tile_size));
+    ifs.read(reinterpret_cast<char *>(&quantization), sizeof(quantization));
+    ifs.read(reinterpret_cast<char *>(&num_tiles), sizeof(num_tiles));
+    if (!ifs || std::memcmp(file_magic, magic(), 4) != 0 || version != 1) {return false;}
+    if (!(tile_size > 0.0) || !std::isfinite(tile_size)) {return false;}
+    if (num_tiles > (file_size - headerSize()) / sizeof(TileInfo)) {return false;}
+
+    std::vector<TileInfo> index(num_tiles);
+    ifs.read(reinterpret_cast<char *>(index.data()), num_tiles * sizeof(TileInfo));
+    if (!ifs) {return false;}
+    const uint64_t blobs_offset = headerSize() + num_tiles * sizeof(TileInfo);
+    for (const auto & info : index) {
+      if (info.offset < blobs_offset || info.offset > file_size ||
+        info.compressed_size > file_size - info.offset || info.num_points > kMaxTilePoints)
+      {
+        return false;
+      }
+    }
+    path_ = path;
+    tile_size_ = tile_size;
+    quantization_ = quantization;
+    tiles_.clear();
+    for (const auto & info : index) {
+      tiles_[info.key] = info;
+    }
+    return true;
+  }
+
+  double getTileSize() const
+  {
+    return tile_size_;
+  }
+
+  const std::unordered_map<uint64_t, TileInfo> & getTiles() const
+  {
+    return tiles_;
+  }
+
+  // keys of the stored tiles overlapping the xy disc
+  std::vector<uint64_t> getTileKeysInRadius(const double x, const double y, const double radius) const
+  {
+    std::vector<uint64_t> keys;
+    const int64_t min_ix = static_cast<int64_t>(std::floor((x - radius) / tile_size_));
+    const int64_t max_ix = static_cast<int64_t>(std::floor((x + radius) / tile_size_));
+    const int64_t min_iy = static_cast<int64_t>(std::floor((y - radius) / tile_size_));
+    const int64_t max_iy = static_cast<int64_t>(std::floor((y + radius) / tile_size_));
+    for (int64_t ix = min_ix; ix <= max_ix; ++ix) {
+      for (int64_t iy = min_iy; iy <= max_iy; ++iy) {
+        // closest point of the tile to the centre
+        const double cx = std::min(std::max(x, ix * tile_size_), (ix + 1) * tile_size_);
+        const double cy = std::min(std::max(y, iy * tile_size_), (iy + 1) * tile_size_);
+        if ((cx - x) * (cx - x) + (cy - y) * (cy - y) > radius * radius) {continue;}
+        const uint64_t key = getKey(ix, iy);
+        if (tiles_.count(key)) {keys.push_back(key);}
+      }
+    }
+    return keys;
+  }
+
+  // Safe to call from several threads, each read uses its own stream.
+  bool readTile(const uint64_t key, Cloud & cloud) const
+  {
+    auto it = tiles_.find(key);
+    if (it == tiles_.end()) {return false;}
+    std::ifstream ifs(path_, std::ios::binary);
+    if (!ifs) {return false;}
+    std::vector<char> blob(it->second.compressed_size);
+    ifs.seekg(it->second.offset);
+    ifs.read(blob.data(), blob.size());
+    if (!ifs) {return false;}
+    return decodeTile(blob, it->second.num_points, cloud);
+  }
+
+  bool readAll(Cloud & cloud) const
+  {
+    cloud.clear();
+    for (const auto & tile : tiles_) {
+      Cloud tile_cloud;
+      if (!readTile(tile.first, tile_cloud)) {return false;}
+      cloud += tile_cloud;
+    }
+    return true;
+  }
+
+  static bool encodeTile(
+    const Cloud & tile, const double quantization, const int compression_level,
+    std::vector<char> & blob)
+  {
+    const size_t n = tile.size();
+    double origin[4], step[4];
+    for (int a = 0; a < 4; ++a) {
+      double min_v = std::numeric_limits<double>::max();
+      double max_v = std::numeric_limits<double>::lowest();
+      for (const auto & p : tile.points) {
+        const double v = value(p, a);
+        if (!std::isfinite(v)) {continue;}
+        min_v = std::min(min_v, v);
+        max_v = std::max(max_v, v);
+      }
+      // no finite value
+      if (min_v > max_v) {min_v = max_v = 0.0;}
+      origin[a] = min_v;
+      const double range_step = (max_v - min_v) / 65535.0;
+      // intensity keeps the finest step its range allows
+      step[a] = a < 3 ? std::max(quantization, range_step) : std::max(range_step, 1e-6);
+    }
+
+    std::vector<std::array<uint16_t, 4>> quantized(n);
+    for (size_t i = 0; i < n; ++i) {
+      for (int a = 0; a < 4; ++a) {
+        const double v = value(tile.points[i], a);
+        const double q = std::isnan(v) ? 0.0 : std::round((v - origin[a]) / step[a]);
+        quantized[i][a] = static_cast<uint16_t>(std::min(std::max(q, 0.0), 65535.0));
+      }
+    }
+    std::sort(quantized.begin(), quantized.end());
+
+    const size_t raw_size = 8 * sizeof(double) + n * 4 * sizeof(uint16_t);
+    std::vector<char> raw(raw_size);
+    std::memcpy(raw.data(), origin, sizeof(origin));
+    std::memcpy(raw.data() + sizeof(origin), step, sizeof(step));
+    unsigned char * planes = reinterpret_cast<unsigned char *>(raw.data() + 8 * sizeof(double));
+    for (int a = 0; a < 4; ++a) {
+      unsigned char * low = planes + (2 * a) * n;
+      unsigned char * high = planes + (2 * a + 1) * n;
+      uint16_t previous = 0;
+      for (size_t i = 0; i < n; ++i) {
+        uint16_t v = quantized[i][a];
+        if (a == 0) {
+          const uint16_t delta = v - previous;
+          previous = v;
+          v = delta;
+        }
+        low[i] = static_cast<unsigned char>(v & 0xff);
+        high[i] = static_cast<unsigned char>(v >> 8);
+      }
+    }
+
+    blob.resize(ZSTD_compressBound(raw_size));
+    const size_t compressed_size = ZSTD_compress(
+      blob.data(), blob.size(), raw.data(), raw_size, compression_level);
+    if (ZSTD_isError(compressed_size)) {return false;}
+    blob.resize(compressed_size);
+    return true;
+  }
+
+  static bool decodeTile(const std::vector<char> & blob, const size_t n, Cloud & cloud)
+  {
+    if (n > kMaxTilePoints) {return false;}
+    const size_t raw_size = 8 * sizeof(double) + n * 4 * sizeof(uint16_t);
+    // checked before allocating, the frame header holding the decompressed size
+    if (ZSTD_getFrameContentSize(blob.data(), blob.size()) != raw_size) {return false;}
+    std::vector<char> raw(raw_size);
+    const size_t decompressed_size = ZSTD_decompress(raw.data(), raw_size, blob.data(), blob.size());
+    if (ZSTD_isError(decompressed_size) || decompressed_size != raw_size) {return false;}
+
+    double origin[4], step[4];
+    std::memcpy(origin, raw.data(), sizeof(origin));
+    std::memcpy(step, raw.data() + sizeof(origin), sizeof(step));
+    const unsigned char * planes =
+      reinterpret_cast<const unsigned char *>(raw.data() + 8 * sizeof(double));
+
+    cloud.resize(n);
+    uint16_t qx = 0;
+    for (size_t i = 0; i < n; ++i) {
+      uint16_t q[4];
+      for (int a = 0; a < 4; ++a) {
+        q[a] = static_cast<uint16_t>(planes[(2 * a) * n + i] | (planes[(2 * a + 1) * n + i] << 8));
+      }
+      qx = static_cast<uint16_t>(qx + q[0]);
+      pcl::PointXYZI & p = cloud.points[i];
+      p.x = static_cast<float>(origin[0] + qx * step[0]);
+      p.y = static_cast<float>(origin[1] + q[1] * step[1]);
+      p.z = static_cast<float>(origin[2] + q[2] * step[2]);
+      p.intensity = static_cast<float>(origin[3] + q[3] * step[3]);
+    }
+    cloud.width = n;
+    cloud.height = 1;
+    cloud.is_dense = true;
+    return true;
+  }
+
+private:
+  // bounds the point count of a tile, so its decompressed size can't overflow
+  static constexpr uint64_t kMaxTilePoints = 1ULL << 32;
+
+  static const char * magic()
+  {
+    return "LMTC";
+  }
+
+  static size_t headerSize()
+  {
+    return 4 + sizeof(uint32_t) + 2 * sizeof(double) + sizeof(uint64_t);
+  }
+
+  static float value(const pcl::PointXYZI & p, const int axis)
+  {
+    switch (axis) {
+      case 0: return p.x;
+      case 1: return p.y;
+      case 2: return p.z;
+      default: return p.intensity;
+    }
+  }
+
+  std::string path_;
+  double tile_size_{20.0};
+  double quantization_{0.001};
+  std::unordered_map<uint64_t, TileInfo> tiles_;
+};
+
+#endif  // COMPRESSED_MAP_HPP_
@@ -0,0 +1,147 @@
+#ifndef INPUT_LOG_HPP_
+#define INPUT_LOG_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "builtin_interfaces/msg/time.hpp"
+#include "rclcpp/serialization.hpp"
+#include "rclcpp/serialized_message.hpp"
+
+// Binary log of the messages received by the node, so that a run can be fed again in the same
+// order. Messages are stored CDR-serialized as they came from the middleware.
+//
+// file: "LLOG" | version u32 | entries of {type u8, stamp_ns i64, size u32, message}
+class InputLog
+{
+public:
+  enum Type : uint8_t
+  {
+    CLOUD = 0,
+    IMU = 1,
+    ODOM = 2,
+    INITIAL_POSE = 3,
+    MAP = 4,
+    MAP_DELTA = 5,
+    TF = 6,
+    TF_STATIC = 7,
+  };
+
+  struct Entry
+  {
+    Type type;
+    int64_t stamp_ns;
+    std::vector<uint8_t> data;
+  };
+
+  InputLog() {}
+
+  bool openForWrite(const std::string & path)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ofs_.open(path, std::ios::binary | std::ios::trunc);
+    if (!ofs_) {return false;}
+    const uint32_t version = 1;
+    ofs_.write("LLOG", 4);
+    ofs_.write(reinterpret_cast<const char *>(&version), sizeof(version));
+    return static_cast<bool>(ofs_);
+  }
+
+  bool isRecording() const
+  {
+    return ofs_.is_open();
+  }
+
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ofs_.is_open()) {ofs_.close();}
+  }
+
+  // Safe to call from concurrent callbacks.
+  template<typename MessageT>
+  void write(const Type type, const builtin_interfaces::msg::Time & stamp, const MessageT & msg)
+  {
+    rclcpp::Serialization<MessageT> serialization;
+    rclcpp::SerializedMessage serialized;
+    serialization.serialize_message(&msg, &serialized);
+    const auto & buffer = serialized.get_rcl_serialized_message();
+
+    const uint8_t type_byte = type;
+    const int64_t stamp_ns = toNanoseconds(stamp);
+    const uint32_t size = static_cast<uint32_t>(buffer.buffer_length);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!ofs_.is_open()) {return;}
+    ofs_.write(reinterpret_cast<const char *>(&type_byte), sizeof(type_byte));
+    ofs_.write(reinterpret_cast<const char *>(&stamp_ns), sizeof(stamp_ns));
+    ofs_.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    ofs_.write(reinterpret_cast<const char *>(buffer.buffer), size);
+  }
+
+  // Entries sorted by stamp. Entries with the same stamp (and unstamped ones, at 0) keep
+  // the order they were received in.
+  static bool read(const std::string & path, std::vector<Entry> & entries)
+  {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) {return false;}
+    char magic[4];
+    uint32_t version;
+    ifs.read(magic, 4);
+    ifs.read(reinterpret_cast<char *>(&version), sizeof(version));
+    if (!ifs || std::memcmp(magic, "LLOG", 4) != 0 || version != 1) {return false;}
+
+    entries.clear();
+    while (true) {
+      uint8_t type_byte;
+      Entry entry;
+      uint32_t size;
+      ifs.read(reinterpret_cast<char *>(&type_byte), sizeof(type_byte));
+      ifs.read(reinterpret_cast<char *>(&entry.stamp_ns), sizeof(entry.stamp_ns));
+      ifs.read(reinterpret_cast<char *>(&size), sizeof(size));
+      if (!ifs) {break;}
+      entry.type = static_cast<Type>(type_byte);
+      entry.data.resize(size);
+      ifs.read(reinterpret_cast<char *>(entry.data.data()), size);
+      // a record cut short by a crash ends the log
+      if (!ifs) {break;}
+      entries.push_back(std::move(entry));
+    }
+
+    std::stable_sort(
+      entries.begin(), entries.end(), [](const Entry & a, const Entry & b) {
+        return a.stamp_ns < b.stamp_ns;
+      });
+    return true;
+  }
+
+  template<typename MessageT>
+  static std::shared_ptr<MessageT> deserialize(const Entry & entry)
+  {
+    rclcpp::SerializedMessage serialized(entry.data.size());
+    auto & buffer = serialized.get_rcl_serialized_message();
+    std::memcpy(buffer.buffer, entry.data.data(), entry.data.size());
+    buffer.buffer_length = entry.data.size();
+
+    auto msg = std::make_shared<MessageT>();
+    rclcpp::Serialization<MessageT> serialization;
+    serialization.deserialize_message(&serialized, msg.get());
+    return msg;
+  }
+
+  static int64_t toNanoseconds(const builtin_interfaces::msg::Time & stamp)
+  {
+    return static_cast<int64_t>(stamp.sec) * 1000000000LL + stamp.nanosec;
+  }
+
+private:
+  std::mutex mutex_;
+  std::ofstream ofs_;
+};
+
+#endif  // INPUT_LOG_HPP_
@@ -0,0 +1,154 @@
+#ifndef KEYFRAME_LOCAL_MAP_HPP_
+#define KEYFRAME_LOCAL_MAP_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <Eigen/Core>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+// Voxel map of the last keyframes, used as a registration target where the global map is
+// missing. Adding or dropping a keyframe only touches the voxels of that keyframe, so the
+// cost of an update is bounded by the window size and not by the distance travelled.
+class KeyframeLocalMap
+{
+public:
+  using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+
+  KeyframeLocalMap() {}
+
+  void setVoxelSize(const double voxel_size /*[m]*/)
+  {
+    voxel_size_ = voxel_size;
+  }
+
+  void setMaxKeyframes(const size_t max_keyframes)
+  {
+    max_keyframes_ = std::max<size_t>(max_keyframes, 1);
+  }
+
+  void setKeyframeDistance(const double distance /*[m]*/)
+  {
+    keyframe_distance_ = distance;
+  }
+
+  void setKeyframeAngle(const double angle /*[rad]*/)
+  {
+    keyframe_angle_ = angle;
+  }
+
+  void clear()
+  {
+    keyframes_.clear();
+    voxels_.clear();
+  }
+
+  size_t size() const
+  {
+    return keyframes_.size();
+  }
+
+  // true when pose is far enough from the last keyframe
+  bool needsKeyframe(const Eigen::Matrix4f & pose) const
+  {
+    if (keyframes_.empty()) {return true;}
+    const Eigen::Matrix4f & last = keyframes_.back().pose;
+    const float distance = (pose.block<3, 1>(0, 3) - last.block<3, 1>(0, 3)).norm();
+    const Eigen::Matrix3f delta = last.block<3, 3>(0, 0).transpose() * pose.block<3, 3>(0, 0);
+    const float cos_angle = std::min(1.0f, std::max(-1.0f, 0.5f * (delta.trace() - 1.0f)));
+    return distance > keyframe_distance_ || std::acos(cos_angle) > keyframe_angle_;
+  }
+
+  // cloud is expected in the map frame. The oldest keyframe is dropped once the window is full.
+  void addKeyframe(const Cloud & cloud, const Eigen::Matrix4f & pose)
+  {
+    Keyframe keyframe;
+    keyframe.pose = pose;
+    keyframe.points.reserve(cloud.size());
+    for (const auto & p : cloud.points) {
+      if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+      keyframe.points.push_back(p);
+      Voxel & v = voxels_[getVoxelKey(p)];
+      v.x += p.x;
+      v.y += p.y;
+      v.z += p.z;
+      v.intensity += p.intensity;
+      ++v.count;
+    }
+    keyframes_.push_back(std::move(keyframe));
+
+    while (keyframes_.size() > max_keyframes_) {
+      for (const auto & p : keyframes_.front().points) {
+        auto it = voxels_.find(getVoxelKey(p));
+        Voxel & v = it->second;
+        if (--v.count == 0) {
+          voxels_.erase(it);
+          continue;
+        }
+        v.x -= p.x;
+        v.y -= p.y;
+        v.z -= p.z;
+        v.intensity -= p.intensity;
+      }
+      keyframes_.pop_front();
+    }
+  }
+
+  // one point per voxel, at the mean of the window points in it
+  Cloud::Ptr getCloud() const
+  {
+    Cloud::Ptr cloud(new Cloud);
+    cloud->reserve(voxels_.size());
+    for (const auto & voxel : voxels_) {
+      const Voxel & v = voxel.second;
+      pcl::PointXYZI p;
+      p.x = static_cast<float>(v.x / v.count);
+      p.y = static_cast<float>(v.y / v.count);
+      p.z = static_cast<float>(v.z / v.count);
+      p.intensity = static_cast<float>(v.intensity / v.count);
+      cloud->push_back(p);
+    }
+    return cloud;
+  }
+
+private:
+  struct Keyframe
+  {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    Eigen::Matrix4f pose;
+    std::vector<pcl::PointXYZI, Eigen::aligned_allocator<pcl::PointXYZI>> points;
+  };
+
+  struct Voxel
+  {
+    double x{0.0};
+    double y{0.0};
+    double z{0.0};
+    double intensity{0.0};
+    int count{0};
+  };
+
+  uint64_t getVoxelKey(const pcl::PointXYZI & p) const
+  {
+    // 21 bits per axis
+    const int64_t ix = static_cast<int64_t>(std::floor(p.x / voxel_size_));
+    const int64_t iy = static_cast<int64_t>(std::floor(p.y / voxel_size_));
+    const int64_t iz = static_cast<int64_t>(std::floor(p.z / voxel_size_));
+    return ((static_cast<uint64_t>(ix) & 0x1fffffULL) << 42) |
+           ((static_cast<uint64_t>(iy) & 0x1fffffULL) << 21) |
+           (static_cast<uint64_t>(iz) & 0x1fffffULL);
+  }
+
+  double voxel_size_{0.2};
+  size_t max_keyframes_{20};
+  double keyframe_distance_{1.0};
+  double keyframe_angle_{0.2};
+  std::deque<Keyframe, Eigen::aligned_allocator<Keyframe>> keyframes_;
+  std::unordered_map<uint64_t, Voxel> voxels_;
+};
+
+#endif  // KEYFRAME_LOCAL_MAP_HPP_
@@ -0,0 +1,639 @@
+#ifndef LAZY_NDT_HPP_
+#define LAZY_NDT_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/common/transforms.h>
+#include <pcl/registration/registration.h>
+#include <pcl/search/kdtree.h>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "lidar_localization/point_kernels.hpp"
+#include "lidar_localization/shared_ndt_target.hpp"
+#include "lidar_localization/tracing.hpp"
+
+// NDT whose voxel statistics are only summed when the target is set. The mean and inverse
+// covariance of a voxel are finalized the first time a scan point falls next to it, once and
+// thread-safely, so startup cost does not depend on the map size and areas the robot never
+// visits are never finalized.
+// The score follows Magnusson's NDT as pcl::NormalDistributionsTransform. The pose is
+// updated by Newton steps on a left-multiplied increment with a backtracking line search
+// bounded by the step size.
+class LazyNDT : public pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>
+{
+public:
+  using Ptr = boost::shared_ptr<LazyNDT>;
+  using Vector6d = Eigen::Matrix<double, 6, 1>;
+  using Matrix6d = Eigen::Matrix<double, 6, 6>;
+
+  LazyNDT()
+  {
+    reg_name_ = "LazyNDT";
+    transformation_epsilon_ = 0.1;
+    max_iterations_ = 35;
+    updateConstants();
+    // The fitness score searches the voxel hash instead of a kd-tree over the whole map.
+    setSearchMethodTarget(KdTreePtr(new VoxelNearestSearch(*this)), true);
+  }
+
+  LazyNDT(const LazyNDT &) = delete;
+  LazyNDT & operator=(const LazyNDT &) = delete;
+
+  void setResolution(const float resolution /*[m]*/)
+  {
+    resolution_ = resolution;
+    updateConstants();
+    if (target_) {
+      buildVoxels();
+    }
+  }
+
+  void setStepSize(const double step_size)
+  {
+    step_size_ = step_size;
+  }
+
+  void setOutlierRatio(const double outlier_ratio)
+  {
+    outlier_ratio_ = outlier_ratio;
+    updateConstants();
+  }
+
+  // num_threads <= 0 uses all available threads
+  void setNumThreads(const int num_threads)
+  {
+    num_threads_ = num_threads;
+  }
+
+  size_t getNumVoxels() const
+  {
+    return shared_target_ ? shared_target_->numVoxels() : voxels_->voxels.size();
+  }
+
+  size_t getNumFinalizedVoxels() const
+  {
+    return shared_target_ ? shared_target_->numVoxels() : voxels_->num_finalized.load();
+  }
+
+  void setInputTarget(const PointCloudTargetConstPtr & cloud) override
+  {
+    pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>::setInputTarget(cloud);
+    shared_target_.reset();
+    buildVoxels();
+  }
+
+  // Finalizes all the voxels of the target on all threads now, rather than as the scans reach
+  // them.
+  void finalizeVoxels()
+  {
+    TRACE_ZONE("LazyNDT::finalizeVoxels");
+    if (shared_target_) {return;}
+    std::vector<Voxel *> voxels;
+    voxels.reserve(voxels_->voxels.size());
+    for (auto & entry : voxels_->voxels) {
+      voxels.push_back(&entry.second);
+    }
+    const int num_voxels = static_cast<int>(voxels.size());
+    #pragma omp parallel for num_threads(getNumThreads()) schedule(guided, 64)
+    for (int i = 0; i < num_voxels; ++i) {
+      Voxel & voxel = *voxels[i];
+      std::call_once(voxel.finalize_flag, [this, &voxel]() {finalize(voxel);});
+    }
+  }
+
+  // Finalizes all the voxels of the target into a new shared memory segment (see
+  // SharedNdtTarget) for other processes to attach. Returns false if the segment exists.
+  bool exportTarget(const std::string & name, const uint64_t map_id)
+  {
+    TRACE_ZONE("LazyNDT::exportTarget");
+    std::vector<std::pair<const uint64_t, Voxel> *> voxels;
+    voxels.reserve(voxels_->voxels.size());
+    size_t num_points = 0;
+    for (auto & entry : voxels_->voxels) {
+      voxels.push_back(&entry);
+      num_points += entry.second.indices.size();
+    }
+    std::unique_ptr<SharedNdtTarget> target = SharedNdtTarget::create(
+      name, map_id, resolution_, voxels.size(), num_points);
+    if (!target) {return false;}
+
+    std::vector<uint32_t> first_points(voxels.size());
+    uint32_t first_point = 0;
+    for (size_t i = 0; i < voxels.size(); ++i) {
+      first_points[i] = first_point;
+      first_point += static_cast<uint32_t>(voxels[i]->second.indices.size());
+    }
+    SharedNdtTarget::Voxel * shared_voxels = target->voxels();
+    SharedNdtTarget::Point * shared_points = target->points();
+    const int num_voxels = static_cast<int>(voxels.size());
+    #pragma omp parallel for num_threads(getNumThreads()) schedule(guided, 64)
+    for (int i = 0; i < num_voxels; ++i) {
+      Voxel & voxel = voxels[i]->second;
+      std::call_once(voxel.finalize_flag, [this, &voxel]() {finalize(voxel);});
+      SharedNdtTarget::Voxel & shared_voxel = shared_voxels[i];
+      shared_voxel.key = voxels[i]->first;
+      shared_voxel.first_point = first_points[i];
+      shared_voxel.num_points = static_cast<uint32_t>(voxel.indices.size());
+      shared_voxel.valid = voxel.valid;
+      shared_voxel.distribution = voxel.distribution;
+      for (size_t k = 0; k < voxel.indices.size(); ++k) {
+        const auto & p = target_->points[voxel.indices[k]];
+        shared_points[first_points[i] + k] = SharedNdtTarget::Point{p.x, p.y, p.z};
+      }
+    }
+    target->publish();
+    return true;
+  }
+
+  // Aligns against a target mapped by SharedNdtTarget::attach in place of the input target,
+  // which is dropped.
+  void setSharedTarget(const std::shared_ptr<const SharedNdtTarget> & shared_target)
+  {
+    // pcl::Registration needs a target to align, and rejects an empty one
+    target_.reset(new PointCloudTarget);
+    target_cloud_updated_ = true;
+    voxels_ = std::make_shared<VoxelMap>();
+    shared_target_ = shared_target;
+  }
+
+  size_t getSharedTargetSize() const
+  {
+    return shared_target_ ? shared_target_->size() : 0;
+  }
+
+  // Aligns against the voxels of another LazyNDT without copying them. A voxel is finalized
+  // once for all the registrations sharing it, by the first one needing it.
+  void shareTarget(const LazyNDT & other)
+  {
+    target_ = other.target_;
+    target_cloud_updated_ = true;
+    resolution_ = other.resolution_;
+    updateConstants();
+    voxels_ = other.voxels_;
+    shared_target_ = other.shared_target_;
+  }
+
+protected:
+  void computeTransformation(PointCloudSource & output, const Matrix4 & guess) override
+  {
+    TRACE_ZONE("LazyNDT::computeTransformation");
+    nr_iterations_ = 0;
+    converged_ = false;
+
+    Eigen::Matrix4d transformation = guess.cast<double>();
+    Vector6d gradient;
+    Matrix6d hessian;
+    int num_correspondences;
+    double score = computeDerivatives(transformation, gradient, hessian, num_correspondences);
+
+    // without enough points next to the target (a scan off the map), a zero gradient would
+    // otherwise pass for convergence
+    while (num_correspondences >= kMinCorrespondences) {
+      Vector6d delta = hessian.jacobiSvd(Eigen::ComputeFullU | Eigen::ComputeFullV).solve(-gradient);
+      // Away from the maximum the hessian is not negative definite, and the newton direction
+      // is reversed when it descends, as pcl does. Scaling the raw gradient instead would give
+      // steps small enough to pass for convergence.
+      if (!delta.allFinite()) {
+        delta = gradient;
+      } else if (gradient.dot(delta) < 0.0) {
+        delta = -delta;
+      }
+      const double delta_norm = delta.norm();
+      if (delta_norm <= 0.0 || !std::isfinite(delta_norm)) {
+        converged_ = true;
+        break;
+      }
+
+      // Backtrack from the newton step (bounded by the step size) until the score improves,
+      // or, when the first step already improves it, expand up to the step size as the
+      // More-Thuente search of pcl does.
+      const double max_step = step_size_ / delta_norm;
+      double step = std::min(1.0, max_step);
+      Eigen::Matrix4d candidate;
+      Vector6d candidate_gradient;
+      Matrix6d candidate_hessian;
+      double candidate_score = -std::numeric_limits<double>::max();
+      int candidate_correspondences = 0;
+      for (int k = 0; k < max_line_search_iterations_; ++k) {
+        candidate = applyIncrement(step * delta, transformation);
+        candidate_score = computeDerivatives(
+          candidate, candidate_gradient, candidate_hessian, candidate_correspondences);
+        if (candidate_score >= score) {break;}
+        step *= 0.5;
+      }
+      if (candidate_score < score) {
+        // no step improves the score: at a local maximum
+        converged_ = true;
+        break;
+      }
+      if (step == 1.0) {
+        for (int k = 0; k < max_line_search_iterations_ && step * 2.0 <= max_step; ++k) {
+          Vector6d expanded_gradient;
+          Matrix6d expanded_hessian;
+          int expanded_correspondences;
+          const Eigen::Matrix4d expanded = applyIncrement(step * 2.0 * delta, transformation);
+          const double expanded_score = computeDerivatives(
+            expanded, expanded_gradient, expanded_hessian, expanded_correspondences);
+          if (expanded_score <= candidate_score) {break;}
+          step *= 2.0;
+          candidate = expanded;
+          candidate_score = expanded_score;
+          candidate_gradient = expanded_gradient;
+          candidate_hessian = expanded_hessian;
+          candidate_correspondences = expanded_correspondences;
+        }
+      }
+
+      transformation = candidate;
+      score = candidate_score;
+      gradient = candidate_gradient;
+      hessian = candidate_hessian;
+      num_correspondences = candidate_correspondences;
+      ++nr_iterations_;
+
+      if (nr_iterations_ >= max_iterations_ || step * delta_norm < transformation_epsilon_) {
+        converged_ = true;
+        break;
+      }
+    }
+
+    final_transformation_ = transformation.cast<float>();
+    transformation_ = final_transformation_;
+    PointKernels::transform(*input_, final_transformation_, output);
+  }
+
+private:
+  struct Voxel
+  {
+    int num_points{0};
+    Eigen::Vector3d sum{Eigen::Vector3d::Zero()};
+    Eigen::Matrix3d sum_sq{Eigen::Matrix3d::Zero()};
+    std::vector<int> indices;
+
+    std::once_flag finalize_flag;
+    bool valid{false};
+    NdtDistribution distribution;
+  };
+
+  // the sums of a voxel over part of the target
+  struct VoxelSums
+  {
+    int num_points{0};
+    Eigen::Vector3d sum{Eigen::Vector3d::Zero()};
+    Eigen::Matrix3d sum_sq{Eigen::Matrix3d::Zero()};
+    std::vector<int> indices;
+  };
+
+  using VoxelSumsMap = std::unordered_map<uint64_t, VoxelSums>;
+
+  struct VoxelMap
+  {
+    std::unordered_map<uint64_t, Voxel> voxels;
+    std::atomic<size_t> num_finalized{0};
+  };
+
+  // Serves getFitnessScore() from the voxel hash. Only the 27 surrounding voxels are searched,
+  // so a point without target points there gets the unmatched distance (see nearestPoint).
+  class VoxelNearestSearch : public pcl::search::KdTree<pcl::PointXYZI>
+  {
+public:
+    explicit VoxelNearestSearch(const LazyNDT & ndt)
+    : ndt_(ndt) {}
+
+    using pcl::search::KdTree<pcl::PointXYZI>::nearestKSearch;
+
+    int nearestKSearch(
+      const pcl::PointXYZI & point, int, pcl::Indices & k_indices,
+      std::vector<float> & k_sqr_distances) const override
+    {
+      k_indices.resize(1);
+      k_sqr_distances.resize(1);
+      ndt_.nearestPoint(point, k_indices[0], k_sqr_distances[0]);
+      return 1;
+    }
+
+private:
+    const LazyNDT & ndt_;
+  };
+
+  void updateConstants()
+  {
+    // Ref:pcl::NormalDistributionsTransform (Magnusson 2009, eq. 6.8)
+    const double gauss_c1 = 10.0 * (1 - outlier_ratio_);
+    const double gauss_c2 = outlier_ratio_ / std::pow(resolution_, 3);
+    const double gauss_d3 = -std::log(gauss_c2);
+    gauss_d1_ = -std::log(gauss_c1 + gauss_c2) - gauss_d3;
+    gauss_d2_ = -2 * std::log((-std::log(gauss_c1 * std::exp(-0.5) + gauss_c2) - gauss_d3) / gauss_d1_);
+    inv_resolution_ = 1.0 / resolution_;
+  }
+
+  static uint64_t getKey(const int64_t ix, const int64_t iy, const int64_t iz)
+  {
+    // 21 bits per axis
+    return ((static_cast<uint64_t>(ix) & 0x1fffffULL) << 42) |
+           ((static_cast<uint64_t>(iy) & 0x1fffffULL) << 21) |
+           (static_cast<uint64_t>(iz) & 0x1fffffULL);
+  }
+
+  Eigen::Vector3i getIndex(const Eigen::Vector3d & p) const
+  {
+    return Eigen::Vector3i(
+      static_cast<int>(std::floor(p.x() * inv_resolution_)),
+      static_cast<int>(std::floor(p.y() * inv_resolution_)),
+      static_cast<int>(std::floor(p.z() * inv_resolution_)));
+  }
+
+  int getNumThreads() const
+  {
+#ifdef _OPENMP
+    return num_threads_ > 0 ? num_threads_ : omp_get_max_threads();
+#else
+    return 1;
+#endif
+  }
+
+  // The points are summed into per-thread maps split into one partition per thread, and each
+  // thread then merges one partition, as ParallelMapLoader::voxelFilter. Only moving the sums
+  // into the voxel map is left to one thread.
+  void buildVoxels()
+  {
+    TRACE_ZONE("LazyNDT::buildVoxels");
+    // a new map, so the registrations sharing the previous one keep it
+    voxels_ = std::make_shared<VoxelMap>();
+    const int num_threads = getNumThreads();
+    std::vector<std::vector<VoxelSumsMap>> local_sums(
+      num_threads, std::vector<VoxelSumsMap>(num_threads));
+
+    #pragma omp parallel for num_threads(num_threads) schedule(static)
+    for (int t = 0; t < num_threads; ++t) {
+      TRACE_ZONE("ndt_voxel_bin");
+      const size_t begin = target_->size() * t / num_threads;
+      const size_t end = target_->size() * (t + 1) / num_threads;
+      auto & partitions = local_sums[t];
+      for (size_t i = begin; i < end; ++i) {
+        const auto & p = target_->points[i];
+        if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+        const Eigen::Vector3d pt(p.x, p.y, p.z);
+        const Eigen::Vector3i index = getIndex(pt);
+        const uint64_t key = getKey(index.x(), index.y(), index.z());
+        VoxelSums & sums = partitions[key % num_threads][key];
+        ++sums.num_points;
+        sums.sum += pt;
+        sums.sum_sq += pt * pt.transpose();
+        sums.indices.push_back(static_cast<int>(i));
+      }
+    }
+
+    #pragma omp parallel for num_threads(num_threads) schedule(static)
+    for (int part = 0; part < num_threads; ++part) {
+      TRACE_ZONE("ndt_voxel_merge");
+      VoxelSumsMap & merged = local_sums[0][part];
+      // in thread order, so the indices of a voxel stay sorted
+      for (int t = 1; t < num_threads; ++t) {
+        for (auto & entry : local_sums[t][part]) {
+          VoxelSums & sums = merged[entry.first];
+          sums.num_points += entry.second.num_points;
+          sums.sum += entry.second.sum;
+          sums.sum_sq += entry.second.sum_sq;
+          sums.indices.insert(
+            sums.indices.end(), entry.second.indices.begin(), entry.second.indices.end());
+        }
+        VoxelSumsMap().swap(local_sums[t][part]);
+      }
+    }
+
+    size_t num_voxels = 0;
+    for (const auto & partition : local_sums[0]) {
+      num_voxels += partition.size();
+    }
+    voxels_->voxels.reserve(num_voxels);
+    for (auto & partition : local_sums[0]) {
+      for (auto & entry : partition) {
+        Voxel & voxel = voxels_->voxels[entry.first];
+        voxel.num_points = entry.second.num_points;
+        voxel.sum = entry.second.sum;
+        voxel.sum_sq = entry.second.sum_sq;
+        voxel.indices = std::move(entry.second.indices);
+      }
+      VoxelSumsMap().swap(partition);
+    }
+  }
+
+  // Ref:pclomp::VoxelGridCovariance::applyFilter
+  void finalize(Voxel & voxel)
+  {
+    ++voxels_->num_finalized;
+    if (voxel.num_points < min_points_per_voxel_) {return;}
+
+    const double n = voxel.num_points;
+    Eigen::Vector3d & mean = voxel.distribution.mean;
+    mean = voxel.sum / n;
+    Eigen::Matrix3d cov = (voxel.sum_sq - n * mean * mean.transpose()) / (n - 1);
+
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(cov);
+    Eigen::Vector3d eigen_values = solver.eigenvalues();
+    if (eigen_values(0) < 0 || eigen_values(1) < 0 || eigen_values(2) <= 0) {return;}
+
+    // inflate near-singular covariances
+    const double min_eigen_value = min_covar_eigvalue_mult_ * eigen_values(2);
+    if (eigen_values(0) < min_eigen_value) {
+      eigen_values(0) = min_eigen_value;
+      if (eigen_values(1) < min_eigen_value) {
+        eigen_values(1) = min_eigen_value;
+      }
+      const Eigen::Matrix3d & eigen_vectors = solver.eigenvectors();
+      cov = eigen_vectors * eigen_values.asDiagonal() * eigen_vectors.transpose();
+    }
+
+    voxel.distribution.icov = cov.inverse();
+    voxel.valid = voxel.distribution.icov.allFinite();
+  }
+
+  const NdtDistribution * getDistribution(const int64_t ix, const int64_t iy, const int64_t iz)
+  {
+    const uint64_t key = getKey(ix, iy, iz);
+    if (shared_target_) {
+      const SharedNdtTarget::Voxel * voxel = shared_target_->find(key);
+      return voxel != nullptr && voxel->valid ? &voxel->distribution : nullptr;
+    }
+    auto it = voxels_->voxels.find(key);
+    if (it == voxels_->voxels.end()) {return nullptr;}
+    Voxel & voxel = it->second;
+    std::call_once(voxel.finalize_flag, [this, &voxel]() {finalize(voxel);});
+    return voxel.valid ? &voxel.distribution : nullptr;
+  }
+
+  void nearestPoint(const pcl::PointXYZI & point, int & index, float & sqr_distance) const
+  {
+    const Eigen::Vector3d query(point.x, point.y, point.z);
+    const Eigen::Vector3i center = getIndex(query);
+    // with no point in the 27 surrounding voxels the nearest one is at least resolution_ away,
+    // and is reported at the unmatched distance so that a scan off the map scores as lost
+    const double unmatched = std::max(2.0 * resolution_, kUnmatchedDistance);
+    double best = unmatched * unmatched;
+    index = 0;
+    auto update = [&](const float x, const float y, const float z, const int i) {
+        const double d = (Eigen::Vector3d(x, y, z) - query).squaredNorm();
+        if (d < best) {
+          best = d;
+          index = i;
+        }
+      };
+    for (int dx = -1; dx <= 1; ++dx) {
+      for (int dy = -1; dy <= 1; ++dy) {
+        for (int dz = -1; dz <= 1; ++dz) {
+          const uint64_t key = getKey(center.x() + dx, center.y() + dy, center.z() + dz);
+          // the index is then one of the points of the segment
+          if (shared_target_) {
+            const SharedNdtTarget::Voxel * voxel = shared_target_->find(key);
+            if (voxel == nullptr) {continue;}
+            const SharedNdtTarget::Point * points = shared_target_->points() + voxel->first_point;
+            for (uint32_t k = 0; k < voxel->num_points; ++k) {
+              update(points[k].x, points[k].y, points[k].z, voxel->first_point + k);
+            }
+            continue;
+          }
+          auto it = voxels_->voxels.find(key);
+          if (it == voxels_->voxels.end()) {continue;}
+          for (const int i : it->second.indices) {
+            const auto & p = target_->points[i];
+            update(p.x, p.y, p.z, i);
+          }
+        }
+      }
+    }
+    sqr_distance = static_cast<float>(best);
+  }
+
+  // [t, w] applied on the left: p' = exp(w) * (R * p + t0) + t
+  static Eigen::Matrix4d applyIncrement(const Vector6d & delta, const Eigen::Matrix4d & transformation)
+  {
+    const Eigen::Vector3d w = delta.tail<3>();
+    const double angle = w.norm();
+    Eigen::Matrix3d rotation = Eigen::Matrix3d::Identity();
+    if (angle > 1e-12) {
+      rotation = Eigen::AngleAxisd(angle, w / angle).toRotationMatrix();
+    }
+    Eigen::Matrix4d increment = Eigen::Matrix4d::Identity();
+    increment.block<3, 3>(0, 0) = rotation;
+    increment.block<3, 1>(0, 3) = delta.head<3>();
+    return increment * transformation;
+  }
+
+  // Ref:pcl::NormalDistributionsTransform::updateDerivatives
+  // num_correspondences: the points next to a voxel of the target
+  double computeDerivatives(
+    const Eigen::Matrix4d & transformation, Vector6d & gradient, Matrix6d & hessian,
+    int & num_correspondences)
+  {
+    TRACE_ZONE("LazyNDT::computeDerivatives");
+    const Eigen::Matrix3d rotation = transformation.block<3, 3>(0, 0);
+    const Eigen::Vector3d translation = transformation.block<3, 1>(0, 3);
+    const int num_points = static_cast<int>(input_->size());
+#ifdef _OPENMP
+    const int num_threads = num_threads_ > 0 ? num_threads_ : omp_get_max_threads();
+#endif
+
+    double score = 0.0;
+    gradient.setZero();
+    hessian.setZero();
+    num_correspondences = 0;
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+      double local_score = 0.0;
+      int local_correspondences = 0;
+      // the derivatives are summed by batches of correspondences, vectorized across them
+      PointKernels::NdtTerms terms;
+      double sums[PointKernels::kNdtSums] = {};
+
+      {
+        // no barrier after the loop, so the idle time of the threads shows in the trace
+        TRACE_ZONE("ndt_derivatives_worker");
+        #pragma omp for schedule(guided, 8) nowait
+        for (int i = 0; i < num_points; ++i) {
+          const auto & p = input_->points[i];
+          if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+          const Eigen::Vector3d q = rotation * Eigen::Vector3d(p.x, p.y, p.z) + translation;
+          const Eigen::Vector3i index = getIndex(q);
+
+          // DIRECT7 neighbourhood
+          static const int offsets[7][3] = {
+            {0, 0, 0}, {1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+          bool matched = false;
+          for (const auto & offset : offsets) {
+            const NdtDistribution * voxel = getDistribution(
+              index.x() + offset[0], index.y() + offset[1], index.z() + offset[2]);
+            if (voxel == nullptr) {continue;}
+            matched = true;
+
+            const Eigen::Vector3d d = q - voxel->mean;
+            const Eigen::Vector3d icov_d = voxel->icov * d;
+            const double e = std::exp(-gauss_d2_ * d.dot(icov_d) / 2);
+            const double factor = gauss_d1_ * gauss_d2_ * e;
+            if (e > 1 || e < 0 || factor != factor) {continue;}
+
+            local_score += -gauss_d1_ * e;
+            if (terms.add(factor, q, voxel->icov, icov_d)) {
+              PointKernels::accumulateNdt(terms, gauss_d2_, sums);
+              terms.size = 0;
+            }
+          }
+          if (matched) {++local_correspondences;}
+        }
+        PointKernels::accumulateNdt(terms, gauss_d2_, sums);
+      }
+
+      #pragma omp critical
+      {
+        score += local_score;
+        num_correspondences += local_correspondences;
+        int k = 6;
+        for (int r = 0; r < 6; ++r) {
+          gradient(r) += sums[r];
+          for (int c = r; c < 6; ++c, ++k) {
+            hessian(r, c) += sums[k];
+            if (c != r) {hessian(c, r) += sums[k];}
+          }
+        }
+      }
+    }
+    return score;
+  }
+
+  static constexpr int kMinCorrespondences = 10;
+  // distance reported for a point with no target point nearby, over the default
+  // score_threshold once squared
+  static constexpr double kUnmatchedDistance = 3.0;  /*[m]*/
+
+  double resolution_{1.0};
+  double inv_resolution_{1.0};
+  double step_size_{0.1};
+  double outlier_ratio_{0.55};
+  double gauss_d1_;
+  double gauss_d2_;
+  int num_threads_{0};
+  int min_points_per_voxel_{6};
+  double min_covar_eigvalue_mult_{0.01};
+  int max_line_search_iterations_{10};
+
+  std::shared_ptr<VoxelMap> voxels_{std::make_shared<VoxelMap>()};
+  // set in place of the voxels by setSharedTarget
+  std::shared_ptr<const SharedNdtTarget> shared_target_;
+};
+
+#endif  // LAZY_NDT_HPP_
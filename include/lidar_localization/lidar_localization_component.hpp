@@ -1,9 +1,15 @@
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include <pcl/registration/ndt.h>
 #include <pcl/registration/gicp.h>
@@ -27,6 +33,7 @@
 #include "sensor_msgs/msg/imu.hpp"
 #include "nav_msgs/msg/odometry.hpp"
 #include "nav_msgs/msg/path.hpp"
+#include "tf2_msgs/msg/tf_message.hpp"
 
 #include <pclomp/ndt_omp.h>
 #include <pclomp/ndt_omp_impl.hpp>
@@ -35,7 +42,26 @@
 #include <pclomp/gicp_omp.h>
 #include <pclomp/gicp_omp_impl.hpp>
 
+#include "lidar_localization/compressed_map.hpp"
+#include "lidar_localization/input_log.hpp"
+#include "lidar_localization/keyframe_local_map.hpp"
+#include "lidar_localization/lazy_ndt.hpp"
 #include "lidar_localization/lidar_undistortion.hpp"
+#include "lidar_localization/lifelong_map.hpp"
+#include "lidar_localization/loam_features.hpp"
+#include "lidar_localization/loam_registration.hpp"
+#include "lidar_localization/map_tiles.hpp"
+#include "lidar_localization/motion_gate.hpp"
+#include "lidar_localization/organized_scan.hpp"
+#include "lidar_localization/parallel_map_loader.hpp"
+#include "lidar_localization/point_kernels.hpp"
+#include "lidar_localization/pose_graph_smoother.hpp"
+#include "lidar_localization/range_adaptive_downsampler.hpp"
+#include "lidar_localization/shared_map.hpp"
+#include "lidar_localization/stage_profiler.hpp"
+#include "lidar_localization/tracing.hpp"
+#include "lidar_localization/voxel_grid_filter.hpp"
+#include "lidar_localization/zone_profiles.hpp"
 
 using namespace std::chrono_literals;
 
@@ -43,9 +69,54 @@ class PCLLocalization : public rclcpp_lifecycle::LifecycleNode
 {
 public:
   explicit PCLLocalization(const rclcpp::NodeOptions & options);
+  ~PCLLocalization();
 
   using CallbackReturn = rclcpp_lifecycle::node_interfaces::LifecycleNodeInterface::CallbackReturn;
 
+  // The filters a scan goes through before the registration. Each thread filtering scans
+  // needs its own.
+  struct ScanFilters
+  {
+    VoxelGridFilter voxel_grid_filter;
+    RangeAdaptiveDownsampler range_adaptive_downsampler;
+    OrganizedScanProcessor organized_scan_processor;
+    LoamFeatureExtractor loam_feature_extractor;
+  };
+
+  // A scan in base_frame_id, ready to be registered.
+  struct FilteredScan
+  {
+    pcl::PointCloud<pcl::PointXYZI>::Ptr cloud;
+    size_t num_downsampled_points{0};
+    // GICP covariances of the points of cloud, only set by the organized path
+    pcl::GeneralizedIterativeClosestPoint<pcl::PointXYZI, pcl::PointXYZI>::MatricesVectorPtr
+      covariances;
+    // features of the organized scan, which LOAM matches instead of cloud
+    pcl::PointCloud<pcl::PointXYZI>::Ptr edge_features;
+    pcl::PointCloud<pcl::PointXYZI>::Ptr planar_features;
+  };
+
+  // A scan of the batch localization with its odometry prior, the pose of base_frame_id in
+  // odom_frame_id at the scan stamp.
+  struct BatchScan
+  {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    sensor_msgs::msg::PointCloud2::ConstSharedPtr msg;
+    Eigen::Matrix4f base_to_sensor;
+    Eigen::Matrix4d odom_pose;
+  };
+
+  struct BatchResult
+  {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    Eigen::Matrix4d pose;
+    // false when the pose is only the smoothed prior
+    bool converged;
+    double fitness_score;
+  };
+  using BatchScans = std::vector<BatchScan, Eigen::aligned_allocator<BatchScan>>;
+  using BatchResults = std::vector<BatchResult, Eigen::aligned_allocator<BatchResult>>;
+
   CallbackReturn on_configure(const rclcpp_lifecycle::State &);
   CallbackReturn on_activate(const rclcpp_lifecycle::State &);
   CallbackReturn on_deactivate(const rclcpp_lifecycle::State &);
@@ -56,17 +127,97 @@ public:
   void initializeParameters();
   void initializePubSub();
   void initializeRegistration();
+  boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> createRegistration();
+  boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> createRegistration(
+    const std::string & registration_method, const double ndt_resolution);
+  void configureRegistration(
+    const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration);
+  static void setSourceCovariances(
+    const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration,
+    const pcl::GeneralizedIterativeClosestPoint<pcl::PointXYZI,
+    pcl::PointXYZI>::MatricesVectorPtr & covariances);
+  static void setInputFeatures(
+    const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration,
+    const pcl::PointCloud<pcl::PointXYZI>::Ptr & edges,
+    const pcl::PointCloud<pcl::PointXYZI>::Ptr & planes);
+  void downsampleScan(
+    const pcl::PointCloud<pcl::PointXYZI>::Ptr & cloud_ptr, const Eigen::Vector3f & sensor_origin,
+    ScanFilters & filters, FilteredScan & scan);
+  bool extractScanFeatures(
+    const pcl::PointCloud<pcl::PointXYZI>::Ptr & cloud_ptr, const Eigen::Vector3f & sensor_origin,
+    ScanFilters & filters, FilteredScan & scan);
+  static void alignScan(
+    const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration,
+    const FilteredScan & scan, const Eigen::Matrix4f & init_guess);
+  void setMapTarget(
+    const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration,
+    const std::string & registration_method, const double ndt_resolution,
+    const double voxel_leaf_size, const pcl::PointCloud<pcl::PointXYZI>::Ptr & map_cloud_ptr,
+    const std::string & shared_map_key);
+  static void shareTarget(
+    const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration,
+    const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> &
+    shared_registration);
+  bool useSharedTarget();
+  bool attachSharedTarget();
+  void exportSharedTarget();
+  bool isGicp() const;
+  static bool isGicp(const std::string & registration_method);
+  static bool isRegistrationMethod(const std::string & registration_method);
+  static bool sharesTarget(const std::string & registration_method);
+  std::string getTargetKey() const;
+  static std::string getTargetKey(
+    const std::string & registration_method, const double ndt_resolution,
+    const double voxel_leaf_size);
+  boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> findCachedTarget(
+    const std::string & key);
+  void cacheTarget(
+    const std::string & key, const uint64_t generation,
+    const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration);
+  rcl_interfaces::msg::SetParametersResult parametersChanged(
+    const std::vector<rclcpp::Parameter> & parameters);
   void initialPoseReceived(const geometry_msgs::msg::PoseWithCovarianceStamped::SharedPtr msg);
-  void mapReceived(const sensor_msgs::msg::PointCloud2::SharedPtr msg);
+  void publishInitialMap(const pcl::PointCloud<pcl::PointXYZI>::ConstPtr & map_cloud_ptr);
+  void mapReceived(const sensor_msgs::msg::PointCloud2::ConstSharedPtr msg);
+  void mapDeltaReceived(const sensor_msgs::msg::PointCloud2::ConstSharedPtr msg);
+  void requestTargetRebuild();
+  void startTargetBuild();
+  void waitForTargetBuild();
+  void rebuildTarget();
+  void startKeyframeTargetBuild();
+  void collectKeyframeTarget();
+  void requestZonePrebuild();
+  void prebuildZoneTargets();
+  void updateZoneProfile(const double x, const double y);
+  void startLifelongMap();
+  void stopLifelongMap();
+  void lifelongMapLoop();
+  void updateLifelongMap();
+  void checkpointLifelongMap();
+  void startPoseSmoothing();
+  void stopPoseSmoothing();
+  void poseSmoothingLoop();
+  void updatePoseSmoothing();
+  bool activateStreamedMap();
+  bool updateStreamedTiles(const double x, const double y);
+  void updateMapStreamPose();
+  bool broadcastPose(const builtin_interfaces::msg::Time & stamp);
+  void startMapStream();
+  void stopMapStream();
+  void mapStreamLoop();
+  static builtin_interfaces::msg::Time getStamp(const tf2_msgs::msg::TFMessage & msg);
   void odomReceived(const nav_msgs::msg::Odometry::ConstSharedPtr msg);
   void imuReceived(const sensor_msgs::msg::Imu::ConstSharedPtr msg);
   void cloudReceived(const sensor_msgs::msg::PointCloud2::ConstSharedPtr msg);
+  BatchResults localizeBatch(
+    const BatchScans & scans, const Eigen::Matrix4d & initial_pose,
+    const int num_threads, const int smoothing_window);
   // void gnssReceived();
 
   tf2_ros::TransformBroadcaster broadcaster_;
   rclcpp::Clock clock_;
   tf2_ros::Buffer tfbuffer_;
-  tf2_ros::TransformListener tflistener_;
+  std::shared_ptr<tf2_ros::TransformListener> tflistener_;
 
   rclcpp::Subscription<geometry_msgs::msg::PoseWithCovarianceStamped>::ConstSharedPtr
     initial_pose_sub_;
@@ -74,19 +225,27 @@ public:
     pose_pub_;
   rclcpp_lifecycle::LifecyclePublisher<nav_msgs::msg::Path>::SharedPtr
     path_pub_;
+  rclcpp_lifecycle::LifecyclePublisher<nav_msgs::msg::Path>::SharedPtr
+    smoothed_path_pub_;
   rclcpp_lifecycle::LifecyclePublisher<sensor_msgs::msg::PointCloud2>::SharedPtr
     initial_map_pub_;
   rclcpp::Subscription<sensor_msgs::msg::PointCloud2>::ConstSharedPtr
     map_sub_;
+  rclcpp::Subscription<sensor_msgs::msg::PointCloud2>::ConstSharedPtr
+    map_delta_sub_;
   rclcpp::Subscription<nav_msgs::msg::Odometry>::ConstSharedPtr
     odom_sub_;
   rclcpp::Subscription<sensor_msgs::msg::PointCloud2>::ConstSharedPtr
     cloud_sub_;
   rclcpp::Subscription<sensor_msgs::msg::Imu>::ConstSharedPtr
     imu_sub_;
+  rclcpp::Subscription<tf2_msgs::msg::TFMessage>::ConstSharedPtr
+    tf_sub_;
+  rclcpp::Subscription<tf2_msgs::msg::TFMessage>::ConstSharedPtr
+    tf_static_sub_;
 
   boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> registration_;
-  pcl::VoxelGrid<pcl::PointXYZI> voxel_grid_filter_;
+  ScanFilters scan_filters_;
   geometry_msgs::msg::PoseWithCovarianceStamped::SharedPtr corrent_pose_with_cov_stamped_ptr_;
   nav_msgs::msg::Path::SharedPtr path_ptr_;
   sensor_msgs::msg::PointCloud2::ConstSharedPtr last_scan_ptr_;
@@ -107,8 +266,21 @@ public:
   double ndt_step_size_;
   double transform_epsilon_;
   double voxel_leaf_size_;
+  std::string scan_downsample_method_;
+  double adaptive_reference_range_;
+  double adaptive_max_leaf_size_;
+  int adaptive_points_per_cell_;
+  int organized_column_stride_;
+  int organized_ground_column_stride_;
+  double loam_edge_threshold_;
+  double loam_planar_threshold_;
+  double loam_planar_leaf_size_;
   bool use_pcd_map_{false};
   std::string map_path_;
+  int map_num_threads_;
+  double map_stream_radius_;
+  bool share_map_{false};
+  std::string shared_target_name_;
   bool set_initial_pose_{false};
   double initial_pose_x_;
   double initial_pose_y_;
@@ -125,8 +297,149 @@ public:
   bool enable_map_odom_tf_{false};
 
   int ndt_num_threads_;
+  bool ndt_finalize_on_load_{false};
   int ndt_max_iterations_;
 
+  bool enable_map_delta_{false};
+  double map_tile_size_;
+  bool enable_lifelong_map_{false};
+  double lifelong_score_threshold_;
+  double lifelong_decay_;
+  double lifelong_max_weight_;
+  double lifelong_max_ray_length_;
+  double lifelong_checkpoint_interval_;
+  std::string lifelong_map_path_;
+  bool enable_keyframe_odometry_{false};
+  double keyframe_distance_;
+  double keyframe_angle_;
+  int keyframe_window_size_;
+  int keyframe_reanchor_interval_;
+  bool enable_pose_smoothing_{false};
+  int smoothing_window_size_;
+  double smoothing_registration_sigma_;
+  double smoothing_odom_sigma_;
+  bool enable_motion_gate_{false};
+  double motion_gate_linear_velocity_;
+  double motion_gate_angular_velocity_;
+  double motion_gate_settle_time_;
+  double motion_gate_idle_interval_;
+  std::string record_path_;
+  std::string trace_output_;
+  bool trace_opened_{false};
+  int target_cache_size_;
+  std::string zone_profiles_path_;
+  double zone_switch_margin_;
+
   // imu
   LidarUndistortion lidar_undistortion_;
+
+  ParallelMapLoader map_loader_;
+
+  // map delta
+  MapTiles map_tiles_;
+  std::mutex map_tiles_mutex_;
+  bool map_tiles_dirty_{false};
+  bool target_build_running_{false};
+  bool zone_prebuild_dirty_{false};
+  bool zone_prebuild_running_{false};
+  std::mutex registration_mutex_;
+
+  // runtime reconfiguration
+  rclcpp::node_interfaces::OnSetParametersCallbackHandle::SharedPtr parameter_callback_handle_;
+  // map the targets are built from when there are no map tiles
+  pcl::PointCloud<pcl::PointXYZI>::Ptr target_map_ptr_;
+  // with share_map, the map file target_map_ptr_ was loaded from, which keys the shared
+  // targets; empty when the map is this node's own
+  std::string shared_map_key_;
+  // the target of registration_ is mapped from shared_target_name_, without the map
+  bool shared_target_attached_{false};
+  // incremented when the map changes, which invalidates the cached targets
+  uint64_t target_generation_{0};
+  struct CachedTarget
+  {
+    std::string key;
+    uint64_t generation;
+    boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> registration;
+  };
+  // most recently used first, guarded by registration_mutex_
+  std::deque<CachedTarget> target_cache_;
+
+  // zone profiles
+  ZoneProfiles zone_profiles_;
+  // the configured parameters, used outside all zones
+  RegistrationProfile default_profile_;
+  int active_zone_{-1};
+
+  // lifelong map
+  LifelongMap lifelong_map_;
+  std::mutex lifelong_mutex_;
+  std::condition_variable lifelong_cv_;
+  bool lifelong_running_{false};
+  pcl::PointCloud<pcl::PointXYZI>::Ptr lifelong_base_map_;
+  // map deltas not applied to the lifelong map yet
+  std::vector<pcl::PointCloud<pcl::PointXYZI>::Ptr> lifelong_deltas_;
+  pcl::PointCloud<pcl::PointXYZI>::Ptr lifelong_scan_;
+  Eigen::Matrix4f lifelong_scan_pose_;
+  // in base_frame_id
+  Eigen::Vector3f lifelong_scan_origin_;
+  double lifelong_scan_stamp_;
+  // stamp of the scan the last checkpoint was made at, NaN until a scan follows the base map
+  double lifelong_checkpoint_stamp_;
+  std::thread lifelong_thread_;
+
+  // keyframe odometry
+  boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> local_registration_;
+  KeyframeLocalMap keyframe_map_;
+  bool keyframe_odometry_active_{false};
+  // scans tracked against the keyframes since the map was last tried
+  int keyframe_scans_since_map_{0};
+  // local_registration_ has a target of the current keyframes
+  bool keyframe_target_ready_{false};
+  // keyframes added while the local target was built
+  bool keyframe_target_dirty_{false};
+  // counts the clears of the keyframe map, so a build of cleared keyframes is dropped
+  uint64_t keyframe_generation_{0};
+  uint64_t keyframe_target_generation_{0};
+  std::string keyframe_target_key_;
+
+  // registration skipped while the robot is still
+  MotionGate motion_gate_;
+
+  // pose smoothing
+  PoseGraphSmoother pose_smoother_;
+  std::mutex smoothing_mutex_;
+  std::condition_variable smoothing_cv_;
+  bool smoothing_running_{false};
+  // set by a new initial pose, which the odometry does not connect to the window
+  bool smoothing_reset_{false};
+  // registered poses waiting to be added to the window
+  std::deque<PoseGraphSmoother::Node, Eigen::aligned_allocator<PoseGraphSmoother::Node>>
+  smoothing_queue_;
+  OdometryBuffer smoothing_odometry_;
+  // the poses that left the window
+  nav_msgs::msg::Path::SharedPtr smoothed_path_ptr_;
+  std::thread smoothing_thread_;
+
+  // record / replay
+  InputLog input_log_;
+  bool record_inputs_{false};
+  // set by the replay driver: background work runs on the calling thread
+  bool replay_mode_{false};
+  StageProfiler stage_profiler_;
+
+  // compressed map streaming
+  CompressedMap compressed_map_;
+  bool map_streaming_{false};
+  std::mutex map_stream_mutex_;
+  std::condition_variable map_stream_cv_;
+  bool map_stream_running_{false};
+  bool map_stream_pose_updated_{false};
+  double map_stream_x_{0.0};
+  double map_stream_y_{0.0};
+  std::thread map_stream_thread_;
+  // declared last so that a running target build is joined before the members it uses go away
+  std::future<void> target_build_future_;
+  std::future<void> zone_prebuild_future_;
+  std::future<boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>>>
+  keyframe_target_future_;
 };
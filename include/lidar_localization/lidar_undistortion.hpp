@@ -8,6 +8,9 @@
 #include <Eigen/Core>
 #include <Eigen/Geometry>
 #include <iostream>
+#include <vector>
+
+#include "lidar_localization/point_kernels.hpp"
 
 class LidarUndistortion
 {
@@ -80,8 +83,11 @@ public:
     bool half_passed = false;
     int cloud_size = cloud->points.size();
 
-    float start_ori = -std::atan2(cloud->points[0].y, cloud->points[0].x);
-    float end_ori = -std::atan2(cloud->points[cloud_size - 1].y, cloud->points[cloud_size - 1].x);
+    azimuths_.resize(cloud_size);
+    PointKernels::azimuths(cloud->points.data(), cloud_size, azimuths_.data());
+
+    float start_ori = azimuths_[0];
+    float end_ori = azimuths_[cloud_size - 1];
     if (end_ori - start_ori > 3 * M_PI) {
       end_ori -= 2 * M_PI;
     } else if (end_ori - start_ori < M_PI) {
@@ -96,7 +102,7 @@ public:
     float ori_h;
     for (int i = 0; i < cloud_size; ++i) {
       pcl::PointXYZI & p = cloud->points[i];
-      ori_h = -std::atan2(p.y, p.x);
+      ori_h = azimuths_[i];
       if (!half_passed) {
         if (ori_h < start_ori - M_PI * 0.5) {
           ori_h += 2 * M_PI;
@@ -216,6 +222,8 @@ private:
   std::array<float, imu_que_length_> imu_angular_rot_x_;
   std::array<float, imu_que_length_> imu_angular_rot_y_;
   std::array<float, imu_que_length_> imu_angular_rot_z_;
+
+  std::vector<float> azimuths_;
 };
 
 #endif  // LIDAR_UNDISTORTION_HPP_
@@ -0,0 +1,285 @@
+#ifndef LIFELONG_MAP_HPP_
+#define LIFELONG_MAP_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <Eigen/Core>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+#include "lidar_localization/map_tiles.hpp"
+
+// Voxel map whose voxels are exponentially decayed means of the points observed in them.
+// Decay is only applied to the voxels a scan sees through, traversed from the sensor to each
+// point, so occluded and unseen voxels keep their weight while removed structure fades out.
+// The voxels are grouped in the xy tiles of MapTiles, a voxel crossing a tile border being kept
+// as one voxel per tile, so the changes can be merged per tile.
+class LifelongMap
+{
+public:
+  using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+
+  LifelongMap() {}
+
+  void setVoxelSize(const double voxel_size /*[m]*/)
+  {
+    voxel_size_ = voxel_size;
+  }
+
+  void setTileSize(const double tile_size /*[m]*/)
+  {
+    tile_size_ = tile_size;
+  }
+
+  // weight kept each time a scan sees through a voxel, in (0, 1]
+  void setDecay(const double decay)
+  {
+    decay_ = decay;
+  }
+
+  // Only the first max_ray_length of each ray decays the voxels, which bounds the traversal of
+  // a scan. The far end of long rays is also the least certain to be free.
+  void setMaxRayLength(const double max_ray_length /*[m]*/)
+  {
+    max_ray_length_ = max_ray_length;
+  }
+
+  // voxels below min_weight are dropped, voxels never exceed max_weight
+  void setWeightRange(const double min_weight, const double max_weight)
+  {
+    min_weight_ = min_weight;
+    max_weight_ = max_weight;
+  }
+
+  void setCloud(const Cloud & cloud)
+  {
+    tiles_.clear();
+    changed_tiles_.clear();
+    for (const auto & p : cloud.points) {
+      addPoint(p);
+    }
+  }
+
+  // Every tile touched by the cloud is replaced by the points of the cloud falling in it, as
+  // MapTiles::replaceTiles does with a map delta.
+  void replaceTiles(const Cloud & cloud)
+  {
+    std::unordered_set<uint64_t> replaced_tiles;
+    for (const auto & p : cloud.points) {
+      if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+      const uint64_t key = getTileKey(p);
+      if (replaced_tiles.insert(key).second) {
+        tiles_.erase(key);
+        changed_tiles_.erase(key);
+      }
+      addPoint(p);
+    }
+  }
+
+  // cloud and sensor_origin are expected in the map frame
+  void integrate(const Cloud & cloud, const Eigen::Vector3f & sensor_origin)
+  {
+    // the voxels hit by the scan are not seen through
+    std::unordered_set<uint64_t> hit_voxels;
+    for (const auto & p : cloud.points) {
+      if (std::isfinite(p.x) && std::isfinite(p.y) && std::isfinite(p.z)) {
+        hit_voxels.insert(getVoxelKey(getVoxelIndex(p.x), getVoxelIndex(p.y), getVoxelIndex(p.z)));
+      }
+    }
+
+    // each voxel seen through is decayed once per scan, whatever the number of rays
+    std::unordered_map<uint64_t, std::pair<int64_t, int64_t>> free_voxels;  // key -> xy index
+    const Eigen::Vector3d origin = sensor_origin.cast<double>();
+    for (const auto & p : cloud.points) {
+      if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+      traverse(
+        origin, Eigen::Vector3d(p.x, p.y, p.z),
+        [this, &hit_voxels, &free_voxels](const int64_t ix, const int64_t iy, const int64_t iz) {
+          const uint64_t voxel_key = getVoxelKey(ix, iy, iz);
+          if (hit_voxels.count(voxel_key) > 0) {return;}
+          free_voxels.emplace(voxel_key, std::make_pair(ix, iy));
+        });
+    }
+
+    for (const auto & free_voxel : free_voxels) {
+      // the parts of the voxel in each tile it crosses
+      const int64_t ix = free_voxel.second.first;
+      const int64_t iy = free_voxel.second.second;
+      for (int64_t tx = MapTiles::getIndex(ix * voxel_size_, tile_size_);
+        tx <= MapTiles::getIndex((ix + 1) * voxel_size_, tile_size_); ++tx)
+      {
+        for (int64_t ty = MapTiles::getIndex(iy * voxel_size_, tile_size_);
+          ty <= MapTiles::getIndex((iy + 1) * voxel_size_, tile_size_); ++ty)
+        {
+          decayVoxel(MapTiles::getKey(tx, ty), free_voxel.first);
+        }
+      }
+    }
+
+    for (const auto & p : cloud.points) {
+      if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+      addPoint(p);
+      changed_tiles_.insert(getTileKey(p));
+    }
+  }
+
+  // The tiles changed by integrate since the last call, one point per voxel. A tile whose
+  // voxels all faded out is returned empty.
+  std::unordered_map<uint64_t, Cloud::Ptr> extractChangedTiles()
+  {
+    std::unordered_map<uint64_t, Cloud::Ptr> changed;
+    for (const auto & key : changed_tiles_) {
+      Cloud::Ptr cloud(new Cloud);
+      auto tile = tiles_.find(key);
+      if (tile != tiles_.end()) {
+        extractTile(tile->second, *cloud);
+      }
+      changed[key] = cloud;
+    }
+    changed_tiles_.clear();
+    return changed;
+  }
+
+  // one point per voxel, at the decayed mean
+  Cloud::Ptr extract() const
+  {
+    Cloud::Ptr cloud(new Cloud);
+    for (const auto & tile : tiles_) {
+      extractTile(tile.second, *cloud);
+    }
+    return cloud;
+  }
+
+private:
+  struct Voxel
+  {
+    // Vector3d has no alignment requirement, unlike Vector4d, so it is safe in hash map nodes.
+    Eigen::Vector3d sum{Eigen::Vector3d::Zero()};
+    double intensity_sum{0.0};
+    double weight{0.0};
+  };
+
+  using Voxels = std::unordered_map<uint64_t, Voxel>;
+
+  void extractTile(const Voxels & voxels, Cloud & cloud) const
+  {
+    for (const auto & voxel : voxels) {
+      const Voxel & v = voxel.second;
+      if (v.weight < min_weight_) {continue;}
+      pcl::PointXYZI p;
+      p.x = v.sum.x() / v.weight;
+      p.y = v.sum.y() / v.weight;
+      p.z = v.sum.z() / v.weight;
+      p.intensity = v.intensity_sum / v.weight;
+      cloud.push_back(p);
+    }
+  }
+
+  void decayVoxel(const uint64_t tile_key, const uint64_t voxel_key)
+  {
+    auto tile = tiles_.find(tile_key);
+    if (tile == tiles_.end()) {return;}
+    auto voxel = tile->second.find(voxel_key);
+    if (voxel == tile->second.end()) {return;}
+    Voxel & v = voxel->second;
+    v.sum *= decay_;
+    v.intensity_sum *= decay_;
+    v.weight *= decay_;
+    if (v.weight < min_weight_) {
+      tile->second.erase(voxel);
+    }
+    changed_tiles_.insert(tile_key);
+  }
+
+  void addPoint(const pcl::PointXYZI & p)
+  {
+    if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {return;}
+    Voxel & v = tiles_[getTileKey(p)][
+      getVoxelKey(getVoxelIndex(p.x), getVoxelIndex(p.y), getVoxelIndex(p.z))];
+    // keep the mean while capping the weight, so old observations are averaged away
+    if (v.weight + 1.0 > max_weight_) {
+      const double scale = (max_weight_ - 1.0) / v.weight;
+      v.sum *= scale;
+      v.intensity_sum *= scale;
+      v.weight *= scale;
+    }
+    v.sum += Eigen::Vector3d(p.x, p.y, p.z);
+    v.intensity_sum += p.intensity;
+    v.weight += 1.0;
+  }
+
+  // Calls visit with the voxels the ray from origin crosses before the voxel of end, stopping
+  // one voxel short of it so the rays grazing a surface don't wear it away (Amanatides-Woo).
+  template<typename Visit>
+  void traverse(const Eigen::Vector3d & origin, const Eigen::Vector3d & end, Visit visit) const
+  {
+    Eigen::Vector3d direction = end - origin;
+    const double length = std::min(direction.norm() - voxel_size_, max_ray_length_);
+    if (length <= 0.0) {return;}
+    direction.normalize();
+    int64_t index[3];
+    int64_t step[3];
+    double t_max[3];
+    double t_delta[3];
+    for (int a = 0; a < 3; ++a) {
+      index[a] = getVoxelIndex(origin[a]);
+      if (direction[a] > 0.0) {
+        step[a] = 1;
+        t_max[a] = ((index[a] + 1) * voxel_size_ - origin[a]) / direction[a];
+        t_delta[a] = voxel_size_ / direction[a];
+      } else if (direction[a] < 0.0) {
+        step[a] = -1;
+        t_max[a] = (index[a] * voxel_size_ - origin[a]) / direction[a];
+        t_delta[a] = -voxel_size_ / direction[a];
+      } else {
+        step[a] = 0;
+        t_max[a] = std::numeric_limits<double>::infinity();
+        t_delta[a] = std::numeric_limits<double>::infinity();
+      }
+    }
+    while (true) {
+      visit(index[0], index[1], index[2]);
+      const int a = t_max[0] < t_max[1] ?
+        (t_max[0] < t_max[2] ? 0 : 2) : (t_max[1] < t_max[2] ? 1 : 2);
+      if (t_max[a] > length) {break;}
+      index[a] += step[a];
+      t_max[a] += t_delta[a];
+    }
+  }
+
+  // the tile of MapTiles the point is in
+  uint64_t getTileKey(const pcl::PointXYZI & p) const
+  {
+    return MapTiles::getKey(
+      MapTiles::getIndex(p.x, tile_size_), MapTiles::getIndex(p.y, tile_size_));
+  }
+
+  int64_t getVoxelIndex(const double coordinate) const
+  {
+    return static_cast<int64_t>(std::floor(coordinate / voxel_size_));
+  }
+
+  uint64_t getVoxelKey(const int64_t ix, const int64_t iy, const int64_t iz) const
+  {
+    // 21 bits per axis
+    return ((static_cast<uint64_t>(ix) & 0x1fffffULL) << 42) |
+           ((static_cast<uint64_t>(iy) & 0x1fffffULL) << 21) |
+           (static_cast<uint64_t>(iz) & 0x1fffffULL);
+  }
+
+  double voxel_size_{0.2};
+  double tile_size_{20.0};
+  double decay_{0.99};
+  double min_weight_{0.1};
+  double max_weight_{10.0};
+  double max_ray_length_{50.0};
+  std::unordered_map<uint64_t, Voxels> tiles_;
+  std::unordered_set<uint64_t> changed_tiles_;
+};
+
+#endif  // LIFELONG_MAP_HPP_
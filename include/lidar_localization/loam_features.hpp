@@ -0,0 +1,206 @@
+#ifndef LOAM_FEATURES_HPP_
+#define LOAM_FEATURES_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <Eigen/Core>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+// Edge and planar features of an organized scan (one row per ring), picked by the smoothness
+// of the range along each ring.
+// Ref:LeGO-LOAM(BSD-3 LICENSE)
+// https://github.com/RobustFieldAutonomyLab/LeGO-LOAM/blob/master/LeGO-LOAM/src/featureAssociation.cpp#L1026-L1201
+class LoamFeatureExtractor
+{
+public:
+  using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+
+  LoamFeatureExtractor() {}
+
+  // squared sums of range differences over the 10 neighbours along the ring [m^2]
+  void setThresholds(const double edge_threshold, const double planar_threshold)
+  {
+    edge_threshold_ = edge_threshold;
+    planar_threshold_ = planar_threshold;
+  }
+
+  // the planar features are thinned to one per voxel of this size
+  void setPlanarLeafSize(const double planar_leaf_size /*[m]*/)
+  {
+    planar_leaf_size_ = planar_leaf_size;
+  }
+
+  // horizontal range from the origin of the cloud's frame, as the crop of cloudReceived
+  void setRange(const double min_range /*[m]*/, const double max_range /*[m]*/)
+  {
+    min_range_ = min_range;
+    max_range_ = max_range;
+  }
+
+  // ranges along the rings are measured from here
+  void setSensorOrigin(const Eigen::Vector3f & sensor_origin)
+  {
+    sensor_origin_ = sensor_origin;
+  }
+
+  void extract(const Cloud & input, Cloud & edges, Cloud & planes)
+  {
+    edges.clear();
+    planes.clear();
+    planar_voxels_.clear();
+    const int width = static_cast<int>(input.width);
+    const int height = static_cast<int>(input.height);
+    for (int row = 0; row < height; ++row) {
+      // the valid points of the ring, in column order
+      ring_.clear();
+      for (int column = 0; column < width; ++column) {
+        const pcl::PointXYZI & p = input.points[row * width + column];
+        if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+        const double r = std::sqrt(p.x * p.x + p.y * p.y);
+        if (r <= min_range_ || r >= max_range_) {continue;}
+        RingPoint point;
+        point.point = &p;
+        point.column = column;
+        point.range = (Eigen::Vector3f(p.x, p.y, p.z) - sensor_origin_).norm();
+        ring_.push_back(point);
+      }
+      extractRing(edges, planes);
+    }
+    finish(edges);
+    finish(planes);
+  }
+
+private:
+  struct RingPoint
+  {
+    const pcl::PointXYZI * point;
+    int column;
+    float range;
+    float curvature{0.0f};
+    bool picked{false};
+  };
+
+  static constexpr int kHalfWindow = 5;
+  static constexpr int kNumSectors = 6;
+  static constexpr int kMaxEdgesPerSector = 20;
+  static constexpr int kMaxColumnGap = 10;
+
+  void extractRing(Cloud & edges, Cloud & planes)
+  {
+    const int size = static_cast<int>(ring_.size());
+    if (size < 2 * kHalfWindow + 1) {return;}
+
+    for (int i = kHalfWindow; i < size - kHalfWindow; ++i) {
+      float diff = -2.0f * kHalfWindow * ring_[i].range;
+      for (int j = -kHalfWindow; j <= kHalfWindow; ++j) {
+        if (j != 0) {diff += ring_[i + j].range;}
+      }
+      ring_[i].curvature = diff * diff;
+    }
+    for (int i = 0; i < kHalfWindow; ++i) {
+      ring_[i].picked = true;
+      ring_[size - 1 - i].picked = true;
+    }
+
+    // The far side of a depth discontinuity is occluded and would move with the viewpoint.
+    // Beams nearly parallel to the surface are unreliable too.
+    for (int i = kHalfWindow; i < size - kHalfWindow - 1; ++i) {
+      const RingPoint & a = ring_[i];
+      const RingPoint & b = ring_[i + 1];
+      if (b.column - a.column < kMaxColumnGap) {
+        if (a.range - b.range > 0.3f) {
+          for (int j = i - kHalfWindow; j <= i; ++j) {ring_[j].picked = true;}
+        } else if (b.range - a.range > 0.3f) {
+          for (int j = i + 1; j <= i + kHalfWindow + 1; ++j) {ring_[j].picked = true;}
+        }
+      }
+      const float diff_previous = std::abs(ring_[i - 1].range - a.range);
+      const float diff_next = std::abs(b.range - a.range);
+      if (diff_previous > 0.02f * a.range && diff_next > 0.02f * a.range) {
+        ring_[i].picked = true;
+      }
+    }
+
+    const int begin = kHalfWindow;
+    const int end = size - kHalfWindow;
+    for (int sector = 0; sector < kNumSectors; ++sector) {
+      const int sector_begin = begin + (end - begin) * sector / kNumSectors;
+      const int sector_end = begin + (end - begin) * (sector + 1) / kNumSectors;
+      order_.clear();
+      for (int i = sector_begin; i < sector_end; ++i) {
+        order_.push_back(i);
+      }
+      std::sort(
+        order_.begin(), order_.end(),
+        [this](const int a, const int b) {return ring_[a].curvature > ring_[b].curvature;});
+
+      int num_edges = 0;
+      for (const int i : order_) {
+        if (num_edges >= kMaxEdgesPerSector || ring_[i].curvature <= edge_threshold_) {break;}
+        if (ring_[i].picked) {continue;}
+        edges.push_back(*ring_[i].point);
+        ++num_edges;
+        ring_[i].picked = true;
+        // no other edge right next to this one
+        for (int j = 1; j <= kHalfWindow; ++j) {
+          if (ring_[i + j].column - ring_[i + j - 1].column > kMaxColumnGap) {break;}
+          ring_[i + j].picked = true;
+        }
+        for (int j = 1; j <= kHalfWindow; ++j) {
+          if (ring_[i - j + 1].column - ring_[i - j].column > kMaxColumnGap) {break;}
+          ring_[i - j].picked = true;
+        }
+      }
+      for (auto it = order_.rbegin(); it != order_.rend(); ++it) {
+        const RingPoint & point = ring_[*it];
+        if (point.curvature >= planar_threshold_) {break;}
+        addPlanar(*point.point, planes);
+      }
+    }
+  }
+
+  static uint64_t getKey(const int64_t ix, const int64_t iy, const int64_t iz)
+  {
+    // 21 bits per axis
+    return ((static_cast<uint64_t>(ix) & 0x1fffffULL) << 42) |
+           ((static_cast<uint64_t>(iy) & 0x1fffffULL) << 21) |
+           (static_cast<uint64_t>(iz) & 0x1fffffULL);
+  }
+
+  // first point of each voxel, so the kept points stay scan points
+  void addPlanar(const pcl::PointXYZI & p, Cloud & planes)
+  {
+    if (planar_leaf_size_ > 0.0) {
+      const double inv_leaf_size = 1.0 / planar_leaf_size_;
+      const uint64_t key = getKey(
+        static_cast<int64_t>(std::floor(p.x * inv_leaf_size)),
+        static_cast<int64_t>(std::floor(p.y * inv_leaf_size)),
+        static_cast<int64_t>(std::floor(p.z * inv_leaf_size)));
+      if (!planar_voxels_.insert(key).second) {return;}
+    }
+    planes.push_back(p);
+  }
+
+  static void finish(Cloud & cloud)
+  {
+    cloud.width = cloud.size();
+    cloud.height = 1;
+    cloud.is_dense = true;
+  }
+
+  double edge_threshold_{0.1};
+  double planar_threshold_{0.1};
+  double planar_leaf_size_{0.4};
+  double min_range_{0.0};
+  double max_range_{100.0};
+  Eigen::Vector3f sensor_origin_{Eigen::Vector3f::Zero()};
+  std::vector<RingPoint> ring_;
+  std::vector<int> order_;
+  std::unordered_set<uint64_t> planar_voxels_;
+};
+
+#endif  // LOAM_FEATURES_HPP_
@@ -0,0 +1,402 @@
+#ifndef LOAM_REGISTRATION_HPP_
+#define LOAM_REGISTRATION_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/common/transforms.h>
+#include <pcl/registration/registration.h>
+#include <pcl/search/kdtree.h>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "lidar_localization/point_kernels.hpp"
+#include "lidar_localization/tracing.hpp"
+
+// Matches the edge and planar features of a scan (LoamFeatureExtractor) against the map, in
+// the manner of the LOAM mapping step: point-to-line distances for the edges and
+// point-to-plane distances for the planes, minimized by Gauss-Newton with the associations
+// redone at every iteration.
+// The map has no rings, so its features are the voxels of the resolution whose points lie on
+// a line (poles, trunks, thin edges) or on a plane. As in LazyNDT, the voxels are only summed
+// when the target is set and are classified the first time a scan point falls in them.
+// A source set with setInputSource only has planar features.
+class LoamRegistration : public pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>
+{
+public:
+  using Ptr = boost::shared_ptr<LoamRegistration>;
+  using Vector6d = Eigen::Matrix<double, 6, 1>;
+  using Matrix6d = Eigen::Matrix<double, 6, 6>;
+
+  LoamRegistration()
+  {
+    reg_name_ = "LoamRegistration";
+    transformation_epsilon_ = 0.01;
+    max_iterations_ = 30;
+    // The fitness score searches the voxel hash instead of a kd-tree over the whole map.
+    setSearchMethodTarget(KdTreePtr(new VoxelNearestSearch(*this)), true);
+  }
+
+  LoamRegistration(const LoamRegistration &) = delete;
+  LoamRegistration & operator=(const LoamRegistration &) = delete;
+
+  void setResolution(const float resolution /*[m]*/)
+  {
+    resolution_ = resolution;
+    inv_resolution_ = 1.0 / resolution_;
+    if (target_) {
+      buildVoxels();
+    }
+  }
+
+  // num_threads <= 0 uses all available threads
+  void setNumThreads(const int num_threads)
+  {
+    num_threads_ = num_threads;
+  }
+
+  void setInputSource(const PointCloudSourceConstPtr & cloud) override
+  {
+    pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>::setInputSource(cloud);
+    num_edges_ = 0;
+  }
+
+  void setInputFeatures(const PointCloudSource & edges, const PointCloudSource & planes)
+  {
+    PointCloudSource::Ptr features(new PointCloudSource(edges));
+    *features += planes;
+    setInputSource(features);
+    num_edges_ = static_cast<int>(edges.size());
+  }
+
+  void setInputTarget(const PointCloudTargetConstPtr & cloud) override
+  {
+    pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>::setInputTarget(cloud);
+    buildVoxels();
+  }
+
+  // Aligns against the voxels of another LoamRegistration without copying them, as
+  // LazyNDT::shareTarget.
+  void shareTarget(const LoamRegistration & other)
+  {
+    pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>::setInputTarget(other.target_);
+    resolution_ = other.resolution_;
+    inv_resolution_ = other.inv_resolution_;
+    voxels_ = other.voxels_;
+  }
+
+protected:
+  void computeTransformation(PointCloudSource & output, const Matrix4 & guess) override
+  {
+    TRACE_ZONE("LoamRegistration::computeTransformation");
+    nr_iterations_ = 0;
+    converged_ = false;
+
+    Eigen::Matrix4d transformation = guess.cast<double>();
+    while (true) {
+      Vector6d gradient;
+      Matrix6d hessian;
+      if (computeNormalEquations(transformation, gradient, hessian) < kMinCorrespondences) {
+        break;
+      }
+
+      // The directions the features do not constrain (along a corridor) are left untouched
+      // rather than driven by noise, as the degeneracy check of LOAM.
+      Eigen::SelfAdjointEigenSolver<Matrix6d> solver(hessian);
+      const Vector6d & values = solver.eigenvalues();
+      const Eigen::Matrix<double, 6, 6> & vectors = solver.eigenvectors();
+      const Vector6d projected = vectors.transpose() * -gradient;
+      Vector6d delta = Vector6d::Zero();
+      for (int k = 0; k < 6; ++k) {
+        if (values(k) > kDegenerateRatio * values(5)) {
+          delta += vectors.col(k) * (projected(k) / values(k));
+        }
+      }
+      if (!delta.allFinite()) {break;}
+
+      transformation = applyIncrement(delta, transformation);
+      ++nr_iterations_;
+      if (nr_iterations_ >= max_iterations_ || delta.norm() < transformation_epsilon_) {
+        converged_ = true;
+        break;
+      }
+    }
+
+    final_transformation_ = transformation.cast<float>();
+    transformation_ = final_transformation_;
+    PointKernels::transform(*input_, final_transformation_, output);
+  }
+
+private:
+  enum class Shape : uint8_t {None, Line, Plane};
+
+  struct Voxel
+  {
+    int num_points{0};
+    Eigen::Vector3d sum{Eigen::Vector3d::Zero()};
+    Eigen::Matrix3d sum_sq{Eigen::Matrix3d::Zero()};
+    std::vector<int> indices;
+
+    std::once_flag finalize_flag;
+    Shape shape{Shape::None};
+    Eigen::Vector3d mean;
+    // direction of a line, normal of a plane
+    Eigen::Vector3d axis;
+  };
+
+  using VoxelMap = std::unordered_map<uint64_t, Voxel>;
+
+  // Serves getFitnessScore() from the voxel hash, as LazyNDT.
+  class VoxelNearestSearch : public pcl::search::KdTree<pcl::PointXYZI>
+  {
+public:
+    explicit VoxelNearestSearch(const LoamRegistration & registration)
+    : registration_(registration) {}
+
+    using pcl::search::KdTree<pcl::PointXYZI>::nearestKSearch;
+
+    int nearestKSearch(
+      const pcl::PointXYZI & point, int, pcl::Indices & k_indices,
+      std::vector<float> & k_sqr_distances) const override
+    {
+      k_indices.resize(1);
+      k_sqr_distances.resize(1);
+      registration_.nearestPoint(point, k_indices[0], k_sqr_distances[0]);
+      return 1;
+    }
+
+private:
+    const LoamRegistration & registration_;
+  };
+
+  static constexpr int kMinPointsPerVoxel = 5;
+  static constexpr int kMinCorrespondences = 10;
+  static constexpr double kUnmatchedDistance = 3.0;  /*[m]*/
+  // a line when the second eigenvalue is below this ratio of the largest one, a plane when
+  // the smallest is below this ratio of the second
+  static constexpr double kShapeRatio = 0.05;
+  static constexpr double kDegenerateRatio = 1e-4;
+
+  static uint64_t getKey(const int64_t ix, const int64_t iy, const int64_t iz)
+  {
+    // 21 bits per axis
+    return ((static_cast<uint64_t>(ix) & 0x1fffffULL) << 42) |
+           ((static_cast<uint64_t>(iy) & 0x1fffffULL) << 21) |
+           (static_cast<uint64_t>(iz) & 0x1fffffULL);
+  }
+
+  Eigen::Vector3i getIndex(const Eigen::Vector3d & p) const
+  {
+    return Eigen::Vector3i(
+      static_cast<int>(std::floor(p.x() * inv_resolution_)),
+      static_cast<int>(std::floor(p.y() * inv_resolution_)),
+      static_cast<int>(std::floor(p.z() * inv_resolution_)));
+  }
+
+  void buildVoxels()
+  {
+    TRACE_ZONE("LoamRegistration::buildVoxels");
+    // a new map, so the registrations sharing the previous one keep it
+    voxels_ = std::make_shared<VoxelMap>();
+    for (size_t i = 0; i < target_->size(); ++i) {
+      const auto & p = target_->points[i];
+      if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+      const Eigen::Vector3d pt(p.x, p.y, p.z);
+      const Eigen::Vector3i index = getIndex(pt);
+      Voxel & voxel = (*voxels_)[getKey(index.x(), index.y(), index.z())];
+      ++voxel.num_points;
+      voxel.sum += pt;
+      voxel.sum_sq += pt * pt.transpose();
+      voxel.indices.push_back(static_cast<int>(i));
+    }
+  }
+
+  static void finalize(Voxel & voxel)
+  {
+    if (voxel.num_points < kMinPointsPerVoxel) {return;}
+    const double n = voxel.num_points;
+    voxel.mean = voxel.sum / n;
+    const Eigen::Matrix3d cov = (voxel.sum_sq - n * voxel.mean * voxel.mean.transpose()) / (n - 1);
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+    solver.computeDirect(cov);
+    const Eigen::Vector3d & values = solver.eigenvalues();
+    if (!(values(2) > 0.0)) {return;}
+    if (values(1) < kShapeRatio * values(2)) {
+      voxel.shape = Shape::Line;
+      voxel.axis = solver.eigenvectors().col(2);
+    } else if (values(0) < kShapeRatio * values(1)) {
+      voxel.shape = Shape::Plane;
+      voxel.axis = solver.eigenvectors().col(0);
+    }
+  }
+
+  const Voxel * getFinalizedVoxel(const int64_t ix, const int64_t iy, const int64_t iz)
+  {
+    auto it = voxels_->find(getKey(ix, iy, iz));
+    if (it == voxels_->end()) {return nullptr;}
+    Voxel & voxel = it->second;
+    std::call_once(voxel.finalize_flag, [&voxel]() {finalize(voxel);});
+    return voxel.shape != Shape::None ? &voxel : nullptr;
+  }
+
+  // The voxel of the point, or else the nearest of its face neighbours, with the given shape.
+  // An edge point on a surface of the map (a corner of a wall) is matched to the plane.
+  const Voxel * findVoxel(const Eigen::Vector3d & q, const Shape shape)
+  {
+    static const int offsets[7][3] = {
+      {0, 0, 0}, {1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+    const Eigen::Vector3i index = getIndex(q);
+    const Voxel * nearest = nullptr;
+    double nearest_sq_distance = resolution_ * resolution_;
+    for (const auto & offset : offsets) {
+      const Voxel * voxel = getFinalizedVoxel(
+        index.x() + offset[0], index.y() + offset[1], index.z() + offset[2]);
+      if (voxel == nullptr || voxel->shape != shape) {continue;}
+      const double sq_distance = (q - voxel->mean).squaredNorm();
+      if (sq_distance < nearest_sq_distance) {
+        nearest = voxel;
+        nearest_sq_distance = sq_distance;
+      }
+      // the voxel of the point comes first and is taken when it matches, otherwise the nearest
+      // of the neighbours is
+      if (&offset == &offsets[0] && nearest != nullptr) {break;}
+    }
+    return nearest;
+  }
+
+  void nearestPoint(const pcl::PointXYZI & point, int & index, float & sqr_distance) const
+  {
+    const Eigen::Vector3d query(point.x, point.y, point.z);
+    const Eigen::Vector3i center = getIndex(query);
+    // as LazyNDT::nearestPoint, so that a scan off the map scores as lost
+    const double unmatched = std::max(2.0 * resolution_, kUnmatchedDistance);
+    double best = unmatched * unmatched;
+    index = 0;
+    for (int dx = -1; dx <= 1; ++dx) {
+      for (int dy = -1; dy <= 1; ++dy) {
+        for (int dz = -1; dz <= 1; ++dz) {
+          auto it = voxels_->find(getKey(center.x() + dx, center.y() + dy, center.z() + dz));
+          if (it == voxels_->end()) {continue;}
+          for (const int i : it->second.indices) {
+            const auto & p = target_->points[i];
+            const double d = (Eigen::Vector3d(p.x, p.y, p.z) - query).squaredNorm();
+            if (d < best) {
+              best = d;
+              index = i;
+            }
+          }
+        }
+      }
+    }
+    sqr_distance = static_cast<float>(best);
+  }
+
+  static Eigen::Matrix3d skew(const Eigen::Vector3d & v)
+  {
+    Eigen::Matrix3d m;
+    m << 0.0, -v.z(), v.y(),
+      v.z(), 0.0, -v.x(),
+      -v.y(), v.x(), 0.0;
+    return m;
+  }
+
+  // [t, w] applied on the left: p' = exp(w) * (R * p + t0) + t
+  static Eigen::Matrix4d applyIncrement(const Vector6d & delta, const Eigen::Matrix4d & transformation)
+  {
+    const Eigen::Vector3d w = delta.tail<3>();
+    const double angle = w.norm();
+    Eigen::Matrix3d rotation = Eigen::Matrix3d::Identity();
+    if (angle > 1e-12) {
+      rotation = Eigen::AngleAxisd(angle, w / angle).toRotationMatrix();
+    }
+    Eigen::Matrix4d increment = Eigen::Matrix4d::Identity();
+    increment.block<3, 3>(0, 0) = rotation;
+    increment.block<3, 1>(0, 3) = delta.head<3>();
+    return increment * transformation;
+  }
+
+  // Gauss-Newton normal equations of the weighted distances, LOAM's weight 1 - 0.9 |d| scaled
+  // to the resolution. Returns the number of correspondences.
+  int computeNormalEquations(
+    const Eigen::Matrix4d & transformation, Vector6d & gradient, Matrix6d & hessian)
+  {
+    TRACE_ZONE("LoamRegistration::computeNormalEquations");
+    const Eigen::Matrix3d rotation = transformation.block<3, 3>(0, 0);
+    const Eigen::Vector3d translation = transformation.block<3, 1>(0, 3);
+    const int num_points = static_cast<int>(input_->size());
+#ifdef _OPENMP
+    const int num_threads = num_threads_ > 0 ? num_threads_ : omp_get_max_threads();
+#endif
+
+    int num_correspondences = 0;
+    gradient.setZero();
+    hessian.setZero();
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+      int local_correspondences = 0;
+      Vector6d local_gradient = Vector6d::Zero();
+      Matrix6d local_hessian = Matrix6d::Zero();
+      Eigen::Matrix<double, 3, 6> jacobian;
+      jacobian.leftCols<3>().setIdentity();
+
+      #pragma omp for schedule(guided, 8)
+      for (int i = 0; i < num_points; ++i) {
+        const auto & p = input_->points[i];
+        if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+        const Eigen::Vector3d q = rotation * Eigen::Vector3d(p.x, p.y, p.z) + translation;
+        jacobian.rightCols<3>() = -skew(q);
+
+        const Voxel * voxel = i < num_edges_ ? findVoxel(q, Shape::Line) : nullptr;
+        if (voxel != nullptr) {
+          // residual: the component of q - mean across the line
+          const Eigen::Matrix3d projection =
+            Eigen::Matrix3d::Identity() - voxel->axis * voxel->axis.transpose();
+          const Eigen::Vector3d residual = projection * (q - voxel->mean);
+          const double weight = 1.0 - 0.9 * residual.norm() * inv_resolution_;
+          if (weight < 0.1) {continue;}
+          const Eigen::Matrix<double, 3, 6> residual_jacobian = projection * jacobian;
+          local_gradient += weight * residual_jacobian.transpose() * residual;
+          local_hessian += weight * residual_jacobian.transpose() * residual_jacobian;
+          ++local_correspondences;
+          continue;
+        }
+
+        voxel = findVoxel(q, Shape::Plane);
+        if (voxel == nullptr) {continue;}
+        const double residual = voxel->axis.dot(q - voxel->mean);
+        const double weight = 1.0 - 0.9 * std::abs(residual) * inv_resolution_;
+        if (weight < 0.1) {continue;}
+        const Vector6d residual_jacobian = jacobian.transpose() * voxel->axis;
+        local_gradient += weight * residual * residual_jacobian;
+        local_hessian += weight * residual_jacobian * residual_jacobian.transpose();
+        ++local_correspondences;
+      }
+
+      #pragma omp critical
+      {
+        num_correspondences += local_correspondences;
+        gradient += local_gradient;
+        hessian += local_hessian;
+      }
+    }
+    return num_correspondences;
+  }
+
+  double resolution_{1.0};
+  double inv_resolution_{1.0};
+  int num_threads_{0};
+  int num_edges_{0};
+
+  std::shared_ptr<VoxelMap> voxels_{std::make_shared<VoxelMap>()};
+};
+
+#endif  // LOAM_REGISTRATION_HPP_
@@ -0,0 +1,158 @@
+#ifndef MAP_TILES_HPP_
+#define MAP_TILES_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/filters/voxel_grid.h>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Map split into square xy tiles so that a map delta only touches the tiles it covers.
+class MapTiles
+{
+public:
+  using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+
+  MapTiles() {}
+
+  void setTileSize(const double tile_size /*[m]*/)
+  {
+    tile_size_ = tile_size;
+  }
+
+  // leaf_size <= 0 disables the downsampled copy of the tiles
+  void setLeafSize(const double leaf_size /*[m]*/)
+  {
+    leaf_size_ = leaf_size;
+    filtered_tiles_.clear();
+    for (const auto & tile : tiles_) {
+      dirty_tiles_.insert(tile.first);
+    }
+  }
+
+  uint64_t getKey(const pcl::PointXYZI & p) const
+  {
+    return getKey(getIndex(p.x, tile_size_), getIndex(p.y, tile_size_));
+  }
+
+  // The tile keys of the point clouds merged per tile (LifelongMap) come from these, so that a
+  // point is in the same tile everywhere.
+  static int64_t getIndex(const double coordinate, const double tile_size /*[m]*/)
+  {
+    return static_cast<int64_t>(std::floor(coordinate / tile_size));
+  }
+
+  static uint64_t getKey(const int64_t ix, const int64_t iy)
+  {
+    return (static_cast<uint64_t>(ix) << 32) | (static_cast<uint64_t>(iy) & 0xffffffffULL);
+  }
+
+  void clear()
+  {
+    tiles_.clear();
+    filtered_tiles_.clear();
+    dirty_tiles_.clear();
+  }
+
+  void setCloud(const Cloud & cloud)
+  {
+    clear();
+    replaceTiles(cloud);
+  }
+
+  // Every tile touched by the cloud is replaced by the points of the cloud falling in it.
+  std::vector<uint64_t> replaceTiles(const Cloud & cloud)
+  {
+    std::unordered_map<uint64_t, Cloud::Ptr> new_tiles;
+    for (const auto & p : cloud.points) {
+      if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+      Cloud::Ptr & tile = new_tiles[getKey(p)];
+      if (!tile) {tile.reset(new Cloud);}
+      tile->push_back(p);
+    }
+
+    std::vector<uint64_t> keys;
+    keys.reserve(new_tiles.size());
+    for (auto & tile : new_tiles) {
+      tiles_[tile.first] = tile.second;
+      dirty_tiles_.insert(tile.first);
+      keys.push_back(tile.first);
+    }
+    return keys;
+  }
+
+  void setTile(const uint64_t key, const Cloud::Ptr & tile)
+  {
+    tiles_[key] = tile;
+    filtered_tiles_.erase(key);
+    dirty_tiles_.insert(key);
+  }
+
+  void removeTile(const uint64_t key)
+  {
+    tiles_.erase(key);
+    filtered_tiles_.erase(key);
+    dirty_tiles_.erase(key);
+  }
+
+  bool hasTile(const uint64_t key) const
+  {
+    return tiles_.count(key) > 0;
+  }
+
+  std::vector<uint64_t> getKeys() const
+  {
+    std::vector<uint64_t> keys;
+    keys.reserve(tiles_.size());
+    for (const auto & tile : tiles_) {
+      keys.push_back(tile.first);
+    }
+    return keys;
+  }
+
+  // Concatenates the tiles. With filtered, only the tiles changed since the last call are
+  // downsampled again.
+  Cloud::Ptr assemble(const bool filtered)
+  {
+    if (filtered && leaf_size_ > 0.0) {
+      for (const auto & key : dirty_tiles_) {
+        Cloud::Ptr filtered_tile(new Cloud);
+        pcl::VoxelGrid<pcl::PointXYZI> voxel_grid_filter;
+        voxel_grid_filter.setLeafSize(leaf_size_, leaf_size_, leaf_size_);
+        voxel_grid_filter.setInputCloud(tiles_.at(key));
+        voxel_grid_filter.filter(*filtered_tile);
+        filtered_tiles_[key] = filtered_tile;
+      }
+      dirty_tiles_.clear();
+    }
+
+    const auto & source = (filtered && leaf_size_ > 0.0) ? filtered_tiles_ : tiles_;
+    size_t num_points = 0;
+    for (const auto & tile : source) {
+      num_points += tile.second->size();
+    }
+    Cloud::Ptr cloud(new Cloud);
+    cloud->reserve(num_points);
+    for (const auto & tile : source) {
+      *cloud += *tile.second;
+    }
+    return cloud;
+  }
+
+  size_t size() const
+  {
+    return tiles_.size();
+  }
+
+private:
+  double tile_size_{20.0};
+  double leaf_size_{0.0};
+  std::unordered_map<uint64_t, Cloud::Ptr> tiles_;
+  std::unordered_map<uint64_t, Cloud::Ptr> filtered_tiles_;
+  std::unordered_set<uint64_t> dirty_tiles_;
+};
+
+#endif  // MAP_TILES_HPP_
@@ -0,0 +1,95 @@
+#ifndef MOTION_GATE_HPP_
+#define MOTION_GATE_HPP_
+
+#include <algorithm>
+#include <limits>
+
+// Decides from the odometry and imu rates whether a scan needs to be registered. Once the robot
+// has been still for the settle time, scans are only registered every idle interval; any motion
+// over the thresholds lets the next scan through. The odometry twist is what tells the robot is
+// still: the imu can only report a rotation, as a constant velocity doesn't show in it.
+class MotionGate
+{
+public:
+  MotionGate() {}
+
+  void setThresholds(
+    const double linear_velocity /*[m/s]*/, const double angular_velocity /*[rad/s]*/)
+  {
+    linear_velocity_ = linear_velocity;
+    angular_velocity_ = angular_velocity;
+  }
+
+  void setSettleTime(const double settle_time /*[sec]*/)
+  {
+    settle_time_ = settle_time;
+  }
+
+  // 0: no scan is registered while still
+  void setIdleInterval(const double idle_interval /*[sec]*/)
+  {
+    idle_interval_ = idle_interval;
+  }
+
+  // The next scan is registered whatever the motion.
+  void reset()
+  {
+    last_odom_stamp_ = kNever;
+    last_motion_stamp_ = kNever;
+    last_registered_stamp_ = kNever;
+  }
+
+  void addOdometry(
+    const double stamp, const double linear_velocity /*[m/s]*/,
+    const double angular_velocity /*[rad/s]*/)
+  {
+    last_odom_stamp_ = std::max(last_odom_stamp_, stamp);
+    if (linear_velocity > linear_velocity_ || angular_velocity > angular_velocity_) {
+      addMotion(stamp);
+    }
+  }
+
+  void addImu(const double stamp, const double angular_velocity /*[rad/s]*/)
+  {
+    if (angular_velocity > angular_velocity_) {
+      addMotion(stamp);
+    }
+  }
+
+  bool needsRegistration(const double stamp) const
+  {
+    if (last_registered_stamp_ == kNever) {return true;}
+    // without recent odometry there is nothing telling the robot is still
+    if (stamp - last_odom_stamp_ > kMaxOdometryAge) {return true;}
+    // moved since the last registration, or not still for long enough yet
+    if (last_motion_stamp_ >= last_registered_stamp_) {return true;}
+    if (stamp - last_motion_stamp_ < settle_time_) {return true;}
+    return idle_interval_ > 0.0 && stamp - last_registered_stamp_ >= idle_interval_;
+  }
+
+  void setRegistered(const double stamp)
+  {
+    // the first registrations after a reset refine the pose as if the robot had just moved
+    if (last_registered_stamp_ == kNever) {addMotion(stamp);}
+    last_registered_stamp_ = stamp;
+  }
+
+private:
+  static constexpr double kNever = -std::numeric_limits<double>::infinity();
+  static constexpr double kMaxOdometryAge = 0.5;  /*[sec]*/
+
+  void addMotion(const double stamp)
+  {
+    last_motion_stamp_ = std::max(last_motion_stamp_, stamp);
+  }
+
+  double linear_velocity_{0.02};
+  double angular_velocity_{0.02};
+  double settle_time_{1.0};
+  double idle_interval_{5.0};
+  double last_odom_stamp_{kNever};
+  double last_motion_stamp_{kNever};
+  double last_registered_stamp_{kNever};
+};
+
+#endif  // MOTION_GATE_HPP_
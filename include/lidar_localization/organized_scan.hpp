@@ -0,0 +1,201 @@
+#ifndef ORGANIZED_SCAN_HPP_
+#define ORGANIZED_SCAN_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <Eigen/Core>
+#include <Eigen/Eigenvalues>
+#include <Eigen/StdVector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Preprocessing of organized scans, laid out as PCL does: one row per ring and one column per
+// azimuth, with NaN points for the missing returns. The neighbours of a point are the points
+// next to it in the range image, so the range crop, the ground detection and the local
+// covariances take O(1) per point and no KD-tree.
+// Columns wrap around, as for a 360 deg sensor. The row order does not matter.
+class OrganizedScanProcessor
+{
+public:
+  using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+  // same type as pcl::GeneralizedIterativeClosestPoint::MatricesVector
+  using Covariances = std::vector<Eigen::Matrix3d, Eigen::aligned_allocator<Eigen::Matrix3d>>;
+
+  OrganizedScanProcessor() {}
+
+  // horizontal range from the origin of the cloud's frame, as the crop of cloudReceived
+  void setRange(const double min_range /*[m]*/, const double max_range /*[m]*/)
+  {
+    min_range_ = min_range;
+    max_range_ = max_range;
+  }
+
+  // Every column_stride-th column is kept, and every ground_column_stride-th on the ground,
+  // which holds most of the points of a scan while constraining only z, roll and pitch.
+  void setColumnStride(const int column_stride, const int ground_column_stride)
+  {
+    column_stride_ = std::max(1, column_stride);
+    ground_column_stride_ = std::max(1, ground_column_stride);
+  }
+
+  // Two vertically adjacent points below the sensor are ground when the slope between them
+  // is under max_ground_slope (LeGO-LOAM).
+  void setSensorOrigin(const Eigen::Vector3f & sensor_origin)
+  {
+    sensor_origin_ = sensor_origin;
+  }
+
+  void setMaxGroundSlope(const double max_ground_slope /*[rad]*/)
+  {
+    max_ground_slope_ = max_ground_slope;
+  }
+
+  // Columns on each side of a point in its neighbourhood, which spans the rings above and below.
+  void setNeighbourhood(const int half_width)
+  {
+    half_width_ = std::max(1, half_width);
+  }
+
+  // output gets the kept points, row by row, and covariances their GICP covariances: plane
+  // shaped, as pcl::GeneralizedIterativeClosestPoint regularizes its own, or the identity
+  // where the neighbours do not span a plane.
+  void filter(const Cloud & input, Cloud & output, Covariances & covariances)
+  {
+    const int width = static_cast<int>(input.width);
+    const int height = static_cast<int>(input.height);
+    const int size = width * height;
+    output.clear();
+    covariances.clear();
+    curvatures_.clear();
+    ground_flags_.clear();
+
+    // NaN, out of range and non finite points are all invalid
+    valid_.assign(size, 0);
+    ranges_.resize(size);
+    for (int i = 0; i < size; ++i) {
+      const pcl::PointXYZI & p = input.points[i];
+      if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+      const double r = std::sqrt(p.x * p.x + p.y * p.y);
+      if (min_range_ < r && r < max_range_) {
+        valid_[i] = 1;
+        ranges_[i] = std::sqrt(p.x * p.x + p.y * p.y + p.z * p.z);
+      }
+    }
+
+    ground_.assign(size, 0);
+    const double max_slope_tan = std::tan(max_ground_slope_);
+    for (int row = 0; row + 1 < height; ++row) {
+      for (int column = 0; column < width; ++column) {
+        const int i = row * width + column;
+        const int j = i + width;
+        if (!valid_[i] || !valid_[j]) {continue;}
+        const pcl::PointXYZI & a = input.points[i];
+        const pcl::PointXYZI & b = input.points[j];
+        if (a.z >= sensor_origin_.z() || b.z >= sensor_origin_.z()) {continue;}
+        const double dx = b.x - a.x;
+        const double dy = b.y - a.y;
+        const double dz = b.z - a.z;
+        if (std::abs(dz) <= max_slope_tan * std::sqrt(dx * dx + dy * dy)) {
+          ground_[i] = 1;
+          ground_[j] = 1;
+        }
+      }
+    }
+
+    for (int row = 0; row < height; ++row) {
+      for (int column = 0; column < width; ++column) {
+        const int i = row * width + column;
+        if (!valid_[i]) {continue;}
+        const int stride = ground_[i] ? ground_column_stride_ : column_stride_;
+        if (column % stride != 0) {continue;}
+
+        Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+        Eigen::Matrix3d sum_sq = Eigen::Matrix3d::Zero();
+        int count = 0;
+        const pcl::PointXYZI & p = input.points[i];
+        // Across a depth discontinuity the neighbour lies on another surface. The ground is
+        // exempt, as its rings are far apart at grazing angles.
+        const double max_distance = kMaxNeighbourDistanceRatio * ranges_[i];
+        for (int n_row = std::max(0, row - 1); n_row <= std::min(height - 1, row + 1); ++n_row) {
+          for (int offset = -half_width_; offset <= half_width_; ++offset) {
+            const int n_column = (column + offset + width) % width;
+            const int j = n_row * width + n_column;
+            if (!valid_[j]) {continue;}
+            const pcl::PointXYZI & q = input.points[j];
+            const Eigen::Vector3d v(q.x, q.y, q.z);
+            if (!(ground_[i] && ground_[j]) &&
+              (v - Eigen::Vector3d(p.x, p.y, p.z)).squaredNorm() > max_distance * max_distance)
+            {
+              continue;
+            }
+            sum += v;
+            sum_sq += v * v.transpose();
+            ++count;
+          }
+        }
+
+        Eigen::Matrix3d covariance = Eigen::Matrix3d::Identity();
+        float curvature = 1.0f;
+        if (count >= kMinNeighbours) {
+          const Eigen::Vector3d mean = sum / count;
+          const Eigen::Matrix3d sample = sum_sq / count - mean * mean.transpose();
+          Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+          solver.computeDirect(sample);
+          const Eigen::Vector3d & values = solver.eigenvalues();
+          const double total = values.sum();
+          // a line of points leaves the plane orientation free
+          if (total > 0.0 && values(1) > kMinPlaneRatio * values(2)) {
+            const Eigen::Matrix3d & vectors = solver.eigenvectors();
+            Eigen::Vector3d scales = Eigen::Vector3d::Ones();
+            scales(0) = kGicpEpsilon;
+            covariance = vectors * scales.asDiagonal() * vectors.transpose();
+            curvature = static_cast<float>(std::max(0.0, values(0)) / total);
+          }
+        }
+
+        output.push_back(p);
+        covariances.push_back(covariance);
+        curvatures_.push_back(curvature);
+        ground_flags_.push_back(ground_[i]);
+      }
+    }
+    output.width = output.size();
+    output.height = 1;
+    output.is_dense = true;
+  }
+
+  // Surface variation of each output point: the smallest eigenvalue of its neighbourhood over
+  // their sum, 0 on a plane, 1 where it is unknown.
+  const std::vector<float> & getCurvatures() const
+  {
+    return curvatures_;
+  }
+
+  const std::vector<uint8_t> & getGroundFlags() const
+  {
+    return ground_flags_;
+  }
+
+private:
+  static constexpr double kMaxNeighbourDistanceRatio = 0.1;
+  static constexpr double kMinPlaneRatio = 0.01;
+  static constexpr double kGicpEpsilon = 0.001;
+  static constexpr int kMinNeighbours = 5;
+
+  double min_range_{0.0};
+  double max_range_{100.0};
+  int column_stride_{1};
+  int ground_column_stride_{1};
+  Eigen::Vector3f sensor_origin_{Eigen::Vector3f::Zero()};
+  double max_ground_slope_{10.0 * M_PI / 180.0};
+  int half_width_{2};
+  std::vector<uint8_t> valid_;
+  std::vector<uint8_t> ground_;
+  std::vector<double> ranges_;
+  std::vector<float> curvatures_;
+  std::vector<uint8_t> ground_flags_;
+};
+
+#endif  // ORGANIZED_SCAN_HPP_
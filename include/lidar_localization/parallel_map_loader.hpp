@@ -0,0 +1,478 @@
+#ifndef PARALLEL_MAP_LOADER_HPP_
+#define PARALLEL_MAP_LOADER_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/io/pcd_io.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <locale>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <locale.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "lidar_localization/point_kernels.hpp"
+#include "lidar_localization/tracing.hpp"
+
+// Multi-threaded replacements for the single-threaded steps of map activation:
+// PCD parsing and map downsampling.
+class ParallelMapLoader
+{
+public:
+  ParallelMapLoader() {}
+
+  // num_threads <= 0 uses all available threads
+  void setNumThreads(const int num_threads)
+  {
+    num_threads_ = num_threads;
+  }
+
+  int getNumThreads() const
+  {
+#ifdef _OPENMP
+    return num_threads_ > 0 ? num_threads_ : omp_get_max_threads();
+#else
+    return 1;
+#endif
+  }
+
+  // Parses ascii and binary pcd files in chunks on all threads. The file is mapped rather than
+  // read, so the map is only held once in memory. binary_compressed files and field types not
+  // handled here fall back to pcl::io::loadPCDFile.
+  // Returns -1 on failure like pcl::io::loadPCDFile.
+  int loadPCDFile(const std::string & path, pcl::PointCloud<pcl::PointXYZI> & cloud) const
+  {
+    TRACE_ZONE("loadPCDFile");
+    MappedFile file(path);
+    if (file.data == nullptr) {
+      return pcl::io::loadPCDFile(path, cloud);
+    }
+    const Buffer buffer{file.data, file.size};
+
+    Header header;
+    if (!parseHeader(buffer, header)) {
+      return pcl::io::loadPCDFile(path, cloud);
+    }
+
+    bool parsed = false;
+    if (header.data == "ascii") {
+      parsed = parseAscii(buffer, header, cloud);
+    } else if (header.data == "binary") {
+      parsed = parseBinary(buffer, header, cloud);
+    }
+    if (!parsed) {
+      return pcl::io::loadPCDFile(path, cloud);
+    }
+
+    cloud.width = header.width;
+    cloud.height = header.height;
+    if (static_cast<size_t>(cloud.width) * cloud.height != cloud.size()) {
+      cloud.width = cloud.size();
+      cloud.height = 1;
+    }
+    cloud.is_dense = false;
+    return 0;
+  }
+
+  // Voxel grid filter averaging the points of each voxel, as pcl::VoxelGrid. Points are binned
+  // into per-thread hash maps split into one partition per thread, and each thread then merges
+  // one partition, so no step runs on a single thread. The grid is aligned to the origin
+  // instead of the cloud's bounding box.
+  void voxelFilter(
+    const pcl::PointCloud<pcl::PointXYZI> & input, const double leaf_size /*[m]*/,
+    pcl::PointCloud<pcl::PointXYZI> & output) const
+  {
+    TRACE_ZONE("voxelFilter");
+    const int num_threads = getNumThreads();
+    const double inv_leaf_size = 1.0 / leaf_size;
+    std::vector<std::vector<VoxelMap>> local_voxels(
+      num_threads, std::vector<VoxelMap>(num_threads));
+
+    #pragma omp parallel for num_threads(num_threads) schedule(static)
+    for (int t = 0; t < num_threads; ++t) {
+      TRACE_ZONE("voxel_bin");
+      const size_t begin = input.size() * t / num_threads;
+      const size_t end = input.size() * (t + 1) / num_threads;
+      auto & partitions = local_voxels[t];
+      // keys in blocks, so the hash map inserts are the only scalar work
+      uint64_t keys[kKeyBlockSize];
+      for (size_t block = begin; block < end; block += kKeyBlockSize) {
+        const size_t block_size = end - block < kKeyBlockSize ? end - block : kKeyBlockSize;
+        PointKernels::voxelKeys(&input.points[block], block_size, inv_leaf_size, keys);
+        for (size_t j = 0; j < block_size; ++j) {
+          const uint64_t key = keys[j];
+          if (key == PointKernels::kInvalidKey) {continue;}
+          const auto & p = input.points[block + j];
+          Accumulator & acc = partitions[key % num_threads][key];
+          acc.x += p.x;
+          acc.y += p.y;
+          acc.z += p.z;
+          acc.intensity += p.intensity;
+          ++acc.count;
+        }
+      }
+    }
+
+    std::vector<pcl::PointCloud<pcl::PointXYZI>> merged(num_threads);
+    #pragma omp parallel for num_threads(num_threads) schedule(static)
+    for (int part = 0; part < num_threads; ++part) {
+      TRACE_ZONE("voxel_merge");
+      VoxelMap & voxels = local_voxels[0][part];
+      for (int t = 1; t < num_threads; ++t) {
+        for (const auto & voxel : local_voxels[t][part]) {
+          Accumulator & acc = voxels[voxel.first];
+          acc.x += voxel.second.x;
+          acc.y += voxel.second.y;
+          acc.z += voxel.second.z;
+          acc.intensity += voxel.second.intensity;
+          acc.count += voxel.second.count;
+        }
+        VoxelMap().swap(local_voxels[t][part]);
+      }
+      merged[part].reserve(voxels.size());
+      for (const auto & voxel : voxels) {
+        const Accumulator & acc = voxel.second;
+        pcl::PointXYZI p;
+        p.x = static_cast<float>(acc.x / acc.count);
+        p.y = static_cast<float>(acc.y / acc.count);
+        p.z = static_cast<float>(acc.z / acc.count);
+        p.intensity = static_cast<float>(acc.intensity / acc.count);
+        merged[part].push_back(p);
+      }
+    }
+
+    output.clear();
+    size_t num_points = 0;
+    for (const auto & part : merged) {
+      num_points += part.size();
+    }
+    output.reserve(num_points);
+    for (const auto & part : merged) {
+      output += part;
+    }
+    output.width = output.size();
+    output.height = 1;
+    output.is_dense = true;
+  }
+
+private:
+  struct Field
+  {
+    std::string name;
+    int size;
+    char type;
+    int count;
+  };
+
+  struct Header
+  {
+    std::vector<Field> fields;
+    uint32_t width{0};
+    uint32_t height{1};
+    size_t points{0};
+    std::string data;
+    size_t data_offset{0};
+  };
+
+  struct Buffer
+  {
+    const char * data;
+    size_t size;
+  };
+
+  // Read-only private mapping of a whole file, data being nullptr on failure
+  struct MappedFile
+  {
+    explicit MappedFile(const std::string & path)
+    {
+      const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {return;}
+      struct stat status;
+      if (fstat(fd, &status) == 0 && status.st_size > 0) {
+        void * mapped = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+          // each thread reads its chunk in order
+          madvise(mapped, status.st_size, MADV_SEQUENTIAL);
+          data = static_cast<const char *>(mapped);
+          size = status.st_size;
+        }
+      }
+      close(fd);
+    }
+
+    ~MappedFile()
+    {
+      if (data != nullptr) {munmap(const_cast<char *>(data), size);}
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    const char * data{nullptr};
+    size_t size{0};
+  };
+
+  struct Accumulator
+  {
+    double x{0.0}, y{0.0}, z{0.0}, intensity{0.0};
+    size_t count{0};
+  };
+
+  using VoxelMap = std::unordered_map<uint64_t, Accumulator>;
+
+  static constexpr size_t kKeyBlockSize = 256;
+
+
+  // strtof_l locale, since std::strtof follows the global locale (a decimal comma in some)
+  static locale_t cLocale()
+  {
+    static const locale_t locale = newlocale(LC_NUMERIC_MASK, "C", static_cast<locale_t>(0));
+    return locale;
+  }
+
+  static bool parseHeader(const Buffer & buffer, Header & header)
+  {
+    std::vector<std::string> names, sizes, types, counts;
+    size_t pos = 0;
+    while (pos < buffer.size) {
+      const char * eol = static_cast<const char *>(
+        std::memchr(buffer.data + pos, '\n', buffer.size - pos));
+      if (eol == nullptr) {return false;}
+      std::istringstream line(std::string(buffer.data + pos, eol));
+      line.imbue(std::locale::classic());
+      pos = eol - buffer.data + 1;
+
+      std::string key;
+      line >> key;
+      if (key.empty() || key[0] == '#') {continue;}
+      std::string value;
+      if (key == "FIELDS") {
+        while (line >> value) {names.push_back(value);}
+      } else if (key == "SIZE") {
+        while (line >> value) {sizes.push_back(value);}
+      } else if (key == "TYPE") {
+        while (line >> value) {types.push_back(value);}
+      } else if (key == "COUNT") {
+        while (line >> value) {counts.push_back(value);}
+      } else if (key == "WIDTH") {
+        line >> header.width;
+      } else if (key == "HEIGHT") {
+        line >> header.height;
+      } else if (key == "POINTS") {
+        line >> header.points;
+      } else if (key == "DATA") {
+        line >> header.data;
+        header.data_offset = pos;
+        break;
+      }
+    }
+    if (header.data.empty() || names.empty() ||
+      sizes.size() != names.size() || types.size() != names.size())
+    {
+      return false;
+    }
+    if (header.points == 0) {
+      header.points = static_cast<size_t>(header.width) * header.height;
+    }
+    for (size_t i = 0; i < names.size(); ++i) {
+      Field field;
+      field.name = names[i];
+      field.size = std::atoi(sizes[i].c_str());
+      field.type = types[i][0];
+      field.count = counts.size() == names.size() ? std::atoi(counts[i].c_str()) : 1;
+      header.fields.push_back(field);
+    }
+    return true;
+  }
+
+  // token or byte offsets of x, y, z, intensity. intensity is -1 when absent.
+  static bool findFields(
+    const Header & header, const bool in_bytes, std::array<int, 4> & offsets,
+    std::array<int, 4> & field_indices)
+  {
+    static const char * names[4] = {"x", "y", "z", "intensity"};
+    offsets.fill(-1);
+    field_indices.fill(-1);
+    int offset = 0;
+    for (size_t i = 0; i < header.fields.size(); ++i) {
+      for (int k = 0; k < 4; ++k) {
+        if (header.fields[i].name == names[k]) {
+          offsets[k] = offset;
+          field_indices[k] = static_cast<int>(i);
+        }
+      }
+      offset += header.fields[i].count * (in_bytes ? header.fields[i].size : 1);
+    }
+    return offsets[0] >= 0 && offsets[1] >= 0 && offsets[2] >= 0;
+  }
+
+  // Splits the data section into one chunk per thread at line boundaries.
+  std::vector<size_t> splitLines(const Buffer & buffer, const size_t begin) const
+  {
+    const int num_threads = getNumThreads();
+    std::vector<size_t> bounds(num_threads + 1, buffer.size);
+    bounds[0] = std::min(begin, buffer.size);
+    for (int t = 1; t < num_threads; ++t) {
+      size_t pos = bounds[0] + (buffer.size - bounds[0]) * t / num_threads;
+      pos = std::max(pos, bounds[t - 1]);
+      const char * eol = static_cast<const char *>(
+        std::memchr(buffer.data + pos, '\n', buffer.size - pos));
+      bounds[t] = eol == nullptr ? buffer.size : eol - buffer.data + 1;
+    }
+    return bounds;
+  }
+
+  bool parseAscii(
+    const Buffer & buffer, const Header & header,
+    pcl::PointCloud<pcl::PointXYZI> & cloud) const
+  {
+    std::array<int, 4> offsets, field_indices;
+    if (!findFields(header, false, offsets, field_indices)) {return false;}
+    const int last_token = *std::max_element(offsets.begin(), offsets.end());
+
+    const std::vector<size_t> bounds = splitLines(buffer, header.data_offset);
+    const int num_chunks = static_cast<int>(bounds.size()) - 1;
+    std::vector<std::vector<pcl::PointXYZI>> chunks(num_chunks);
+
+    #pragma omp parallel for num_threads(num_chunks) schedule(static)
+    for (int c = 0; c < num_chunks; ++c) {
+      TRACE_ZONE("parse_ascii_chunk");
+      const char * ptr = buffer.data + bounds[c];
+      const char * end = buffer.data + bounds[c + 1];
+      std::vector<pcl::PointXYZI> & points = chunks[c];
+      points.reserve(header.points / num_chunks + 1);
+      std::string last_line;
+      while (ptr < end) {
+        const char * line = ptr;
+        const char * eol = static_cast<const char *>(std::memchr(ptr, '\n', end - ptr));
+        ptr = eol == nullptr ? end : eol + 1;
+        if (eol == nullptr) {
+          // the last line of the file, copied since nothing ends the mapping for strtof_l
+          last_line.assign(line, end);
+          line = last_line.c_str();
+          eol = line + last_line.size();
+        }
+        float values[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+        int token = 0;
+        const char * cur = line;
+        while (cur < eol && token <= last_token) {
+          char * next;
+          const float value = strtof_l(cur, &next, cLocale());
+          // no value left on the line, strtof_l skipping the newline
+          if (next == cur || next > eol) {break;}
+          for (int k = 0; k < 4; ++k) {
+            if (offsets[k] == token) {values[k] = value;}
+          }
+          cur = next;
+          ++token;
+        }
+        if (token > std::max(offsets[0], std::max(offsets[1], offsets[2]))) {
+          pcl::PointXYZI p;
+          p.x = values[0];
+          p.y = values[1];
+          p.z = values[2];
+          p.intensity = values[3];
+          points.push_back(p);
+        }
+      }
+    }
+
+    concatenate(chunks, cloud);
+    return true;
+  }
+
+  static bool readValue(const char * ptr, const Field & field, float & value)
+  {
+    switch (field.type) {
+      case 'F':
+        if (field.size == 4) {float v; std::memcpy(&v, ptr, 4); value = v; return true;}
+        if (field.size == 8) {double v; std::memcpy(&v, ptr, 8); value = v; return true;}
+        return false;
+      case 'U':
+        if (field.size == 1) {uint8_t v; std::memcpy(&v, ptr, 1); value = v; return true;}
+        if (field.size == 2) {uint16_t v; std::memcpy(&v, ptr, 2); value = v; return true;}
+        if (field.size == 4) {uint32_t v; std::memcpy(&v, ptr, 4); value = v; return true;}
+        return false;
+      case 'I':
+        if (field.size == 1) {int8_t v; std::memcpy(&v, ptr, 1); value = v; return true;}
+        if (field.size == 2) {int16_t v; std::memcpy(&v, ptr, 2); value = v; return true;}
+        if (field.size == 4) {int32_t v; std::memcpy(&v, ptr, 4); value = v; return true;}
+        return false;
+      default:
+        return false;
+    }
+  }
+
+  bool parseBinary(
+    const Buffer & buffer, const Header & header,
+    pcl::PointCloud<pcl::PointXYZI> & cloud) const
+  {
+    std::array<int, 4> offsets, field_indices;
+    if (!findFields(header, true, offsets, field_indices)) {return false;}
+    size_t stride = 0;
+    for (const auto & field : header.fields) {
+      stride += field.size * field.count;
+    }
+    if (header.data_offset + stride * header.points > buffer.size) {return false;}
+    float dummy;
+    for (int k = 0; k < 4; ++k) {
+      if (field_indices[k] >= 0 && !readValue(buffer.data, header.fields[field_indices[k]], dummy)) {
+        return false;
+      }
+    }
+
+    TRACE_ZONE("parse_binary");
+    cloud.resize(header.points);
+    const char * data = buffer.data + header.data_offset;
+    const int num_threads = getNumThreads();
+    #pragma omp parallel for num_threads(num_threads) schedule(static)
+    for (int64_t i = 0; i < static_cast<int64_t>(header.points); ++i) {
+      const char * ptr = data + stride * i;
+      float values[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+      for (int k = 0; k < 4; ++k) {
+        if (field_indices[k] >= 0) {
+          readValue(ptr + offsets[k], header.fields[field_indices[k]], values[k]);
+        }
+      }
+      pcl::PointXYZI & p = cloud.points[i];
+      p.x = values[0];
+      p.y = values[1];
+      p.z = values[2];
+      p.intensity = values[3];
+    }
+    return true;
+  }
+
+  void concatenate(
+    const std::vector<std::vector<pcl::PointXYZI>> & chunks,
+    pcl::PointCloud<pcl::PointXYZI> & cloud) const
+  {
+    std::vector<size_t> starts(chunks.size() + 1, 0);
+    for (size_t c = 0; c < chunks.size(); ++c) {
+      starts[c + 1] = starts[c] + chunks[c].size();
+    }
+    cloud.resize(starts.back());
+    const int num_chunks = static_cast<int>(chunks.size());
+    #pragma omp parallel for num_threads(num_chunks) schedule(static)
+    for (int c = 0; c < num_chunks; ++c) {
+      std::copy(chunks[c].begin(), chunks[c].end(), cloud.points.begin() + starts[c]);
+    }
+  }
+
+  int num_threads_{0};
+};
+
+#endif  // PARALLEL_MAP_LOADER_HPP_
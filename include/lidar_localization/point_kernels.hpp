@@ -0,0 +1,536 @@
+#ifndef POINT_KERNELS_HPP_
+#define POINT_KERNELS_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <Eigen/Core>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Keeps each multiply and add of the transforms rounded on its own, whatever -ffp-contract and
+// the target CPU (FMA with -march=native or LIDAR_LOCALIZATION_CPU) allow. GCC takes it as a
+// function attribute, clang as a pragma at the top of the function body.
+#if defined(__clang__)
+#define POINT_KERNELS_NO_FP_CONTRACT
+#define POINT_KERNELS_NO_FP_CONTRACT_BODY _Pragma("clang fp contract(off)")
+#else
+#define POINT_KERNELS_NO_FP_CONTRACT __attribute__((optimize("fp-contract=off")))
+#define POINT_KERNELS_NO_FP_CONTRACT_BODY
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LIDAR_LOCALIZATION_NEON
+#elif defined(__x86_64__) && defined(__GNUC__)
+#include "lidar_localization/point_kernels_x86.hpp"
+#define LIDAR_LOCALIZATION_X86
+#endif
+
+// Per-point kernels of the scan and map hot paths, and the accumulation of the NDT
+// derivatives. There are NEON versions on aarch64 (Jetson, RK3588), and SSE4.2, AVX2 and
+// AVX-512 versions on x86-64, picked at runtime from the CPU so that one binary runs on all
+// of them (see PointKernelsX86).
+// The voxel keys, the range crop and the transform match the scalar versions bit for bit, no
+// multiply-add of the transforms being fused (POINT_KERNELS_NO_FP_CONTRACT).
+// The azimuths are within 3e-7 rad of std::atan2, and the NDT sums only differ by their
+// summation order.
+// The ...Scalar versions are the references, also used on other CPUs.
+class PointKernels
+{
+public:
+  enum class Isa { kScalar, kNeon, kSse42, kAvx2, kAvx512 };
+
+  // never a voxel key, whose top bit is always 0
+  static constexpr uint64_t kInvalidKey = ~0ULL;
+
+  // instruction set of the kernels, detected once
+  static Isa getIsa()
+  {
+    static const Isa isa = detectIsa();
+    return isa;
+  }
+
+  static const char * isa()
+  {
+    switch (getIsa()) {
+      case Isa::kNeon: return "neon";
+      case Isa::kSse42: return "sse4.2";
+      case Isa::kAvx2: return "avx2";
+      case Isa::kAvx512: return "avx512";
+      default: return "scalar";
+    }
+  }
+
+  // 21 bits per axis of floor(p * inv_leaf_size), or kInvalidKey for non finite points
+  static void voxelKeys(
+    const pcl::PointXYZI * points, const size_t size, const double inv_leaf_size,
+    uint64_t * keys)
+  {
+    size_t i = 0;
+#ifdef LIDAR_LOCALIZATION_NEON
+    const float64x2_t inv = vdupq_n_f64(inv_leaf_size);
+    const uint64x2_t mask = vdupq_n_u64(0x1fffffULL);
+    const float32x4_t max_float = vdupq_n_f32(FLT_MAX);
+    for (; i + 4 <= size; i += 4) {
+      float32x4_t x, y, z;
+      load(points + i, x, y, z);
+      // NaN and inf compare false
+      const uint32x4_t finite = vandq_u32(
+        vandq_u32(vcaleq_f32(x, max_float), vcaleq_f32(y, max_float)), vcaleq_f32(z, max_float));
+      uint64x2_t low = vorrq_u64(
+        vorrq_u64(
+          vshlq_n_u64(index(vget_low_f32(x), inv, mask), 42),
+          vshlq_n_u64(index(vget_low_f32(y), inv, mask), 21)),
+        index(vget_low_f32(z), inv, mask));
+      uint64x2_t high = vorrq_u64(
+        vorrq_u64(
+          vshlq_n_u64(index(vget_high_f32(x), inv, mask), 42),
+          vshlq_n_u64(index(vget_high_f32(y), inv, mask), 21)),
+        index(vget_high_f32(z), inv, mask));
+      // sign extension widens the all-ones lanes of the mask
+      const int32x4_t finite_mask = vreinterpretq_s32_u32(finite);
+      const uint64x2_t invalid = vdupq_n_u64(kInvalidKey);
+      low = vbslq_u64(
+        vreinterpretq_u64_s64(vmovl_s32(vget_low_s32(finite_mask))), low, invalid);
+      high = vbslq_u64(
+        vreinterpretq_u64_s64(vmovl_s32(vget_high_s32(finite_mask))), high, invalid);
+      vst1q_u64(keys + i, low);
+      vst1q_u64(keys + i + 2, high);
+    }
+#elif defined(LIDAR_LOCALIZATION_X86)
+    switch (getIsa()) {
+      case Isa::kAvx512:
+        i = PointKernelsX86::voxelKeysAvx512(points, size, inv_leaf_size, keys);
+        break;
+      case Isa::kAvx2:
+        i = PointKernelsX86::voxelKeysAvx2(points, size, inv_leaf_size, keys);
+        break;
+      case Isa::kSse42:
+        i = PointKernelsX86::voxelKeysSse42(points, size, inv_leaf_size, keys);
+        break;
+      default:
+        break;
+    }
+#endif
+    voxelKeysScalar(points + i, size - i, inv_leaf_size, keys + i);
+  }
+
+  static void voxelKeysScalar(
+    const pcl::PointXYZI * points, const size_t size, const double inv_leaf_size,
+    uint64_t * keys)
+  {
+    for (size_t i = 0; i < size; ++i) {
+      const pcl::PointXYZI & p = points[i];
+      if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {
+        keys[i] = kInvalidKey;
+        continue;
+      }
+      const int64_t ix = static_cast<int64_t>(std::floor(p.x * inv_leaf_size));
+      const int64_t iy = static_cast<int64_t>(std::floor(p.y * inv_leaf_size));
+      const int64_t iz = static_cast<int64_t>(std::floor(p.z * inv_leaf_size));
+      keys[i] = ((static_cast<uint64_t>(ix) & 0x1fffffULL) << 42) |
+        ((static_cast<uint64_t>(iy) & 0x1fffffULL) << 21) |
+        (static_cast<uint64_t>(iz) & 0x1fffffULL);
+    }
+  }
+
+  // Appends the points with min_range < sqrt(x^2 + y^2) < max_range to output, in order.
+  static void cropRange(
+    const pcl::PointCloud<pcl::PointXYZI> & input, const double min_range /*[m]*/,
+    const double max_range /*[m]*/, pcl::PointCloud<pcl::PointXYZI> & output)
+  {
+    const pcl::PointXYZI * points = input.points.data();
+    const size_t size = input.size();
+    // room for every point, so that the kept ones are stored without a branch
+    const size_t offset = output.size();
+    output.points.resize(offset + size);
+    pcl::PointXYZI * kept = output.points.data() + offset;
+    size_t count = 0;
+    size_t i = 0;
+#if defined(LIDAR_LOCALIZATION_NEON)
+    const float64x2_t min = vdupq_n_f64(min_range);
+    const float64x2_t max = vdupq_n_f64(max_range);
+    uint64_t inside[4];
+    for (; i + 4 <= size; i += 4) {
+      float32x4_t x, y, z;
+      load(points + i, x, y, z);
+      // x^2 of a float is exact in double, so no fused multiply-add can change the sum
+      const float64x2_t x_low = vcvt_f64_f32(vget_low_f32(x));
+      const float64x2_t y_low = vcvt_f64_f32(vget_low_f32(y));
+      const float64x2_t x_high = vcvt_high_f64_f32(x);
+      const float64x2_t y_high = vcvt_high_f64_f32(y);
+      const float64x2_t r_low = vsqrtq_f64(
+        vaddq_f64(vmulq_f64(x_low, x_low), vmulq_f64(y_low, y_low)));
+      const float64x2_t r_high = vsqrtq_f64(
+        vaddq_f64(vmulq_f64(x_high, x_high), vmulq_f64(y_high, y_high)));
+      vst1q_u64(inside, vandq_u64(vcltq_f64(min, r_low), vcltq_f64(r_low, max)));
+      vst1q_u64(inside + 2, vandq_u64(vcltq_f64(min, r_high), vcltq_f64(r_high, max)));
+      for (int j = 0; j < 4; ++j) {
+        kept[count] = points[i + j];
+        count += inside[j] & 1;
+      }
+    }
+#elif defined(LIDAR_LOCALIZATION_X86)
+    switch (getIsa()) {
+      case Isa::kAvx512:
+        i = PointKernelsX86::cropRangeAvx512(points, size, min_range, max_range, kept, count);
+        break;
+      case Isa::kAvx2:
+        i = PointKernelsX86::cropRangeAvx2(points, size, min_range, max_range, kept, count);
+        break;
+      case Isa::kSse42:
+        i = PointKernelsX86::cropRangeSse42(points, size, min_range, max_range, kept, count);
+        break;
+      default:
+        break;
+    }
+#endif
+    for (; i < size; ++i) {
+      const pcl::PointXYZI & p = points[i];
+      const double r = std::sqrt(static_cast<double>(p.x) * p.x + static_cast<double>(p.y) * p.y);
+      kept[count] = p;
+      count += (min_range < r && r < max_range);
+    }
+    output.points.resize(offset + count);
+    output.width = output.size();
+    output.height = 1;
+  }
+
+  static void cropRangeScalar(
+    const pcl::PointCloud<pcl::PointXYZI> & input, const double min_range /*[m]*/,
+    const double max_range /*[m]*/, pcl::PointCloud<pcl::PointXYZI> & output)
+  {
+    double r;
+    for (const auto & p : input.points) {
+      r = sqrt(pow(p.x, 2.0) + pow(p.y, 2.0));
+      if (min_range < r && r < max_range) {
+        output.push_back(p);
+      }
+    }
+  }
+
+  // -atan2(y, x) of each point, the horizontal angle used by LidarUndistortion [rad]
+  static void azimuths(const pcl::PointXYZI * points, const size_t size, float * azimuths)
+  {
+    size_t i = 0;
+#ifdef LIDAR_LOCALIZATION_NEON
+    for (; i + 4 <= size; i += 4) {
+      float32x4_t x, y, z;
+      load(points + i, x, y, z);
+      vst1q_f32(azimuths + i, vnegq_f32(atan2(y, x)));
+    }
+#endif
+    azimuthsScalar(points + i, size - i, azimuths + i);
+  }
+
+  static void azimuthsScalar(const pcl::PointXYZI * points, const size_t size, float * azimuths)
+  {
+    for (size_t i = 0; i < size; ++i) {
+      azimuths[i] = -std::atan2(points[i].y, points[i].x);
+    }
+  }
+
+  // output = matrix * input as pcl::transformPointCloud, also in place. The other fields are
+  // copied, and non finite points stay non finite.
+  static void transform(
+    const pcl::PointCloud<pcl::PointXYZI> & input, const Eigen::Matrix4f & matrix,
+    pcl::PointCloud<pcl::PointXYZI> & output)
+  {
+    prepare(input, output);
+    const pcl::PointXYZI * points = input.points.data();
+    const size_t size = input.size();
+    size_t i = 0;
+#ifdef LIDAR_LOCALIZATION_X86
+    switch (getIsa()) {
+      case Isa::kAvx512:
+        i = PointKernelsX86::transformAvx512(points, size, matrix, output.points.data());
+        break;
+      case Isa::kAvx2:
+        i = PointKernelsX86::transformAvx2(points, size, matrix, output.points.data());
+        break;
+      case Isa::kSse42:
+        i = PointKernelsX86::transformSse42(points, size, matrix, output.points.data());
+        break;
+      default:
+        break;
+    }
+#endif
+    transformPoints(points + i, size - i, matrix, output.points.data() + i);
+  }
+
+  static void transformScalar(
+    const pcl::PointCloud<pcl::PointXYZI> & input, const Eigen::Matrix4f & matrix,
+    pcl::PointCloud<pcl::PointXYZI> & output)
+  {
+    prepare(input, output);
+    transformPoints(input.points.data(), input.size(), matrix, output.points.data());
+  }
+
+  static constexpr int kNdtBatchSize = 64;
+  // gradient, then the upper triangle of the hessian row by row
+  static constexpr int kNdtSums = 6 + 21;
+
+  // NDT correspondences, one column per term: the Newton factor, the transformed point q, the
+  // upper triangle of the inverse covariance S of the voxel and u = S (q - mean).
+  struct NdtTerms
+  {
+    enum Column {
+      kFactor, kQx, kQy, kQz, kS00, kS01, kS02, kS11, kS12, kS22, kUx, kUy, kUz, kNumColumns
+    };
+
+    double columns[kNumColumns][kNdtBatchSize];
+    int size{0};
+
+    // returns true once the batch is full
+    bool add(
+      const double factor, const Eigen::Vector3d & q, const Eigen::Matrix3d & icov,
+      const Eigen::Vector3d & icov_d)
+    {
+      const double values[kNumColumns] = {
+        factor, q.x(), q.y(), q.z(), icov(0, 0), icov(0, 1), icov(0, 2), icov(1, 1), icov(1, 2),
+        icov(2, 2), icov_d.x(), icov_d.y(), icov_d.z()};
+      for (int k = 0; k < kNumColumns; ++k) {
+        columns[k][size] = values[k];
+      }
+      return ++size == kNdtBatchSize;
+    }
+  };
+
+  // Adds the derivatives of the NDT score of the terms over a pose increment [t, w] applied on
+  // the left, with J = [I, -[q]x] the jacobian of q:
+  //   gradient += factor * J^T u
+  //   hessian += factor * (J^T S J + u^T d2q - gauss_d2 * (J^T u) (J^T u)^T)
+  // where u^T d2q, the second derivative of q along u, only has a rotation block.
+  // Ref:pcl::NormalDistributionsTransform::updateDerivatives
+  static void accumulateNdt(const NdtTerms & terms, const double gauss_d2, double * sums)
+  {
+    int i = 0;
+    switch (getIsa()) {
+#if defined(LIDAR_LOCALIZATION_NEON)
+      case Isa::kNeon:
+        i = accumulateNdtLanes<Double2>(terms, 0, gauss_d2, sums);
+        break;
+#elif defined(LIDAR_LOCALIZATION_X86)
+      case Isa::kAvx512:
+        i = accumulateNdtAvx512(terms, gauss_d2, sums);
+        break;
+      case Isa::kAvx2:
+        i = accumulateNdtAvx2(terms, gauss_d2, sums);
+        break;
+      case Isa::kSse42:
+        i = accumulateNdtSse42(terms, gauss_d2, sums);
+        break;
+#endif
+      default:
+        break;
+    }
+    accumulateNdtLanes<double>(terms, i, gauss_d2, sums);
+  }
+
+  static void accumulateNdtScalar(const NdtTerms & terms, const double gauss_d2, double * sums)
+  {
+    accumulateNdtLanes<double>(terms, 0, gauss_d2, sums);
+  }
+
+private:
+  // GCC vector types, lowered to the instruction set of the function using them
+  typedef double Double2 __attribute__((vector_size(16)));
+  typedef double Double4 __attribute__((vector_size(32)));
+  typedef double Double8 __attribute__((vector_size(64)));
+
+  static Isa detectIsa()
+  {
+#if defined(LIDAR_LOCALIZATION_NEON)
+    return Isa::kNeon;
+#elif defined(LIDAR_LOCALIZATION_X86)
+    // also checks that the OS saves the AVX registers
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {return Isa::kAvx512;}
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {return Isa::kAvx2;}
+    if (__builtin_cpu_supports("sse4.2")) {return Isa::kSse42;}
+    return Isa::kScalar;
+#else
+    return Isa::kScalar;
+#endif
+  }
+
+  static void prepare(
+    const pcl::PointCloud<pcl::PointXYZI> & input, pcl::PointCloud<pcl::PointXYZI> & output)
+  {
+    if (&input == &output) {return;}
+    output.header = input.header;
+    output.is_dense = input.is_dense;
+    output.sensor_origin_ = input.sensor_origin_;
+    output.sensor_orientation_ = input.sensor_orientation_;
+    output.points.resize(input.size());
+    output.width = input.width;
+    output.height = input.height;
+  }
+
+  POINT_KERNELS_NO_FP_CONTRACT
+  static void transformPoints(
+    const pcl::PointXYZI * input, const size_t size, const Eigen::Matrix4f & m,
+    pcl::PointXYZI * output)
+  {
+    POINT_KERNELS_NO_FP_CONTRACT_BODY
+    for (size_t i = 0; i < size; ++i) {
+      const pcl::PointXYZI p = input[i];
+      output[i] = p;
+      output[i].x = m(0, 0) * p.x + m(0, 1) * p.y + m(0, 2) * p.z + m(0, 3);
+      output[i].y = m(1, 0) * p.x + m(1, 1) * p.y + m(1, 2) * p.z + m(1, 3);
+      output[i].z = m(2, 0) * p.x + m(2, 1) * p.y + m(2, 2) * p.z + m(2, 3);
+    }
+  }
+
+  // The terms from begin on, as many lanes of T at a time as there are, T being double or a
+  // vector type. Returns the index of the first term left.
+  template<typename T>
+  __attribute__((always_inline))
+  static int accumulateNdtLanes(
+    const NdtTerms & terms, const int begin, const double gauss_d2, double * sums)
+  {
+    const int lanes = sizeof(T) / sizeof(double);
+    T acc[kNdtSums];
+    std::memset(acc, 0, sizeof(acc));
+    int i = begin;
+    for (; i + lanes <= terms.size; i += lanes) {
+      T c[NdtTerms::kNumColumns];
+      for (int k = 0; k < NdtTerms::kNumColumns; ++k) {
+        std::memcpy(&c[k], &terms.columns[k][i], sizeof(T));
+      }
+      const T & qx = c[NdtTerms::kQx];
+      const T & qy = c[NdtTerms::kQy];
+      const T & qz = c[NdtTerms::kQz];
+      const T & ux = c[NdtTerms::kUx];
+      const T & uy = c[NdtTerms::kUy];
+      const T & uz = c[NdtTerms::kUz];
+      const T s[3][3] = {
+        {c[NdtTerms::kS00], c[NdtTerms::kS01], c[NdtTerms::kS02]},
+        {c[NdtTerms::kS01], c[NdtTerms::kS11], c[NdtTerms::kS12]},
+        {c[NdtTerms::kS02], c[NdtTerms::kS12], c[NdtTerms::kS22]}};
+
+      // J^T u = [u, q x u]
+      const T g[6] = {ux, uy, uz, qy * uz - qz * uy, qz * ux - qx * uz, qx * uy - qy * ux};
+      // S (-[q]x)
+      T sb[3][3];
+      for (int r = 0; r < 3; ++r) {
+        sb[r][0] = s[r][2] * qy - s[r][1] * qz;
+        sb[r][1] = s[r][0] * qz - s[r][2] * qx;
+        sb[r][2] = s[r][1] * qx - s[r][0] * qy;
+      }
+      // u^T d2q/dw2 = (u q^T + q u^T) / 2 - (u . q) I
+      const T uq = ux * qx + uy * qy + uz * qz;
+      const T uqxy = 0.5 * (ux * qy + qx * uy);
+      const T uqxz = 0.5 * (ux * qz + qx * uz);
+      const T uqyz = 0.5 * (uy * qz + qy * uz);
+      // upper triangle of J^T S J + u^T d2q, with (-[q]x)^T S (-[q]x) in the bottom right block
+      const T jsj[21] = {
+        s[0][0], s[0][1], s[0][2], sb[0][0], sb[0][1], sb[0][2],
+        s[1][1], s[1][2], sb[1][0], sb[1][1], sb[1][2],
+        s[2][2], sb[2][0], sb[2][1], sb[2][2],
+        qy * sb[2][0] - qz * sb[1][0] + ux * qx - uq,
+        qy * sb[2][1] - qz * sb[1][1] + uqxy, qy * sb[2][2] - qz * sb[1][2] + uqxz,
+        qz * sb[0][1] - qx * sb[2][1] + uy * qy - uq, qz * sb[0][2] - qx * sb[2][2] + uqyz,
+        qx * sb[1][2] - qy * sb[0][2] + uz * qz - uq};
+
+      const T & factor = c[NdtTerms::kFactor];
+      const T weighted_d2 = factor * gauss_d2;
+      for (int k = 0; k < 6; ++k) {
+        acc[k] += factor * g[k];
+      }
+      int k = 6;
+      for (int r = 0; r < 6; ++r) {
+        for (int col = r; col < 6; ++col, ++k) {
+          acc[k] += factor * jsj[k - 6] - weighted_d2 * g[r] * g[col];
+        }
+      }
+    }
+    for (int k = 0; k < kNdtSums; ++k) {
+      double lane_sums[lanes];
+      std::memcpy(lane_sums, &acc[k], sizeof(T));
+      for (int lane = 0; lane < lanes; ++lane) {
+        sums[k] += lane_sums[lane];
+      }
+    }
+    return i;
+  }
+
+#ifdef LIDAR_LOCALIZATION_X86
+  __attribute__((target("sse4.2")))
+  static int accumulateNdtSse42(const NdtTerms & terms, const double gauss_d2, double * sums)
+  {
+    return accumulateNdtLanes<Double2>(terms, 0, gauss_d2, sums);
+  }
+
+  __attribute__((target("avx2,fma")))
+  static int accumulateNdtAvx2(const NdtTerms & terms, const double gauss_d2, double * sums)
+  {
+    return accumulateNdtLanes<Double4>(terms, 0, gauss_d2, sums);
+  }
+
+  __attribute__((target("avx512f")))
+  static int accumulateNdtAvx512(const NdtTerms & terms, const double gauss_d2, double * sums)
+  {
+    return accumulateNdtLanes<Double8>(terms, 0, gauss_d2, sums);
+  }
+#endif
+
+#ifdef LIDAR_LOCALIZATION_NEON
+  static_assert(sizeof(pcl::PointXYZI) == 32, "PointXYZI is expected to span 8 floats");
+
+  // x, y and z of 4 points. vld4q_f32 splits every 4th float of 2 points (x0 i0 x1 i1, ...),
+  // and vuzp1q_f32 keeps the even lanes of 2 such loads.
+  static void load(
+    const pcl::PointXYZI * points, float32x4_t & x, float32x4_t & y, float32x4_t & z)
+  {
+    const float * data = reinterpret_cast<const float *>(points);
+    const float32x4x4_t a = vld4q_f32(data);
+    const float32x4x4_t b = vld4q_f32(data + 16);
+    x = vuzp1q_f32(a.val[0], b.val[0]);
+    y = vuzp1q_f32(a.val[1], b.val[1]);
+    z = vuzp1q_f32(a.val[2], b.val[2]);
+  }
+
+  // masked 21 bit voxel index of 2 coordinates
+  static uint64x2_t index(const float32x2_t v, const float64x2_t inv, const uint64x2_t mask)
+  {
+    const int64x2_t i = vcvtq_s64_f64(vrndmq_f64(vmulq_f64(vcvt_f64_f32(v), inv)));
+    return vandq_u64(vreinterpretq_u64_s64(i), mask);
+  }
+
+  // atan of the ratio in [0, 1] after reducing the ratios above tan(pi/8) by pi/4, then the
+  // octant and the quadrant.
+  // Ref:Cephes atanf
+  static float32x4_t atan2(const float32x4_t y, const float32x4_t x)
+  {
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    const float32x4_t abs_x = vabsq_f32(x);
+    const float32x4_t abs_y = vabsq_f32(y);
+    const float32x4_t max = vmaxq_f32(abs_x, abs_y);
+    const float32x4_t min = vminq_f32(abs_x, abs_y);
+    const float32x4_t a = vbslq_f32(vceqq_f32(max, zero), zero, vdivq_f32(min, max));
+    const uint32x4_t reduce = vcgtq_f32(a, vdupq_n_f32(0.41421356f));
+    const float32x4_t t = vbslq_f32(
+      reduce, vdivq_f32(vsubq_f32(a, one), vaddq_f32(a, one)), a);
+    const float32x4_t s = vmulq_f32(t, t);
+    float32x4_t poly = vdupq_n_f32(8.05374449538e-2f);
+    poly = vfmaq_f32(vdupq_n_f32(-1.38776856032e-1f), poly, s);
+    poly = vfmaq_f32(vdupq_n_f32(1.99777106478e-1f), poly, s);
+    poly = vfmaq_f32(vdupq_n_f32(-3.33329491539e-1f), poly, s);
+    float32x4_t r = vfmaq_f32(t, vmulq_f32(poly, s), t);
+    r = vbslq_f32(reduce, vaddq_f32(r, vdupq_n_f32(static_cast<float>(M_PI / 4))), r);
+    const float32x4_t half_pi = vdupq_n_f32(static_cast<float>(M_PI / 2));
+    const float32x4_t pi = vdupq_n_f32(static_cast<float>(M_PI));
+    r = vbslq_f32(vcgtq_f32(abs_y, abs_x), vsubq_f32(half_pi, r), r);
+    r = vbslq_f32(vcltq_f32(x, zero), vsubq_f32(pi, r), r);
+    // sign of y
+    return vbslq_f32(vdupq_n_u32(0x80000000u), y, r);
+  }
+#endif
+};
+
+#endif  // POINT_KERNELS_HPP_
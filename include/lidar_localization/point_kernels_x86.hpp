@@ -0,0 +1,318 @@
+#ifndef POINT_KERNELS_X86_HPP_
+#define POINT_KERNELS_X86_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <Eigen/Core>
+#include <immintrin.h>
+#include <cfloat>
+#include <cstddef>
+#include <cstdint>
+
+// SSE4.2, AVX2 and AVX-512 versions of the PointKernels kernels. Each is compiled for its
+// instruction set by a target attribute, whatever the flags of the build, and PointKernels
+// calls the best one the CPU supports. Each returns the number of points it processed, and
+// the caller finishes the rest with the scalar version.
+// The crop and the keys compute in double as the scalar versions. The transform makes the
+// same float operations in the same order, and no multiply-add is fused in either (the rounding
+// variants for AVX-512, POINT_KERNELS_NO_FP_CONTRACT otherwise), so all three match the scalar
+// versions bit for bit.
+class PointKernelsX86
+{
+public:
+  static_assert(sizeof(pcl::PointXYZI) == 32, "PointXYZI is expected to span 8 floats");
+
+  __attribute__((target("sse4.2")))
+  static size_t voxelKeysSse42(
+    const pcl::PointXYZI * points, const size_t size, const double inv_leaf_size,
+    uint64_t * keys)
+  {
+    const __m128d inv = _mm_set1_pd(inv_leaf_size);
+    const __m128i invalid = _mm_set1_epi64x(-1);
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+      __m128 x, y, z;
+      load(points + i, x, y, z);
+      const __m128i finite =
+        _mm_castps_si128(_mm_and_ps(_mm_and_ps(isFinite(x), isFinite(y)), isFinite(z)));
+      const __m128i low = _mm_or_si128(
+        _mm_or_si128(
+          _mm_slli_epi64(index(_mm_cvtps_pd(x), inv), 42),
+          _mm_slli_epi64(index(_mm_cvtps_pd(y), inv), 21)),
+        index(_mm_cvtps_pd(z), inv));
+      const __m128i high = _mm_or_si128(
+        _mm_or_si128(
+          _mm_slli_epi64(index(_mm_cvtps_pd(_mm_movehl_ps(x, x)), inv), 42),
+          _mm_slli_epi64(index(_mm_cvtps_pd(_mm_movehl_ps(y, y)), inv), 21)),
+        index(_mm_cvtps_pd(_mm_movehl_ps(z, z)), inv));
+      // sign extension widens the all-ones lanes of the mask
+      _mm_storeu_si128(
+        reinterpret_cast<__m128i *>(keys + i),
+        _mm_blendv_epi8(invalid, low, _mm_cvtepi32_epi64(finite)));
+      _mm_storeu_si128(
+        reinterpret_cast<__m128i *>(keys + i + 2),
+        _mm_blendv_epi8(invalid, high, _mm_cvtepi32_epi64(_mm_srli_si128(finite, 8))));
+    }
+    return i;
+  }
+
+  __attribute__((target("avx2")))
+  static size_t voxelKeysAvx2(
+    const pcl::PointXYZI * points, const size_t size, const double inv_leaf_size,
+    uint64_t * keys)
+  {
+    const __m256d inv = _mm256_set1_pd(inv_leaf_size);
+    const __m256d magic = _mm256_set1_pd(kMagic);
+    const __m256i mask = _mm256_set1_epi64x(0x1fffff);
+    const __m256i invalid = _mm256_set1_epi64x(-1);
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+      __m128 x, y, z;
+      load(points + i, x, y, z);
+      const __m128i finite =
+        _mm_castps_si128(_mm_and_ps(_mm_and_ps(isFinite(x), isFinite(y)), isFinite(z)));
+      __m256i key = _mm256_setzero_si256();
+      const __m128 axes[3] = {x, y, z};
+      for (int axis = 0; axis < 3; ++axis) {
+        const __m256d v = _mm256_floor_pd(_mm256_mul_pd(_mm256_cvtps_pd(axes[axis]), inv));
+        key = _mm256_or_si256(
+          _mm256_slli_epi64(key, 21),
+          _mm256_and_si256(_mm256_castpd_si256(_mm256_add_pd(v, magic)), mask));
+      }
+      _mm256_storeu_si256(
+        reinterpret_cast<__m256i *>(keys + i),
+        _mm256_blendv_epi8(invalid, key, _mm256_cvtepi32_epi64(finite)));
+    }
+    return i;
+  }
+
+  __attribute__((target("avx512f")))
+  static size_t voxelKeysAvx512(
+    const pcl::PointXYZI * points, const size_t size, const double inv_leaf_size,
+    uint64_t * keys)
+  {
+    const __m512d inv = _mm512_set1_pd(inv_leaf_size);
+    const __m512d magic = _mm512_set1_pd(kMagic);
+    const __m512d max_float = _mm512_set1_pd(FLT_MAX);
+    const __m512i mask = _mm512_set1_epi64(0x1fffff);
+    const __m512i invalid = _mm512_set1_epi64(-1);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+      __m128 x[2], y[2], z[2];
+      load(points + i, x[0], y[0], z[0]);
+      load(points + i + 4, x[1], y[1], z[1]);
+      const __m256 axes[3] = {
+        _mm256_set_m128(x[1], x[0]), _mm256_set_m128(y[1], y[0]), _mm256_set_m128(z[1], z[0])};
+      __m512i key = _mm512_setzero_si512();
+      __mmask8 finite = 0xff;
+      for (int axis = 0; axis < 3; ++axis) {
+        const __m512d v = _mm512_cvtps_pd(axes[axis]);
+        // NaN compares false
+        finite &= _mm512_cmp_pd_mask(_mm512_abs_pd(v), max_float, _CMP_LE_OQ);
+        const __m512d index = _mm512_roundscale_pd(
+          _mm512_mul_pd(v, inv), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        key = _mm512_or_si512(
+          _mm512_slli_epi64(key, 21),
+          _mm512_and_si512(_mm512_castpd_si512(_mm512_add_pd(index, magic)), mask));
+      }
+      _mm512_storeu_si512(keys + i, _mm512_mask_blend_epi64(finite, invalid, key));
+    }
+    return i;
+  }
+
+  __attribute__((target("sse4.2")))
+  static size_t cropRangeSse42(
+    const pcl::PointXYZI * points, const size_t size, const double min_range,
+    const double max_range, pcl::PointXYZI * output, size_t & count)
+  {
+    const __m128d min = _mm_set1_pd(min_range);
+    const __m128d max = _mm_set1_pd(max_range);
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+      __m128 x, y, z;
+      load(points + i, x, y, z);
+      const __m128d r_low = range(_mm_cvtps_pd(x), _mm_cvtps_pd(y));
+      const __m128d r_high = range(
+        _mm_cvtps_pd(_mm_movehl_ps(x, x)), _mm_cvtps_pd(_mm_movehl_ps(y, y)));
+      const int inside =
+        _mm_movemask_pd(_mm_and_pd(_mm_cmplt_pd(min, r_low), _mm_cmplt_pd(r_low, max))) |
+        (_mm_movemask_pd(_mm_and_pd(_mm_cmplt_pd(min, r_high), _mm_cmplt_pd(r_high, max))) << 2);
+      storeInside(points + i, inside, 4, output, count);
+    }
+    return i;
+  }
+
+  __attribute__((target("avx2")))
+  static size_t cropRangeAvx2(
+    const pcl::PointXYZI * points, const size_t size, const double min_range,
+    const double max_range, pcl::PointXYZI * output, size_t & count)
+  {
+    const __m256d min = _mm256_set1_pd(min_range);
+    const __m256d max = _mm256_set1_pd(max_range);
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+      __m128 x, y, z;
+      load(points + i, x, y, z);
+      const __m256d x_d = _mm256_cvtps_pd(x);
+      const __m256d y_d = _mm256_cvtps_pd(y);
+      const __m256d r = _mm256_sqrt_pd(
+        _mm256_add_pd(_mm256_mul_pd(x_d, x_d), _mm256_mul_pd(y_d, y_d)));
+      const int inside = _mm256_movemask_pd(
+        _mm256_and_pd(_mm256_cmp_pd(min, r, _CMP_LT_OQ), _mm256_cmp_pd(r, max, _CMP_LT_OQ)));
+      storeInside(points + i, inside, 4, output, count);
+    }
+    return i;
+  }
+
+  __attribute__((target("avx512f")))
+  static size_t cropRangeAvx512(
+    const pcl::PointXYZI * points, const size_t size, const double min_range,
+    const double max_range, pcl::PointXYZI * output, size_t & count)
+  {
+    const __m512d min = _mm512_set1_pd(min_range);
+    const __m512d max = _mm512_set1_pd(max_range);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+      __m128 x[2], y[2], z[2];
+      load(points + i, x[0], y[0], z[0]);
+      load(points + i + 4, x[1], y[1], z[1]);
+      const __m512d x_d = _mm512_cvtps_pd(_mm256_set_m128(x[1], x[0]));
+      const __m512d y_d = _mm512_cvtps_pd(_mm256_set_m128(y[1], y[0]));
+      // x^2 of a float is exact in double, so a fused multiply-add gives the same sum
+      const __m512d r = _mm512_sqrt_pd(
+        _mm512_add_pd(_mm512_mul_pd(x_d, x_d), _mm512_mul_pd(y_d, y_d)));
+      const int inside =
+        _mm512_cmp_pd_mask(min, r, _CMP_LT_OQ) & _mm512_cmp_pd_mask(r, max, _CMP_LT_OQ);
+      storeInside(points + i, inside, 8, output, count);
+    }
+    return i;
+  }
+
+  // one point per register: ((m0 * x + m1 * y) + m2 * z) + m3 with the columns m0..m3
+  POINT_KERNELS_NO_FP_CONTRACT
+  __attribute__((target("sse4.2")))
+  static size_t transformSse42(
+    const pcl::PointXYZI * input, const size_t size, const Eigen::Matrix4f & matrix,
+    pcl::PointXYZI * output)
+  {
+    POINT_KERNELS_NO_FP_CONTRACT_BODY
+    const float * m = matrix.data();
+    const __m128 c0 = _mm_loadu_ps(m);
+    const __m128 c1 = _mm_loadu_ps(m + 4);
+    const __m128 c2 = _mm_loadu_ps(m + 8);
+    const __m128 c3 = _mm_loadu_ps(m + 12);
+    for (size_t i = 0; i < size; ++i) {
+      const __m128 v = _mm_loadu_ps(&input[i].x);
+      __m128 r = _mm_add_ps(
+        _mm_mul_ps(c0, _mm_shuffle_ps(v, v, 0x00)), _mm_mul_ps(c1, _mm_shuffle_ps(v, v, 0x55)));
+      r = _mm_add_ps(_mm_add_ps(r, _mm_mul_ps(c2, _mm_shuffle_ps(v, v, 0xaa))), c3);
+      output[i] = input[i];
+      _mm_storeu_ps(&output[i].x, _mm_blend_ps(r, v, 0x8));
+    }
+    return size;
+  }
+
+  // one whole point per register: x, y and z from the product, the rest copied
+  POINT_KERNELS_NO_FP_CONTRACT
+  __attribute__((target("avx2")))
+  static size_t transformAvx2(
+    const pcl::PointXYZI * input, const size_t size, const Eigen::Matrix4f & matrix,
+    pcl::PointXYZI * output)
+  {
+    POINT_KERNELS_NO_FP_CONTRACT_BODY
+    const float * m = matrix.data();
+    const __m256 c0 = _mm256_broadcast_ps(reinterpret_cast<const __m128 *>(m));
+    const __m256 c1 = _mm256_broadcast_ps(reinterpret_cast<const __m128 *>(m + 4));
+    const __m256 c2 = _mm256_broadcast_ps(reinterpret_cast<const __m128 *>(m + 8));
+    const __m256 c3 = _mm256_broadcast_ps(reinterpret_cast<const __m128 *>(m + 12));
+    for (size_t i = 0; i < size; ++i) {
+      const __m256 v = _mm256_loadu_ps(&input[i].x);
+      __m256 r = _mm256_add_ps(
+        _mm256_mul_ps(c0, _mm256_permute_ps(v, 0x00)),
+        _mm256_mul_ps(c1, _mm256_permute_ps(v, 0x55)));
+      r = _mm256_add_ps(_mm256_add_ps(r, _mm256_mul_ps(c2, _mm256_permute_ps(v, 0xaa))), c3);
+      _mm256_storeu_ps(&output[i].x, _mm256_blend_ps(r, v, 0xf8));
+    }
+    return size;
+  }
+
+  // two whole points per register
+  __attribute__((target("avx512f")))
+  static size_t transformAvx512(
+    const pcl::PointXYZI * input, const size_t size, const Eigen::Matrix4f & matrix,
+    pcl::PointXYZI * output)
+  {
+    const float * m = matrix.data();
+    const __m512 c0 = _mm512_broadcast_f32x4(_mm_loadu_ps(m));
+    const __m512 c1 = _mm512_broadcast_f32x4(_mm_loadu_ps(m + 4));
+    const __m512 c2 = _mm512_broadcast_f32x4(_mm_loadu_ps(m + 8));
+    const __m512 c3 = _mm512_broadcast_f32x4(_mm_loadu_ps(m + 12));
+    size_t i = 0;
+    for (; i + 2 <= size; i += 2) {
+      const __m512 v = _mm512_loadu_ps(&input[i].x);
+      // the rounding variants are never fused into multiply-adds
+      __m512 r = _mm512_add_round_ps(
+        _mm512_mul_round_ps(c0, _mm512_permute_ps(v, 0x00), _MM_FROUND_CUR_DIRECTION),
+        _mm512_mul_round_ps(c1, _mm512_permute_ps(v, 0x55), _MM_FROUND_CUR_DIRECTION),
+        _MM_FROUND_CUR_DIRECTION);
+      r = _mm512_add_round_ps(
+        r, _mm512_mul_round_ps(c2, _mm512_permute_ps(v, 0xaa), _MM_FROUND_CUR_DIRECTION),
+        _MM_FROUND_CUR_DIRECTION);
+      r = _mm512_add_round_ps(r, c3, _MM_FROUND_CUR_DIRECTION);
+      _mm512_storeu_ps(&output[i].x, _mm512_mask_blend_ps(0xf8f8, r, v));
+    }
+    return i;
+  }
+
+private:
+  // Adding 1.5 * 2^52 to an integer below 2^51 in magnitude leaves its two's complement in the
+  // low bits of the mantissa, as SSE and AVX2 have no conversion from double to int64.
+  static constexpr double kMagic = 6755399441055744.0;
+
+  // x, y and z of 4 points, transposed from their first 4 floats
+  static void load(const pcl::PointXYZI * points, __m128 & x, __m128 & y, __m128 & z)
+  {
+    __m128 p0 = _mm_loadu_ps(&points[0].x);
+    __m128 p1 = _mm_loadu_ps(&points[1].x);
+    __m128 p2 = _mm_loadu_ps(&points[2].x);
+    __m128 p3 = _mm_loadu_ps(&points[3].x);
+    _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+    x = p0;
+    y = p1;
+    z = p2;
+  }
+
+  // NaN compares false
+  static __m128 isFinite(const __m128 v)
+  {
+    const __m128 abs = _mm_and_ps(v, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff)));
+    return _mm_cmple_ps(abs, _mm_set1_ps(FLT_MAX));
+  }
+
+  // masked 21 bit voxel index of 2 coordinates
+  __attribute__((target("sse4.2")))
+  static __m128i index(const __m128d v, const __m128d inv)
+  {
+    const __m128d floor = _mm_floor_pd(_mm_mul_pd(v, inv));
+    return _mm_and_si128(
+      _mm_castpd_si128(_mm_add_pd(floor, _mm_set1_pd(kMagic))), _mm_set1_epi64x(0x1fffff));
+  }
+
+  static __m128d range(const __m128d x, const __m128d y)
+  {
+    return _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(x, x), _mm_mul_pd(y, y)));
+  }
+
+  // every point is stored, and only the kept ones advance count, so there is no branch
+  static void storeInside(
+    const pcl::PointXYZI * points, const int inside, const int size, pcl::PointXYZI * output,
+    size_t & count)
+  {
+    for (int j = 0; j < size; ++j) {
+      output[count] = points[j];
+      count += (inside >> j) & 1;
+    }
+  }
+};
+
+#endif  // POINT_KERNELS_X86_HPP_
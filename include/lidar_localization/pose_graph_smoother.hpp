@@ -0,0 +1,275 @@
+#ifndef POSE_GRAPH_SMOOTHER_HPP_
+#define POSE_GRAPH_SMOOTHER_HPP_
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <Eigen/Cholesky>
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <vector>
+
+// Poses of the odometry (base in the odom frame) over time, interpolated at the scan stamps.
+class OdometryBuffer
+{
+public:
+  OdometryBuffer() {}
+
+  // Samples older than max_age behind the newest one are dropped (0: kept).
+  void setMaxAge(const double max_age /*[sec]*/)
+  {
+    max_age_ = max_age;
+  }
+
+  void clear()
+  {
+    samples_.clear();
+  }
+
+  bool empty() const
+  {
+    return samples_.empty();
+  }
+
+  // Samples are expected in stamp order; an older one replaces the newer ones.
+  void add(const double stamp, const Eigen::Matrix4d & pose)
+  {
+    while (!samples_.empty() && samples_.back().stamp >= stamp) {
+      samples_.pop_back();
+    }
+    samples_.push_back(Sample{stamp, pose});
+    while (max_age_ > 0.0 && samples_.front().stamp < stamp - max_age_) {
+      samples_.pop_front();
+    }
+  }
+
+  // Pose at the stamp, interpolated between the samples around it, or the nearest sample when
+  // the stamp is at most max_gap outside of them. Returns false otherwise.
+  bool interpolate(const double stamp, const double max_gap, Eigen::Matrix4d & pose) const
+  {
+    if (samples_.empty()) {return false;}
+    auto it = std::lower_bound(
+      samples_.begin(), samples_.end(), stamp,
+      [](const Sample & sample, const double t) {return sample.stamp < t;});
+    if (it == samples_.begin()) {
+      if (it->stamp - stamp > max_gap) {return false;}
+      pose = it->pose;
+      return true;
+    }
+    if (it == samples_.end()) {
+      if (stamp - samples_.back().stamp > max_gap) {return false;}
+      pose = samples_.back().pose;
+      return true;
+    }
+    const Sample & before = *(it - 1);
+    const double t = (stamp - before.stamp) / (it->stamp - before.stamp);
+    const Eigen::Quaterniond quat_before(before.pose.block<3, 3>(0, 0));
+    const Eigen::Quaterniond quat_after(it->pose.block<3, 3>(0, 0));
+    pose.setIdentity();
+    pose.block<3, 3>(0, 0) = quat_before.slerp(t, quat_after).toRotationMatrix();
+    pose.block<3, 1>(0, 3) =
+      (1 - t) * before.pose.block<3, 1>(0, 3) + t * it->pose.block<3, 1>(0, 3);
+    return true;
+  }
+
+private:
+  struct Sample
+  {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    double stamp;
+    Eigen::Matrix4d pose;
+  };
+
+  double max_age_{0.0};
+  std::deque<Sample, Eigen::aligned_allocator<Sample>> samples_;
+};
+
+// Sliding-window pose graph over the latest scans: each scan is tied to its registered pose
+// (unary factor) and to the next scan by the odometry motion between them. The window is
+// optimized with Gauss-Newton, so a single registration that jitters or slips is pulled back
+// by the odometry and its neighbours. Rotation errors are weighted as the displacement they
+// cause at kLeverArm, so a single sigma per factor covers both.
+class PoseGraphSmoother
+{
+public:
+  struct Node
+  {
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    double stamp;
+    Eigen::Matrix4d registered_pose;
+    // pose of the odometry at the stamp, when has_odometry
+    Eigen::Matrix4d odometry_pose;
+    bool has_odometry;
+    // estimate
+    Eigen::Matrix4d pose;
+  };
+
+  PoseGraphSmoother() {}
+
+  void setWindowSize(const int window_size)
+  {
+    window_size_ = std::max(window_size, 2);
+  }
+
+  void setRegistrationSigma(const double sigma /*[m]*/)
+  {
+    registration_sigma_ = sigma;
+  }
+
+  void setOdometrySigma(const double sigma /*[m]*/)
+  {
+    odometry_sigma_ = sigma;
+  }
+
+  void clear()
+  {
+    nodes_.clear();
+  }
+
+  // Adds the scan at the end of the window, starting from the pose propagated by the odometry
+  // from the previous estimate. The node leaving the window, if any, is moved to removed.
+  bool addNode(Node node, Node & removed)
+  {
+    node.pose = node.registered_pose;
+    if (!nodes_.empty() && nodes_.back().has_odometry && node.has_odometry) {
+      node.pose = nodes_.back().pose * measuredMotion(nodes_.back(), node);
+    }
+    nodes_.push_back(node);
+    if (static_cast<int>(nodes_.size()) <= window_size_) {return false;}
+    removed = nodes_.front();
+    nodes_.pop_front();
+    return true;
+  }
+
+  // Gauss-Newton on the right perturbation [translation, rotation] of each pose.
+  void optimize(const int max_iterations = 5)
+  {
+    const int n = static_cast<int>(nodes_.size());
+    if (n == 0) {return;}
+    for (int iteration = 0; iteration < max_iterations; ++iteration) {
+      Eigen::MatrixXd hessian = Eigen::MatrixXd::Zero(6 * n, 6 * n);
+      Eigen::VectorXd gradient = Eigen::VectorXd::Zero(6 * n);
+      for (int i = 0; i < n; ++i) {
+        addFactor(
+          i, -1, [this](const Node & node, const Node &) {return unaryResidual(node);},
+          hessian, gradient);
+        if (i + 1 < n && nodes_[i].has_odometry && nodes_[i + 1].has_odometry) {
+          addFactor(
+            i, i + 1,
+            [this](const Node & from, const Node & to) {return odometryResidual(from, to);},
+            hessian, gradient);
+        }
+      }
+      hessian.diagonal().array() += 1e-9;
+      const Eigen::VectorXd delta = hessian.ldlt().solve(-gradient);
+      if (!delta.allFinite()) {return;}
+      for (int i = 0; i < n; ++i) {
+        nodes_[i].pose = applyIncrement(nodes_[i].pose, delta.segment<6>(6 * i));
+      }
+      if (delta.lpNorm<Eigen::Infinity>() < 1e-6) {break;}
+    }
+  }
+
+  size_t size() const
+  {
+    return nodes_.size();
+  }
+
+  const Node & getNode(const size_t i) const
+  {
+    return nodes_[i];
+  }
+
+private:
+  using Vector6d = Eigen::Matrix<double, 6, 1>;
+
+  static constexpr double kLeverArm = 10.0;  /*[m]*/
+
+  static Eigen::Vector3d logRotation(const Eigen::Matrix3d & rotation)
+  {
+    Eigen::Quaterniond quat(rotation);
+    if (quat.w() < 0) {quat.coeffs() = -quat.coeffs();}
+    const double norm = quat.vec().norm();
+    if (norm < 1e-12) {return 2.0 * quat.vec();}
+    return quat.vec() * (2.0 * std::atan2(norm, quat.w()) / norm);
+  }
+
+  static Eigen::Matrix4d applyIncrement(const Eigen::Matrix4d & pose, const Vector6d & delta)
+  {
+    Eigen::Matrix4d result = pose;
+    result.block<3, 1>(0, 3) += delta.head<3>();
+    const double angle = delta.tail<3>().norm();
+    if (angle > 0.0) {
+      result.block<3, 3>(0, 0) = pose.block<3, 3>(0, 0) *
+        Eigen::AngleAxisd(angle, delta.tail<3>() / angle).toRotationMatrix();
+    }
+    return result;
+  }
+
+  static Eigen::Matrix4d measuredMotion(const Node & from, const Node & to)
+  {
+    return from.odometry_pose.inverse() * to.odometry_pose;
+  }
+
+  Vector6d residual(const Eigen::Matrix4d & error, const double sigma) const
+  {
+    Vector6d r;
+    r.head<3>() = error.block<3, 1>(0, 3) / sigma;
+    r.tail<3>() = logRotation(error.block<3, 3>(0, 0)) * (kLeverArm / sigma);
+    return r;
+  }
+
+  Vector6d unaryResidual(const Node & node) const
+  {
+    Eigen::Matrix4d error = node.registered_pose.inverse() * node.pose;
+    // the translation error in the map frame
+    error.block<3, 1>(0, 3) =
+      node.pose.block<3, 1>(0, 3) - node.registered_pose.block<3, 1>(0, 3);
+    return residual(error, registration_sigma_);
+  }
+
+  Vector6d odometryResidual(const Node & from, const Node & to) const
+  {
+    const Eigen::Matrix4d motion = from.pose.inverse() * to.pose;
+    return residual(measuredMotion(from, to).inverse() * motion, odometry_sigma_);
+  }
+
+  // Adds the factor on node i (and j unless -1) with numerical jacobians, as each factor only
+  // involves one or two poses.
+  template<typename Residual>
+  void addFactor(
+    const int i, const int j, const Residual & compute, Eigen::MatrixXd & hessian,
+    Eigen::VectorXd & gradient)
+  {
+    const int num_nodes = j < 0 ? 1 : 2;
+    Node & from = nodes_[i];
+    Node & to = nodes_[j < 0 ? i : j];
+    const Vector6d r = compute(from, to);
+    Eigen::Matrix<double, 6, 12> jacobian;
+    const double eps = 1e-6;
+    for (int k = 0; k < num_nodes; ++k) {
+      Node & node = k == 0 ? from : to;
+      const Eigen::Matrix4d pose = node.pose;
+      for (int d = 0; d < 6; ++d) {
+        node.pose = applyIncrement(pose, Vector6d::Unit(d) * eps);
+        jacobian.col(6 * k + d) = (compute(from, to) - r) / eps;
+      }
+      node.pose = pose;
+    }
+    const int index[2] = {6 * i, 6 * (j < 0 ? i : j)};
+    for (int a = 0; a < num_nodes; ++a) {
+      gradient.segment<6>(index[a]) += jacobian.block<6, 6>(0, 6 * a).transpose() * r;
+      for (int b = 0; b < num_nodes; ++b) {
+        hessian.block<6, 6>(index[a], index[b]) +=
+          jacobian.block<6, 6>(0, 6 * a).transpose() * jacobian.block<6, 6>(0, 6 * b);
+      }
+    }
+  }
+
+  int window_size_{20};
+  double registration_sigma_{0.1};
+  double odometry_sigma_{0.02};
+  std::deque<Node, Eigen::aligned_allocator<Node>> nodes_;
+};
+
+#endif  // POSE_GRAPH_SMOOTHER_HPP_
@@ -0,0 +1,164 @@
+#ifndef RANGE_ADAPTIVE_DOWNSAMPLER_HPP_
+#define RANGE_ADAPTIVE_DOWNSAMPLER_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Scan downsampling for registration. A spinning LiDAR samples close surfaces far more densely
+// than distant ones, so a single voxel size leaves most of the points near the sensor while the
+// distant points, which constrain the rotation best, are few.
+// The voxel size here grows towards the sensor: leaf_size beyond the reference range, and
+// leaf_size * reference_range / range closer, up to max_leaf_size. The sizes are rounded to
+// leaf_size times a power of two. Points are averaged per voxel as pcl::VoxelGrid.
+// Optionally, at most max_points_per_cell voxels are then kept in each registration cell (an
+// NDT cell), the ones averaging the most points, since more points in a cell add little.
+class RangeAdaptiveDownsampler
+{
+public:
+  using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+
+  RangeAdaptiveDownsampler() {}
+
+  void setLeafSize(const double leaf_size /*[m]*/)
+  {
+    leaf_size_ = leaf_size;
+  }
+
+  void setMaxLeafSize(const double max_leaf_size /*[m]*/)
+  {
+    max_leaf_size_ = max_leaf_size;
+  }
+
+  void setReferenceRange(const double reference_range /*[m]*/)
+  {
+    reference_range_ = reference_range;
+  }
+
+  // max_points_per_cell <= 0 keeps every voxel
+  void setCellSize(const double cell_size /*[m]*/, const int max_points_per_cell)
+  {
+    cell_size_ = cell_size;
+    max_points_per_cell_ = max_points_per_cell;
+  }
+
+  // Ranges are measured from the origin of the cloud's frame.
+  void filter(const Cloud & input, Cloud & output)
+  {
+    const int max_level = std::max(
+      0, static_cast<int>(std::floor(std::log2(std::max(max_leaf_size_ / leaf_size_, 1.0)))));
+    std::vector<double> inv_leaf_sizes(max_level + 1);
+    for (int level = 0; level <= max_level; ++level) {
+      inv_leaf_sizes[level] = 1.0 / (leaf_size_ * (1 << level));
+    }
+
+    // one map per level, so a voxel only averages the points of its own range band
+    voxels_.resize(max_level + 1);
+    for (auto & voxels : voxels_) {
+      voxels.clear();
+    }
+    for (const auto & p : input.points) {
+      if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+      const double range = std::sqrt(p.x * p.x + p.y * p.y + p.z * p.z);
+      int level = 0;
+      if (range < reference_range_) {
+        const double scale = range > 0.0 ? reference_range_ / range : max_leaf_size_ / leaf_size_;
+        level = std::min(max_level, static_cast<int>(std::ceil(std::log2(scale) - 1e-9)));
+      }
+      const double inv_leaf_size = inv_leaf_sizes[level];
+      Voxel & voxel = voxels_[level][getKey(
+          static_cast<int64_t>(std::floor(p.x * inv_leaf_size)),
+          static_cast<int64_t>(std::floor(p.y * inv_leaf_size)),
+          static_cast<int64_t>(std::floor(p.z * inv_leaf_size)))];
+      voxel.x += p.x;
+      voxel.y += p.y;
+      voxel.z += p.z;
+      voxel.intensity += p.intensity;
+      ++voxel.count;
+    }
+
+    output.clear();
+    if (max_points_per_cell_ <= 0 || cell_size_ <= 0.0) {
+      for (const auto & voxels : voxels_) {
+        for (const auto & voxel : voxels) {
+          output.push_back(voxel.second.mean());
+        }
+      }
+    } else {
+      selectPerCell(output);
+    }
+    output.width = output.size();
+    output.height = 1;
+    output.is_dense = true;
+  }
+
+private:
+  struct Voxel
+  {
+    double x{0.0};
+    double y{0.0};
+    double z{0.0};
+    double intensity{0.0};
+    int count{0};
+
+    pcl::PointXYZI mean() const
+    {
+      pcl::PointXYZI p;
+      p.x = static_cast<float>(x / count);
+      p.y = static_cast<float>(y / count);
+      p.z = static_cast<float>(z / count);
+      p.intensity = static_cast<float>(intensity / count);
+      return p;
+    }
+  };
+
+  static uint64_t getKey(const int64_t ix, const int64_t iy, const int64_t iz)
+  {
+    // 21 bits per axis
+    return ((static_cast<uint64_t>(ix) & 0x1fffffULL) << 42) |
+           ((static_cast<uint64_t>(iy) & 0x1fffffULL) << 21) |
+           (static_cast<uint64_t>(iz) & 0x1fffffULL);
+  }
+
+  void selectPerCell(Cloud & output)
+  {
+    const double inv_cell_size = 1.0 / cell_size_;
+    cells_.clear();
+    for (const auto & voxels : voxels_) {
+      for (const auto & voxel : voxels) {
+        const pcl::PointXYZI p = voxel.second.mean();
+        const uint64_t key = getKey(
+          static_cast<int64_t>(std::floor(p.x * inv_cell_size)),
+          static_cast<int64_t>(std::floor(p.y * inv_cell_size)),
+          static_cast<int64_t>(std::floor(p.z * inv_cell_size)));
+        cells_[key].push_back(&voxel.second);
+      }
+    }
+    for (auto & cell : cells_) {
+      auto & members = cell.second;
+      if (static_cast<int>(members.size()) > max_points_per_cell_) {
+        std::nth_element(
+          members.begin(), members.begin() + max_points_per_cell_, members.end(),
+          [](const Voxel * a, const Voxel * b) {return a->count > b->count;});
+        members.resize(max_points_per_cell_);
+      }
+      for (const Voxel * voxel : members) {
+        output.push_back(voxel->mean());
+      }
+    }
+  }
+
+  double leaf_size_{0.2};
+  double max_leaf_size_{1.0};
+  double reference_range_{20.0};
+  double cell_size_{1.0};
+  int max_points_per_cell_{0};
+  std::vector<std::unordered_map<uint64_t, Voxel>> voxels_;
+  std::unordered_map<uint64_t, std::vector<const Voxel *>> cells_;
+};
+
+#endif  // RANGE_ADAPTIVE_DOWNSAMPLER_HPP_
@@ -0,0 +1,134 @@
+#ifndef SHARED_MAP_HPP_
+#define SHARED_MAP_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <pcl/registration/registration.h>
+#include <boost/shared_ptr.hpp>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// Maps and registration targets shared by the localization sessions of one process (several
+// PCLLocalization nodes in one container, one per robot). Each map file is loaded once and
+// each target is built once; the sessions asking for one while it is being loaded or built
+// wait for it. Nothing here is modified after it is stored. Each entry counts the sessions
+// that asked for it, identified by an opaque pointer, and is dropped once they all released it.
+class SharedMapStore
+{
+public:
+  using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+  using RegistrationPtr = boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>>;
+
+  static SharedMapStore & instance()
+  {
+    static SharedMapStore store;
+    return store;
+  }
+
+  // Loads the map with load(cloud) unless it is loaded already. loaded is set when this call
+  // loaded it. Returns null if the load fails, which the next call retries.
+  Cloud::Ptr getMap(
+    const std::string & path, const std::function<bool(Cloud &)> & load, bool & loaded,
+    const void * session)
+  {
+    loaded = false;
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = maps_.find(path);
+    if (it != maps_.end()) {
+      it->second.sessions.insert(session);
+      std::shared_future<Cloud::Ptr> future = it->second.future;
+      lock.unlock();
+      return future.get();
+    }
+    std::promise<Cloud::Ptr> promise;
+    Entry<Cloud::Ptr> & entry = maps_[path];
+    entry.future = promise.get_future().share();
+    entry.sessions.insert(session);
+    lock.unlock();
+
+    Cloud::Ptr map(new Cloud);
+    if (!load(*map)) {
+      map.reset();
+      lock.lock();
+      maps_.erase(path);
+      lock.unlock();
+    }
+    promise.set_value(map);
+    loaded = map != nullptr;
+    return map;
+  }
+
+  // Returns the registration stored for the key, or stores the one returned by build().
+  // built is set when this call built it.
+  RegistrationPtr getTarget(
+    const std::string & key, const std::function<RegistrationPtr()> & build, bool & built,
+    const void * session)
+  {
+    built = false;
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = targets_.find(key);
+    if (it != targets_.end()) {
+      it->second.sessions.insert(session);
+      std::shared_future<RegistrationPtr> future = it->second.future;
+      lock.unlock();
+      return future.get();
+    }
+    std::promise<RegistrationPtr> promise;
+    Entry<RegistrationPtr> & entry = targets_[key];
+    entry.future = promise.get_future().share();
+    entry.sessions.insert(session);
+    lock.unlock();
+
+    const RegistrationPtr registration = build();
+    promise.set_value(registration);
+    built = true;
+    return registration;
+  }
+
+  // Releases the maps and targets the session asked for, dropping those no other session
+  // asked for. The other sessions keep theirs whatever this session does.
+  void release(const void * session)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    release(maps_, session);
+    release(targets_, session);
+  }
+
+private:
+  template<typename T>
+  struct Entry
+  {
+    std::shared_future<T> future;
+    std::unordered_set<const void *> sessions;
+  };
+
+  SharedMapStore() {}
+
+  template<typename T>
+  static void release(
+    std::unordered_map<std::string, Entry<T>> & entries, const void * session)
+  {
+    for (auto it = entries.begin(); it != entries.end(); ) {
+      it->second.sessions.erase(session);
+      // an entry still being loaded or built is left to the next release
+      if (it->second.sessions.empty() &&
+        it->second.future.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+      {
+        it = entries.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, Entry<Cloud::Ptr>> maps_;
+  std::unordered_map<std::string, Entry<RegistrationPtr>> targets_;
+};
+
+#endif  // SHARED_MAP_HPP_
@@ -0,0 +1,322 @@
+#ifndef SHARED_NDT_TARGET_HPP_
+#define SHARED_NDT_TARGET_HPP_
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <Eigen/Core>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+// Mean and inverse covariance of an NDT voxel.
+struct NdtDistribution
+{
+  Eigen::Vector3d mean;
+  Eigen::Matrix3d icov;
+};
+
+// A finalized LazyNDT target in a POSIX shared memory segment, written once by one process and
+// mapped read-only by the others. The segment only holds offsets, so it can be mapped at any
+// address:
+//   header | voxels | hash buckets (voxel index + 1, 0 if empty) | points of the voxels
+// The writer holds an exclusive lock on the segment until it is complete, so the processes
+// attaching meanwhile wait for it instead of building the target themselves. A process that gets
+// the lock on an incomplete segment knows its writer died, as the lock goes with the process.
+class SharedNdtTarget
+{
+public:
+  struct Voxel
+  {
+    uint64_t key;
+    // the points of the voxel, for the fitness score
+    uint32_t first_point;
+    uint32_t num_points;
+    uint32_t valid;
+    uint32_t reserved;
+    NdtDistribution distribution;
+  };
+
+  struct Point
+  {
+    float x;
+    float y;
+    float z;
+  };
+
+  // kAbandoned: the segment was left incomplete by a writer that died, and has been removed
+  enum class AttachResult {kAttached, kMissing, kAbandoned, kOtherTarget};
+
+  SharedNdtTarget(const SharedNdtTarget &) = delete;
+  SharedNdtTarget & operator=(const SharedNdtTarget &) = delete;
+
+  ~SharedNdtTarget()
+  {
+    munmap(data_, size_);
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  // Identifies a map file by its path, size and modification time.
+  static uint64_t fingerprint(const std::string & path)
+  {
+    struct stat status;
+    if (stat(path.c_str(), &status) != 0) {return 0;}
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    auto add = [&hash](const void * data, const size_t size) {
+        const unsigned char * bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; ++i) {
+          hash = (hash ^ bytes[i]) * 1099511628211ULL;
+        }
+      };
+    add(path.data(), path.size());
+    const int64_t values[2] = {
+      static_cast<int64_t>(status.st_size), static_cast<int64_t>(status.st_mtime)};
+    add(values, sizeof(values));
+    return hash;
+  }
+
+  // Creates the segment, sized for the voxels and points, for the caller to fill and publish.
+  // Returns null if the segment exists. The segment stays locked until published.
+  static std::unique_ptr<SharedNdtTarget> create(
+    const std::string & name, const uint64_t map_id, const double resolution,
+    const size_t num_voxels, const size_t num_points)
+  {
+    uint64_t num_buckets = 1;
+    int bucket_bits = 0;
+    while (num_buckets < 2 * num_voxels) {
+      num_buckets <<= 1;
+      ++bucket_bits;
+    }
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kMagic, sizeof(header.magic));
+    header.version = kVersion;
+    header.map_id = map_id;
+    header.resolution = resolution;
+    header.num_voxels = num_voxels;
+    header.voxels_offset = align(sizeof(Header));
+    header.num_buckets = num_buckets;
+    header.bucket_bits = bucket_bits;
+    header.buckets_offset = align(header.voxels_offset + num_voxels * sizeof(Voxel));
+    header.num_points = num_points;
+    header.points_offset = align(header.buckets_offset + num_buckets * sizeof(uint32_t));
+    header.size = header.points_offset + num_points * sizeof(Point);
+
+    const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {return nullptr;}
+    void * data = MAP_FAILED;
+    if (flock(fd, LOCK_EX) == 0 && ftruncate(fd, header.size) == 0) {
+      data = mmap(nullptr, header.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (data == MAP_FAILED) {
+      close(fd);
+      shm_unlink(name.c_str());
+      return nullptr;
+    }
+    // ftruncate zero-fills the buckets and the ready flag
+    std::memcpy(data, &header, sizeof(header));
+    return std::unique_ptr<SharedNdtTarget>(new SharedNdtTarget(data, header.size, fd));
+  }
+
+  Voxel * voxels()
+  {
+    return reinterpret_cast<Voxel *>(data() + header().voxels_offset);
+  }
+
+  Point * points()
+  {
+    return reinterpret_cast<Point *>(data() + header().points_offset);
+  }
+
+  // Indexes the voxels and marks the segment complete, after which attach accepts it.
+  void publish()
+  {
+    Header & header = *reinterpret_cast<Header *>(data_);
+    uint32_t * buckets = reinterpret_cast<uint32_t *>(data() + header.buckets_offset);
+    const Voxel * voxels = this->voxels();
+    const uint64_t mask = header.num_buckets - 1;
+    for (uint64_t i = 0; i < header.num_voxels; ++i) {
+      uint64_t bucket = getBucket(voxels[i].key);
+      while (buckets[bucket] != 0) {
+        bucket = (bucket + 1) & mask;
+      }
+      buckets[bucket] = static_cast<uint32_t>(i + 1);
+    }
+    __atomic_store_n(&header.ready, 1u, __ATOMIC_RELEASE);
+    close(fd_);
+    fd_ = -1;
+  }
+
+  // Maps a complete segment built from the map and resolution read-only, once its writer is
+  // done. A segment whose writer died is removed, for the caller to build it again.
+  static std::shared_ptr<const SharedNdtTarget> attach(
+    const std::string & name, const uint64_t map_id, const double resolution,
+    AttachResult & result)
+  {
+    result = AttachResult::kMissing;
+    int fd = -1;
+    struct stat status;
+    // A segment is empty from its creation until its writer has locked and sized it, which
+    // only takes a moment; it stays empty if the writer died in between.
+    for (int attempt = 0; ; ++attempt) {
+      fd = shm_open(name.c_str(), O_RDONLY, 0);
+      if (fd < 0) {return nullptr;}
+      if (flock(fd, LOCK_SH) != 0 || fstat(fd, &status) != 0) {
+        close(fd);
+        return nullptr;
+      }
+      if (status.st_size > 0) {break;}
+      if (attempt == kMaxEmptyAttempts) {
+        removeAbandoned(name, status);
+        close(fd);
+        result = AttachResult::kAbandoned;
+        return nullptr;
+      }
+      close(fd);
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    void * data = MAP_FAILED;
+    if (static_cast<size_t>(status.st_size) >= sizeof(Header)) {
+      data = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    std::shared_ptr<const SharedNdtTarget> target;
+    if (data != MAP_FAILED) {
+      target.reset(new SharedNdtTarget(data, status.st_size));
+    }
+    // the writer holds its lock until the segment is complete, so having the lock on an
+    // incomplete one means the writer is gone
+    if (!target || std::memcmp(target->header().magic, kMagic, sizeof(Header::magic)) != 0 ||
+      __atomic_load_n(&target->header().ready, __ATOMIC_ACQUIRE) == 0 ||
+      target->header().size > static_cast<uint64_t>(status.st_size))
+    {
+      removeAbandoned(name, status);
+      close(fd);
+      result = AttachResult::kAbandoned;
+      return nullptr;
+    }
+    close(fd);
+
+    const Header & header = target->header();
+    if (header.version != kVersion || header.map_id != map_id ||
+      header.resolution != resolution)
+    {
+      result = AttachResult::kOtherTarget;
+      return nullptr;
+    }
+    result = AttachResult::kAttached;
+    return target;
+  }
+
+  static void remove(const std::string & name)
+  {
+    shm_unlink(name.c_str());
+  }
+
+  const Voxel * find(const uint64_t key) const
+  {
+    const Header & header = this->header();
+    const uint32_t * buckets = reinterpret_cast<const uint32_t *>(data() + header.buckets_offset);
+    const Voxel * voxels = reinterpret_cast<const Voxel *>(data() + header.voxels_offset);
+    const uint64_t mask = header.num_buckets - 1;
+    for (uint64_t bucket = getBucket(key); buckets[bucket] != 0; bucket = (bucket + 1) & mask) {
+      const Voxel & voxel = voxels[buckets[bucket] - 1];
+      if (voxel.key == key) {return &voxel;}
+    }
+    return nullptr;
+  }
+
+  const Point * points() const
+  {
+    return reinterpret_cast<const Point *>(data() + header().points_offset);
+  }
+
+  size_t numVoxels() const
+  {
+    return header().num_voxels;
+  }
+
+  size_t size() const
+  {
+    return size_;
+  }
+
+private:
+  struct Header
+  {
+    char magic[8];
+    uint32_t version;
+    // set once the segment is complete
+    uint32_t ready;
+    uint64_t map_id;
+    double resolution;
+    uint64_t num_voxels;
+    uint64_t voxels_offset;
+    uint64_t num_buckets;
+    uint64_t bucket_bits;
+    uint64_t buckets_offset;
+    uint64_t num_points;
+    uint64_t points_offset;
+    uint64_t size;
+  };
+
+  static constexpr const char * kMagic = "LLNDTSHM";
+  static constexpr uint32_t kVersion = 1;
+  // 10 ms apart
+  static constexpr int kMaxEmptyAttempts = 100;
+
+  SharedNdtTarget(void * data, const size_t size, const int fd = -1)
+  : data_(data), size_(size), fd_(fd) {}
+
+  // Unlinks the segment unless another process already replaced it by a new one.
+  static void removeAbandoned(const std::string & name, const struct stat & status)
+  {
+    struct stat current;
+    if (stat(("/dev/shm" + name).c_str(), &current) == 0 && current.st_ino == status.st_ino) {
+      shm_unlink(name.c_str());
+    }
+  }
+
+  static uint64_t align(const uint64_t offset)
+  {
+    return (offset + 63) & ~uint64_t{63};
+  }
+
+  const Header & header() const
+  {
+    return *reinterpret_cast<const Header *>(data_);
+  }
+
+  char * data()
+  {
+    return static_cast<char *>(data_);
+  }
+
+  const char * data() const
+  {
+    return static_cast<const char *>(data_);
+  }
+
+  // Fibonacci hashing, as the keys of neighbouring voxels only differ in their low bits
+  uint64_t getBucket(const uint64_t key) const
+  {
+    const uint64_t bits = header().bucket_bits;
+    return bits == 0 ? 0 : (key * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+  }
+
+  void * data_;
+  size_t size_;
+  // held locked by the writer until publish
+  int fd_;
+};
+
+#endif  // SHARED_NDT_TARGET_HPP_
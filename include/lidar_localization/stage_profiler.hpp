@@ -0,0 +1,92 @@
+#ifndef STAGE_PROFILER_HPP_
+#define STAGE_PROFILER_HPP_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Wall time per processing stage, accumulated over calls. Stages are reported in the order
+// they were first seen.
+class StageProfiler
+{
+public:
+  StageProfiler() {}
+
+  void setEnabled(const bool enabled)
+  {
+    enabled_ = enabled;
+  }
+
+  bool isEnabled() const
+  {
+    return enabled_;
+  }
+
+  void add(const char * stage, const double seconds)
+  {
+    if (!enabled_) {return;}
+    auto it = std::find_if(
+      stages_.begin(), stages_.end(), [stage](const Stage & s) {return s.name == stage;});
+    if (it == stages_.end()) {
+      stages_.push_back(Stage{stage, 0, 0.0, 0.0});
+      it = stages_.end() - 1;
+    }
+    ++it->count;
+    it->total += seconds;
+    it->max = std::max(it->max, seconds);
+  }
+
+  std::string report() const
+  {
+    std::string text = "stage                 count   total[s]   mean[ms]    max[ms]\n";
+    char line[128];
+    for (const auto & s : stages_) {
+      std::snprintf(
+        line, sizeof(line), "%-20s %6zu %10.3f %10.3f %10.3f\n", s.name.c_str(), s.count,
+        s.total, 1e3 * s.total / s.count, 1e3 * s.max);
+      text += line;
+    }
+    return text;
+  }
+
+  // Records the time since the previous lap (or construction) under each lap's stage.
+  class Timer
+  {
+  public:
+    explicit Timer(StageProfiler & profiler)
+    : profiler_(profiler), last_(now()) {}
+
+    void lap(const char * stage)
+    {
+      if (!profiler_.isEnabled()) {return;}
+      const auto t = now();
+      profiler_.add(stage, std::chrono::duration<double>(t - last_).count());
+      last_ = t;
+    }
+
+  private:
+    static std::chrono::steady_clock::time_point now()
+    {
+      return std::chrono::steady_clock::now();
+    }
+
+    StageProfiler & profiler_;
+    std::chrono::steady_clock::time_point last_;
+  };
+
+private:
+  struct Stage
+  {
+    std::string name;
+    size_t count;
+    double total;
+    double max;
+  };
+
+  bool enabled_{false};
+  std::vector<Stage> stages_;
+};
+
+#endif  // STAGE_PROFILER_HPP_
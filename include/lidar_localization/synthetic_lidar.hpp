@@ -0,0 +1,221 @@
+#ifndef SYNTHETIC_LIDAR_HPP_
+#define SYNTHETIC_LIDAR_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+
+// Spinning LiDAR simulated by casting rays into a voxelized map. Each column of the sweep is
+// cast from the pose at its own time, so the scan carries the motion distortion of a real
+// sensor. Columns are ordered clockwise, as the undistortion expects.
+class SyntheticLidar
+{
+public:
+  using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+  using PoseFunction = std::function<Eigen::Isometry3d(double /*time[sec]*/)>;
+
+  struct BeamModel
+  {
+    int channels{16};
+    int columns{1800};
+    double min_elevation{-15.0 * M_PI / 180.0}; /*[rad]*/
+    double max_elevation{15.0 * M_PI / 180.0}; /*[rad]*/
+    double min_range{0.5}; /*[m]*/
+    double max_range{100.0}; /*[m]*/
+    double range_noise{0.02}; /*[m] standard deviation*/
+    // One row per channel, bottom up, and NaN points for the misses, as an organized cloud.
+    // The points are then ordered by row, not along the sweep.
+    bool organized{false};
+  };
+
+  SyntheticLidar() {}
+
+  void setBeamModel(const BeamModel & beam_model)
+  {
+    beam_model_ = beam_model;
+  }
+
+  const BeamModel & getBeamModel() const
+  {
+    return beam_model_;
+  }
+
+  // Rays stop at the first voxel holding a map point, at the mean of the points in it.
+  void setMap(const Cloud & map, const double voxel_size /*[m]*/)
+  {
+    voxel_size_ = voxel_size;
+    voxels_.clear();
+    coarse_voxels_.clear();
+    for (const auto & p : map.points) {
+      if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z)) {continue;}
+      const Eigen::Vector3d v(p.x, p.y, p.z);
+      Voxel & voxel = voxels_[getKey(v, voxel_size_)];
+      ++voxel.count;
+      voxel.mean += (v - voxel.mean) / voxel.count;
+      voxel.intensity += (p.intensity - voxel.intensity) / voxel.count;
+      coarse_voxels_.insert(getKey(v, voxel_size_ * kCoarseFactor));
+    }
+  }
+
+  size_t getNumVoxels() const
+  {
+    return voxels_.size();
+  }
+
+  // Distance to the first occupied voxel along a unit direction, or a negative value
+  // when nothing is hit within the max range.
+  double castRay(
+    const Eigen::Vector3d & origin, const Eigen::Vector3d & direction, float & intensity) const
+  {
+    // empty coarse cells are skipped whole, the fine voxels are only walked in the others
+    double range = -1.0;
+    traverse(
+      origin, direction, 0.0, beam_model_.max_range, voxel_size_ * kCoarseFactor,
+      [&](const uint64_t coarse_key, const double t_enter, const double t_exit) {
+        if (!coarse_voxels_.count(coarse_key)) {return false;}
+        return traverse(
+          origin, direction, t_enter, t_exit, voxel_size_,
+          [&](const uint64_t key, const double, const double) {
+            auto it = voxels_.find(key);
+            if (it == voxels_.end()) {return false;}
+            const double t = (it->second.mean - origin).dot(direction);
+            if (t < beam_model_.min_range || t > beam_model_.max_range) {return false;}
+            range = t;
+            intensity = it->second.intensity;
+            return true;
+          });
+      });
+    return range;
+  }
+
+  // Sweep starting at start_time. Points are in the sensor frame at their own capture time.
+  Cloud::Ptr scan(
+    const PoseFunction & sensor_pose, const double start_time /*[sec]*/,
+    const double scan_period /*[sec]*/, std::mt19937 & rng) const
+  {
+    std::normal_distribution<double> range_noise(0.0, beam_model_.range_noise);
+    Cloud::Ptr cloud(new Cloud);
+    if (beam_model_.organized) {
+      pcl::PointXYZI nan_point;
+      nan_point.x = nan_point.y = nan_point.z = std::numeric_limits<float>::quiet_NaN();
+      nan_point.intensity = 0.0f;
+      cloud->points.assign(
+        static_cast<size_t>(beam_model_.channels) * beam_model_.columns, nan_point);
+      cloud->width = beam_model_.columns;
+      cloud->height = beam_model_.channels;
+      cloud->is_dense = false;
+    } else {
+      cloud->reserve(static_cast<size_t>(beam_model_.channels) * beam_model_.columns);
+    }
+    for (int c = 0; c < beam_model_.columns; ++c) {
+      const double time = start_time + scan_period * c / beam_model_.columns;
+      const Eigen::Isometry3d pose = sensor_pose(time);
+      const double azimuth = -2.0 * M_PI * c / beam_model_.columns;
+      for (int r = 0; r < beam_model_.channels; ++r) {
+        const double elevation = beam_model_.channels == 1 ? 0.0 :
+          beam_model_.min_elevation +
+          (beam_model_.max_elevation - beam_model_.min_elevation) * r / (beam_model_.channels - 1);
+        const Eigen::Vector3d direction(
+          std::cos(elevation) * std::cos(azimuth), std::cos(elevation) * std::sin(azimuth),
+          std::sin(elevation));
+        float intensity = 0.0f;
+        const double range = castRay(pose.translation(), pose.linear() * direction, intensity);
+        if (range < 0.0) {continue;}
+        const Eigen::Vector3d p = (range + range_noise(rng)) * direction;
+        pcl::PointXYZI point;
+        point.x = static_cast<float>(p.x());
+        point.y = static_cast<float>(p.y());
+        point.z = static_cast<float>(p.z());
+        point.intensity = intensity;
+        if (beam_model_.organized) {
+          cloud->points[static_cast<size_t>(r) * beam_model_.columns + c] = point;
+        } else {
+          cloud->push_back(point);
+        }
+      }
+    }
+    return cloud;
+  }
+
+private:
+  struct Voxel
+  {
+    Eigen::Vector3d mean{Eigen::Vector3d::Zero()};
+    float intensity{0.0f};
+    int count{0};
+  };
+
+  static constexpr int kCoarseFactor = 8;
+
+  static uint64_t getKey(const int64_t ix, const int64_t iy, const int64_t iz)
+  {
+    // 21 bits per axis
+    return ((static_cast<uint64_t>(ix) & 0x1fffffULL) << 42) |
+           ((static_cast<uint64_t>(iy) & 0x1fffffULL) << 21) |
+           (static_cast<uint64_t>(iz) & 0x1fffffULL);
+  }
+
+  static uint64_t getKey(const Eigen::Vector3d & v, const double size)
+  {
+    return getKey(
+      static_cast<int64_t>(std::floor(v.x() / size)), static_cast<int64_t>(std::floor(v.y() / size)),
+      static_cast<int64_t>(std::floor(v.z() / size)));
+  }
+
+  // Amanatides & Woo traversal of the cells of the given size crossed by the ray between
+  // t_start and t_end. visit(key, t_enter, t_exit) returns true to stop; so does traverse.
+  template<typename Visit>
+  static bool traverse(
+    const Eigen::Vector3d & origin, const Eigen::Vector3d & direction, const double t_start,
+    const double t_end, const double size, Visit visit)
+  {
+    const Eigen::Vector3d start = origin + t_start * direction;
+    int64_t index[3];
+    int64_t step[3];
+    double t_max[3];
+    double t_delta[3];
+    for (int a = 0; a < 3; ++a) {
+      index[a] = static_cast<int64_t>(std::floor(start[a] / size));
+      if (direction[a] > 0.0) {
+        step[a] = 1;
+        t_max[a] = t_start + ((index[a] + 1) * size - start[a]) / direction[a];
+        t_delta[a] = size / direction[a];
+      } else if (direction[a] < 0.0) {
+        step[a] = -1;
+        t_max[a] = t_start + (index[a] * size - start[a]) / direction[a];
+        t_delta[a] = -size / direction[a];
+      } else {
+        step[a] = 0;
+        t_max[a] = std::numeric_limits<double>::infinity();
+        t_delta[a] = std::numeric_limits<double>::infinity();
+      }
+    }
+
+    double t = t_start;
+    while (t < t_end) {
+      const int a = t_max[0] < t_max[1] ? (t_max[0] < t_max[2] ? 0 : 2) :
+        (t_max[1] < t_max[2] ? 1 : 2);
+      const double t_exit = std::min(t_max[a], t_end);
+      if (visit(getKey(index[0], index[1], index[2]), t, t_exit)) {return true;}
+      t = t_max[a];
+      t_max[a] += t_delta[a];
+      index[a] += step[a];
+    }
+    return false;
+  }
+
+  BeamModel beam_model_;
+  double voxel_size_{0.1};
+  std::unordered_map<uint64_t, Voxel> voxels_;
+  std::unordered_set<uint64_t> coarse_voxels_;
+};
+
+#endif  // SYNTHETIC_LIDAR_HPP_
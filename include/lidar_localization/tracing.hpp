@@ -0,0 +1,313 @@
+#ifndef TRACING_HPP_
+#define TRACING_HPP_
+
+// Scoped trace zones written as Chrome trace events, which chrome://tracing and
+// ui.perfetto.dev open directly. TRACE_ZONE("name") times the rest of the enclosing scope.
+// The zones compile to nothing unless LIDAR_LOCALIZATION_TRACING is defined
+// (cmake -DENABLE_TRACING=ON).
+
+#ifdef LIDAR_LOCALIZATION_TRACING
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// The events are buffered per thread and handed to a writer thread, so a slow reader or disk
+// never blocks the zones being timed. When the writer falls behind, whole batches are dropped.
+// The sessions of a process share the recorder: each open is matched by a close, and the trace
+// is closed by the last one.
+class TraceRecorder
+{
+public:
+  static TraceRecorder & instance()
+  {
+    static TraceRecorder recorder;
+    return recorder;
+  }
+
+  // output is a file path, or "unix:<path>" to stream to a listening local socket. Fails when
+  // the trace is open to another output.
+  bool open(const std::string & output)
+  {
+    std::lock_guard<std::mutex> sessions_lock(sessions_mutex_);
+    if (sessions_ > 0) {
+      if (output != output_) {return false;}
+      ++sessions_;
+      return true;
+    }
+    const std::string prefix = "unix:";
+    int fd = -1;
+    const bool socket_sink = output.compare(0, prefix.size(), prefix) == 0;
+    if (socket_sink) {
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      sockaddr_un address;
+      std::memset(&address, 0, sizeof(address));
+      address.sun_family = AF_UNIX;
+      std::strncpy(address.sun_path, output.c_str() + prefix.size(), sizeof(address.sun_path) - 1);
+      if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        ::close(fd);
+        fd = -1;
+      }
+    } else {
+      fd = ::open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {return false;}
+    sink_fd_ = fd;
+    socket_sink_ = socket_sink;
+    sink_failed_.store(false);
+    dropped_events_ = 0;
+    // array format: a reader accepts the file even if the closing bracket never gets written
+    writeAll("[\n", 2);
+    first_event_ = true;
+    writer_running_ = true;
+    writer_ = std::thread(&TraceRecorder::writerLoop, this);
+    output_ = output;
+    sessions_ = 1;
+    enabled_.store(true, std::memory_order_release);
+    return true;
+  }
+
+  void close()
+  {
+    std::lock_guard<std::mutex> sessions_lock(sessions_mutex_);
+    if (sessions_ == 0 || --sessions_ > 0) {return;}
+    stop();
+  }
+
+  // false once the reader of the socket went away
+  bool isEnabled() const
+  {
+    return enabled_.load(std::memory_order_relaxed) &&
+           !sink_failed_.load(std::memory_order_relaxed);
+  }
+
+  static int64_t now()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void record(const char * name, const int64_t begin_ns, const int64_t end_ns)
+  {
+    ThreadBuffer & buffer = threadBuffer();
+    std::unique_lock<std::mutex> lock(buffer.mutex);
+    buffer.events.push_back(Event{name, begin_ns, end_ns});
+    if (buffer.events.size() >= kFlushSize) {
+      lock.unlock();
+      submit(buffer);
+    }
+  }
+
+  ~TraceRecorder()
+  {
+    stop();
+  }
+
+private:
+  struct Event
+  {
+    const char * name;
+    int64_t begin_ns;
+    int64_t end_ns;
+  };
+
+  // Events are buffered per thread, so a zone only takes an uncontended lock.
+  struct ThreadBuffer
+  {
+    std::mutex mutex;
+    std::vector<Event> events;
+    uint32_t tid;
+
+    ~ThreadBuffer()
+    {
+      TraceRecorder & recorder = TraceRecorder::instance();
+      recorder.submit(*this);
+      std::lock_guard<std::mutex> lock(recorder.buffers_mutex_);
+      recorder.buffers_.erase(this);
+    }
+  };
+
+  struct Batch
+  {
+    uint32_t tid;
+    std::vector<Event> events;
+  };
+
+  static constexpr size_t kFlushSize = 1024;
+  static constexpr size_t kMaxPendingBatches = 64;
+
+  TraceRecorder() {}
+
+  void stop()
+  {
+    if (!enabled_.exchange(false)) {return;}
+    {
+      std::lock_guard<std::mutex> lock(buffers_mutex_);
+      for (ThreadBuffer * buffer : buffers_) {
+        submit(*buffer);
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      writer_running_ = false;
+      queue_cv_.notify_one();
+    }
+    writer_.join();
+    writeAll("\n]\n", 3);
+    ::close(sink_fd_);
+    sink_fd_ = -1;
+    if (dropped_events_ > 0) {
+      std::fprintf(
+        stderr, "trace: %lu events dropped, the output was too slow\n",
+        static_cast<unsigned long>(dropped_events_));
+    }
+  }
+
+  ThreadBuffer & threadBuffer()
+  {
+    thread_local ThreadBuffer buffer;
+    thread_local bool registered = false;
+    if (!registered) {
+      std::lock_guard<std::mutex> lock(buffers_mutex_);
+      buffer.tid = next_tid_++;
+      buffers_.insert(&buffer);
+      registered = true;
+    }
+    return buffer;
+  }
+
+  // Hands the events of the buffer to the writer, without waiting for any I/O.
+  void submit(ThreadBuffer & buffer)
+  {
+    Batch batch;
+    {
+      std::lock_guard<std::mutex> lock(buffer.mutex);
+      batch.events.swap(buffer.events);
+      batch.tid = buffer.tid;
+    }
+    if (batch.events.empty()) {return;}
+    std::lock_guard<std::mutex> lock(queue_mutex_);
+    if (!writer_running_ || queue_.size() >= kMaxPendingBatches) {
+      dropped_events_ += batch.events.size();
+      return;
+    }
+    queue_.push_back(std::move(batch));
+    queue_cv_.notify_one();
+  }
+
+  // Writes the batches until close, then the ones still queued.
+  void writerLoop()
+  {
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    while (true) {
+      queue_cv_.wait(lock, [this]() {return !writer_running_ || !queue_.empty();});
+      if (queue_.empty()) {break;}
+      Batch batch = std::move(queue_.front());
+      queue_.pop_front();
+      lock.unlock();
+      writeBatch(batch);
+      lock.lock();
+    }
+  }
+
+  void writeBatch(const Batch & batch)
+  {
+    const int pid = static_cast<int>(getpid());
+    std::string text;
+    char line[256];
+    for (const auto & e : batch.events) {
+      const int size = std::snprintf(
+        line, sizeof(line),
+        "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+        first_event_ ? "" : ",\n", e.name, e.begin_ns * 1e-3, (e.end_ns - e.begin_ns) * 1e-3,
+        pid, batch.tid);
+      text.append(line, std::min<size_t>(size, sizeof(line) - 1));
+      first_event_ = false;
+    }
+    writeAll(text.data(), text.size());
+  }
+
+  // A socket is written with MSG_NOSIGNAL, so a reader going away fails the write instead of
+  // raising SIGPIPE; tracing then stops.
+  void writeAll(const char * data, size_t size)
+  {
+    while (size > 0 && !sink_failed_.load()) {
+      const ssize_t written = socket_sink_ ?
+        send(sink_fd_, data, size, MSG_NOSIGNAL) : ::write(sink_fd_, data, size);
+      if (written < 0 && errno == EINTR) {continue;}
+      if (written <= 0) {
+        sink_failed_.store(true);
+        return;
+      }
+      data += written;
+      size -= written;
+    }
+  }
+
+  std::mutex sessions_mutex_;
+  int sessions_{0};
+  std::string output_;
+  std::atomic<bool> enabled_{false};
+  std::atomic<bool> sink_failed_{false};
+  int sink_fd_{-1};
+  bool socket_sink_{false};
+  // only touched by the writer thread while it runs
+  bool first_event_{true};
+  std::mutex buffers_mutex_;
+  std::unordered_set<ThreadBuffer *> buffers_;
+  uint32_t next_tid_{1};
+  std::mutex queue_mutex_;
+  std::condition_variable queue_cv_;
+  std::deque<Batch> queue_;
+  bool writer_running_{false};
+  size_t dropped_events_{0};
+  std::thread writer_;
+};
+
+class TraceZone
+{
+public:
+  explicit TraceZone(const char * name)
+  : name_(name), begin_ns_(TraceRecorder::instance().isEnabled() ? TraceRecorder::now() : 0) {}
+
+  ~TraceZone()
+  {
+    if (begin_ns_ != 0 && TraceRecorder::instance().isEnabled()) {
+      TraceRecorder::instance().record(name_, begin_ns_, TraceRecorder::now());
+    }
+  }
+
+private:
+  const char * name_;
+  int64_t begin_ns_;
+};
+
+#define TRACE_ZONE_CONCAT_(a, b) a ## b
+#define TRACE_ZONE_CONCAT(a, b) TRACE_ZONE_CONCAT_(a, b)
+// name must be a string literal
+#define TRACE_ZONE(name) TraceZone TRACE_ZONE_CONCAT(trace_zone_, __LINE__)(name)
+
+#else
+
+#define TRACE_ZONE(name) do {} while (0)
+
+#endif  // LIDAR_LOCALIZATION_TRACING
+
+#endif  // TRACING_HPP_
@@ -0,0 +1,83 @@
+#ifndef VOXEL_GRID_FILTER_HPP_
+#define VOXEL_GRID_FILTER_HPP_
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "lidar_localization/point_kernels.hpp"
+
+// Scan voxel grid filter averaging the points of each voxel, as pcl::VoxelGrid, with the voxel
+// keys of PointKernels. The grid is aligned to the origin instead of the cloud's bounding box,
+// and the voxels come out in the order of their first point. The buffers are kept from one scan
+// to the next.
+class VoxelGridFilter
+{
+public:
+  using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+
+  VoxelGridFilter() {}
+
+  void setLeafSize(const double leaf_size /*[m]*/)
+  {
+    leaf_size_ = leaf_size;
+  }
+
+  void filter(const Cloud & input, Cloud & output)
+  {
+    keys_.resize(input.size());
+    PointKernels::voxelKeys(input.points.data(), input.size(), 1.0 / leaf_size_, keys_.data());
+
+    indices_.clear();
+    voxels_.clear();
+    for (size_t i = 0; i < input.size(); ++i) {
+      const uint64_t key = keys_[i];
+      if (key == PointKernels::kInvalidKey) {continue;}
+      const auto inserted = indices_.emplace(key, voxels_.size());
+      if (inserted.second) {voxels_.emplace_back();}
+      const pcl::PointXYZI & p = input.points[i];
+      Voxel & voxel = voxels_[inserted.first->second];
+      voxel.x += p.x;
+      voxel.y += p.y;
+      voxel.z += p.z;
+      voxel.intensity += p.intensity;
+      ++voxel.count;
+    }
+
+    output.clear();
+    output.reserve(voxels_.size());
+    for (const Voxel & voxel : voxels_) {
+      pcl::PointXYZI p;
+      p.x = static_cast<float>(voxel.x / voxel.count);
+      p.y = static_cast<float>(voxel.y / voxel.count);
+      p.z = static_cast<float>(voxel.z / voxel.count);
+      p.intensity = static_cast<float>(voxel.intensity / voxel.count);
+      output.push_back(p);
+    }
+    output.header = input.header;
+    output.width = output.size();
+    output.height = 1;
+    output.is_dense = true;
+  }
+
+private:
+  struct Voxel
+  {
+    double x{0.0};
+    double y{0.0};
+    double z{0.0};
+    double intensity{0.0};
+    int count{0};
+  };
+
+  double leaf_size_{0.2};
+  std::vector<uint64_t> keys_;
+  // voxel key -> index in voxels_
+  std::unordered_map<uint64_t, size_t> indices_;
+  std::vector<Voxel> voxels_;
+};
+
+#endif  // VOXEL_GRID_FILTER_HPP_
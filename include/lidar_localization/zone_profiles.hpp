@@ -0,0 +1,144 @@
+#ifndef ZONE_PROFILES_HPP_
+#define ZONE_PROFILES_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct RegistrationProfile
+{
+  std::string name;
+  std::string registration_method;
+  double ndt_resolution;
+  double voxel_leaf_size;
+  int ndt_max_iterations;
+};
+
+// Map regions, as xy polygons in the map frame, each with its own registration profile.
+// One zone per line of the file, '#' starting a comment:
+//   <name> <registration_method> <ndt_resolution> <voxel_leaf_size> <ndt_max_iterations> x1 y1 x2 y2 ...
+// Where zones overlap, the first one in the file is entered.
+class ZoneProfiles
+{
+public:
+  ZoneProfiles() {}
+
+  bool load(const std::string & path)
+  {
+    zones_.clear();
+    std::ifstream ifs(path);
+    if (!ifs) {return false;}
+    std::string line;
+    while (std::getline(ifs, line)) {
+      line = line.substr(0, line.find('#'));
+      std::istringstream iss(line);
+      Zone zone;
+      if (!(iss >> zone.profile.name)) {continue;}
+      if (!(iss >> zone.profile.registration_method >> zone.profile.ndt_resolution >>
+        zone.profile.voxel_leaf_size >> zone.profile.ndt_max_iterations))
+      {
+        zones_.clear();
+        return false;
+      }
+      std::vector<double> coordinates;
+      double value;
+      while (iss >> value) {
+        coordinates.push_back(value);
+      }
+      if (!iss.eof() || coordinates.size() % 2 != 0 || coordinates.size() < 6) {
+        zones_.clear();
+        return false;
+      }
+      for (size_t i = 0; i < coordinates.size(); i += 2) {
+        zone.polygon.push_back(Point{coordinates[i], coordinates[i + 1]});
+      }
+      zones_.push_back(zone);
+    }
+    return true;
+  }
+
+  bool empty() const
+  {
+    return zones_.empty();
+  }
+
+  size_t size() const
+  {
+    return zones_.size();
+  }
+
+  const RegistrationProfile & getProfile(const size_t index) const
+  {
+    return zones_[index].profile;
+  }
+
+  // Zone of the position, -1 outside all zones. The current zone is kept until the position
+  // is further than margin outside it, so that a pose on a border does not switch back and forth.
+  int find(const double x, const double y, const int current, const double margin /*[m]*/) const
+  {
+    if (current >= 0 && current < static_cast<int>(zones_.size()) &&
+      outsideDistance(zones_[current].polygon, x, y) <= margin)
+    {
+      return current;
+    }
+    for (size_t i = 0; i < zones_.size(); ++i) {
+      if (contains(zones_[i].polygon, x, y)) {return static_cast<int>(i);}
+    }
+    return -1;
+  }
+
+private:
+  struct Point
+  {
+    double x;
+    double y;
+  };
+
+  struct Zone
+  {
+    RegistrationProfile profile;
+    std::vector<Point> polygon;
+  };
+
+  // even-odd rule
+  static bool contains(const std::vector<Point> & polygon, const double x, const double y)
+  {
+    bool inside = false;
+    for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+      const Point & a = polygon[i];
+      const Point & b = polygon[j];
+      if ((a.y > y) != (b.y > y) && x < (b.x - a.x) * (y - a.y) / (b.y - a.y) + a.x) {
+        inside = !inside;
+      }
+    }
+    return inside;
+  }
+
+  // 0 inside the polygon, the distance to its nearest edge outside
+  static double outsideDistance(const std::vector<Point> & polygon, const double x, const double y)
+  {
+    if (contains(polygon, x, y)) {return 0.0;}
+    double min_sq_distance = std::numeric_limits<double>::max();
+    for (size_t i = 0, j = polygon.size() - 1; i < polygon.size(); j = i++) {
+      const Point & a = polygon[j];
+      const Point & b = polygon[i];
+      const double dx = b.x - a.x;
+      const double dy = b.y - a.y;
+      const double length_sq = dx * dx + dy * dy;
+      const double t = length_sq > 0.0 ?
+        std::min(1.0, std::max(0.0, ((x - a.x) * dx + (y - a.y) * dy) / length_sq)) : 0.0;
+      const double ex = a.x + t * dx - x;
+      const double ey = a.y + t * dy - y;
+      min_sq_distance = std::min(min_sq_distance, ex * ex + ey * ey);
+    }
+    return std::sqrt(min_sq_distance);
+  }
+
+  std::vector<Zone> zones_;
+};
+
+#endif  // ZONE_PROFILES_HPP_
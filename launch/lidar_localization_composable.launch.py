@@ -0,0 +1,76 @@
+import os
+
+import launch
+import launch.actions
+import launch.event_handlers
+import launch.substitutions
+
+import launch_ros
+import launch_ros.actions
+from launch_ros.descriptions import ComposableNode
+
+from ament_index_python.packages import get_package_share_directory
+
+def generate_launch_description():
+
+    ld = launch.LaunchDescription()
+
+    lidar_tf = launch_ros.actions.Node(
+        name='lidar_tf',
+        package='tf2_ros',
+        executable='static_transform_publisher',
+        arguments=['0','0','0','0','0','0','1','base_link','velodyne']
+        )
+
+    localization_param_dir = launch.substitutions.LaunchConfiguration(
+        'localization_param_dir',
+        default=os.path.join(
+            get_package_share_directory('lidar_localization_ros2'),
+            'param',
+            'localization.yaml'))
+
+    # Load the LiDAR driver into the same container (e.g. via
+    # `ros2 component load /lidar_localization_container ...`) to get
+    # zero-copy intra-process delivery of /cloud.
+    container = launch_ros.actions.ComposableNodeContainer(
+        name='lidar_localization_container',
+        namespace='',
+        package='rclcpp_components',
+        executable='component_container',
+        composable_node_descriptions=[
+            ComposableNode(
+                name='lidar_localization',
+                namespace='',
+                package='lidar_localization_ros2',
+                plugin='PCLLocalization',
+                parameters=[localization_param_dir],
+                remappings=[('/cloud','/velodyne_points')],
+                extra_arguments=[{'use_intra_process_comms': True}]),
+        ],
+        output='screen')
+
+    # launch_ros lifecycle events only target standalone LifecycleNode actions,
+    # so the composed node is driven through the lifecycle CLI instead.
+    configure = launch.actions.ExecuteProcess(
+        cmd=['ros2', 'lifecycle', 'set', '/lidar_localization', 'configure'],
+        output='screen')
+
+    activate = launch.actions.ExecuteProcess(
+        cmd=['ros2', 'lifecycle', 'set', '/lidar_localization', 'activate'],
+        output='screen')
+
+    configure_after_load = launch.actions.TimerAction(
+        period=2.0,
+        actions=[configure])
+
+    activate_after_configure = launch.actions.RegisterEventHandler(
+        launch.event_handlers.OnProcessExit(
+            target_action=configure,
+            on_exit=[activate]))
+
+    ld.add_action(container)
+    ld.add_action(lidar_tf)
+    ld.add_action(configure_after_load)
+    ld.add_action(activate_after_configure)
+
+    return ld
@@ -0,0 +1,95 @@
+import os
+
+import launch
+import launch.actions
+import launch.event_handlers
+import launch.substitutions
+
+import launch_ros
+import launch_ros.actions
+from launch_ros.descriptions import ComposableNode
+
+from ament_index_python.packages import get_package_share_directory
+
+# One localization session per robot namespace in a single multi-threaded container. With
+# share_map, the map and the registration targets are loaded and built once for all of them.
+#   ros2 launch lidar_localization_ros2 lidar_localization_multi.launch.py robots:=robot1,robot2
+
+
+def launch_setup(context, *args, **kwargs):
+    robots = [
+        robot.strip()
+        for robot in launch.substitutions.LaunchConfiguration('robots').perform(context).split(',')
+        if robot.strip()]
+    localization_param_dir = launch.substitutions.LaunchConfiguration(
+        'localization_param_dir').perform(context)
+    num_threads = int(launch.substitutions.LaunchConfiguration('num_threads').perform(context))
+
+    sessions = []
+    for robot in robots:
+        sessions.append(ComposableNode(
+            name='lidar_localization',
+            namespace=robot,
+            package='lidar_localization_ros2',
+            plugin='PCLLocalization',
+            parameters=[
+                localization_param_dir,
+                {
+                    'share_map': True,
+                    'base_frame_id': robot + '/base_link',
+                    'odom_frame_id': robot + '/odom',
+                    # the container threads run the sessions side by side
+                    'ndt_num_threads': 1,
+                    'map_num_threads': 1,
+                }],
+            # the shared map is published once, by the session that loaded it
+            remappings=[('cloud', 'velodyne_points'), ('initial_map', '/initial_map')],
+            extra_arguments=[{'use_intra_process_comms': True}]))
+
+    container = launch_ros.actions.ComposableNodeContainer(
+        name='lidar_localization_container',
+        namespace='',
+        package='rclcpp_components',
+        executable='component_container_mt',
+        parameters=[{'thread_num': num_threads}] if num_threads > 0 else [],
+        composable_node_descriptions=sessions,
+        output='screen')
+
+    # launch_ros lifecycle events only target standalone LifecycleNode actions,
+    # so the composed nodes are driven through the lifecycle CLI instead.
+    actions = [container]
+    for robot in robots:
+        node_name = '/' + robot + '/lidar_localization'
+        configure = launch.actions.ExecuteProcess(
+            cmd=['ros2', 'lifecycle', 'set', node_name, 'configure'],
+            output='screen')
+        activate = launch.actions.ExecuteProcess(
+            cmd=['ros2', 'lifecycle', 'set', node_name, 'activate'],
+            output='screen')
+        actions.append(launch.actions.TimerAction(period=2.0, actions=[configure]))
+        actions.append(launch.actions.RegisterEventHandler(
+            launch.event_handlers.OnProcessExit(
+                target_action=configure,
+                on_exit=[activate])))
+    return actions
+
+
+def generate_launch_description():
+
+    ld = launch.LaunchDescription()
+
+    ld.add_action(launch.actions.DeclareLaunchArgument(
+        'robots', default_value='robot1,robot2',
+        description='comma-separated namespaces of the robots'))
+    ld.add_action(launch.actions.DeclareLaunchArgument(
+        'localization_param_dir',
+        default_value=os.path.join(
+            get_package_share_directory('lidar_localization_ros2'),
+            'param',
+            'localization.yaml')))
+    ld.add_action(launch.actions.DeclareLaunchArgument(
+        'num_threads', default_value='0',
+        description='threads of the container shared by the sessions(0: one per core)'))
+    ld.add_action(launch.actions.OpaqueFunction(function=launch_setup))
+
+    return ld
@@ -0,0 +1,237 @@
+#!/usr/bin/env python3
+"""Replays a recorded input log under a grid of parameters and scores each run against a
+ground-truth trajectory (ATE/RPE) and its cost (latency and cpu time per scan).
+
+The runs are spread over parallel processes. A csv with one row per run is written and the
+Pareto front of accuracy vs. cpu time is printed for each registration_method.
+
+example:
+  evaluate_localization.py inputs.log ground_truth.txt \\
+    --params param/localization.yaml \\
+    --grid registration_method=NDT_OMP,NDT_LAZY --grid ndt_resolution=1.0,2.0 \\
+    --grid voxel_leaf_size=0.2,0.5 --jobs 4 --output results.csv
+
+Trajectories are in the TUM format (stamp x y z qx qy qz qw) and both in the map frame, so
+the estimate is compared to the ground truth without any alignment.
+"""
+
+import argparse
+import bisect
+import csv
+import itertools
+import math
+import os
+import subprocess
+import sys
+import tempfile
+from concurrent.futures import ThreadPoolExecutor
+
+
+def read_tum(path):
+    poses = []
+    with open(path) as f:
+        for line in f:
+            values = line.split()
+            if len(values) != 8 or line.startswith('#'):
+                continue
+            values = [float(v) for v in values]
+            poses.append((values[0], pose_matrix(values[1:4], values[4:8])))
+    poses.sort(key=lambda p: p[0])
+    return poses
+
+
+def pose_matrix(t, q):
+    x, y, z, w = q
+    n = math.sqrt(x * x + y * y + z * z + w * w)
+    x, y, z, w = x / n, y / n, z / n, w / n
+    return [
+        [1 - 2 * (y * y + z * z), 2 * (x * y - z * w), 2 * (x * z + y * w), t[0]],
+        [2 * (x * y + z * w), 1 - 2 * (x * x + z * z), 2 * (y * z - x * w), t[1]],
+        [2 * (x * z - y * w), 2 * (y * z + x * w), 1 - 2 * (x * x + y * y), t[2]],
+        [0.0, 0.0, 0.0, 1.0]]
+
+
+def multiply(a, b):
+    return [[sum(a[i][k] * b[k][j] for k in range(4)) for j in range(4)] for i in range(4)]
+
+
+def inverse(m):
+    r = [[m[j][i] for j in range(3)] for i in range(3)]
+    t = [-sum(r[i][k] * m[k][3] for k in range(3)) for i in range(3)]
+    return [r[0] + [t[0]], r[1] + [t[1]], r[2] + [t[2]], [0.0, 0.0, 0.0, 1.0]]
+
+
+def translation_norm(m):
+    return math.sqrt(m[0][3] ** 2 + m[1][3] ** 2 + m[2][3] ** 2)
+
+
+def rotation_angle(m):
+    cos_angle = 0.5 * (m[0][0] + m[1][1] + m[2][2] - 1.0)
+    return math.acos(max(-1.0, min(1.0, cos_angle)))
+
+
+def associate(estimate, ground_truth, max_dt):
+    """Pairs each estimated pose with the ground-truth pose nearest in time."""
+    stamps = [p[0] for p in ground_truth]
+    pairs = []
+    for stamp, pose in estimate:
+        i = bisect.bisect_left(stamps, stamp)
+        candidates = [j for j in (i - 1, i) if 0 <= j < len(stamps)]
+        if not candidates:
+            continue
+        j = min(candidates, key=lambda k: abs(stamps[k] - stamp))
+        if abs(stamps[j] - stamp) <= max_dt:
+            pairs.append((pose, ground_truth[j][1]))
+    return pairs
+
+
+def absolute_trajectory_error(pairs):
+    """rmse of the position error [m]."""
+    squared_errors = [sum((est[i][3] - gt[i][3]) ** 2 for i in range(3)) for est, gt in pairs]
+    return math.sqrt(sum(squared_errors) / len(squared_errors))
+
+
+def relative_pose_error(pairs, delta):
+    """rmse of the translation [m] and mean rotation [deg] of the motion over delta scans."""
+    translations = []
+    rotations = []
+    for i in range(len(pairs) - delta):
+        est_i, gt_i = pairs[i]
+        est_j, gt_j = pairs[i + delta]
+        error = multiply(inverse(multiply(inverse(gt_i), gt_j)), multiply(inverse(est_i), est_j))
+        translations.append(translation_norm(error))
+        rotations.append(math.degrees(rotation_angle(error)))
+    if not translations:
+        return float('nan'), float('nan')
+    return (math.sqrt(sum(t * t for t in translations) / len(translations)),
+            sum(rotations) / len(rotations))
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))]
+
+
+def run(config, args, work_dir, index):
+    pose_path = os.path.join(work_dir, 'poses_%d.txt' % index)
+    stats_path = os.path.join(work_dir, 'stats_%d.txt' % index)
+    command = [args.replay, args.log, pose_path, stats_path, '--ros-args']
+    if args.params:
+        command += ['--params-file', args.params]
+    for name, value in config.items():
+        command += ['-p', '%s:=%s' % (name, value)]
+
+    with open(os.path.join(work_dir, 'log_%d.txt' % index), 'w') as log:
+        process = subprocess.Popen(command, stdout=log, stderr=subprocess.STDOUT)
+        # wait4 gives the cpu time of this run alone, the runs being concurrent
+        _, status, usage = os.wait4(process.pid, 0)
+        returncode = os.waitstatus_to_exitcode(status)
+        process.returncode = returncode
+
+    result = dict(config)
+    result['status'] = 'ok' if returncode == 0 else 'failed'
+    if returncode != 0 or not os.path.exists(pose_path):
+        return result
+
+    estimate = read_tum(pose_path)
+    pairs = associate(estimate, args.ground_truth_poses, args.max_dt)
+    latencies = []
+    cpu_times = []
+    with open(stats_path) as f:
+        for line in f:
+            _, latency, cpu_time = (float(v) for v in line.split())
+            latencies.append(latency)
+            cpu_times.append(cpu_time)
+
+    num_scans = len(latencies)
+    result['scans'] = num_scans
+    result['localized'] = len(estimate)
+    if pairs:
+        result['ate_rmse'] = absolute_trajectory_error(pairs)
+        result['rpe_trans_rmse'], result['rpe_rot_mean_deg'] = relative_pose_error(
+            pairs, args.rpe_delta)
+    if num_scans:
+        result['latency_mean_ms'] = 1e3 * sum(latencies) / num_scans
+        result['latency_p95_ms'] = 1e3 * percentile(latencies, 95)
+        result['cpu_per_scan_ms'] = 1e3 * sum(cpu_times) / num_scans
+        result['process_cpu_s'] = usage.ru_utime + usage.ru_stime
+    return result
+
+
+def pareto_front(results):
+    """Runs not beaten on both ate_rmse and cpu_per_scan_ms by another run."""
+    scored = [r for r in results if 'ate_rmse' in r and 'cpu_per_scan_ms' in r]
+    front = []
+    for r in scored:
+        dominated = any(
+            o['ate_rmse'] <= r['ate_rmse'] and o['cpu_per_scan_ms'] <= r['cpu_per_scan_ms'] and
+            (o['ate_rmse'] < r['ate_rmse'] or o['cpu_per_scan_ms'] < r['cpu_per_scan_ms'])
+            for o in scored)
+        if not dominated:
+            front.append(r)
+    return sorted(front, key=lambda r: r['cpu_per_scan_ms'])
+
+
+def parse_grid(grid_args):
+    names = []
+    values = []
+    for item in grid_args:
+        name, _, value_list = item.partition('=')
+        names.append(name)
+        values.append(value_list.split(','))
+    return [dict(zip(names, combination)) for combination in itertools.product(*values)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('log', help='input log recorded with record_path')
+    parser.add_argument('ground_truth', help='ground-truth trajectory in the TUM format')
+    parser.add_argument('--params', help='parameter file the grid values override')
+    parser.add_argument('--grid', action='append', default=[],
+                        help='name=value1,value2,... (repeat for each parameter)')
+    parser.add_argument('--jobs', type=int, default=os.cpu_count(),
+                        help='runs executed in parallel')
+    parser.add_argument('--output', default='evaluation.csv')
+    parser.add_argument('--replay', default='lidar_localization_replay',
+                        help='path of the replay executable')
+    parser.add_argument('--max-dt', type=float, default=0.02,
+                        help='max stamp difference to associate a pose with the ground truth[s]')
+    parser.add_argument('--rpe-delta', type=int, default=10,
+                        help='scans between the poses compared by the RPE')
+    args = parser.parse_args()
+    if os.path.sep not in args.replay:
+        prefix = subprocess.run(['ros2', 'pkg', 'prefix', 'lidar_localization_ros2'],
+                                capture_output=True, text=True).stdout.strip()
+        if prefix:
+            args.replay = os.path.join(prefix, 'lib', 'lidar_localization_ros2', args.replay)
+    args.ground_truth_poses = read_tum(args.ground_truth)
+
+    configs = parse_grid(args.grid)
+    with tempfile.TemporaryDirectory() as work_dir:
+        with ThreadPoolExecutor(max_workers=max(1, args.jobs)) as executor:
+            results = list(executor.map(
+                lambda item: run(item[1], args, work_dir, item[0]), enumerate(configs)))
+
+    columns = []
+    for r in results:
+        columns += [k for k in r if k not in columns]
+    with open(args.output, 'w', newline='') as f:
+        writer = csv.DictWriter(f, fieldnames=columns)
+        writer.writeheader()
+        writer.writerows(results)
+    print('%d runs written to %s' % (len(results), args.output))
+
+    methods = sorted(set(r.get('registration_method', '') for r in results))
+    for method in methods:
+        front = pareto_front([r for r in results if r.get('registration_method', '') == method])
+        print('\nPareto front %s(ate_rmse [m] vs cpu per scan [ms]):' %
+              (method + ' ' if method else ''))
+        for r in front:
+            grid_values = ', '.join('%s=%s' % (k, r[k]) for k in configs[0])
+            print('  %8.4f %10.2f   %s' % (r['ate_rmse'], r['cpu_per_scan_ms'], grid_values))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,143 @@
+#include <lidar_localization/lidar_localization_component.hpp>
+
+#include <fstream>
+#include <iomanip>
+#include <limits>
+
+// Localizes all the scans of an input log recorded with `record_path` at once, on all the
+// cores, seeded from the odometry of the log, then writes the poses.
+int main(int argc, char * argv[])
+{
+  const std::vector<std::string> args = rclcpp::init_and_remove_ros_arguments(argc, argv);
+  if (args.size() < 3) {
+    std::cerr << "usage: lidar_localization_batch <input_log> <pose_output> [num_threads]"
+              << " [smoothing_window] --ros-args --params-file localization.yaml" << std::endl;
+    return 1;
+  }
+  const int num_threads = args.size() > 3 ? std::stoi(args[3]) : 0;
+  const int smoothing_window = args.size() > 4 ? std::stoi(args[4]) : 10;
+
+  std::vector<InputLog::Entry> entries;
+  if (!InputLog::read(args[1], entries)) {
+    std::cerr << "failed to read " << args[1] << std::endl;
+    return 1;
+  }
+
+  rclcpp::NodeOptions options;
+  std::shared_ptr<PCLLocalization> pcl_l = std::make_shared<PCLLocalization>(options);
+  pcl_l->replay_mode_ = true;
+  pcl_l->set_parameter(rclcpp::Parameter("record_path", ""));
+  if (pcl_l->configure().id() != lifecycle_msgs::msg::State::PRIMARY_STATE_INACTIVE ||
+    pcl_l->activate().id() != lifecycle_msgs::msg::State::PRIMARY_STATE_ACTIVE)
+  {
+    std::cerr << "failed to activate the node" << std::endl;
+    return 1;
+  }
+  // the other methods can't share a built target between the threads
+  if (!PCLLocalization::sharesTarget(pcl_l->registration_method_)) {
+    std::cerr << "the batch localization needs registration_method NDT_LAZY or LOAM" << std::endl;
+    return 1;
+  }
+
+  // The log is read in stamp order as in the replay, for the transforms of the scans to
+  // base_frame_id, the odometry and the first initial pose. The scans are localized against
+  // the map the node holds at the end.
+  PCLLocalization::BatchScans scans;
+  std::vector<int64_t> scan_stamps;
+  OdometryBuffer odom;
+  bool has_initial_pose = pcl_l->initialpose_recieved_;
+  Eigen::Affine3d initial_pose = Eigen::Affine3d::Identity();
+  if (has_initial_pose) {
+    tf2::fromMsg(pcl_l->corrent_pose_with_cov_stamped_ptr_->pose.pose, initial_pose);
+  }
+  for (const auto & entry : entries) {
+    switch (entry.type) {
+      case InputLog::CLOUD: {
+          auto msg = InputLog::deserialize<sensor_msgs::msg::PointCloud2>(entry);
+          PCLLocalization::BatchScan scan;
+          scan.msg = msg;
+          scan.base_to_sensor = Eigen::Matrix4f::Identity();
+          if (msg->header.frame_id != pcl_l->base_frame_id_) {
+            try {
+              scan.base_to_sensor = tf2::transformToEigen(
+                pcl_l->tfbuffer_.lookupTransform(
+                  pcl_l->base_frame_id_, msg->header.frame_id, msg->header.stamp).transform)
+                .matrix().cast<float>();
+            } catch (const tf2::TransformException & ex) {
+              std::cerr << "skipped a scan: " << ex.what() << std::endl;
+              break;
+            }
+          }
+          scans.push_back(scan);
+          scan_stamps.push_back(entry.stamp_ns);
+          break;
+        }
+      case InputLog::ODOM: {
+          auto msg = InputLog::deserialize<nav_msgs::msg::Odometry>(entry);
+          Eigen::Affine3d pose;
+          tf2::fromMsg(msg->pose.pose, pose);
+          odom.add(entry.stamp_ns * 1e-9, pose.matrix());
+          break;
+        }
+      case InputLog::INITIAL_POSE:
+        if (!has_initial_pose) {
+          auto msg = InputLog::deserialize<geometry_msgs::msg::PoseWithCovarianceStamped>(entry);
+          tf2::fromMsg(msg->pose.pose, initial_pose);
+          has_initial_pose = true;
+        }
+        break;
+      case InputLog::MAP:
+        pcl_l->mapReceived(InputLog::deserialize<sensor_msgs::msg::PointCloud2>(entry));
+        break;
+      case InputLog::TF:
+      case InputLog::TF_STATIC: {
+          auto msg = InputLog::deserialize<tf2_msgs::msg::TFMessage>(entry);
+          for (const auto & transform : msg->transforms) {
+            pcl_l->tfbuffer_.setTransform(transform, "batch", entry.type == InputLog::TF_STATIC);
+          }
+          break;
+        }
+      default:
+        break;
+    }
+  }
+  if (!has_initial_pose || !pcl_l->map_recieved_) {
+    std::cerr << "the log or the parameters need an initial pose and a map" << std::endl;
+    return 1;
+  }
+  if (odom.empty()) {
+    std::cerr << "no odometry in the log, the scans are seeded from the initial pose" <<
+      std::endl;
+  }
+  for (size_t i = 0; i < scans.size(); ++i) {
+    scans[i].odom_pose = Eigen::Matrix4d::Identity();
+    odom.interpolate(
+      scan_stamps[i] * 1e-9, std::numeric_limits<double>::infinity(), scans[i].odom_pose);
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  const auto results =
+    pcl_l->localizeBatch(scans, initial_pose.matrix(), num_threads, smoothing_window);
+  const double elapsed =
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // poses in the TUM format: stamp x y z qx qy qz qw
+  std::ofstream pose_ofs(args[2]);
+  pose_ofs << std::fixed << std::setprecision(9);
+  size_t num_converged = 0;
+  for (size_t i = 0; i < results.size(); ++i) {
+    const Eigen::Quaterniond quat(results[i].pose.block<3, 3>(0, 0));
+    pose_ofs << scan_stamps[i] * 1e-9 << " " << results[i].pose(0, 3) << " " <<
+      results[i].pose(1, 3) << " " << results[i].pose(2, 3) << " " << quat.x() << " " <<
+      quat.y() << " " << quat.z() << " " << quat.w() << std::endl;
+    num_converged += results[i].converged;
+  }
+  std::cout << scans.size() << " scans in " << elapsed << " s (" << scans.size() / elapsed <<
+    " scans/s), " << num_converged << " matched the map" << std::endl;
+
+  pcl_l->deactivate();
+  pcl_l->cleanup();
+  rclcpp::shutdown();
+
+  return 0;
+}
@@ -3,7 +3,6 @@ PCLLocalization::PCLLocalization(const rclcpp::NodeOptions & options)
 : rclcpp_lifecycle::LifecycleNode("lidar_localization", options),
   clock_(RCL_ROS_TIME),
   tfbuffer_(std::make_shared<rclcpp::Clock>(clock_)),
-  tflistener_(tfbuffer_),
   broadcaster_(this)
 {
   declare_parameter("global_frame_id", "map");
@@ -16,13 +15,27 @@ PCLLocalization::PCLLocalization(const rclcpp::NodeOptions & options)
   declare_parameter("ndt_step_size", 0.1);
   declare_parameter("ndt_max_iterations", 35);
   declare_parameter("ndt_num_threads", 4);
+  declare_parameter("ndt_finalize_on_load", false);
   declare_parameter("transform_epsilon", 0.01);
   declare_parameter("voxel_leaf_size", 0.2);
+  declare_parameter("scan_downsample_method", "VOXEL");
+  declare_parameter("adaptive_reference_range", 20.0);
+  declare_parameter("adaptive_max_leaf_size", 1.6);
+  declare_parameter("adaptive_points_per_cell", 0);
+  declare_parameter("organized_column_stride", 2);
+  declare_parameter("organized_ground_column_stride", 8);
+  declare_parameter("loam_edge_threshold", 0.1);
+  declare_parameter("loam_planar_threshold", 0.1);
+  declare_parameter("loam_planar_leaf_size", 0.4);
   declare_parameter("scan_max_range", 100.0);
   declare_parameter("scan_min_range", 1.0);
   declare_parameter("scan_period", 0.1);
   declare_parameter("use_pcd_map", false);
   declare_parameter("map_path", "/map/map.pcd");
+  declare_parameter("map_num_threads", 0);
+  declare_parameter("map_stream_radius", 150.0);
+  declare_parameter("share_map", false);
+  declare_parameter("shared_target_name", "");
   declare_parameter("set_initial_pose", false);
   declare_parameter("initial_pose_x", 0.0);
   declare_parameter("initial_pose_y", 0.0);
@@ -34,6 +47,44 @@ PCLLocalization::PCLLocalization(const rclcpp::NodeOptions & options)
   declare_parameter("use_odom", false);
   declare_parameter("use_imu", false);
   declare_parameter("enable_debug", false);
+  declare_parameter("enable_map_delta", false);
+  declare_parameter("map_tile_size", 20.0);
+  declare_parameter("enable_lifelong_map", false);
+  declare_parameter("lifelong_score_threshold", 0.5);
+  declare_parameter("lifelong_decay", 0.99);
+  declare_parameter("lifelong_max_weight", 10.0);
+  declare_parameter("lifelong_max_ray_length", 50.0);
+  declare_parameter("lifelong_checkpoint_interval", 600.0);
+  declare_parameter("lifelong_map_path", "");
+  declare_parameter("enable_keyframe_odometry", false);
+  declare_parameter("keyframe_distance", 1.0);
+  declare_parameter("keyframe_angle", 0.2);
+  declare_parameter("keyframe_window_size", 20);
+  declare_parameter("keyframe_reanchor_interval", 10);
+  declare_parameter("enable_pose_smoothing", false);
+  declare_parameter("smoothing_window_size", 20);
+  declare_parameter("smoothing_registration_sigma", 0.1);
+  declare_parameter("smoothing_odom_sigma", 0.02);
+  declare_parameter("enable_motion_gate", false);
+  declare_parameter("motion_gate_linear_velocity", 0.02);
+  declare_parameter("motion_gate_angular_velocity", 0.02);
+  declare_parameter("motion_gate_settle_time", 1.0);
+  declare_parameter("motion_gate_idle_interval", 5.0);
+  declare_parameter("record_path", "");
+  declare_parameter("trace_output", "");
+  declare_parameter("target_cache_size", 2);
+  declare_parameter("zone_profiles_path", "");
+  declare_parameter("zone_switch_margin", 1.0);
+
+  parameter_callback_handle_ = add_on_set_parameters_callback(
+    std::bind(&PCLLocalization::parametersChanged, this, std::placeholders::_1));
+}
+
+PCLLocalization::~PCLLocalization()
+{
+  stopLifelongMap();
+  stopPoseSmoothing();
+  stopMapStream();
 }
 
 using CallbackReturn = rclcpp_lifecycle::node_interfaces::LifecycleNodeInterface::CallbackReturn;
@@ -41,6 +92,7 @@ using CallbackReturn = rclcpp_lifecycle::node_interfaces::LifecycleNodeInterface
 CallbackReturn PCLLocalization::on_configure(const rclcpp_lifecycle::State &)
 {
   RCLCPP_INFO(get_logger(), "Configuring");
+  RCLCPP_INFO(get_logger(), "point kernels: %s", PointKernels::isa());
 
   initializeParameters();
   initializePubSub();
@@ -48,6 +100,8 @@ CallbackReturn PCLLocalization::on_configure(const rclcpp_lifecycle::State &)
 
   path_ptr_ = std::make_shared<nav_msgs::msg::Path>();
   path_ptr_->header.frame_id = global_frame_id_;
+  smoothed_path_ptr_ = std::make_shared<nav_msgs::msg::Path>();
+  smoothed_path_ptr_->header.frame_id = global_frame_id_;
 
   RCLCPP_INFO(get_logger(), "Configuring end");
   return CallbackReturn::SUCCESS;
@@ -59,8 +113,16 @@ CallbackReturn PCLLocalization::on_activate(const rclcpp_lifecycle::State &)
 
   pose_pub_->on_activate();
   path_pub_->on_activate();
+  smoothed_path_pub_->on_activate();
   initial_map_pub_->on_activate();
 
+  if (enable_lifelong_map_) {
+    startLifelongMap();
+  }
+  if (enable_pose_smoothing_) {
+    startPoseSmoothing();
+  }
+
   if (set_initial_pose_) {
     auto msg = std::make_shared<geometry_msgs::msg::PoseWithCovarianceStamped>();
 
@@ -83,47 +145,106 @@ CallbackReturn PCLLocalization::on_activate(const rclcpp_lifecycle::State &)
     initialPoseReceived(msg);
   }
 
-  if (use_pcd_map_) {
-    pcl::PointCloud<pcl::PointXYZI>::Ptr map_cloud_ptr(new pcl::PointCloud<pcl::PointXYZI>);
+  bool shared_target_attached = false;
+  if (use_pcd_map_ && useSharedTarget()) {
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    shared_target_attached = attachSharedTarget();
+  }
+
+  if (use_pcd_map_ && map_path_.rfind(".lmt") != std::string::npos) {
+    if (!activateStreamedMap()) {
+      return CallbackReturn::FAILURE;
+    }
+  } else if (shared_target_attached) {
+    // the map file itself is not loaded
+    uint64_t generation;
+    {
+      std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+      generation = ++target_generation_;
+    }
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    cacheTarget(getTargetKey(), generation, registration_);
+    map_recieved_ = true;
+  } else if (use_pcd_map_) {
     // load a pcd or ply file
-    if (map_path_.rfind(".pcd") != std::string::npos) {
-      RCLCPP_INFO(get_logger(), "Loading pcd map from: %s", map_path_.c_str());
-      if (pcl::io::loadPCDFile(map_path_, *map_cloud_ptr) == -1) {
-        RCLCPP_ERROR(get_logger(), "Failed to load pcd file: %s", map_path_.c_str());
-        return CallbackReturn::FAILURE;
-      }
-    } else if (map_path_.rfind(".ply") != std::string::npos) {
-      RCLCPP_INFO(get_logger(), "Loading ply map from: %s", map_path_.c_str());
-      if (pcl::io::loadPLYFile(map_path_, *map_cloud_ptr) == -1) {
-        RCLCPP_ERROR(get_logger(), "Failed to load ply file: %s", map_path_.c_str());
-        return CallbackReturn::FAILURE;
-      }
+    auto load = [this](pcl::PointCloud<pcl::PointXYZI> & map_cloud) {
+        if (map_path_.rfind(".pcd") != std::string::npos) {
+          RCLCPP_INFO(get_logger(), "Loading pcd map from: %s", map_path_.c_str());
+          if (map_loader_.loadPCDFile(map_path_, map_cloud) == -1) {
+            RCLCPP_ERROR(get_logger(), "Failed to load pcd file: %s", map_path_.c_str());
+            return false;
+          }
+        } else if (map_path_.rfind(".ply") != std::string::npos) {
+          RCLCPP_INFO(get_logger(), "Loading ply map from: %s", map_path_.c_str());
+          if (pcl::io::loadPLYFile(map_path_, map_cloud) == -1) {
+            RCLCPP_ERROR(get_logger(), "Failed to load ply file: %s", map_path_.c_str());
+            return false;
+          }
+        } else {
+          RCLCPP_ERROR(
+              get_logger(), "Unsupported map file format. Please use .pcd or .ply or .lmt: %s",
+              map_path_.c_str());
+          return false;
+        }
+        return true;
+      };
+
+    pcl::PointCloud<pcl::PointXYZI>::Ptr map_cloud_ptr;
+    bool loaded = true;
+    std::string shared_map_key;
+    if (share_map_) {
+      // the other sessions of the process wait for the one loading the map
+      map_cloud_ptr = SharedMapStore::instance().getMap(map_path_, load, loaded, this);
+      shared_map_key = map_path_;
     } else {
-      RCLCPP_ERROR(
-          get_logger(), "Unsupported map file format. Please use .pcd or .ply: %s",
-          map_path_.c_str());
+      map_cloud_ptr.reset(new pcl::PointCloud<pcl::PointXYZI>);
+      if (!load(*map_cloud_ptr)) {
+        map_cloud_ptr.reset();
+      }
+    }
+    if (!map_cloud_ptr) {
       return CallbackReturn::FAILURE;
     }
 
     RCLCPP_INFO(get_logger(), "Map Size %ld", map_cloud_ptr->size());
-    sensor_msgs::msg::PointCloud2::SharedPtr map_msg_ptr(new sensor_msgs::msg::PointCloud2);
-    pcl::toROSMsg(*map_cloud_ptr, *map_msg_ptr);
-    map_msg_ptr->header.frame_id = global_frame_id_;
-    initial_map_pub_->publish(*map_msg_ptr);
-    RCLCPP_INFO(get_logger(), "Initial Map Published");
-
-    if (registration_method_ == "GICP" || registration_method_ == "GICP_OMP") {
-      pcl::PointCloud<pcl::PointXYZI>::Ptr filtered_cloud_ptr(new pcl::PointCloud<pcl::PointXYZI>());
-      voxel_grid_filter_.setInputCloud(map_cloud_ptr);
-      voxel_grid_filter_.filter(*filtered_cloud_ptr);
-      registration_->setInputTarget(filtered_cloud_ptr);
-    } else {
-      registration_->setInputTarget(map_cloud_ptr);
+    // a shared map is published by the session that loaded it
+    if (loaded) {
+      publishInitialMap(map_cloud_ptr);
+      RCLCPP_INFO(get_logger(), "Initial Map Published");
+    }
+
+    uint64_t generation;
+    {
+      std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+      // the lifelong map checkpoints are merged per tile too
+      if (enable_map_delta_ || enable_lifelong_map_) {
+        map_tiles_.setCloud(*map_cloud_ptr);
+      }
+      target_map_ptr_ = map_cloud_ptr;
+      shared_map_key_ = shared_map_key;
+      generation = ++target_generation_;
+    }
+    if (enable_lifelong_map_) {
+      std::lock_guard<std::mutex> lock(lifelong_mutex_);
+      lifelong_base_map_ = map_cloud_ptr;
+      lifelong_deltas_.clear();
+      lifelong_cv_.notify_one();
     }
 
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    setMapTarget(
+      registration_, registration_method_, ndt_resolution_, voxel_leaf_size_, map_cloud_ptr,
+      shared_map_key);
+    if (useSharedTarget()) {
+      exportSharedTarget();
+    }
+    cacheTarget(getTargetKey(), generation, registration_);
+
     map_recieved_ = true;
   }
 
+  requestZonePrebuild();
+
   RCLCPP_INFO(get_logger(), "Activating end");
   return CallbackReturn::SUCCESS;
 }
@@ -134,8 +255,15 @@ CallbackReturn PCLLocalization::on_deactivate(const rclcpp_lifecycle::State &)
 
   pose_pub_->on_deactivate();
   path_pub_->on_deactivate();
+  smoothed_path_pub_->on_deactivate();
   initial_map_pub_->on_deactivate();
 
+  stopLifelongMap();
+  stopPoseSmoothing();
+  stopMapStream();
+  // a build still running would set its target after on_cleanup cleared them
+  waitForTargetBuild();
+
   RCLCPP_INFO(get_logger(), "Deactivating end");
   return CallbackReturn::SUCCESS;
 }
@@ -145,11 +273,43 @@ CallbackReturn PCLLocalization::on_cleanup(const rclcpp_lifecycle::State &)
   RCLCPP_INFO(get_logger(), "Cleaning Up");
   initial_pose_sub_.reset();
   initial_map_pub_.reset();
+  map_sub_.reset();
+  map_delta_sub_.reset();
   path_pub_.reset();
+  smoothed_path_pub_.reset();
   pose_pub_.reset();
   odom_sub_.reset();
   cloud_sub_.reset();
   imu_sub_.reset();
+  tf_sub_.reset();
+  tf_static_sub_.reset();
+  tflistener_.reset();
+  record_inputs_ = false;
+  input_log_.close();
+  if (zone_prebuild_future_.valid()) {
+    zone_prebuild_future_.wait();
+  }
+  // for a map delta received while inactive
+  waitForTargetBuild();
+  {
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    target_cache_.clear();
+    // may be a target shared with the other sessions
+    registration_.reset();
+    shared_target_attached_ = false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+    target_map_ptr_.reset();
+    shared_map_key_.clear();
+  }
+  SharedMapStore::instance().release(this);
+#ifdef LIDAR_LOCALIZATION_TRACING
+  if (trace_opened_) {
+    TraceRecorder::instance().close();
+    trace_opened_ = false;
+  }
+#endif
 
   RCLCPP_INFO(get_logger(), "Cleaning Up end");
   return CallbackReturn::SUCCESS;
@@ -181,14 +341,28 @@ void PCLLocalization::initializeParameters()
   get_parameter("ndt_resolution", ndt_resolution_);
   get_parameter("ndt_step_size", ndt_step_size_);
   get_parameter("ndt_num_threads", ndt_num_threads_);
+  get_parameter("ndt_finalize_on_load", ndt_finalize_on_load_);
   get_parameter("ndt_max_iterations", ndt_max_iterations_);
   get_parameter("transform_epsilon", transform_epsilon_);
   get_parameter("voxel_leaf_size", voxel_leaf_size_);
+  get_parameter("scan_downsample_method", scan_downsample_method_);
+  get_parameter("adaptive_reference_range", adaptive_reference_range_);
+  get_parameter("adaptive_max_leaf_size", adaptive_max_leaf_size_);
+  get_parameter("adaptive_points_per_cell", adaptive_points_per_cell_);
+  get_parameter("organized_column_stride", organized_column_stride_);
+  get_parameter("organized_ground_column_stride", organized_ground_column_stride_);
+  get_parameter("loam_edge_threshold", loam_edge_threshold_);
+  get_parameter("loam_planar_threshold", loam_planar_threshold_);
+  get_parameter("loam_planar_leaf_size", loam_planar_leaf_size_);
   get_parameter("scan_max_range", scan_max_range_);
   get_parameter("scan_min_range", scan_min_range_);
   get_parameter("scan_period", scan_period_);
   get_parameter("use_pcd_map", use_pcd_map_);
   get_parameter("map_path", map_path_);
+  get_parameter("map_num_threads", map_num_threads_);
+  get_parameter("map_stream_radius", map_stream_radius_);
+  get_parameter("share_map", share_map_);
+  get_parameter("shared_target_name", shared_target_name_);
   get_parameter("set_initial_pose", set_initial_pose_);
   get_parameter("initial_pose_x", initial_pose_x_);
   get_parameter("initial_pose_y", initial_pose_y_);
@@ -200,6 +374,34 @@ void PCLLocalization::initializeParameters()
   get_parameter("use_odom", use_odom_);
   get_parameter("use_imu", use_imu_);
   get_parameter("enable_debug", enable_debug_);
+  get_parameter("enable_map_delta", enable_map_delta_);
+  get_parameter("map_tile_size", map_tile_size_);
+  get_parameter("enable_lifelong_map", enable_lifelong_map_);
+  get_parameter("lifelong_score_threshold", lifelong_score_threshold_);
+  get_parameter("lifelong_decay", lifelong_decay_);
+  get_parameter("lifelong_max_weight", lifelong_max_weight_);
+  get_parameter("lifelong_max_ray_length", lifelong_max_ray_length_);
+  get_parameter("lifelong_checkpoint_interval", lifelong_checkpoint_interval_);
+  get_parameter("lifelong_map_path", lifelong_map_path_);
+  get_parameter("enable_keyframe_odometry", enable_keyframe_odometry_);
+  get_parameter("keyframe_distance", keyframe_distance_);
+  get_parameter("keyframe_angle", keyframe_angle_);
+  get_parameter("keyframe_window_size", keyframe_window_size_);
+  get_parameter("keyframe_reanchor_interval", keyframe_reanchor_interval_);
+  get_parameter("enable_pose_smoothing", enable_pose_smoothing_);
+  get_parameter("smoothing_window_size", smoothing_window_size_);
+  get_parameter("smoothing_registration_sigma", smoothing_registration_sigma_);
+  get_parameter("smoothing_odom_sigma", smoothing_odom_sigma_);
+  get_parameter("enable_motion_gate", enable_motion_gate_);
+  get_parameter("motion_gate_linear_velocity", motion_gate_linear_velocity_);
+  get_parameter("motion_gate_angular_velocity", motion_gate_angular_velocity_);
+  get_parameter("motion_gate_settle_time", motion_gate_settle_time_);
+  get_parameter("motion_gate_idle_interval", motion_gate_idle_interval_);
+  get_parameter("record_path", record_path_);
+  get_parameter("trace_output", trace_output_);
+  get_parameter("target_cache_size", target_cache_size_);
+  get_parameter("zone_profiles_path", zone_profiles_path_);
+  get_parameter("zone_switch_margin", zone_switch_margin_);
 
   RCLCPP_INFO(get_logger(),"global_frame_id: %s", global_frame_id_.c_str());
   RCLCPP_INFO(get_logger(),"odom_frame_id: %s", odom_frame_id_.c_str());
@@ -209,54 +411,182 @@ void PCLLocalization::initializeParameters()
   RCLCPP_INFO(get_logger(),"ndt_resolution: %lf", ndt_resolution_);
   RCLCPP_INFO(get_logger(),"ndt_step_size: %lf", ndt_step_size_);
   RCLCPP_INFO(get_logger(),"ndt_num_threads: %d", ndt_num_threads_);
+  RCLCPP_INFO(get_logger(),"ndt_finalize_on_load: %d", ndt_finalize_on_load_);
   RCLCPP_INFO(get_logger(),"transform_epsilon: %lf", transform_epsilon_);
   RCLCPP_INFO(get_logger(),"voxel_leaf_size: %lf", voxel_leaf_size_);
+  RCLCPP_INFO(get_logger(),"scan_downsample_method: %s", scan_downsample_method_.c_str());
+  RCLCPP_INFO(get_logger(),"adaptive_reference_range: %lf", adaptive_reference_range_);
+  RCLCPP_INFO(get_logger(),"adaptive_max_leaf_size: %lf", adaptive_max_leaf_size_);
+  RCLCPP_INFO(get_logger(),"adaptive_points_per_cell: %d", adaptive_points_per_cell_);
+  RCLCPP_INFO(get_logger(),"organized_column_stride: %d", organized_column_stride_);
+  RCLCPP_INFO(get_logger(),"organized_ground_column_stride: %d", organized_ground_column_stride_);
+  RCLCPP_INFO(get_logger(),"loam_edge_threshold: %lf", loam_edge_threshold_);
+  RCLCPP_INFO(get_logger(),"loam_planar_threshold: %lf", loam_planar_threshold_);
+  RCLCPP_INFO(get_logger(),"loam_planar_leaf_size: %lf", loam_planar_leaf_size_);
   RCLCPP_INFO(get_logger(),"scan_max_range: %lf", scan_max_range_);
   RCLCPP_INFO(get_logger(),"scan_min_range: %lf", scan_min_range_);
   RCLCPP_INFO(get_logger(),"scan_period: %lf", scan_period_);
   RCLCPP_INFO(get_logger(),"use_pcd_map: %d", use_pcd_map_);
   RCLCPP_INFO(get_logger(),"map_path: %s", map_path_.c_str());
+  RCLCPP_INFO(get_logger(),"map_num_threads: %d", map_num_threads_);
+  RCLCPP_INFO(get_logger(),"map_stream_radius: %lf", map_stream_radius_);
+  RCLCPP_INFO(get_logger(),"share_map: %d", share_map_);
+  RCLCPP_INFO(get_logger(),"shared_target_name: %s", shared_target_name_.c_str());
   RCLCPP_INFO(get_logger(),"set_initial_pose: %d", set_initial_pose_);
   RCLCPP_INFO(get_logger(),"use_odom: %d", use_odom_);
   RCLCPP_INFO(get_logger(),"use_imu: %d", use_imu_);
   RCLCPP_INFO(get_logger(),"enable_debug: %d", enable_debug_);
+  RCLCPP_INFO(get_logger(),"enable_map_delta: %d", enable_map_delta_);
+  RCLCPP_INFO(get_logger(),"map_tile_size: %lf", map_tile_size_);
+  RCLCPP_INFO(get_logger(),"enable_lifelong_map: %d", enable_lifelong_map_);
+  RCLCPP_INFO(get_logger(),"lifelong_score_threshold: %lf", lifelong_score_threshold_);
+  RCLCPP_INFO(get_logger(),"lifelong_decay: %lf", lifelong_decay_);
+  RCLCPP_INFO(get_logger(),"lifelong_max_weight: %lf", lifelong_max_weight_);
+  RCLCPP_INFO(get_logger(),"lifelong_max_ray_length: %lf", lifelong_max_ray_length_);
+  RCLCPP_INFO(get_logger(),"lifelong_checkpoint_interval: %lf", lifelong_checkpoint_interval_);
+  RCLCPP_INFO(get_logger(),"lifelong_map_path: %s", lifelong_map_path_.c_str());
+  RCLCPP_INFO(get_logger(),"enable_keyframe_odometry: %d", enable_keyframe_odometry_);
+  RCLCPP_INFO(get_logger(),"keyframe_distance: %lf", keyframe_distance_);
+  RCLCPP_INFO(get_logger(),"keyframe_angle: %lf", keyframe_angle_);
+  RCLCPP_INFO(get_logger(),"keyframe_window_size: %d", keyframe_window_size_);
+  RCLCPP_INFO(get_logger(),"keyframe_reanchor_interval: %d", keyframe_reanchor_interval_);
+  RCLCPP_INFO(get_logger(),"enable_pose_smoothing: %d", enable_pose_smoothing_);
+  RCLCPP_INFO(get_logger(),"smoothing_window_size: %d", smoothing_window_size_);
+  RCLCPP_INFO(get_logger(),"smoothing_registration_sigma: %lf", smoothing_registration_sigma_);
+  RCLCPP_INFO(get_logger(),"smoothing_odom_sigma: %lf", smoothing_odom_sigma_);
+  RCLCPP_INFO(get_logger(),"enable_motion_gate: %d", enable_motion_gate_);
+  RCLCPP_INFO(get_logger(),"motion_gate_linear_velocity: %lf", motion_gate_linear_velocity_);
+  RCLCPP_INFO(get_logger(),"motion_gate_angular_velocity: %lf", motion_gate_angular_velocity_);
+  RCLCPP_INFO(get_logger(),"motion_gate_settle_time: %lf", motion_gate_settle_time_);
+  RCLCPP_INFO(get_logger(),"motion_gate_idle_interval: %lf", motion_gate_idle_interval_);
+  RCLCPP_INFO(get_logger(),"record_path: %s", record_path_.c_str());
+  RCLCPP_INFO(get_logger(),"trace_output: %s", trace_output_.c_str());
+  RCLCPP_INFO(get_logger(),"target_cache_size: %d", target_cache_size_);
+  RCLCPP_INFO(get_logger(),"zone_profiles_path: %s", zone_profiles_path_.c_str());
+  RCLCPP_INFO(get_logger(),"zone_switch_margin: %lf", zone_switch_margin_);
+
+  if (!trace_output_.empty()) {
+#ifdef LIDAR_LOCALIZATION_TRACING
+    // the trace is shared with the other sessions of the process
+    trace_opened_ = TraceRecorder::instance().open(trace_output_);
+    if (!trace_opened_) {
+      RCLCPP_ERROR(
+        get_logger(), "Failed to open the trace output (or the process traces to another): %s",
+        trace_output_.c_str());
+    }
+#else
+    RCLCPP_WARN(get_logger(), "trace_output is ignored, the node was built without ENABLE_TRACING");
+#endif
+  }
 }
 
 void PCLLocalization::initializePubSub()
 {
   RCLCPP_INFO(get_logger(), "initializePubSub");
 
+  // Intra-process delivery only supports volatile durability, so the latched
+  // (transient_local) topics always go through the middleware.
+  rclcpp::PublisherOptions latched_pub_options;
+  latched_pub_options.use_intra_process_comm = rclcpp::IntraProcessSetting::Disable;
+  rclcpp::SubscriptionOptions latched_sub_options;
+  latched_sub_options.use_intra_process_comm = rclcpp::IntraProcessSetting::Disable;
+
   pose_pub_ = create_publisher<geometry_msgs::msg::PoseWithCovarianceStamped>(
     "pcl_pose",
-    rclcpp::QoS(rclcpp::KeepLast(1)).transient_local().reliable());
+    rclcpp::QoS(rclcpp::KeepLast(1)).transient_local().reliable(),
+    latched_pub_options);
 
   path_pub_ = create_publisher<nav_msgs::msg::Path>(
     "path",
-    rclcpp::QoS(rclcpp::KeepLast(1)).transient_local().reliable());
+    rclcpp::QoS(rclcpp::KeepLast(1)).transient_local().reliable(),
+    latched_pub_options);
+
+  smoothed_path_pub_ = create_publisher<nav_msgs::msg::Path>(
+    "smoothed_path",
+    rclcpp::QoS(rclcpp::KeepLast(1)).transient_local().reliable(),
+    latched_pub_options);
 
   initial_map_pub_ = create_publisher<sensor_msgs::msg::PointCloud2>(
     "initial_map",
-    rclcpp::QoS(rclcpp::KeepLast(1)).transient_local().reliable());
+    rclcpp::QoS(rclcpp::KeepLast(1)).transient_local().reliable(),
+    latched_pub_options);
+
+  // Inputs are recorded at the subscriptions, as cloudReceived is also called internally.
+  record_inputs_ = false;
+  if (!record_path_.empty()) {
+    record_inputs_ = input_log_.openForWrite(record_path_);
+    if (!record_inputs_) {
+      RCLCPP_ERROR(get_logger(), "Failed to open the input log: %s", record_path_.c_str());
+    }
+  }
 
   initial_pose_sub_ = create_subscription<geometry_msgs::msg::PoseWithCovarianceStamped>(
     "initialpose", rclcpp::SystemDefaultsQoS(),
-    std::bind(&PCLLocalization::initialPoseReceived, this, std::placeholders::_1));
+    [this](const geometry_msgs::msg::PoseWithCovarianceStamped::SharedPtr msg) {
+      if (record_inputs_) {input_log_.write(InputLog::INITIAL_POSE, msg->header.stamp, *msg);}
+      initialPoseReceived(msg);
+    });
 
   map_sub_ = create_subscription<sensor_msgs::msg::PointCloud2>(
     "map", rclcpp::QoS(rclcpp::KeepLast(1)).transient_local().reliable(),
-    std::bind(&PCLLocalization::mapReceived, this, std::placeholders::_1));
+    [this](const sensor_msgs::msg::PointCloud2::ConstSharedPtr msg) {
+      if (record_inputs_) {input_log_.write(InputLog::MAP, msg->header.stamp, *msg);}
+      mapReceived(msg);
+    },
+    latched_sub_options);
+
+  if (enable_map_delta_) {
+    map_delta_sub_ = create_subscription<sensor_msgs::msg::PointCloud2>(
+      "map_delta", rclcpp::QoS(rclcpp::KeepLast(10)).reliable(),
+      [this](const sensor_msgs::msg::PointCloud2::ConstSharedPtr msg) {
+        if (record_inputs_) {input_log_.write(InputLog::MAP_DELTA, msg->header.stamp, *msg);}
+        mapDeltaReceived(msg);
+      });
+  }
 
   odom_sub_ = create_subscription<nav_msgs::msg::Odometry>(
     "odom", rclcpp::SensorDataQoS(),
-    std::bind(&PCLLocalization::odomReceived, this, std::placeholders::_1));
-
+    [this](const nav_msgs::msg::Odometry::ConstSharedPtr msg) {
+      if (record_inputs_) {input_log_.write(InputLog::ODOM, msg->header.stamp, *msg);}
+      odomReceived(msg);
+    });
+
+  // The scan and map callbacks never take ownership, so a unique_ptr published by a
+  // driver in the same container and a middleware-loaned message are both handed
+  // in without a copy.
   cloud_sub_ = create_subscription<sensor_msgs::msg::PointCloud2>(
     "cloud", rclcpp::SensorDataQoS(),
-    std::bind(&PCLLocalization::cloudReceived, this, std::placeholders::_1));
+    [this](const sensor_msgs::msg::PointCloud2::ConstSharedPtr msg) {
+      if (record_inputs_) {input_log_.write(InputLog::CLOUD, msg->header.stamp, *msg);}
+      cloudReceived(msg);
+    });
 
   imu_sub_ = create_subscription<sensor_msgs::msg::Imu>(
     "imu", rclcpp::SensorDataQoS(),
-    std::bind(&PCLLocalization::imuReceived, this, std::placeholders::_1));
+    [this](const sensor_msgs::msg::Imu::ConstSharedPtr msg) {
+      if (record_inputs_) {input_log_.write(InputLog::IMU, msg->header.stamp, *msg);}
+      imuReceived(msg);
+    });
+
+  // a replay feeds the recorded transforms to tfbuffer_ itself
+  if (!replay_mode_) {
+    tflistener_ = std::make_shared<tf2_ros::TransformListener>(tfbuffer_);
+  }
+
+  // The transforms looked up by the callbacks are recorded too, so a replay doesn't need them.
+  if (record_inputs_) {
+    tf_sub_ = create_subscription<tf2_msgs::msg::TFMessage>(
+      "/tf", rclcpp::QoS(rclcpp::KeepLast(100)),
+      [this](const tf2_msgs::msg::TFMessage::ConstSharedPtr msg) {
+        input_log_.write(InputLog::TF, getStamp(*msg), *msg);
+      });
+    tf_static_sub_ = create_subscription<tf2_msgs::msg::TFMessage>(
+      "/tf_static", rclcpp::QoS(rclcpp::KeepLast(100)).transient_local().reliable(),
+      [this](const tf2_msgs::msg::TFMessage::ConstSharedPtr msg) {
+        input_log_.write(InputLog::TF_STATIC, getStamp(*msg), *msg);
+      },
+      latched_sub_options);
+  }
 
   RCLCPP_INFO(get_logger(), "initializePubSub end");
 }
@@ -265,48 +595,527 @@ void PCLLocalization::initializeRegistration()
 {
   RCLCPP_INFO(get_logger(), "initializeRegistration");
 
-  if (registration_method_ == "GICP") {
+  registration_ = createRegistration();
+
+  scan_filters_.voxel_grid_filter.setLeafSize(voxel_leaf_size_);
+  if (scan_downsample_method_ != "VOXEL" && scan_downsample_method_ != "RANGE_ADAPTIVE" &&
+    scan_downsample_method_ != "ORGANIZED")
+  {
+    RCLCPP_WARN(
+      get_logger(), "Invalid scan_downsample_method %s, VOXEL is used",
+      scan_downsample_method_.c_str());
+  }
+  scan_filters_.range_adaptive_downsampler.setReferenceRange(adaptive_reference_range_);
+  scan_filters_.range_adaptive_downsampler.setMaxLeafSize(adaptive_max_leaf_size_);
+  scan_filters_.organized_scan_processor.setRange(scan_min_range_, scan_max_range_);
+  scan_filters_.organized_scan_processor.setColumnStride(
+    organized_column_stride_, organized_ground_column_stride_);
+  scan_filters_.loam_feature_extractor.setRange(scan_min_range_, scan_max_range_);
+  scan_filters_.loam_feature_extractor.setThresholds(
+    loam_edge_threshold_, loam_planar_threshold_);
+  scan_filters_.loam_feature_extractor.setPlanarLeafSize(loam_planar_leaf_size_);
+  map_loader_.setNumThreads(map_num_threads_);
+
+  map_tiles_.setTileSize(map_tile_size_);
+  // only the GICP targets are assembled from filtered tiles
+  map_tiles_.setLeafSize(voxel_leaf_size_);
+
+  lifelong_map_.setVoxelSize(voxel_leaf_size_);
+  lifelong_map_.setTileSize(map_tile_size_);
+  lifelong_map_.setDecay(lifelong_decay_);
+  // a voxel seeded from a single map point is only dropped after being seen through ~230 times
+  // at the default decay
+  lifelong_map_.setWeightRange(0.1, lifelong_max_weight_);
+  lifelong_map_.setMaxRayLength(lifelong_max_ray_length_);
+
+  local_registration_ = createRegistration();
+  keyframe_map_.clear();
+  keyframe_target_ready_ = false;
+  ++keyframe_generation_;
+  keyframe_map_.setVoxelSize(voxel_leaf_size_);
+  keyframe_map_.setMaxKeyframes(keyframe_window_size_);
+  keyframe_map_.setKeyframeDistance(keyframe_distance_);
+  keyframe_map_.setKeyframeAngle(keyframe_angle_);
+
+  motion_gate_.reset();
+  motion_gate_.setThresholds(motion_gate_linear_velocity_, motion_gate_angular_velocity_);
+  motion_gate_.setSettleTime(motion_gate_settle_time_);
+  motion_gate_.setIdleInterval(motion_gate_idle_interval_);
+
+  zone_profiles_ = ZoneProfiles();
+  active_zone_ = -1;
+  default_profile_ = RegistrationProfile{
+    "default", registration_method_, ndt_resolution_, voxel_leaf_size_, ndt_max_iterations_};
+  if (!zone_profiles_path_.empty()) {
+    if (!zone_profiles_.load(zone_profiles_path_)) {
+      RCLCPP_ERROR(get_logger(), "Failed to load zone profiles: %s", zone_profiles_path_.c_str());
+    }
+    for (size_t i = 0; i < zone_profiles_.size(); ++i) {
+      if (!isRegistrationMethod(zone_profiles_.getProfile(i).registration_method)) {
+        RCLCPP_ERROR(
+          get_logger(), "Invalid registration method in zone %s",
+          zone_profiles_.getProfile(i).name.c_str());
+        zone_profiles_ = ZoneProfiles();
+        break;
+      }
+    }
+    RCLCPP_INFO(get_logger(), "Zone profiles: %ld", zone_profiles_.size());
+    // the targets of all the profiles stay built
+    target_cache_size_ = std::max(target_cache_size_, static_cast<int>(zone_profiles_.size()) + 1);
+  }
+  RCLCPP_INFO(get_logger(), "initializeRegistration end");
+}
+
+boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>>
+PCLLocalization::createRegistration()
+{
+  return createRegistration(registration_method_, ndt_resolution_);
+}
+
+boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>>
+PCLLocalization::createRegistration(
+  const std::string & registration_method, const double ndt_resolution)
+{
+  boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> registration;
+  if (registration_method == "GICP") {
     boost::shared_ptr<pcl::GeneralizedIterativeClosestPoint<pcl::PointXYZI, pcl::PointXYZI>> gicp(
       new pcl::GeneralizedIterativeClosestPoint<pcl::PointXYZI, pcl::PointXYZI>());
-    gicp->setTransformationEpsilon(transform_epsilon_);
-    registration_ = gicp;
+    registration = gicp;
   }
-  else if (registration_method_ == "NDT") {
+  else if (registration_method == "NDT") {
     boost::shared_ptr<pcl::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI>> ndt(
       new pcl::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI>());
-    ndt->setStepSize(ndt_step_size_);
-    ndt->setResolution(ndt_resolution_);
-    ndt->setTransformationEpsilon(transform_epsilon_);
-    registration_ = ndt;
+    ndt->setResolution(ndt_resolution);
+    registration = ndt;
   }
-  else if (registration_method_ == "NDT_OMP") {
+  else if (registration_method == "NDT_OMP") {
     pclomp::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI>::Ptr ndt_omp(
       new pclomp::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI>());
-    ndt_omp->setStepSize(ndt_step_size_);
-    ndt_omp->setResolution(ndt_resolution_);
-    ndt_omp->setTransformationEpsilon(transform_epsilon_);
-    if (ndt_num_threads_ > 0) {
-      ndt_omp->setNumThreads(ndt_num_threads_);
-    } else {
-      ndt_omp->setNumThreads(omp_get_max_threads());
-    }
-    registration_ = ndt_omp;
+    ndt_omp->setResolution(ndt_resolution);
+    registration = ndt_omp;
+  }
+  else if (registration_method == "NDT_LAZY") {
+    LazyNDT::Ptr ndt_lazy(new LazyNDT());
+    ndt_lazy->setResolution(ndt_resolution);
+    registration = ndt_lazy;
   }
-  else if (registration_method_ == "GICP_OMP") {
+  else if (registration_method == "LOAM") {
+    LoamRegistration::Ptr loam(new LoamRegistration());
+    loam->setResolution(ndt_resolution);
+    registration = loam;
+  }
+  else if (registration_method == "GICP_OMP") {
     pclomp::GeneralizedIterativeClosestPoint<pcl::PointXYZI, pcl::PointXYZI>::Ptr gicp_omp(
       new pclomp::GeneralizedIterativeClosestPoint<pcl::PointXYZI, pcl::PointXYZI>());
-    gicp_omp->setTransformationEpsilon(transform_epsilon_);
-    registration_ = gicp_omp;
+    registration = gicp_omp;
   }
   else {
     RCLCPP_ERROR(get_logger(), "Invalid registration method.");
     exit(EXIT_FAILURE);
   }
-  registration_->setMaximumIterations(ndt_max_iterations_);
+  configureRegistration(registration);
 
+  return registration;
+}
 
-  voxel_grid_filter_.setLeafSize(voxel_leaf_size_, voxel_leaf_size_, voxel_leaf_size_);
-  RCLCPP_INFO(get_logger(), "initializeRegistration end");
+// Settings that can change without rebuilding the target.
+void PCLLocalization::configureRegistration(
+  const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration)
+{
+  registration->setMaximumIterations(ndt_max_iterations_);
+  registration->setTransformationEpsilon(transform_epsilon_);
+  if (auto ndt = boost::dynamic_pointer_cast<
+      pcl::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI>>(registration))
+  {
+    ndt->setStepSize(ndt_step_size_);
+  } else if (auto ndt_omp = boost::dynamic_pointer_cast<
+      pclomp::NormalDistributionsTransform<pcl::PointXYZI, pcl::PointXYZI>>(registration))
+  {
+    ndt_omp->setStepSize(ndt_step_size_);
+    ndt_omp->setNumThreads(ndt_num_threads_ > 0 ? ndt_num_threads_ : omp_get_max_threads());
+  } else if (auto ndt_lazy = boost::dynamic_pointer_cast<LazyNDT>(registration)) {
+    ndt_lazy->setStepSize(ndt_step_size_);
+    ndt_lazy->setNumThreads(ndt_num_threads_);
+  } else if (auto loam = boost::dynamic_pointer_cast<LoamRegistration>(registration)) {
+    loam->setNumThreads(ndt_num_threads_);
+  }
+}
+
+// Hands the covariances of the organized path to GICP, which otherwise searches the neighbours
+// of every point in a KD-tree. setInputSource clears them, so this comes after it.
+void PCLLocalization::setSourceCovariances(
+  const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration,
+  const pcl::GeneralizedIterativeClosestPoint<pcl::PointXYZI,
+  pcl::PointXYZI>::MatricesVectorPtr & covariances)
+{
+  if (!covariances) {return;}
+  if (auto gicp = boost::dynamic_pointer_cast<
+      pcl::GeneralizedIterativeClosestPoint<pcl::PointXYZI, pcl::PointXYZI>>(registration))
+  {
+    gicp->setSourceCovariances(covariances);
+  }
+}
+
+// LOAM matches the features of the scan in place of its downsampled points.
+void PCLLocalization::setInputFeatures(
+  const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration,
+  const pcl::PointCloud<pcl::PointXYZI>::Ptr & edges,
+  const pcl::PointCloud<pcl::PointXYZI>::Ptr & planes)
+{
+  if (!edges) {return;}
+  if (auto loam = boost::dynamic_pointer_cast<LoamRegistration>(registration)) {
+    loam->setInputFeatures(*edges, *planes);
+  }
+}
+
+// Downsamples the scan with the configured method and crops it to the scan range.
+void PCLLocalization::downsampleScan(
+  const pcl::PointCloud<pcl::PointXYZI>::Ptr & cloud_ptr, const Eigen::Vector3f & sensor_origin,
+  ScanFilters & filters, FilteredScan & scan)
+{
+  scan.cloud.reset(new pcl::PointCloud<pcl::PointXYZI>());
+  if (scan_downsample_method_ == "ORGANIZED" && cloud_ptr->height > 1) {
+    TRACE_ZONE("organized_scan_processor");
+    // the points are selected, not averaged, so the covariances stay those of the scan points
+    scan.covariances.reset(
+      new pcl::GeneralizedIterativeClosestPoint<pcl::PointXYZI, pcl::PointXYZI>::MatricesVector);
+    filters.organized_scan_processor.setSensorOrigin(sensor_origin);
+    filters.organized_scan_processor.filter(*cloud_ptr, *scan.cloud, *scan.covariances);
+    scan.num_downsampled_points = scan.cloud->size();
+    return;
+  }
+  if (scan_downsample_method_ == "ORGANIZED") {
+    RCLCPP_WARN_ONCE(get_logger(), "The scans are not organized, VOXEL is used.");
+  }
+  pcl::PointCloud<pcl::PointXYZI> filtered_cloud;
+  if (scan_downsample_method_ == "RANGE_ADAPTIVE") {
+    TRACE_ZONE("range_adaptive_downsampler");
+    // set on each scan, as the profile may change at runtime
+    filters.range_adaptive_downsampler.setLeafSize(voxel_leaf_size_);
+    filters.range_adaptive_downsampler.setCellSize(ndt_resolution_, adaptive_points_per_cell_);
+    filters.range_adaptive_downsampler.filter(*cloud_ptr, filtered_cloud);
+  } else {
+    TRACE_ZONE("voxel_grid_filter");
+    filters.voxel_grid_filter.filter(*cloud_ptr, filtered_cloud);
+  }
+  scan.num_downsampled_points = filtered_cloud.size();
+  PointKernels::cropRange(filtered_cloud, scan_min_range_, scan_max_range_, *scan.cloud);
+}
+
+// Extracts the features LOAM matches from an organized scan. Returns false without them.
+bool PCLLocalization::extractScanFeatures(
+  const pcl::PointCloud<pcl::PointXYZI>::Ptr & cloud_ptr, const Eigen::Vector3f & sensor_origin,
+  ScanFilters & filters, FilteredScan & scan)
+{
+  if (registration_method_ != "LOAM") {return false;}
+  if (cloud_ptr->height <= 1) {
+    RCLCPP_WARN_ONCE(
+      get_logger(), "The scans are not organized, LOAM matches all the points as planes.");
+    return false;
+  }
+  TRACE_ZONE("loam_feature_extraction");
+  scan.edge_features.reset(new pcl::PointCloud<pcl::PointXYZI>());
+  scan.planar_features.reset(new pcl::PointCloud<pcl::PointXYZI>());
+  filters.loam_feature_extractor.setSensorOrigin(sensor_origin);
+  filters.loam_feature_extractor.extract(*cloud_ptr, *scan.edge_features, *scan.planar_features);
+  return true;
+}
+
+void PCLLocalization::alignScan(
+  const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration,
+  const FilteredScan & scan, const Eigen::Matrix4f & init_guess)
+{
+  pcl::PointCloud<pcl::PointXYZI> output_cloud;
+  registration->setInputSource(scan.cloud);
+  setSourceCovariances(registration, scan.covariances);
+  setInputFeatures(registration, scan.edge_features, scan.planar_features);
+  registration->align(output_cloud, init_guess);
+}
+
+// Sets the target built from the map on the registration, downsampled for GICP. With a
+// shared map key, the sessions of the process build the target of each setting once: the first
+// one stores its registration and the others share its target.
+void PCLLocalization::setMapTarget(
+  const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration,
+  const std::string & registration_method, const double ndt_resolution,
+  const double voxel_leaf_size, const pcl::PointCloud<pcl::PointXYZI>::Ptr & map_cloud_ptr,
+  const std::string & shared_map_key)
+{
+  auto build = [&]() {
+      if (isGicp(registration_method)) {
+        pcl::PointCloud<pcl::PointXYZI>::Ptr filtered_cloud_ptr(
+          new pcl::PointCloud<pcl::PointXYZI>());
+        map_loader_.voxelFilter(*map_cloud_ptr, voxel_leaf_size, *filtered_cloud_ptr);
+        registration->setInputTarget(filtered_cloud_ptr);
+      } else {
+        registration->setInputTarget(map_cloud_ptr);
+      }
+      auto ndt_lazy = boost::dynamic_pointer_cast<LazyNDT>(registration);
+      if (ndt_lazy && ndt_finalize_on_load_) {
+        ndt_lazy->finalizeVoxels();
+      }
+      return registration;
+    };
+  if (shared_map_key.empty()) {
+    build();
+    return;
+  }
+  bool built;
+  const auto shared_registration = SharedMapStore::instance().getTarget(
+    shared_map_key + "/" + getTargetKey(registration_method, ndt_resolution, voxel_leaf_size),
+    build, built, this);
+  if (!built) {
+    shareTarget(registration, shared_registration);
+  }
+}
+
+// NDT_LAZY and LOAM share the voxels of the target. The other methods share its cloud and build
+// their own search structure from it.
+void PCLLocalization::shareTarget(
+  const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration,
+  const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & shared_registration)
+{
+  auto ndt_lazy = boost::dynamic_pointer_cast<LazyNDT>(registration);
+  auto shared_ndt_lazy = boost::dynamic_pointer_cast<LazyNDT>(shared_registration);
+  if (ndt_lazy && shared_ndt_lazy) {
+    ndt_lazy->shareTarget(*shared_ndt_lazy);
+    return;
+  }
+  auto loam = boost::dynamic_pointer_cast<LoamRegistration>(registration);
+  auto shared_loam = boost::dynamic_pointer_cast<LoamRegistration>(shared_registration);
+  if (loam && shared_loam) {
+    loam->shareTarget(*shared_loam);
+    return;
+  }
+  registration->setInputTarget(shared_registration->getInputTarget());
+}
+
+// A target in shared memory is only built from the map file, for NDT_LAZY. The features that
+// rebuild the target keep it in the process.
+bool PCLLocalization::useSharedTarget()
+{
+  if (shared_target_name_.empty()) {return false;}
+  if (registration_method_ != "NDT_LAZY" || map_path_.rfind(".lmt") != std::string::npos ||
+    enable_map_delta_ || enable_lifelong_map_ || !zone_profiles_.empty())
+  {
+    RCLCPP_WARN_ONCE(
+      get_logger(), "shared_target_name needs NDT_LAZY and a pcd or ply map, without map delta, "
+      "lifelong map or zone profiles. The target is built in the process.");
+    return false;
+  }
+  return true;
+}
+
+// Called with registration_mutex_ held. A segment built from another map file or resolution is
+// removed, for this process to build it again; processes attached to it keep their mapping.
+bool PCLLocalization::attachSharedTarget()
+{
+  auto ndt_lazy = boost::dynamic_pointer_cast<LazyNDT>(registration_);
+  if (!ndt_lazy) {return false;}
+  SharedNdtTarget::AttachResult result;
+  const auto shared_target = SharedNdtTarget::attach(
+    shared_target_name_, SharedNdtTarget::fingerprint(map_path_), ndt_resolution_, result);
+  if (result == SharedNdtTarget::AttachResult::kOtherTarget) {
+    RCLCPP_INFO(get_logger(), "Replacing the shared target %s", shared_target_name_.c_str());
+    SharedNdtTarget::remove(shared_target_name_);
+  } else if (result == SharedNdtTarget::AttachResult::kAbandoned) {
+    RCLCPP_WARN(
+      get_logger(), "Removed the shared target %s left incomplete by a crashed loader, "
+      "building it again", shared_target_name_.c_str());
+  }
+  if (!shared_target) {return false;}
+
+  ndt_lazy->setSharedTarget(shared_target);
+  shared_target_attached_ = true;
+  RCLCPP_INFO(
+    get_logger(), "Attached the shared target %s: %ld voxels, %.1f MB",
+    shared_target_name_.c_str(), shared_target->numVoxels(), shared_target->size() / 1e6);
+  return true;
+}
+
+// Called with registration_mutex_ held, once the target is built from the map file. This
+// process then aligns against the segment too, so the voxels it built are freed.
+void PCLLocalization::exportSharedTarget()
+{
+  auto ndt_lazy = boost::dynamic_pointer_cast<LazyNDT>(registration_);
+  if (!ndt_lazy) {return;}
+  if (!ndt_lazy->exportTarget(shared_target_name_, SharedNdtTarget::fingerprint(map_path_))) {
+    // another process is writing it
+    RCLCPP_WARN(
+      get_logger(), "Could not create the shared target %s, the target stays in the process",
+      shared_target_name_.c_str());
+    return;
+  }
+  if (!attachSharedTarget()) {return;}
+  // as in the processes attaching it, the map is no longer needed
+  std::lock_guard<std::mutex> tiles_lock(map_tiles_mutex_);
+  target_map_ptr_.reset();
+}
+
+bool PCLLocalization::isGicp() const
+{
+  return isGicp(registration_method_);
+}
+
+bool PCLLocalization::isGicp(const std::string & registration_method)
+{
+  return registration_method == "GICP" || registration_method == "GICP_OMP";
+}
+
+bool PCLLocalization::isRegistrationMethod(const std::string & registration_method)
+{
+  return registration_method == "GICP" || registration_method == "NDT" ||
+         registration_method == "NDT_OMP" || registration_method == "NDT_LAZY" ||
+         registration_method == "GICP_OMP" || registration_method == "LOAM";
+}
+
+// Registrations of these methods share a built target through shareTarget; the others are
+// handed the target cloud and build their own from it.
+bool PCLLocalization::sharesTarget(const std::string & registration_method)
+{
+  return registration_method == "NDT_LAZY" || registration_method == "LOAM";
+}
+
+std::string PCLLocalization::getTargetKey() const
+{
+  return getTargetKey(registration_method_, ndt_resolution_, voxel_leaf_size_);
+}
+
+// Identifies the settings a registration target is built with.
+std::string PCLLocalization::getTargetKey(
+  const std::string & registration_method, const double ndt_resolution,
+  const double voxel_leaf_size)
+{
+  if (isGicp(registration_method)) {
+    return registration_method + "/" + std::to_string(voxel_leaf_size);
+  }
+  return registration_method + "/" + std::to_string(ndt_resolution);
+}
+
+// Called with registration_mutex_ held. Returns null if the target is not built for the
+// current map.
+boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>>
+PCLLocalization::findCachedTarget(const std::string & key)
+{
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+    generation = target_generation_;
+  }
+  for (const auto & cached : target_cache_) {
+    if (cached.key == key && cached.generation == generation) {
+      return cached.registration;
+    }
+  }
+  return nullptr;
+}
+
+// Called with registration_mutex_ held. Targets built from another map are dropped.
+void PCLLocalization::cacheTarget(
+  const std::string & key, const uint64_t generation,
+  const boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> & registration)
+{
+  for (auto it = target_cache_.begin(); it != target_cache_.end(); ) {
+    if (it->key == key || it->generation != generation) {
+      it = target_cache_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  target_cache_.push_front(CachedTarget{key, generation, registration});
+  while (target_cache_.size() > static_cast<size_t>(std::max(target_cache_size_, 1))) {
+    target_cache_.pop_back();
+  }
+}
+
+// Registration settings are applied without a lifecycle transition. A target already built
+// with the new settings is swapped in at once; otherwise the scans keep aligning against the
+// current one while the new target is built in the background.
+rcl_interfaces::msg::SetParametersResult PCLLocalization::parametersChanged(
+  const std::vector<rclcpp::Parameter> & parameters)
+{
+  rcl_interfaces::msg::SetParametersResult result;
+  result.successful = true;
+  for (const auto & parameter : parameters) {
+    const std::string & name = parameter.get_name();
+    // the map was never loaded to build another target from
+    if (shared_target_attached_ && (name == "registration_method" || name == "ndt_resolution")) {
+      result.successful = false;
+      result.reason = "The target is attached from shared memory: " + shared_target_name_;
+      return result;
+    }
+    if (name != "registration_method") {continue;}
+    if (!isRegistrationMethod(parameter.as_string())) {
+      result.successful = false;
+      result.reason = "Invalid registration method: " + parameter.as_string();
+      return result;
+    }
+  }
+  // before configuration the values are read by initializeParameters
+  if (!registration_) {return result;}
+
+  {
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    const std::string previous_key = getTargetKey();
+    for (const auto & parameter : parameters) {
+      const std::string & name = parameter.get_name();
+      if (name == "registration_method") {
+        registration_method_ = parameter.as_string();
+      } else if (name == "ndt_resolution") {
+        ndt_resolution_ = parameter.as_double();
+      } else if (name == "voxel_leaf_size") {
+        if (parameter.as_double() == voxel_leaf_size_) {continue;}
+        voxel_leaf_size_ = parameter.as_double();
+        scan_filters_.voxel_grid_filter.setLeafSize(voxel_leaf_size_);
+        std::lock_guard<std::mutex> tiles_lock(map_tiles_mutex_);
+        map_tiles_.setLeafSize(voxel_leaf_size_);
+      } else if (name == "ndt_step_size") {
+        ndt_step_size_ = parameter.as_double();
+      } else if (name == "ndt_max_iterations") {
+        ndt_max_iterations_ = parameter.as_int();
+      } else if (name == "ndt_num_threads") {
+        ndt_num_threads_ = parameter.as_int();
+      } else if (name == "transform_epsilon") {
+        transform_epsilon_ = parameter.as_double();
+      } else if (name == "score_threshold") {
+        score_threshold_ = parameter.as_double();
+      } else {
+        continue;
+      }
+      RCLCPP_INFO(get_logger(), "%s: %s", name.c_str(), parameter.value_to_string().c_str());
+    }
+    configureRegistration(registration_);
+    configureRegistration(local_registration_);
+
+    const std::string key = getTargetKey();
+    if (key == previous_key) {return result;}
+
+    // the current local target serves until the one with the new settings is built
+    if (keyframe_map_.size() > 0) {
+      startKeyframeTargetBuild();
+    }
+
+    auto cached = findCachedTarget(key);
+    if (cached) {
+      registration_ = cached;
+      configureRegistration(registration_);
+      RCLCPP_INFO(get_logger(), "Switched to the cached target %s", key.c_str());
+      return result;
+    }
+    if (!map_recieved_) {
+      // the map, when it arrives, is set on this one
+      registration_ = createRegistration();
+      return result;
+    }
+  }
+
+  RCLCPP_INFO(get_logger(), "Building the registration target in the background");
+  {
+    std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+    map_tiles_dirty_ = true;
+  }
+  startTargetBuild();
+  return result;
 }
 
 void PCLLocalization::initialPoseReceived(const geometry_msgs::msg::PoseWithCovarianceStamped::SharedPtr msg)
@@ -318,15 +1127,51 @@ void PCLLocalization::initialPoseReceived(const geometry_msgs::msg::PoseWithCova
   }
   initialpose_recieved_ = true;
   corrent_pose_with_cov_stamped_ptr_ = msg;
+  {
+    // the keyframes around the previous pose don't describe the new one
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    keyframe_map_.clear();
+    keyframe_target_ready_ = false;
+    ++keyframe_generation_;
+    keyframe_odometry_active_ = false;
+  }
+  motion_gate_.reset();
+  if (enable_pose_smoothing_) {
+    std::lock_guard<std::mutex> lock(smoothing_mutex_);
+    smoothing_queue_.clear();
+    smoothing_reset_ = true;
+  }
   pose_pub_->publish(*corrent_pose_with_cov_stamped_ptr_);
+  updateMapStreamPose();
 
   cloudReceived(last_scan_ptr_);
   RCLCPP_INFO(get_logger(), "initialPoseReceived end");
 }
 
-void PCLLocalization::mapReceived(const sensor_msgs::msg::PointCloud2::SharedPtr msg)
+void PCLLocalization::publishInitialMap(
+  const pcl::PointCloud<pcl::PointXYZI>::ConstPtr & map_cloud_ptr)
+{
+  // Loan the message from the middleware when it can hand out shared memory
+  // (e.g. iceoryx), so the map is written in place instead of being copied.
+  if (initial_map_pub_->can_loan_messages()) {
+    auto loaned_msg = initial_map_pub_->borrow_loaned_message();
+    pcl::toROSMsg(*map_cloud_ptr, loaned_msg.get());
+    loaned_msg.get().header.frame_id = global_frame_id_;
+    initial_map_pub_->publish(std::move(loaned_msg));
+    return;
+  }
+
+  RCLCPP_DEBUG(get_logger(), "Middleware can't loan messages, publishing a copy of the map.");
+  sensor_msgs::msg::PointCloud2::UniquePtr map_msg_ptr(new sensor_msgs::msg::PointCloud2);
+  pcl::toROSMsg(*map_cloud_ptr, *map_msg_ptr);
+  map_msg_ptr->header.frame_id = global_frame_id_;
+  initial_map_pub_->publish(std::move(map_msg_ptr));
+}
+
+void PCLLocalization::mapReceived(const sensor_msgs::msg::PointCloud2::ConstSharedPtr msg)
 {
   RCLCPP_INFO(get_logger(), "mapReceived");
+  TRACE_ZONE("mapReceived");
   pcl::PointCloud<pcl::PointXYZI>::Ptr map_cloud_ptr(new pcl::PointCloud<pcl::PointXYZI>);
 
   if (msg->header.frame_id != global_frame_id_) {
@@ -336,23 +1181,686 @@ void PCLLocalization::mapReceived(const sensor_msgs::msg::PointCloud2::SharedPtr
 
   pcl::fromROSMsg(*msg, *map_cloud_ptr);
 
-  if (registration_method_ == "GICP" || registration_method_ == "GICP_OMP") {
-    pcl::PointCloud<pcl::PointXYZI>::Ptr filtered_cloud_ptr(new pcl::PointCloud<pcl::PointXYZI>());
-    voxel_grid_filter_.setInputCloud(map_cloud_ptr);
-    voxel_grid_filter_.filter(*filtered_cloud_ptr);
-    registration_->setInputTarget(filtered_cloud_ptr);
+  uint64_t generation;
+  bool shared_target;
+  {
+    std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+    if (enable_map_delta_ || enable_lifelong_map_) {
+      map_tiles_.setCloud(*map_cloud_ptr);
+    }
+    target_map_ptr_ = map_cloud_ptr;
+    // a map received by this session is its own
+    shared_target = !shared_map_key_.empty();
+    shared_map_key_.clear();
+    generation = ++target_generation_;
+  }
+  if (enable_lifelong_map_) {
+    std::lock_guard<std::mutex> lock(lifelong_mutex_);
+    lifelong_base_map_ = map_cloud_ptr;
+    lifelong_deltas_.clear();
+    lifelong_cv_.notify_one();
+  }
 
-  } else {
-    registration_->setInputTarget(map_cloud_ptr);
+  {
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    // the other sessions keep using the shared target
+    if (shared_target) {
+      registration_ = createRegistration();
+    }
+    setMapTarget(
+      registration_, registration_method_, ndt_resolution_, voxel_leaf_size_, map_cloud_ptr, "");
+    cacheTarget(getTargetKey(), generation, registration_);
   }
 
   map_recieved_ = true;
+  requestZonePrebuild();
   RCLCPP_INFO(get_logger(), "mapReceived end");
 }
 
+void PCLLocalization::mapDeltaReceived(const sensor_msgs::msg::PointCloud2::ConstSharedPtr msg)
+{
+  TRACE_ZONE("mapDeltaReceived");
+  RCLCPP_INFO(get_logger(), "mapDeltaReceived");
+  if (msg->header.frame_id != global_frame_id_) {
+    RCLCPP_WARN(this->get_logger(), "map_delta_frame_id does not match global_frame_id");
+    return;
+  }
+  if (!map_recieved_) {
+    RCLCPP_WARN(this->get_logger(), "map_delta received before map, ignored");
+    return;
+  }
+
+  pcl::PointCloud<pcl::PointXYZI>::Ptr delta_cloud_ptr(new pcl::PointCloud<pcl::PointXYZI>);
+  pcl::fromROSMsg(*msg, *delta_cloud_ptr);
+
+  {
+    std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+    const std::vector<uint64_t> keys = map_tiles_.replaceTiles(*delta_cloud_ptr);
+    RCLCPP_INFO(get_logger(), "Replaced %ld map tiles", keys.size());
+  }
+  // so the next checkpoint doesn't bring back the replaced tiles
+  if (enable_lifelong_map_) {
+    std::lock_guard<std::mutex> lock(lifelong_mutex_);
+    lifelong_deltas_.push_back(delta_cloud_ptr);
+    lifelong_cv_.notify_one();
+  }
+  requestTargetRebuild();
+  RCLCPP_INFO(get_logger(), "mapDeltaReceived end");
+}
+
+void PCLLocalization::requestTargetRebuild()
+{
+  {
+    std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+    map_tiles_dirty_ = true;
+    ++target_generation_;
+  }
+  startTargetBuild();
+}
+
+void PCLLocalization::startTargetBuild()
+{
+  {
+    std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+    // Changes arriving while a build runs are picked up by that build's next pass.
+    if (target_build_running_) {return;}
+    target_build_running_ = true;
+    if (!replay_mode_) {
+      target_build_future_ = std::async(
+        std::launch::async, &PCLLocalization::rebuildTarget, this);
+      return;
+    }
+  }
+  // A replay builds the target in place, so the scans see it at the same point in every run.
+  rebuildTarget();
+}
+
+void PCLLocalization::waitForTargetBuild()
+{
+  std::future<void> target_build_future;
+  {
+    std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+    target_build_future = std::move(target_build_future_);
+  }
+  if (target_build_future.valid()) {
+    target_build_future.wait();
+  }
+}
+
+void PCLLocalization::rebuildTarget()
+{
+  TRACE_ZONE("rebuildTarget");
+  while (true) {
+    boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> registration;
+    std::string key;
+    std::string registration_method;
+    double ndt_resolution;
+    double voxel_leaf_size;
+    {
+      std::lock_guard<std::mutex> lock(registration_mutex_);
+      registration = createRegistration();
+      key = getTargetKey();
+      registration_method = registration_method_;
+      ndt_resolution = ndt_resolution_;
+      voxel_leaf_size = voxel_leaf_size_;
+    }
+
+    pcl::PointCloud<pcl::PointXYZI>::Ptr target_cloud_ptr;
+    uint64_t generation;
+    bool whole_map = false;
+    std::string shared_map_key;
+    {
+      std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+      if (!map_tiles_dirty_) {
+        target_build_running_ = false;
+        return;
+      }
+      map_tiles_dirty_ = false;
+      generation = target_generation_;
+      if (map_tiles_.size() > 0 || !target_map_ptr_) {
+        target_cloud_ptr = map_tiles_.assemble(isGicp(registration_method));
+      } else {
+        target_cloud_ptr = target_map_ptr_;
+        whole_map = true;
+        shared_map_key = shared_map_key_;
+      }
+    }
+
+    // The new target is built on the side; scans keep aligning against the old one.
+    if (whole_map) {
+      setMapTarget(
+        registration, registration_method, ndt_resolution, voxel_leaf_size, target_cloud_ptr,
+        shared_map_key);
+    } else {
+      registration->setInputTarget(target_cloud_ptr);
+    }
+
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    {
+      // a map received during the build has set its own target and cached targets
+      std::lock_guard<std::mutex> tiles_lock(map_tiles_mutex_);
+      if (generation != target_generation_) {continue;}
+    }
+    cacheTarget(key, generation, registration);
+    // settings changed during the build are built by the next pass
+    if (key != getTargetKey()) {continue;}
+    registration_ = registration;
+    configureRegistration(registration_);
+    RCLCPP_INFO(get_logger(), "Registration target rebuilt, Map Size %ld", target_cloud_ptr->size());
+  }
+}
+
+// Builds the target of the keyframe map on the side, or in place during a replay. Keyframes
+// added while a build runs are picked up by the next build, started once it is collected.
+void PCLLocalization::startKeyframeTargetBuild()
+{
+  if (keyframe_target_future_.valid()) {
+    keyframe_target_dirty_ = true;
+    return;
+  }
+  keyframe_target_dirty_ = false;
+  keyframe_target_key_ = getTargetKey();
+  keyframe_target_generation_ = keyframe_generation_;
+  auto registration = createRegistration();
+  const pcl::PointCloud<pcl::PointXYZI>::Ptr cloud = keyframe_map_.getCloud();
+  auto build = [registration, cloud]() {
+      TRACE_ZONE("keyframe_target_build");
+      registration->setInputTarget(cloud);
+      return registration;
+    };
+  if (replay_mode_) {
+    local_registration_ = build();
+    keyframe_target_ready_ = true;
+    return;
+  }
+  keyframe_target_future_ = std::async(std::launch::async, build);
+}
+
+// Swaps in the keyframe target once built, unless the keyframes were cleared or the settings
+// changed meanwhile.
+void PCLLocalization::collectKeyframeTarget()
+{
+  if (!keyframe_target_future_.valid() ||
+    keyframe_target_future_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+  {
+    return;
+  }
+  auto registration = keyframe_target_future_.get();
+  if (keyframe_target_generation_ != keyframe_generation_) {
+    keyframe_target_dirty_ = keyframe_map_.size() > 0;
+  } else if (keyframe_target_key_ != getTargetKey()) {
+    keyframe_target_dirty_ = true;
+  } else {
+    local_registration_ = registration;
+    configureRegistration(local_registration_);
+    keyframe_target_ready_ = true;
+  }
+  if (keyframe_target_dirty_) {
+    startKeyframeTargetBuild();
+  }
+}
+
+void PCLLocalization::requestZonePrebuild()
+{
+  if (zone_profiles_.empty()) {return;}
+  {
+    std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+    zone_prebuild_dirty_ = true;
+    // A prebuild still running makes another pass for the new map.
+    if (zone_prebuild_running_) {return;}
+    zone_prebuild_running_ = true;
+    if (!replay_mode_) {
+      zone_prebuild_future_ = std::async(
+        std::launch::async, &PCLLocalization::prebuildZoneTargets, this);
+      return;
+    }
+  }
+  prebuildZoneTargets();
+}
+
+// Builds the target of every profile for the current map, so entering a zone swaps its
+// target in at once. A map change during a pass stops it, and the next pass builds the targets
+// of the new map.
+void PCLLocalization::prebuildZoneTargets()
+{
+  TRACE_ZONE("prebuildZoneTargets");
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+      if (!zone_prebuild_dirty_) {
+        zone_prebuild_running_ = false;
+        return;
+      }
+      zone_prebuild_dirty_ = false;
+    }
+    for (size_t i = 0; i <= zone_profiles_.size(); ++i) {
+      const RegistrationProfile & profile =
+        i < zone_profiles_.size() ? zone_profiles_.getProfile(i) : default_profile_;
+      const std::string key = getTargetKey(
+        profile.registration_method, profile.ndt_resolution, profile.voxel_leaf_size);
+      boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>> registration;
+      {
+        std::lock_guard<std::mutex> lock(registration_mutex_);
+        if (findCachedTarget(key)) {continue;}
+        registration = createRegistration(profile.registration_method, profile.ndt_resolution);
+      }
+
+      pcl::PointCloud<pcl::PointXYZI>::Ptr target_cloud_ptr;
+      uint64_t generation;
+      std::string shared_map_key;
+      {
+        std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+        generation = target_generation_;
+        if (map_tiles_.size() > 0) {
+          target_cloud_ptr = map_tiles_.assemble(false);
+        } else {
+          target_cloud_ptr = target_map_ptr_;
+          shared_map_key = shared_map_key_;
+        }
+      }
+      if (!target_cloud_ptr) {break;}
+      setMapTarget(
+        registration, profile.registration_method, profile.ndt_resolution,
+        profile.voxel_leaf_size, target_cloud_ptr, shared_map_key);
+
+      std::lock_guard<std::mutex> lock(registration_mutex_);
+      {
+        std::lock_guard<std::mutex> tiles_lock(map_tiles_mutex_);
+        if (generation != target_generation_) {break;}
+      }
+      cacheTarget(key, generation, registration);
+      RCLCPP_INFO(get_logger(), "Target of zone %s built", profile.name.c_str());
+    }
+  }
+}
+
+// Called after each localized scan, without registration_mutex_ held.
+void PCLLocalization::updateZoneProfile(const double x, const double y)
+{
+  const int zone = zone_profiles_.find(x, y, active_zone_, zone_switch_margin_);
+  if (zone == active_zone_) {return;}
+  active_zone_ = zone;
+  const RegistrationProfile & profile =
+    zone >= 0 ? zone_profiles_.getProfile(zone) : default_profile_;
+  RCLCPP_INFO(get_logger(), "Entering zone %s", profile.name.c_str());
+
+  // set together, so that a target is only built for the complete profile
+  const auto result = set_parameters_atomically({
+    rclcpp::Parameter("registration_method", profile.registration_method),
+    rclcpp::Parameter("ndt_resolution", profile.ndt_resolution),
+    rclcpp::Parameter("voxel_leaf_size", profile.voxel_leaf_size),
+    rclcpp::Parameter("ndt_max_iterations", profile.ndt_max_iterations)});
+  if (!result.successful) {
+    RCLCPP_WARN(get_logger(), "Failed to apply zone %s: %s", profile.name.c_str(), result.reason.c_str());
+  }
+}
+
+void PCLLocalization::startLifelongMap()
+{
+  lifelong_checkpoint_stamp_ = std::numeric_limits<double>::quiet_NaN();
+  // a replay updates the map in place, on the callback that hands it a map or a scan
+  if (lifelong_thread_.joinable() || replay_mode_) {return;}
+  lifelong_running_ = true;
+  lifelong_thread_ = std::thread(&PCLLocalization::lifelongMapLoop, this);
+}
+
+void PCLLocalization::stopLifelongMap()
+{
+  if (!lifelong_thread_.joinable()) {return;}
+  {
+    std::lock_guard<std::mutex> lock(lifelong_mutex_);
+    lifelong_running_ = false;
+    lifelong_cv_.notify_one();
+  }
+  lifelong_thread_.join();
+}
+
+void PCLLocalization::lifelongMapLoop()
+{
+  std::unique_lock<std::mutex> lock(lifelong_mutex_);
+  while (true) {
+    lifelong_cv_.wait(lock, [this]() {
+      return !lifelong_running_ || lifelong_base_map_ || !lifelong_deltas_.empty() ||
+             lifelong_scan_;
+    });
+    if (!lifelong_running_) {break;}
+    lock.unlock();
+    updateLifelongMap();
+    lock.lock();
+  }
+}
+
+// Applies the pending base map, map deltas and scan. The checkpoints follow the scan stamps, so
+// a replay makes them at the same scans in every run.
+void PCLLocalization::updateLifelongMap()
+{
+  std::unique_lock<std::mutex> lock(lifelong_mutex_);
+  pcl::PointCloud<pcl::PointXYZI>::Ptr base_map_ptr = lifelong_base_map_;
+  std::vector<pcl::PointCloud<pcl::PointXYZI>::Ptr> deltas;
+  deltas.swap(lifelong_deltas_);
+  pcl::PointCloud<pcl::PointXYZI>::Ptr scan_ptr = lifelong_scan_;
+  const Eigen::Matrix4f scan_pose = lifelong_scan_pose_;
+  const Eigen::Vector3f scan_origin = lifelong_scan_origin_;
+  const double scan_stamp = lifelong_scan_stamp_;
+  lifelong_base_map_.reset();
+  lifelong_scan_.reset();
+  lock.unlock();
+
+  if (base_map_ptr) {
+    lifelong_map_.setCloud(*base_map_ptr);
+    lifelong_checkpoint_stamp_ = std::numeric_limits<double>::quiet_NaN();
+  }
+  for (const auto & delta_ptr : deltas) {
+    lifelong_map_.replaceTiles(*delta_ptr);
+  }
+  if (!scan_ptr) {return;}
+
+  {
+    TRACE_ZONE("lifelong_integrate");
+    pcl::PointCloud<pcl::PointXYZI> scan_in_map;
+    pcl::transformPointCloud(*scan_ptr, scan_in_map, scan_pose);
+    const Eigen::Vector3f origin_in_map =
+      scan_pose.block<3, 3>(0, 0) * scan_origin + scan_pose.block<3, 1>(0, 3);
+    lifelong_map_.integrate(scan_in_map, origin_in_map);
+  }
+
+  if (std::isnan(lifelong_checkpoint_stamp_)) {
+    lifelong_checkpoint_stamp_ = scan_stamp;
+  } else if (scan_stamp - lifelong_checkpoint_stamp_ > lifelong_checkpoint_interval_) {
+    checkpointLifelongMap();
+    lifelong_checkpoint_stamp_ = scan_stamp;
+  }
+}
+
+void PCLLocalization::checkpointLifelongMap()
+{
+  TRACE_ZONE("checkpointLifelongMap");
+  // only the tiles the scans changed are replaced, the others keep their points
+  const auto changed_tiles = lifelong_map_.extractChangedTiles();
+  RCLCPP_INFO(get_logger(), "Lifelong map checkpoint, %ld tiles changed", changed_tiles.size());
+  if (changed_tiles.empty()) {return;}
+
+  {
+    std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+    for (const auto & tile : changed_tiles) {
+      if (tile.second->empty()) {
+        map_tiles_.removeTile(tile.first);
+      } else {
+        map_tiles_.setTile(tile.first, tile.second);
+      }
+    }
+  }
+  requestTargetRebuild();
+
+  if (!lifelong_map_path_.empty()) {
+    pcl::PointCloud<pcl::PointXYZI>::Ptr map_cloud_ptr = lifelong_map_.extract();
+    if (pcl::io::savePCDFileBinary(lifelong_map_path_, *map_cloud_ptr) == -1) {
+      RCLCPP_ERROR(get_logger(), "Failed to save pcd file: %s", lifelong_map_path_.c_str());
+    }
+  }
+}
+
+void PCLLocalization::startPoseSmoothing()
+{
+  if (smoothing_thread_.joinable()) {return;}
+  pose_smoother_.clear();
+  pose_smoother_.setWindowSize(smoothing_window_size_);
+  pose_smoother_.setRegistrationSigma(smoothing_registration_sigma_);
+  pose_smoother_.setOdometrySigma(smoothing_odom_sigma_);
+  smoothing_odometry_.clear();
+  // the scans wait in the queue for a few odometry messages at most
+  smoothing_odometry_.setMaxAge(10.0);
+  // a replay smooths in place, on the scan callback
+  if (replay_mode_) {return;}
+  smoothing_running_ = true;
+  smoothing_thread_ = std::thread(&PCLLocalization::poseSmoothingLoop, this);
+}
+
+void PCLLocalization::stopPoseSmoothing()
+{
+  if (!smoothing_thread_.joinable()) {return;}
+  {
+    std::lock_guard<std::mutex> lock(smoothing_mutex_);
+    smoothing_running_ = false;
+    smoothing_cv_.notify_one();
+  }
+  smoothing_thread_.join();
+}
+
+void PCLLocalization::poseSmoothingLoop()
+{
+  std::unique_lock<std::mutex> lock(smoothing_mutex_);
+  while (true) {
+    smoothing_cv_.wait(lock, [this]() {
+      return !smoothing_running_ || !smoothing_queue_.empty() || smoothing_reset_;
+    });
+    if (!smoothing_running_) {break;}
+    lock.unlock();
+    updatePoseSmoothing();
+    lock.lock();
+  }
+}
+
+// Adds the registered poses to the window and optimizes it, off the scan callback, so pcl_pose
+// is published as soon as the scan is registered. smoothed_path holds the poses that left the
+// window followed by the current estimates of the window.
+void PCLLocalization::updatePoseSmoothing()
+{
+  std::unique_lock<std::mutex> lock(smoothing_mutex_);
+  if (smoothing_reset_) {
+    pose_smoother_.clear();
+    smoothing_reset_ = false;
+  }
+  std::deque<PoseGraphSmoother::Node, Eigen::aligned_allocator<PoseGraphSmoother::Node>> nodes;
+  nodes.swap(smoothing_queue_);
+  for (auto & node : nodes) {
+    // the odometry message of the scan stamp may still be on its way
+    node.has_odometry = smoothing_odometry_.interpolate(node.stamp, 0.1, node.odometry_pose);
+    if (!node.has_odometry) {
+      RCLCPP_WARN_ONCE(
+        get_logger(), "No odometry at the scan stamps, the poses are smoothed without it.");
+    }
+  }
+  lock.unlock();
+
+  TRACE_ZONE("pose_smoothing");
+  auto to_pose_stamped = [this](const PoseGraphSmoother::Node & node) {
+      geometry_msgs::msg::PoseStamped pose_stamped;
+      pose_stamped.header.stamp =
+        rclcpp::Time(static_cast<int64_t>(std::llround(node.stamp * 1e9)));
+      pose_stamped.header.frame_id = global_frame_id_;
+      pose_stamped.pose = tf2::toMsg(Eigen::Affine3d(node.pose));
+      return pose_stamped;
+    };
+  for (const auto & node : nodes) {
+    PoseGraphSmoother::Node removed;
+    if (pose_smoother_.addNode(node, removed)) {
+      smoothed_path_ptr_->poses.push_back(to_pose_stamped(removed));
+    }
+  }
+  pose_smoother_.optimize();
+
+  const size_t num_finished = smoothed_path_ptr_->poses.size();
+  for (size_t i = 0; i < pose_smoother_.size(); ++i) {
+    smoothed_path_ptr_->poses.push_back(to_pose_stamped(pose_smoother_.getNode(i)));
+  }
+  smoothed_path_pub_->publish(*smoothed_path_ptr_);
+  smoothed_path_ptr_->poses.resize(num_finished);
+}
+
+bool PCLLocalization::activateStreamedMap()
+{
+  RCLCPP_INFO(get_logger(), "Opening compressed map: %s", map_path_.c_str());
+  if (!compressed_map_.open(map_path_)) {
+    RCLCPP_ERROR(get_logger(), "Failed to open compressed map: %s", map_path_.c_str());
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+    map_tiles_.clear();
+    map_tiles_.setTileSize(compressed_map_.getTileSize());
+  }
+
+  double x = 0.0;
+  double y = 0.0;
+  if (corrent_pose_with_cov_stamped_ptr_) {
+    x = corrent_pose_with_cov_stamped_ptr_->pose.pose.position.x;
+    y = corrent_pose_with_cov_stamped_ptr_->pose.pose.position.y;
+  }
+  updateStreamedTiles(x, y);
+
+  pcl::PointCloud<pcl::PointXYZI>::Ptr map_cloud_ptr;
+  pcl::PointCloud<pcl::PointXYZI>::Ptr target_cloud_ptr;
+  uint64_t generation;
+  {
+    std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+    generation = ++target_generation_;
+    map_cloud_ptr = map_tiles_.assemble(false);
+    target_cloud_ptr = isGicp() ? map_tiles_.assemble(true) : map_cloud_ptr;
+    RCLCPP_INFO(
+      get_logger(), "Map Size %ld (%ld of %ld tiles)", map_cloud_ptr->size(),
+      map_tiles_.size(), compressed_map_.getTiles().size());
+  }
+  publishInitialMap(map_cloud_ptr);
+  RCLCPP_INFO(get_logger(), "Initial Map Published");
+
+  {
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    registration_->setInputTarget(target_cloud_ptr);
+    cacheTarget(getTargetKey(), generation, registration_);
+  }
+  map_recieved_ = true;
+
+  map_streaming_ = true;
+  if (!replay_mode_) {
+    startMapStream();
+  }
+  return true;
+}
+
+bool PCLLocalization::updateStreamedTiles(const double x, const double y)
+{
+  TRACE_ZONE("updateStreamedTiles");
+  std::vector<uint64_t> missing_keys;
+  {
+    std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+    for (const auto & key : compressed_map_.getTileKeysInRadius(x, y, map_stream_radius_)) {
+      if (!map_tiles_.hasTile(key)) {missing_keys.push_back(key);}
+    }
+  }
+
+  // decompress outside the lock, the target rebuild may be reading the tiles
+  std::vector<std::pair<uint64_t, pcl::PointCloud<pcl::PointXYZI>::Ptr>> loaded_tiles;
+  for (const auto & key : missing_keys) {
+    pcl::PointCloud<pcl::PointXYZI>::Ptr tile(new pcl::PointCloud<pcl::PointXYZI>);
+    if (!compressed_map_.readTile(key, *tile)) {
+      RCLCPP_ERROR(get_logger(), "Failed to read map tile %lu", key);
+      continue;
+    }
+    loaded_tiles.emplace_back(key, tile);
+  }
+
+  // one extra tile of margin so that tiles are not reloaded back and forth at the border
+  const std::vector<uint64_t> keep_keys = compressed_map_.getTileKeysInRadius(
+    x, y, map_stream_radius_ + compressed_map_.getTileSize());
+  const std::unordered_set<uint64_t> keep(keep_keys.begin(), keep_keys.end());
+
+  bool changed = !loaded_tiles.empty();
+  std::lock_guard<std::mutex> lock(map_tiles_mutex_);
+  for (const auto & tile : loaded_tiles) {
+    map_tiles_.setTile(tile.first, tile.second);
+  }
+  for (const auto & key : map_tiles_.getKeys()) {
+    if (!keep.count(key)) {
+      map_tiles_.removeTile(key);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+void PCLLocalization::updateMapStreamPose()
+{
+  if (!map_streaming_ || !corrent_pose_with_cov_stamped_ptr_) {return;}
+  const double x = corrent_pose_with_cov_stamped_ptr_->pose.pose.position.x;
+  const double y = corrent_pose_with_cov_stamped_ptr_->pose.pose.position.y;
+  if (replay_mode_) {
+    if (updateStreamedTiles(x, y)) {
+      requestTargetRebuild();
+    }
+    return;
+  }
+  std::lock_guard<std::mutex> lock(map_stream_mutex_);
+  map_stream_x_ = x;
+  map_stream_y_ = y;
+  map_stream_pose_updated_ = true;
+  map_stream_cv_.notify_one();
+}
+
+void PCLLocalization::startMapStream()
+{
+  if (map_stream_thread_.joinable()) {return;}
+  map_stream_running_ = true;
+  map_stream_thread_ = std::thread(&PCLLocalization::mapStreamLoop, this);
+}
+
+void PCLLocalization::stopMapStream()
+{
+  map_streaming_ = false;
+  if (!map_stream_thread_.joinable()) {return;}
+  {
+    std::lock_guard<std::mutex> lock(map_stream_mutex_);
+    map_stream_running_ = false;
+    map_stream_cv_.notify_one();
+  }
+  map_stream_thread_.join();
+}
+
+void PCLLocalization::mapStreamLoop()
+{
+  std::unique_lock<std::mutex> lock(map_stream_mutex_);
+  while (true) {
+    map_stream_cv_.wait(lock, [this]() {
+      return !map_stream_running_ || map_stream_pose_updated_;
+    });
+    if (!map_stream_running_) {break;}
+    map_stream_pose_updated_ = false;
+    const double x = map_stream_x_;
+    const double y = map_stream_y_;
+    lock.unlock();
+
+    if (updateStreamedTiles(x, y)) {
+      requestTargetRebuild();
+    }
+    lock.lock();
+  }
+}
+
+builtin_interfaces::msg::Time PCLLocalization::getStamp(const tf2_msgs::msg::TFMessage & msg)
+{
+  // unstamped static transforms sort first in a replay
+  return msg.transforms.empty() ? builtin_interfaces::msg::Time() : msg.transforms[0].header.stamp;
+}
+
 void PCLLocalization::odomReceived(const nav_msgs::msg::Odometry::ConstSharedPtr msg)
 {
+  // the odometry edges of the smoothing take the odometry pose, with or without use_odom
+  if (enable_pose_smoothing_) {
+    Eigen::Affine3d odom_pose;
+    tf2::fromMsg(msg->pose.pose, odom_pose);
+    std::lock_guard<std::mutex> lock(smoothing_mutex_);
+    smoothing_odometry_.add(
+      msg->header.stamp.sec + msg->header.stamp.nanosec * 1e-9, odom_pose.matrix());
+  }
+  if (enable_motion_gate_) {
+    const auto & twist = msg->twist.twist;
+    motion_gate_.addOdometry(
+      msg->header.stamp.sec + msg->header.stamp.nanosec * 1e-9,
+      Eigen::Vector3d(twist.linear.x, twist.linear.y, twist.linear.z).norm(),
+      Eigen::Vector3d(twist.angular.x, twist.angular.y, twist.angular.z).norm());
+  }
   if (!use_odom_) {return;}
+  TRACE_ZONE("odomReceived");
   RCLCPP_INFO(get_logger(), "odomReceived");
 
   double current_odom_received_time = msg->header.stamp.sec +
@@ -399,7 +1907,15 @@ void PCLLocalization::odomReceived(const nav_msgs::msg::Odometry::ConstSharedPtr
 
 void PCLLocalization::imuReceived(const sensor_msgs::msg::Imu::ConstSharedPtr msg)
 {
+  // the rate norm doesn't depend on the imu frame
+  if (enable_motion_gate_) {
+    motion_gate_.addImu(
+      msg->header.stamp.sec + msg->header.stamp.nanosec * 1e-9,
+      Eigen::Vector3d(
+        msg->angular_velocity.x, msg->angular_velocity.y, msg->angular_velocity.z).norm());
+  }
   if (!use_imu_) {return;}
+  TRACE_ZONE("imuReceived");
 
   sensor_msgs::msg::Imu tf_converted_imu;
 
@@ -442,20 +1958,85 @@ void PCLLocalization::imuReceived(const sensor_msgs::msg::Imu::ConstSharedPtr ms
 
 }
 
+// Sends the current pose as map to base_frame_id, or as map to odom_frame_id with
+// enable_map_odom_tf. Returns false if the odometry transform at the stamp is missing.
+bool PCLLocalization::broadcastPose(const builtin_interfaces::msg::Time & stamp)
+{
+  const geometry_msgs::msg::Pose & pose = corrent_pose_with_cov_stamped_ptr_->pose.pose;
+  geometry_msgs::msg::TransformStamped map_to_base_link_stamped;
+  map_to_base_link_stamped.header.stamp = stamp;
+  map_to_base_link_stamped.header.frame_id = global_frame_id_;
+  map_to_base_link_stamped.child_frame_id = base_frame_id_;
+  map_to_base_link_stamped.transform.translation.x = pose.position.x;
+  map_to_base_link_stamped.transform.translation.y = pose.position.y;
+  map_to_base_link_stamped.transform.translation.z = pose.position.z;
+  map_to_base_link_stamped.transform.rotation = pose.orientation;
+  if (!enable_map_odom_tf_) {
+    broadcaster_.sendTransform(map_to_base_link_stamped);
+    return true;
+  }
+  tf2::Transform map_to_base_link_tf;
+  tf2::fromMsg(map_to_base_link_stamped.transform, map_to_base_link_tf);
+
+  geometry_msgs::msg::TransformStamped odom_to_base_link_msg;
+  try {
+    TRACE_ZONE("lookupTransform odom_to_base");
+    odom_to_base_link_msg = tfbuffer_.lookupTransform(
+      odom_frame_id_, base_frame_id_, stamp, rclcpp::Duration::from_seconds(0.1));
+  } catch (tf2::TransformException & ex) {
+    RCLCPP_WARN(
+      this->get_logger(), "Could not get transform %s to %s: %s",
+      base_frame_id_.c_str(), odom_frame_id_.c_str(), ex.what());
+    return false;
+  }
+  tf2::Transform odom_to_base_link_tf;
+  tf2::fromMsg(odom_to_base_link_msg.transform, odom_to_base_link_tf);
+
+  tf2::Transform map_to_odom_tf = map_to_base_link_tf * odom_to_base_link_tf.inverse();
+  geometry_msgs::msg::TransformStamped map_to_odom_stamped;
+  map_to_odom_stamped.header.stamp = stamp;
+  map_to_odom_stamped.header.frame_id = global_frame_id_;
+  map_to_odom_stamped.child_frame_id = odom_frame_id_;
+  map_to_odom_stamped.transform = tf2::toMsg(map_to_odom_tf);
+  broadcaster_.sendTransform(map_to_odom_stamped);
+  return true;
+}
+
 void PCLLocalization::cloudReceived(const sensor_msgs::msg::PointCloud2::ConstSharedPtr msg)
 {
   if (!map_recieved_ || !initialpose_recieved_) {return;}
   RCLCPP_INFO(get_logger(), "cloudReceived");
+  TRACE_ZONE("cloudReceived");
+
+  // While the robot is still, the pose propagated by the odometry (or the last registered one)
+  // is republished in place of the registration.
+  const double scan_time = msg->header.stamp.sec + msg->header.stamp.nanosec * 1e-9;
+  if (enable_motion_gate_ && !motion_gate_.needsRegistration(scan_time)) {
+    TRACE_ZONE("motion_gate");
+    corrent_pose_with_cov_stamped_ptr_->header.stamp = msg->header.stamp;
+    corrent_pose_with_cov_stamped_ptr_->header.frame_id = global_frame_id_;
+    pose_pub_->publish(*corrent_pose_with_cov_stamped_ptr_);
+    broadcastPose(msg->header.stamp);
+    last_scan_ptr_ = msg;
+    return;
+  }
+
+  StageProfiler::Timer stage_timer(stage_profiler_);
   pcl::PointCloud<pcl::PointXYZI>::Ptr cloud_ptr(new pcl::PointCloud<pcl::PointXYZI>);
-  pcl::fromROSMsg(*msg, *cloud_ptr);
+  {
+    TRACE_ZONE("fromROSMsg");
+    pcl::fromROSMsg(*msg, *cloud_ptr);
+  }
 
   // If your cloud is not robot-centric, convert to base_frame.
+  Eigen::Vector3f sensor_origin = Eigen::Vector3f::Zero();
   if (msg->header.frame_id != base_frame_id_) {
     RCLCPP_DEBUG(
         this->get_logger(), "Transforming point cloud from %s to %s",
         msg->header.frame_id.c_str(), base_frame_id_.c_str());
     geometry_msgs::msg::TransformStamped base_to_lidar_stamped;
     try {
+      TRACE_ZONE("lookupTransform base_to_lidar");
       base_to_lidar_stamped = tfbuffer_.lookupTransform(
           base_frame_id_, msg->header.frame_id, msg->header.stamp,
           rclcpp::Duration::from_seconds(0.1));
@@ -469,44 +2050,87 @@ void PCLLocalization::cloudReceived(const sensor_msgs::msg::PointCloud2::ConstSh
     Eigen::Matrix4f initial_transformation =
       tf2::transformToEigen(base_to_lidar_stamped.transform).matrix().cast<float>();
     pcl::PointCloud<pcl::PointXYZI>::Ptr transformed_cloud(new pcl::PointCloud<pcl::PointXYZI>());
-    pcl::transformPointCloud(*cloud_ptr, *transformed_cloud, initial_transformation);
+    PointKernels::transform(*cloud_ptr, initial_transformation, *transformed_cloud);
     cloud_ptr = transformed_cloud;
+    sensor_origin = initial_transformation.block<3, 1>(0, 3);
   }
+  stage_timer.lap("convert");
 
   if (use_imu_) {
-    double received_time = msg->header.stamp.sec +
-      msg->header.stamp.nanosec * 1e-9;
-    lidar_undistortion_.adjustDistortion(cloud_ptr, received_time);
+    TRACE_ZONE("adjustDistortion");
+    lidar_undistortion_.adjustDistortion(cloud_ptr, scan_time);
+    stage_timer.lap("undistortion");
   }
 
-  pcl::PointCloud<pcl::PointXYZI>::Ptr filtered_cloud_ptr(new pcl::PointCloud<pcl::PointXYZI>());
-  voxel_grid_filter_.setInputCloud(cloud_ptr);
-  voxel_grid_filter_.filter(*filtered_cloud_ptr);
+  FilteredScan scan;
+  downsampleScan(cloud_ptr, sensor_origin, scan_filters_, scan);
+  stage_timer.lap("downsample");
+  if (extractScanFeatures(cloud_ptr, sensor_origin, scan_filters_, scan)) {
+    stage_timer.lap("features");
+  }
 
-  double r;
-  pcl::PointCloud<pcl::PointXYZI> tmp;
-  for (const auto & p : filtered_cloud_ptr->points) {
-    r = sqrt(pow(p.x, 2.0) + pow(p.y, 2.0));
-    if (scan_min_range_ < r && r < scan_max_range_) {
-      tmp.push_back(p);
-    }
+  // waits here while a rebuilt target is being swapped in
+  std::unique_lock<std::mutex> registration_lock(registration_mutex_, std::defer_lock);
+  {
+    TRACE_ZONE("registration_mutex");
+    registration_lock.lock();
   }
-  pcl::PointCloud<pcl::PointXYZI>::Ptr tmp_ptr(new pcl::PointCloud<pcl::PointXYZI>(tmp));
-  registration_->setInputSource(tmp_ptr);
 
   Eigen::Affine3d affine;
   tf2::fromMsg(corrent_pose_with_cov_stamped_ptr_->pose.pose, affine);
 
   Eigen::Matrix4f init_guess = affine.matrix().cast<float>();
 
-  pcl::PointCloud<pcl::PointXYZI>::Ptr output_cloud(new pcl::PointCloud<pcl::PointXYZI>);
+  if (enable_keyframe_odometry_) {
+    collectKeyframeTarget();
+  }
+  // While tracking against the keyframes, the map is only tried every keyframe_reanchor_interval
+  // scans, as each try outside the map is a failing align.
+  bool try_map = true;
+  if (keyframe_odometry_active_ && keyframe_target_ready_) {
+    try_map = ++keyframe_scans_since_map_ >= keyframe_reanchor_interval_;
+  }
+
   rclcpp::Clock system_clock;
   rclcpp::Time time_align_start = system_clock.now();
-  registration_->align(*output_cloud, init_guess);
+  bool has_converged = false;
+  double fitness_score = std::numeric_limits<double>::max();
+  Eigen::Matrix4f final_transformation = init_guess;
+  if (try_map) {
+    {
+      TRACE_ZONE("align");
+      alignScan(registration_, scan, init_guess);
+    }
+    stage_timer.lap("align");
+    keyframe_scans_since_map_ = 0;
+    has_converged = registration_->hasConverged();
+    fitness_score = registration_->getFitnessScore();
+    final_transformation = registration_->getFinalTransformation();
+  }
   rclcpp::Time time_align_end = system_clock.now();
 
-  bool has_converged = registration_->hasConverged();
-  double fitness_score = registration_->getFitnessScore();
+  // Outside the map, track against the recent keyframes instead, until the map matches again.
+  bool keyframe_odometry = false;
+  if (enable_keyframe_odometry_ && keyframe_target_ready_ &&
+    (!has_converged || fitness_score > score_threshold_))
+  {
+    TRACE_ZONE("keyframe_align");
+    alignScan(local_registration_, scan, init_guess);
+    has_converged = local_registration_->hasConverged();
+    fitness_score = local_registration_->getFitnessScore();
+    final_transformation = local_registration_->getFinalTransformation();
+    keyframe_odometry = true;
+    stage_timer.lap("keyframe_align");
+  }
+  if (keyframe_odometry != keyframe_odometry_active_) {
+    if (keyframe_odometry) {
+      RCLCPP_WARN(get_logger(), "Lost the map, tracking against the last keyframes.");
+    } else {
+      RCLCPP_INFO(get_logger(), "Re-anchored to the map.");
+    }
+    keyframe_odometry_active_ = keyframe_odometry;
+  }
+
   if (!has_converged) {
     RCLCPP_WARN(get_logger(), "The registration didn't converge.");
     return;
@@ -515,7 +2139,6 @@ void PCLLocalization::cloudReceived(const sensor_msgs::msg::PointCloud2::ConstSh
     RCLCPP_WARN(get_logger(), "The fitness score is over %lf.", score_threshold_);
   }
 
-  Eigen::Matrix4f final_transformation = registration_->getFinalTransformation();
   Eigen::Matrix3d rot_mat = final_transformation.block<3, 3>(0, 0).cast<double>();
   Eigen::Quaterniond quat_eig(rot_mat);
   geometry_msgs::msg::Quaternion quat_msg = tf2::toMsg(quat_eig);
@@ -527,42 +2150,22 @@ void PCLLocalization::cloudReceived(const sensor_msgs::msg::PointCloud2::ConstSh
   corrent_pose_with_cov_stamped_ptr_->pose.pose.position.z = static_cast<double>(final_transformation(2, 3));
   corrent_pose_with_cov_stamped_ptr_->pose.pose.orientation = quat_msg;
   pose_pub_->publish(*corrent_pose_with_cov_stamped_ptr_);
-
-  geometry_msgs::msg::TransformStamped map_to_base_link_stamped;
-  map_to_base_link_stamped.header.stamp = msg->header.stamp;
-  map_to_base_link_stamped.header.frame_id = global_frame_id_;
-  map_to_base_link_stamped.child_frame_id = base_frame_id_;
-  map_to_base_link_stamped.transform.translation.x = static_cast<double>(final_transformation(0, 3));
-  map_to_base_link_stamped.transform.translation.y = static_cast<double>(final_transformation(1, 3));
-  map_to_base_link_stamped.transform.translation.z = static_cast<double>(final_transformation(2, 3));
-  map_to_base_link_stamped.transform.rotation = quat_msg;
-  if (!enable_map_odom_tf_) {
-    broadcaster_.sendTransform(map_to_base_link_stamped);
-  } else {
-    tf2::Transform map_to_base_link_tf;
-    tf2::fromMsg(map_to_base_link_stamped.transform, map_to_base_link_tf);
-
-    geometry_msgs::msg::TransformStamped odom_to_base_link_msg;
-    try {
-      odom_to_base_link_msg = tfbuffer_.lookupTransform(
-        odom_frame_id_, base_frame_id_, msg->header.stamp, rclcpp::Duration::from_seconds(0.1));
-    } catch (tf2::TransformException & ex) {
-      RCLCPP_WARN(
-        this->get_logger(), "Could not get transform %s to %s: %s",
-        base_frame_id_.c_str(), odom_frame_id_.c_str(), ex.what());
-      return;
-    }
-    tf2::Transform odom_to_base_link_tf;
-    tf2::fromMsg(odom_to_base_link_msg.transform, odom_to_base_link_tf);
-
-    tf2::Transform map_to_odom_tf = map_to_base_link_tf * odom_to_base_link_tf.inverse();
-    geometry_msgs::msg::TransformStamped map_to_odom_stamped;
-    map_to_odom_stamped.header.stamp = msg->header.stamp;
-    map_to_odom_stamped.header.frame_id = global_frame_id_;
-    map_to_odom_stamped.child_frame_id = odom_frame_id_;
-    map_to_odom_stamped.transform = tf2::toMsg(map_to_odom_tf);
-    broadcaster_.sendTransform(map_to_odom_stamped);
+  updateMapStreamPose();
+  motion_gate_.setRegistered(scan_time);
+
+  if (enable_pose_smoothing_) {
+    PoseGraphSmoother::Node node;
+    node.stamp = scan_time;
+    node.registered_pose = final_transformation.cast<double>();
+    std::lock_guard<std::mutex> lock(smoothing_mutex_);
+    smoothing_queue_.push_back(node);
+    smoothing_cv_.notify_one();
   }
+  if (enable_pose_smoothing_ && replay_mode_) {
+    updatePoseSmoothing();
+  }
+
+  if (!broadcastPose(msg->header.stamp)) {return;}
 
   geometry_msgs::msg::PoseStamped::SharedPtr pose_stamped_ptr(new geometry_msgs::msg::PoseStamped);
   pose_stamped_ptr->header.stamp = msg->header.stamp;
@@ -570,11 +2173,48 @@ void PCLLocalization::cloudReceived(const sensor_msgs::msg::PointCloud2::ConstSh
   pose_stamped_ptr->pose = corrent_pose_with_cov_stamped_ptr_->pose.pose;
   path_ptr_->poses.push_back(*pose_stamped_ptr);
   path_pub_->publish(*path_ptr_);
+  stage_timer.lap("publish");
+
+  // The local map only changes with a keyframe, so its cost is bounded by the window size. The
+  // local target is then built in the background.
+  if (enable_keyframe_odometry_ && fitness_score <= score_threshold_ &&
+    keyframe_map_.needsKeyframe(final_transformation))
+  {
+    TRACE_ZONE("keyframe_update");
+    pcl::PointCloud<pcl::PointXYZI> keyframe_cloud;
+    PointKernels::transform(*scan.cloud, final_transformation, keyframe_cloud);
+    keyframe_map_.addKeyframe(keyframe_cloud, final_transformation);
+    startKeyframeTargetBuild();
+    stage_timer.lap("keyframe_update");
+  }
 
-  last_scan_ptr_ = msg;
+  // Only well-localized scans refresh the map. A scan still pending is replaced, so the
+  // worker integrates at the rate it can keep up with.
+  if (enable_lifelong_map_ && !keyframe_odometry && fitness_score < lifelong_score_threshold_) {
+    std::lock_guard<std::mutex> lock(lifelong_mutex_);
+    lifelong_scan_ = scan.cloud;
+    lifelong_scan_pose_ = final_transformation;
+    lifelong_scan_origin_ = sensor_origin;
+    lifelong_scan_stamp_ = scan_time;
+    lifelong_cv_.notify_one();
+  }
+  if (enable_lifelong_map_ && replay_mode_) {
+    updateLifelongMap();
+  }
+
+  if (!zone_profiles_.empty()) {
+    registration_lock.unlock();
+    updateZoneProfile(final_transformation(0, 3), final_transformation(1, 3));
+  }
+
+  {
+    // the previous scan is freed here unless a subscriber still holds it
+    TRACE_ZONE("release_previous_scan");
+    last_scan_ptr_ = msg;
+  }
 
   if (enable_debug_) {
-    std::cout << "number of filtered cloud points: " << filtered_cloud_ptr->size() << std::endl;
+    std::cout << "number of filtered cloud points: " << scan.num_downsampled_points << std::endl;
     std::cout << "align time:" << time_align_end.seconds() - time_align_start.seconds() <<
       "[sec]" << std::endl;
     std::cout << "has converged: " << has_converged << std::endl;
@@ -597,3 +2237,130 @@ void PCLLocalization::cloudReceived(const sensor_msgs::msg::PointCloud2::ConstSh
     std::cout << "-----------------------------------------------------" << std::endl;
   }
 }
+
+// Localizes a sequence of scans offline, registering them in parallel rather than one after the
+// other. The first pass seeds each scan from its odometry prior, anchored to the map by the last
+// matched scan of the previous block. The map to odom corrections of the matched scans are then
+// averaged over smoothing_window scans on each side, which evens out the jitter and the failures
+// of single registrations, and the second pass registers every scan again from the smoothed
+// prior. The scans go through the same filters and registration as in cloudReceived.
+PCLLocalization::BatchResults PCLLocalization::localizeBatch(
+  const BatchScans & scans, const Eigen::Matrix4d & initial_pose,
+  const int num_threads, const int smoothing_window)
+{
+  // each thread would build its own copy of the target, one after the other
+  if (!sharesTarget(registration_method_)) {
+    RCLCPP_ERROR(get_logger(), "The batch localization needs NDT_LAZY or LOAM.");
+    return BatchResults();
+  }
+  BatchResults results(scans.size());
+  if (scans.empty()) {return results;}
+  const int threads = num_threads > 0 ? num_threads : omp_get_max_threads();
+
+  // one registration and set of filters per thread, the scans rather than the registrations
+  // running in parallel, all sharing the target of the node
+  std::vector<boost::shared_ptr<pcl::Registration<pcl::PointXYZI, pcl::PointXYZI>>> registrations(
+    threads);
+  std::vector<ScanFilters, Eigen::aligned_allocator<ScanFilters>> filters(threads, scan_filters_);
+  {
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    const int ndt_num_threads = ndt_num_threads_;
+    ndt_num_threads_ = 1;
+    for (auto & registration : registrations) {
+      registration = createRegistration();
+      shareTarget(registration, registration_);
+    }
+    ndt_num_threads_ = ndt_num_threads;
+  }
+
+  // the scans are filtered once, in the first pass
+  std::vector<FilteredScan> filtered_scans(scans.size());
+  auto localize = [&](const size_t i, const Eigen::Matrix4d & prior) {
+      const int thread = omp_get_thread_num();
+      FilteredScan & filtered_scan = filtered_scans[i];
+      if (!filtered_scan.cloud) {
+        pcl::PointCloud<pcl::PointXYZI>::Ptr cloud_ptr(new pcl::PointCloud<pcl::PointXYZI>);
+        pcl::fromROSMsg(*scans[i].msg, *cloud_ptr);
+        Eigen::Vector3f sensor_origin = Eigen::Vector3f::Zero();
+        if (scans[i].msg->header.frame_id != base_frame_id_) {
+          pcl::PointCloud<pcl::PointXYZI>::Ptr transformed_cloud(
+            new pcl::PointCloud<pcl::PointXYZI>());
+          PointKernels::transform(*cloud_ptr, scans[i].base_to_sensor, *transformed_cloud);
+          cloud_ptr = transformed_cloud;
+          sensor_origin = scans[i].base_to_sensor.block<3, 1>(0, 3);
+        }
+        downsampleScan(cloud_ptr, sensor_origin, filters[thread], filtered_scan);
+        extractScanFeatures(cloud_ptr, sensor_origin, filters[thread], filtered_scan);
+      }
+      const auto & registration = registrations[thread];
+      alignScan(registration, filtered_scan, prior.cast<float>());
+      BatchResult & result = results[i];
+      result.fitness_score = registration->getFitnessScore();
+      result.converged = registration->hasConverged() && result.fitness_score <= score_threshold_;
+      result.pose =
+        result.converged ? registration->getFinalTransformation().cast<double>() : prior;
+    };
+
+  // first pass, in blocks of a few scans per thread
+  const size_t block_size = 4 * threads;
+  Eigen::Matrix4d correction = initial_pose * scans.front().odom_pose.inverse();
+  for (size_t begin = 0; begin < scans.size(); begin += block_size) {
+    const size_t end = std::min(begin + block_size, scans.size());
+    #pragma omp parallel for num_threads(threads) schedule(dynamic)
+    for (size_t i = begin; i < end; ++i) {
+      localize(i, correction * scans[i].odom_pose);
+    }
+    for (size_t i = end; i-- > begin; ) {
+      if (results[i].converged) {
+        correction = results[i].pose * scans[i].odom_pose.inverse();
+        break;
+      }
+    }
+  }
+
+  std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d>> corrections(
+    scans.size());
+  for (size_t i = 0; i < scans.size(); ++i) {
+    corrections[i] = results[i].pose * scans[i].odom_pose.inverse();
+  }
+  std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d>> priors(scans.size());
+  const size_t window = static_cast<size_t>(std::max(smoothing_window, 0));
+  for (size_t i = 0; i < scans.size(); ++i) {
+    Eigen::Vector3d translation = Eigen::Vector3d::Zero();
+    Eigen::Vector4d rotation = Eigen::Vector4d::Zero();
+    Eigen::Quaterniond reference;
+    int count = 0;
+    const size_t first = i > window ? i - window : 0;
+    const size_t last = std::min(i + window, scans.size() - 1);
+    for (size_t j = first; j <= last; ++j) {
+      if (!results[j].converged) {continue;}
+      Eigen::Quaterniond quat(corrections[j].block<3, 3>(0, 0));
+      if (count == 0) {
+        reference = quat;
+      } else if (quat.dot(reference) < 0) {
+        quat.coeffs() = -quat.coeffs();
+      }
+      translation += corrections[j].block<3, 1>(0, 3);
+      rotation += quat.coeffs();
+      ++count;
+    }
+    Eigen::Matrix4d smoothed_correction = corrections[i];
+    if (count > 0) {
+      smoothed_correction.setIdentity();
+      smoothed_correction.block<3, 3>(0, 0) =
+        Eigen::Quaterniond(rotation.normalized()).toRotationMatrix();
+      smoothed_correction.block<3, 1>(0, 3) = translation / count;
+    }
+    priors[i] = smoothed_correction * scans[i].odom_pose;
+  }
+
+  // second pass, every scan at once
+  #pragma omp parallel for num_threads(threads) schedule(dynamic)
+  for (size_t i = 0; i < scans.size(); ++i) {
+    localize(i, priors[i]);
+  }
+  return results;
+}
+
+#include "rclcpp_components/register_node_macro.hpp"
+RCLCPP_COMPONENTS_REGISTER_NODE(PCLLocalization)
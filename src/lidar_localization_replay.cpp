@@ -0,0 +1,132 @@
+#include <lidar_localization/lidar_localization_component.hpp>
+
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+
+// The transforms are fed this far ahead of the other messages, so the lookups at the stamp of a
+// message find the transforms after it to interpolate with instead of waiting for them. It is
+// well within the 10 s cache of the tf buffer.
+static constexpr int64_t kTfLookahead = 1000000000; /*[ns]*/
+
+// Feeds an input log recorded with `record_path` to the node in stamp order, without waiting
+// between messages, then prints the time spent in each stage of the scan callback.
+int main(int argc, char * argv[])
+{
+  const std::vector<std::string> args = rclcpp::init_and_remove_ros_arguments(argc, argv);
+  if (args.size() < 2) {
+    std::cerr << "usage: lidar_localization_replay <input_log> [pose_output] [scan_stats_output]"
+              << " --ros-args --params-file localization.yaml" << std::endl;
+    return 1;
+  }
+
+  std::vector<InputLog::Entry> entries;
+  if (!InputLog::read(args[1], entries)) {
+    std::cerr << "failed to read " << args[1] << std::endl;
+    return 1;
+  }
+
+  rclcpp::NodeOptions options;
+  std::shared_ptr<PCLLocalization> pcl_l = std::make_shared<PCLLocalization>(options);
+  pcl_l->replay_mode_ = true;
+  pcl_l->stage_profiler_.setEnabled(true);
+  // the log being replayed is not recorded again
+  pcl_l->set_parameter(rclcpp::Parameter("record_path", ""));
+  if (pcl_l->configure().id() != lifecycle_msgs::msg::State::PRIMARY_STATE_INACTIVE ||
+    pcl_l->activate().id() != lifecycle_msgs::msg::State::PRIMARY_STATE_ACTIVE)
+  {
+    std::cerr << "failed to activate the node" << std::endl;
+    return 1;
+  }
+
+  // poses in the TUM format: stamp x y z qx qy qz qw
+  std::ofstream pose_ofs;
+  if (args.size() > 2) {
+    pose_ofs.open(args[2]);
+    pose_ofs << std::fixed << std::setprecision(9);
+  }
+  // per scan: stamp latency[s] cpu_time[s], the cpu time covering all the threads of the node
+  std::ofstream stats_ofs;
+  if (args.size() > 3) {
+    stats_ofs.open(args[3]);
+    stats_ofs << std::fixed << std::setprecision(9);
+  }
+
+  auto feedTransforms = [&pcl_l](const InputLog::Entry & entry) {
+      auto msg = InputLog::deserialize<tf2_msgs::msg::TFMessage>(entry);
+      for (const auto & transform : msg->transforms) {
+        pcl_l->tfbuffer_.setTransform(transform, "replay", entry.type == InputLog::TF_STATIC);
+      }
+    };
+  // the static transforms hold at any stamp
+  for (const auto & entry : entries) {
+    if (entry.type == InputLog::TF_STATIC) {feedTransforms(entry);}
+  }
+
+  size_t num_scans = 0;
+  size_t next_tf = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (const auto & entry : entries) {
+    for (; next_tf < entries.size() &&
+      entries[next_tf].stamp_ns <= entry.stamp_ns + kTfLookahead; ++next_tf)
+    {
+      if (entries[next_tf].type == InputLog::TF) {feedTransforms(entries[next_tf]);}
+    }
+    switch (entry.type) {
+      case InputLog::CLOUD: {
+          auto msg = InputLog::deserialize<sensor_msgs::msg::PointCloud2>(entry);
+          const auto scan_start = std::chrono::steady_clock::now();
+          const std::clock_t scan_cpu_start = std::clock();
+          pcl_l->cloudReceived(msg);
+          const double cpu_time = static_cast<double>(std::clock() - scan_cpu_start) / CLOCKS_PER_SEC;
+          const double latency =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - scan_start).count();
+          ++num_scans;
+          if (stats_ofs.is_open()) {
+            stats_ofs << entry.stamp_ns * 1e-9 << " " << latency << " " << cpu_time << std::endl;
+          }
+          // the scan is kept only when a pose was published for it
+          if (pose_ofs.is_open() && pcl_l->last_scan_ptr_ == msg) {
+            const auto & pose = pcl_l->corrent_pose_with_cov_stamped_ptr_->pose.pose;
+            pose_ofs << entry.stamp_ns * 1e-9 << " " << pose.position.x << " " <<
+              pose.position.y << " " << pose.position.z << " " << pose.orientation.x << " " <<
+              pose.orientation.y << " " << pose.orientation.z << " " << pose.orientation.w <<
+              std::endl;
+          }
+          break;
+        }
+      case InputLog::IMU:
+        pcl_l->imuReceived(InputLog::deserialize<sensor_msgs::msg::Imu>(entry));
+        break;
+      case InputLog::ODOM:
+        pcl_l->odomReceived(InputLog::deserialize<nav_msgs::msg::Odometry>(entry));
+        break;
+      case InputLog::INITIAL_POSE:
+        pcl_l->initialPoseReceived(
+          InputLog::deserialize<geometry_msgs::msg::PoseWithCovarianceStamped>(entry));
+        break;
+      case InputLog::MAP:
+        pcl_l->mapReceived(InputLog::deserialize<sensor_msgs::msg::PointCloud2>(entry));
+        break;
+      case InputLog::MAP_DELTA:
+        pcl_l->mapDeltaReceived(InputLog::deserialize<sensor_msgs::msg::PointCloud2>(entry));
+        break;
+      case InputLog::TF:
+      case InputLog::TF_STATIC:
+        // fed ahead above
+        break;
+    }
+  }
+  const double elapsed =
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::cout << entries.size() << " messages, " << num_scans << " scans in " << elapsed <<
+    " s (" << num_scans / elapsed << " scans/s)" << std::endl;
+  std::cout << pcl_l->stage_profiler_.report();
+
+  pcl_l->deactivate();
+  pcl_l->cleanup();
+  rclcpp::shutdown();
+
+  return 0;
+}
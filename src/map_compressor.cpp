@@ -0,0 +1,73 @@
+#include <pcl/io/pcd_io.h>
+#include <pcl/io/ply_io.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "lidar_localization/compressed_map.hpp"
+
+// Converts a pcd/ply map to the tiled .lmt format and compares loading both files.
+int main(int argc, char ** argv)
+{
+  if (argc < 3) {
+    std::cerr << "usage: lidar_map_compressor <input.pcd|input.ply> <output.lmt>"
+              << " [tile_size=20.0] [quantization=0.001]" << std::endl;
+    return 1;
+  }
+  const std::string input_path = argv[1];
+  const std::string output_path = argv[2];
+  const double tile_size = argc > 3 ? std::stod(argv[3]) : 20.0;
+  const double quantization = argc > 4 ? std::stod(argv[4]) : 0.001;
+
+  auto elapsed = [](const std::chrono::steady_clock::time_point & start) {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+  auto file_size = [](const std::string & path) {
+      std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+      return static_cast<double>(ifs.tellg());
+    };
+
+  pcl::PointCloud<pcl::PointXYZI> cloud;
+  auto start = std::chrono::steady_clock::now();
+  int result = -1;
+  if (input_path.find(".pcd") != std::string::npos) {
+    result = pcl::io::loadPCDFile(input_path, cloud);
+  } else if (input_path.find(".ply") != std::string::npos) {
+    result = pcl::io::loadPLYFile(input_path, cloud);
+  }
+  if (result != 0) {
+    std::cerr << "failed to load " << input_path << std::endl;
+    return 1;
+  }
+  const double load_time = elapsed(start);
+
+  start = std::chrono::steady_clock::now();
+  if (!CompressedMap::write(output_path, cloud, tile_size, quantization)) {
+    std::cerr << "failed to write " << output_path << std::endl;
+    return 1;
+  }
+  const double write_time = elapsed(start);
+
+  CompressedMap compressed_map;
+  pcl::PointCloud<pcl::PointXYZI> decompressed;
+  start = std::chrono::steady_clock::now();
+  if (!compressed_map.open(output_path) || !compressed_map.readAll(decompressed)) {
+    std::cerr << "failed to read back " << output_path << std::endl;
+    return 1;
+  }
+  const double read_time = elapsed(start);
+
+  const double input_size = file_size(input_path);
+  const double output_size = file_size(output_path);
+  const double mpts = cloud.size() * 1e-6;
+  std::cout << "points: " << cloud.size() << ", tiles: " << compressed_map.getTiles().size()
+            << std::endl;
+  std::cout << "size: " << input_size * 1e-6 << " MB -> " << output_size * 1e-6 << " MB (ratio "
+            << input_size / output_size << ")" << std::endl;
+  std::cout << "write: " << write_time << " s" << std::endl;
+  std::cout << "load input: " << load_time << " s (" << mpts / load_time << " Mpts/s)" << std::endl;
+  std::cout << "load lmt: " << read_time << " s (" << mpts / read_time << " Mpts/s)" << std::endl;
+  return 0;
+}
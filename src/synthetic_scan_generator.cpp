@@ -0,0 +1,314 @@
+#include <pcl/io/pcd_io.h>
+#include <pcl_conversions/pcl_conversions.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+
+#include "geometry_msgs/msg/pose_with_covariance_stamped.hpp"
+#include "sensor_msgs/msg/imu.hpp"
+#include "sensor_msgs/msg/point_cloud2.hpp"
+
+#include "lidar_localization/input_log.hpp"
+#include "lidar_localization/synthetic_lidar.hpp"
+
+// Generates an input log (scans, imu and the initial pose) and its ground truth by raycasting a
+// map along a scripted trajectory, so that the node can be replayed and evaluated without a
+// recorded dataset. Without --map, a procedural city-block map is generated and written too.
+namespace
+{
+
+const double kGravity = 9.80665;  /*[m/s^2]*/
+
+struct Options
+{
+  std::string output_dir{"."};
+  std::string map_path;
+  std::string frame_id{"base_link"};
+  std::string trajectory{"figure8"};
+  double duration{60.0};  /*[sec]*/
+  double speed{2.0};  /*[m/s]*/
+  double radius{30.0};  /*[m]*/
+  double sensor_height{1.8};  /*[m]*/
+  double scan_period{0.1};  /*[sec]*/
+  double imu_rate{200.0};  /*[Hz]*/
+  double gyro_noise{0.001};  /*[rad/s]*/
+  double accel_noise{0.01};  /*[m/s^2]*/
+  double voxel_size{0.1};  /*[m]*/
+  double map_size{120.0};  /*[m]*/
+  int seed{0};
+  SyntheticLidar::BeamModel beam_model;
+};
+
+void printUsage()
+{
+  std::cerr <<
+    "usage: lidar_synthetic_scans [--output-dir dir] [--map map.pcd] [--frame-id base_link]\n"
+    "  [--trajectory figure8|circle] [--duration 60] [--speed 2.0] [--radius 30]\n"
+    "  [--sensor-height 1.8] [--scan-period 0.1] [--channels 16] [--columns 1800]\n"
+    "  [--min-elevation -15] [--max-elevation 15] [--max-range 100] [--range-noise 0.02]\n"
+    "  [--imu-rate 200] [--gyro-noise 0.001] [--accel-noise 0.01] [--voxel-size 0.1]\n"
+    "  [--organized 0] [--map-size 120] [--seed 0]\n"
+    "writes inputs.log, ground_truth.txt (TUM) and map.pcd when no map is given" << std::endl;
+}
+
+bool parseOptions(int argc, char ** argv, Options & options)
+{
+  std::map<std::string, std::string> values;
+  for (int i = 1; i < argc; i += 2) {
+    const std::string key = argv[i];
+    if (key.compare(0, 2, "--") != 0 || i + 1 >= argc) {return false;}
+    values[key.substr(2)] = argv[i + 1];
+  }
+  auto get = [&values](const std::string & key, auto & value) {
+      auto it = values.find(key);
+      if (it == values.end()) {return;}
+      std::istringstream iss(it->second);
+      iss >> value;
+      values.erase(it);
+    };
+  double min_elevation_deg = options.beam_model.min_elevation * 180.0 / M_PI;
+  double max_elevation_deg = options.beam_model.max_elevation * 180.0 / M_PI;
+  get("output-dir", options.output_dir);
+  get("map", options.map_path);
+  get("frame-id", options.frame_id);
+  get("trajectory", options.trajectory);
+  get("duration", options.duration);
+  get("speed", options.speed);
+  get("radius", options.radius);
+  get("sensor-height", options.sensor_height);
+  get("scan-period", options.scan_period);
+  get("channels", options.beam_model.channels);
+  get("columns", options.beam_model.columns);
+  get("min-elevation", min_elevation_deg);
+  get("max-elevation", max_elevation_deg);
+  get("max-range", options.beam_model.max_range);
+  get("range-noise", options.beam_model.range_noise);
+  get("organized", options.beam_model.organized);
+  get("imu-rate", options.imu_rate);
+  get("gyro-noise", options.gyro_noise);
+  get("accel-noise", options.accel_noise);
+  get("voxel-size", options.voxel_size);
+  get("map-size", options.map_size);
+  get("seed", options.seed);
+  options.beam_model.min_elevation = min_elevation_deg * M_PI / 180.0;
+  options.beam_model.max_elevation = max_elevation_deg * M_PI / 180.0;
+  for (const auto & value : values) {
+    std::cerr << "unknown option --" << value.first << std::endl;
+  }
+  return values.empty() && (options.trajectory == "figure8" || options.trajectory == "circle");
+}
+
+// Ground, blocks of buildings along streets crossing every 40 m, and poles along the streets.
+// Points are spaced by the voxel size so that rays can't slip through the surfaces.
+pcl::PointCloud<pcl::PointXYZI>::Ptr generateMap(const Options & options, std::mt19937 & rng)
+{
+  pcl::PointCloud<pcl::PointXYZI>::Ptr map(new pcl::PointCloud<pcl::PointXYZI>);
+  const double spacing = options.voxel_size;
+  const double half = 0.5 * options.map_size;
+  auto add = [&map](const double x, const double y, const double z, const float intensity) {
+      pcl::PointXYZI p;
+      p.x = static_cast<float>(x);
+      p.y = static_cast<float>(y);
+      p.z = static_cast<float>(z);
+      p.intensity = intensity;
+      map->push_back(p);
+    };
+  auto add_box = [&](const double x0, const double y0, const double x1, const double y1,
+    const double height, const float intensity) {
+      for (double z = 0.0; z <= height; z += spacing) {
+        for (double x = x0; x <= x1; x += spacing) {
+          add(x, y0, z, intensity);
+          add(x, y1, z, intensity);
+        }
+        for (double y = y0; y <= y1; y += spacing) {
+          add(x0, y, z, intensity);
+          add(x1, y, z, intensity);
+        }
+      }
+    };
+
+  for (double x = -half; x < half; x += spacing) {
+    for (double y = -half; y < half; y += spacing) {
+      add(x, y, 0.0, 10.0f);
+    }
+  }
+
+  const double block = 40.0;
+  const double street = 12.0;
+  std::uniform_real_distribution<double> height(4.0, 20.0);
+  std::uniform_real_distribution<double> inset(0.0, 4.0);
+  std::uniform_real_distribution<double> intensity(20.0, 100.0);
+  for (double bx = -half; bx + block <= half; bx += block) {
+    for (double by = -half; by + block <= half; by += block) {
+      const double x0 = bx + 0.5 * street + inset(rng);
+      const double y0 = by + 0.5 * street + inset(rng);
+      const double x1 = bx + block - 0.5 * street - inset(rng);
+      const double y1 = by + block - 0.5 * street - inset(rng);
+      add_box(x0, y0, x1, y1, height(rng), static_cast<float>(intensity(rng)));
+      // a pole at the street corner
+      add_box(bx + 1.0, by + 1.0, bx + 1.3, by + 1.3, 6.0, 200.0f);
+    }
+  }
+  map->width = map->size();
+  map->height = 1;
+  return map;
+}
+
+// Base pose along the trajectory, heading along the direction of travel.
+Eigen::Isometry3d trajectoryPose(const Options & options, const double time)
+{
+  const double w = options.speed / options.radius;
+  double x, y, dx, dy;
+  if (options.trajectory == "circle") {
+    x = options.radius * std::cos(w * time);
+    y = options.radius * std::sin(w * time);
+    dx = -std::sin(w * time);
+    dy = std::cos(w * time);
+  } else {
+    // figure eight through the origin
+    x = options.radius * std::sin(w * time);
+    y = 0.5 * options.radius * std::sin(2.0 * w * time);
+    dx = std::cos(w * time);
+    dy = std::cos(2.0 * w * time);
+  }
+  Eigen::Isometry3d pose = Eigen::Isometry3d::Identity();
+  pose.translation() = Eigen::Vector3d(x, y, options.sensor_height);
+  pose.linear() = Eigen::AngleAxisd(std::atan2(dy, dx), Eigen::Vector3d::UnitZ()).toRotationMatrix();
+  return pose;
+}
+
+builtin_interfaces::msg::Time toStamp(const double time)
+{
+  builtin_interfaces::msg::Time stamp;
+  stamp.sec = static_cast<int32_t>(std::floor(time));
+  stamp.nanosec = static_cast<uint32_t>(std::round((time - stamp.sec) * 1e9)) % 1000000000u;
+  return stamp;
+}
+
+}  // namespace
+
+int main(int argc, char ** argv)
+{
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    printUsage();
+    return 1;
+  }
+  std::mt19937 rng(options.seed);
+
+  pcl::PointCloud<pcl::PointXYZI>::Ptr map(new pcl::PointCloud<pcl::PointXYZI>);
+  if (options.map_path.empty()) {
+    map = generateMap(options, rng);
+    const std::string map_path = options.output_dir + "/map.pcd";
+    pcl::io::savePCDFileBinary(map_path, *map);
+    std::cout << "generated " << map->size() << " map points: " << map_path << std::endl;
+  } else if (pcl::io::loadPCDFile(options.map_path, *map) != 0) {
+    std::cerr << "failed to load " << options.map_path << std::endl;
+    return 1;
+  }
+
+  SyntheticLidar lidar;
+  lidar.setBeamModel(options.beam_model);
+  lidar.setMap(*map, options.voxel_size);
+
+  InputLog log;
+  if (!log.openForWrite(options.output_dir + "/inputs.log")) {
+    std::cerr << "failed to open " << options.output_dir << "/inputs.log" << std::endl;
+    return 1;
+  }
+  std::ofstream ground_truth(options.output_dir + "/ground_truth.txt");
+  ground_truth << std::fixed << std::setprecision(9);
+
+  // starts away from 0 so that unstamped messages of a recording would sort first
+  const double start_time = 1000.0;
+  auto pose_at = [&options, start_time](const double time) {
+      return trajectoryPose(options, time - start_time);
+    };
+
+  geometry_msgs::msg::PoseWithCovarianceStamped initial_pose;
+  initial_pose.header.stamp = toStamp(start_time);
+  initial_pose.header.frame_id = "map";
+  const Eigen::Isometry3d start_pose = pose_at(start_time);
+  const Eigen::Quaterniond start_quat(start_pose.linear());
+  initial_pose.pose.pose.position.x = start_pose.translation().x();
+  initial_pose.pose.pose.position.y = start_pose.translation().y();
+  initial_pose.pose.pose.position.z = start_pose.translation().z();
+  initial_pose.pose.pose.orientation.x = start_quat.x();
+  initial_pose.pose.pose.orientation.y = start_quat.y();
+  initial_pose.pose.pose.orientation.z = start_quat.z();
+  initial_pose.pose.pose.orientation.w = start_quat.w();
+  log.write(InputLog::INITIAL_POSE, initial_pose.header.stamp, initial_pose);
+
+  std::normal_distribution<double> gyro_noise(0.0, options.gyro_noise);
+  std::normal_distribution<double> accel_noise(0.0, options.accel_noise);
+  const double imu_period = 1.0 / options.imu_rate;
+  const double h = 1e-3;  // finite difference step[sec]
+  double imu_time = start_time;
+  size_t num_scans = 0;
+  size_t num_points = 0;
+  const auto wall_start = std::chrono::steady_clock::now();
+  for (double scan_time = start_time; scan_time < start_time + options.duration;
+    scan_time += options.scan_period)
+  {
+    // imu samples up to the end of the sweep come before the scan
+    for (; imu_time < scan_time + options.scan_period; imu_time += imu_period) {
+      const Eigen::Isometry3d before = pose_at(imu_time - h);
+      const Eigen::Isometry3d now = pose_at(imu_time);
+      const Eigen::Isometry3d after = pose_at(imu_time + h);
+      const Eigen::AngleAxisd delta(before.linear().transpose() * after.linear());
+      const Eigen::Vector3d angular_velocity = delta.axis() * delta.angle() / (2.0 * h);
+      const Eigen::Vector3d acceleration =
+        (after.translation() - 2.0 * now.translation() + before.translation()) / (h * h);
+      // accelerometers measure the specific force, gravity included
+      const Eigen::Vector3d specific_force =
+        now.linear().transpose() * (acceleration + Eigen::Vector3d(0.0, 0.0, kGravity));
+      const Eigen::Quaterniond quat(now.linear());
+
+      sensor_msgs::msg::Imu imu;
+      imu.header.stamp = toStamp(imu_time);
+      imu.header.frame_id = options.frame_id;
+      imu.orientation.x = quat.x();
+      imu.orientation.y = quat.y();
+      imu.orientation.z = quat.z();
+      imu.orientation.w = quat.w();
+      imu.angular_velocity.x = angular_velocity.x() + gyro_noise(rng);
+      imu.angular_velocity.y = angular_velocity.y() + gyro_noise(rng);
+      imu.angular_velocity.z = angular_velocity.z() + gyro_noise(rng);
+      imu.linear_acceleration.x = specific_force.x() + accel_noise(rng);
+      imu.linear_acceleration.y = specific_force.y() + accel_noise(rng);
+      imu.linear_acceleration.z = specific_force.z() + accel_noise(rng);
+      log.write(InputLog::IMU, imu.header.stamp, imu);
+    }
+
+    pcl::PointCloud<pcl::PointXYZI>::Ptr scan =
+      lidar.scan(pose_at, scan_time, options.scan_period, rng);
+    sensor_msgs::msg::PointCloud2 cloud_msg;
+    pcl::toROSMsg(*scan, cloud_msg);
+    cloud_msg.header.stamp = toStamp(scan_time);
+    cloud_msg.header.frame_id = options.frame_id;
+    log.write(InputLog::CLOUD, cloud_msg.header.stamp, cloud_msg);
+
+    const Eigen::Isometry3d pose = pose_at(scan_time);
+    const Eigen::Quaterniond quat(pose.linear());
+    ground_truth << scan_time << " " << pose.translation().x() << " " <<
+      pose.translation().y() << " " << pose.translation().z() << " " << quat.x() << " " <<
+      quat.y() << " " << quat.z() << " " << quat.w() << "\n";
+    ++num_scans;
+    num_points += scan->size();
+  }
+  log.close();
+
+  const double elapsed =
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+  std::cout << num_scans << " scans, " << num_points / std::max<size_t>(num_scans, 1) <<
+    " points per scan, generated in " << elapsed << " s" << std::endl;
+  return 0;
+}
@@ -0,0 +1,221 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "lidar_localization/compressed_map.hpp"
+#include "lidar_localization/map_tiles.hpp"
+
+namespace
+{
+
+using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+
+const double kTileSize = 20.0;
+const double kQuantization = 0.001;
+const double kGridStep = 0.1;
+
+// Points on a 0.1 m grid over four tiles, moved by less than half a step so that the grid cell
+// identifies each point once decoded.
+Cloud makeCloud()
+{
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<float> jitter(-0.02f, 0.02f);
+  std::uniform_real_distribution<float> intensity(0.0f, 255.0f);
+  Cloud cloud;
+  for (int ix = -150; ix < 150; ix += 3) {
+    for (int iy = -150; iy < 150; iy += 3) {
+      pcl::PointXYZI p;
+      p.x = static_cast<float>(ix * kGridStep) + jitter(rng);
+      p.y = static_cast<float>(iy * kGridStep) + jitter(rng);
+      p.z = static_cast<float>(((ix + iy) % 40) * kGridStep) + jitter(rng);
+      p.intensity = intensity(rng);
+      cloud.push_back(p);
+    }
+  }
+  return cloud;
+}
+
+std::tuple<long, long, long> getCell(const pcl::PointXYZI & p)
+{
+  return std::make_tuple(
+    std::lround(p.x / kGridStep), std::lround(p.y / kGridStep), std::lround(p.z / kGridStep));
+}
+
+void sortByCell(Cloud & cloud)
+{
+  std::sort(
+    cloud.points.begin(), cloud.points.end(),
+    [](const pcl::PointXYZI & a, const pcl::PointXYZI & b) {
+      return getCell(a) < getCell(b);
+    });
+}
+
+std::string getPath(const std::string & name)
+{
+  return testing::TempDir() + name;
+}
+
+std::string readFile(const std::string & path)
+{
+  std::ifstream ifs(path, std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::string & path, const std::string & bytes)
+{
+  std::ofstream ofs(path, std::ios::binary);
+  ofs.write(bytes.data(), bytes.size());
+}
+
+template<typename T>
+void patch(std::string & bytes, const size_t offset, const T value)
+{
+  std::memcpy(&bytes[offset], &value, sizeof(value));
+}
+
+// as laid out in compressed_map.hpp
+const size_t kNumTilesOffset = 24;
+const size_t kIndexOffset = 32;
+const size_t kNumPointsOffset = kIndexOffset + 24;
+
+}  // namespace
+
+TEST(CompressedMap, RoundTripsWithinQuantization)
+{
+  Cloud cloud = makeCloud();
+  const std::string path = getPath("round_trip.lmtc");
+  ASSERT_TRUE(CompressedMap::write(path, cloud, kTileSize, kQuantization));
+
+  CompressedMap map;
+  ASSERT_TRUE(map.open(path));
+  EXPECT_EQ(kTileSize, map.getTileSize());
+  EXPECT_EQ(4u, map.getTiles().size());
+  // keyed as MapTiles
+  EXPECT_EQ(1u, map.getTiles().count(MapTiles::getKey(-1, 0)));
+  EXPECT_EQ(1u, map.getTiles().count(MapTiles::getKey(0, -1)));
+
+  Cloud decoded;
+  ASSERT_TRUE(map.readAll(decoded));
+  ASSERT_EQ(cloud.size(), decoded.size());
+  sortByCell(cloud);
+  sortByCell(decoded);
+  for (size_t i = 0; i < cloud.size(); ++i) {
+    ASSERT_EQ(getCell(cloud.points[i]), getCell(decoded.points[i]));
+    EXPECT_NEAR(cloud.points[i].x, decoded.points[i].x, 0.5 * kQuantization + 1e-5);
+    EXPECT_NEAR(cloud.points[i].y, decoded.points[i].y, 0.5 * kQuantization + 1e-5);
+    EXPECT_NEAR(cloud.points[i].z, decoded.points[i].z, 0.5 * kQuantization + 1e-5);
+    EXPECT_NEAR(cloud.points[i].intensity, decoded.points[i].intensity, 0.01);
+  }
+}
+
+TEST(CompressedMap, ReadsTheTilesInRadius)
+{
+  const std::string path = getPath("radius.lmtc");
+  ASSERT_TRUE(CompressedMap::write(path, makeCloud(), kTileSize, kQuantization));
+  CompressedMap map;
+  ASSERT_TRUE(map.open(path));
+
+  const std::vector<uint64_t> keys = map.getTileKeysInRadius(10.0, 10.0, 5.0);
+  ASSERT_EQ(1u, keys.size());
+  EXPECT_EQ(MapTiles::getKey(0, 0), keys[0]);
+  Cloud tile;
+  ASSERT_TRUE(map.readTile(keys[0], tile));
+  EXPECT_EQ(map.getTiles().at(keys[0]).num_points, tile.size());
+  for (const auto & p : tile.points) {
+    EXPECT_GE(p.x, 0.0f);
+    EXPECT_GE(p.y, 0.0f);
+  }
+  EXPECT_EQ(4u, map.getTileKeysInRadius(0.0, 0.0, 1.0).size());
+}
+
+// A NaN intensity is stored as the lowest of its tile and infinite ones are clamped, without
+// spreading to the other points. Points with a non finite coordinate are dropped.
+TEST(CompressedMap, SanitizesNonFiniteValues)
+{
+  Cloud cloud;
+  const float intensities[] = {
+    5.0f, 10.0f, std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::infinity(),
+    -std::numeric_limits<float>::infinity()};
+  for (int i = 0; i < 5; ++i) {
+    pcl::PointXYZI p;
+    p.x = static_cast<float>(i);
+    p.y = 1.0f;
+    p.z = 0.0f;
+    p.intensity = intensities[i];
+    cloud.push_back(p);
+  }
+  pcl::PointXYZI dropped = cloud.points[0];
+  dropped.x = std::numeric_limits<float>::quiet_NaN();
+  cloud.push_back(dropped);
+
+  const std::string path = getPath("non_finite.lmtc");
+  ASSERT_TRUE(CompressedMap::write(path, cloud, kTileSize, kQuantization));
+  CompressedMap map;
+  ASSERT_TRUE(map.open(path));
+  Cloud decoded;
+  ASSERT_TRUE(map.readAll(decoded));
+  ASSERT_EQ(5u, decoded.size());
+  const float expected[] = {5.0f, 10.0f, 5.0f, 10.0f, 5.0f};
+  for (const auto & p : decoded.points) {
+    const int i = static_cast<int>(std::lround(p.x));
+    ASSERT_GE(i, 0);
+    ASSERT_LT(i, 5);
+    EXPECT_NEAR(expected[i], p.intensity, 1e-3) << "point " << i;
+  }
+}
+
+TEST(CompressedMap, RejectsTruncatedFile)
+{
+  const std::string path = getPath("truncated.lmtc");
+  ASSERT_TRUE(CompressedMap::write(path, makeCloud(), kTileSize, kQuantization));
+  const std::string bytes = readFile(path);
+
+  // in the last blob, in the index and in the header
+  for (const size_t size : {bytes.size() - 10, kIndexOffset + 40, kNumTilesOffset}) {
+    writeFile(path, bytes.substr(0, size));
+    CompressedMap map;
+    EXPECT_FALSE(map.open(path)) << "truncated to " << size << " bytes";
+  }
+}
+
+TEST(CompressedMap, RejectsCorruptIndex)
+{
+  const std::string path = getPath("corrupt.lmtc");
+  ASSERT_TRUE(CompressedMap::write(path, makeCloud(), kTileSize, kQuantization));
+  const std::string bytes = readFile(path);
+
+  std::string corrupt = bytes;
+  patch<uint64_t>(corrupt, kNumTilesOffset, 1ULL << 60);
+  writeFile(path, corrupt);
+  CompressedMap map;
+  EXPECT_FALSE(map.open(path));
+
+  corrupt = bytes;
+  patch<uint64_t>(corrupt, kNumPointsOffset, 1ULL << 40);
+  writeFile(path, corrupt);
+  EXPECT_FALSE(map.open(path));
+
+  corrupt = bytes;
+  patch<double>(corrupt, 8, std::numeric_limits<double>::quiet_NaN());
+  writeFile(path, corrupt);
+  EXPECT_FALSE(map.open(path));
+
+  // a point count not matching its blob passes the index, but not the decoding
+  corrupt = bytes;
+  uint64_t num_points;
+  std::memcpy(&num_points, &corrupt[kNumPointsOffset], sizeof(num_points));
+  patch<uint64_t>(corrupt, kNumPointsOffset, num_points + 1);
+  writeFile(path, corrupt);
+  ASSERT_TRUE(map.open(path));
+  Cloud decoded;
+  EXPECT_FALSE(map.readAll(decoded));
+}
@@ -0,0 +1,146 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+
+#include "lidar_localization/lifelong_map.hpp"
+#include "lidar_localization/map_tiles.hpp"
+
+namespace
+{
+
+using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+
+const double kTileSize = 20.0;
+// not a divisor of the tile size, so the voxel [19.8, 20.1) crosses the border at x = 20
+const double kVoxelSize = 0.3;
+
+pcl::PointXYZI makePoint(const float x, const float y, const float z = 0.15f)
+{
+  pcl::PointXYZI p;
+  p.x = x;
+  p.y = y;
+  p.z = z;
+  p.intensity = 1.0f;
+  return p;
+}
+
+void configure(LifelongMap & map)
+{
+  map.setVoxelSize(kVoxelSize);
+  map.setTileSize(kTileSize);
+  map.setDecay(0.5);
+  map.setWeightRange(0.6, 10.0);
+}
+
+bool contains(const Cloud & cloud, const float x, const float y)
+{
+  for (const auto & p : cloud.points) {
+    if (std::abs(p.x - x) < 1e-4f && std::abs(p.y - y) < 1e-4f) {return true;}
+  }
+  return false;
+}
+
+}  // namespace
+
+// A map delta replaces the tiles it touches, as MapTiles::replaceTiles, and leaves the others.
+TEST(LifelongMap, ReplacesOnlyTheTouchedTiles)
+{
+  LifelongMap map;
+  configure(map);
+  Cloud cloud;
+  cloud.push_back(makePoint(5.15f, 5.15f));
+  cloud.push_back(makePoint(25.15f, 5.15f));
+  cloud.push_back(makePoint(-5.15f, -5.15f));
+  map.setCloud(cloud);
+
+  Cloud delta;
+  delta.push_back(makePoint(8.15f, 2.15f));
+  map.replaceTiles(delta);
+
+  const Cloud::Ptr extracted = map.extract();
+  EXPECT_EQ(3u, extracted->size());
+  EXPECT_FALSE(contains(*extracted, 5.15f, 5.15f));
+  EXPECT_TRUE(contains(*extracted, 8.15f, 2.15f));
+  EXPECT_TRUE(contains(*extracted, 25.15f, 5.15f));
+  EXPECT_TRUE(contains(*extracted, -5.15f, -5.15f));
+}
+
+// A voxel crossing a tile border is kept as one voxel per tile, under the keys of MapTiles.
+TEST(LifelongMap, SplitsBorderVoxelsByTile)
+{
+  LifelongMap map;
+  configure(map);
+  Cloud scan;
+  scan.push_back(makePoint(19.9f, 0.15f));
+  scan.push_back(makePoint(20.05f, 0.15f));
+  map.integrate(scan, Eigen::Vector3f(19.95f, 10.0f, 0.15f));
+
+  std::unordered_map<uint64_t, Cloud::Ptr> changed = map.extractChangedTiles();
+  ASSERT_EQ(2u, changed.size());
+  const uint64_t left = MapTiles::getKey(
+    MapTiles::getIndex(19.9, kTileSize), MapTiles::getIndex(0.15, kTileSize));
+  const uint64_t right = MapTiles::getKey(
+    MapTiles::getIndex(20.05, kTileSize), MapTiles::getIndex(0.15, kTileSize));
+  ASSERT_EQ(1u, changed.count(left));
+  ASSERT_EQ(1u, changed.count(right));
+  ASSERT_EQ(1u, changed[left]->size());
+  ASSERT_EQ(1u, changed[right]->size());
+  EXPECT_NEAR(19.9f, changed[left]->points[0].x, 1e-4f);
+  EXPECT_NEAR(20.05f, changed[right]->points[0].x, 1e-4f);
+  EXPECT_TRUE(map.extractChangedTiles().empty());
+}
+
+// A ray through the border voxel decays both its halves, and a tile left without voxels is
+// returned empty so that it is cleared from the map. Voxels off the ray are kept.
+TEST(LifelongMap, DecaysSeenThroughVoxelsInEveryTile)
+{
+  LifelongMap map;
+  configure(map);
+  Cloud cloud;
+  cloud.push_back(makePoint(19.9f, 0.15f));
+  cloud.push_back(makePoint(20.05f, 0.15f));
+  cloud.push_back(makePoint(15.15f, 5.15f));
+  map.setCloud(cloud);
+
+  Cloud scan;
+  scan.push_back(makePoint(30.1f, 0.15f));
+  map.integrate(scan, Eigen::Vector3f(10.15f, 0.15f, 0.15f));
+
+  const Cloud::Ptr extracted = map.extract();
+  EXPECT_EQ(2u, extracted->size());
+  EXPECT_FALSE(contains(*extracted, 19.9f, 0.15f));
+  EXPECT_FALSE(contains(*extracted, 20.05f, 0.15f));
+  EXPECT_TRUE(contains(*extracted, 15.15f, 5.15f));
+  EXPECT_TRUE(contains(*extracted, 30.1f, 0.15f));
+
+  std::unordered_map<uint64_t, Cloud::Ptr> changed = map.extractChangedTiles();
+  const uint64_t left = MapTiles::getKey(0, 0);
+  const uint64_t right = MapTiles::getKey(1, 0);
+  ASSERT_EQ(1u, changed.count(left));
+  ASSERT_EQ(1u, changed.count(right));
+  // the voxel off the ray is still there
+  EXPECT_EQ(1u, changed[left]->size());
+  EXPECT_EQ(1u, changed[right]->size());
+  EXPECT_NEAR(30.1f, changed[right]->points[0].x, 1e-4f);
+}
+
+TEST(LifelongMap, BoundsTheDecayedRays)
+{
+  LifelongMap map;
+  configure(map);
+  map.setMaxRayLength(5.0);
+  Cloud cloud;
+  cloud.push_back(makePoint(12.05f, 0.15f));
+  cloud.push_back(makePoint(19.9f, 0.15f));
+  map.setCloud(cloud);
+
+  Cloud scan;
+  scan.push_back(makePoint(30.1f, 0.15f));
+  map.integrate(scan, Eigen::Vector3f(10.15f, 0.15f, 0.15f));
+
+  const Cloud::Ptr extracted = map.extract();
+  EXPECT_FALSE(contains(*extracted, 12.05f, 0.15f));
+  EXPECT_TRUE(contains(*extracted, 19.9f, 0.15f));
+}
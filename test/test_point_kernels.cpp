@@ -0,0 +1,192 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "lidar_localization/point_kernels.hpp"
+
+namespace
+{
+
+// Points spread over the range of a scan, with some on the voxel borders and some non finite,
+// and a size that leaves a tail for the scalar loop of every kernel.
+pcl::PointCloud<pcl::PointXYZI> makeCloud()
+{
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<float> coordinate(-80.0f, 80.0f);
+  pcl::PointCloud<pcl::PointXYZI> cloud;
+  for (int i = 0; i < 1027; ++i) {
+    pcl::PointXYZI p;
+    p.x = coordinate(rng);
+    p.y = coordinate(rng);
+    p.z = 0.1f * coordinate(rng);
+    p.intensity = static_cast<float>(i);
+    if (i % 50 == 0) {
+      p.x = 0.2f * static_cast<float>(i / 50 - 10);
+      p.y = -p.x;
+    }
+    cloud.push_back(p);
+  }
+  cloud.points[3].x = std::numeric_limits<float>::quiet_NaN();
+  cloud.points[10].y = std::numeric_limits<float>::infinity();
+  cloud.points[17].z = -std::numeric_limits<float>::infinity();
+  cloud.points[1026].x = std::numeric_limits<float>::quiet_NaN();
+  return cloud;
+}
+
+Eigen::Matrix4f makeMatrix()
+{
+  Eigen::Affine3f affine(Eigen::AngleAxisf(0.3f, Eigen::Vector3f(0.1f, 0.2f, 1.0f).normalized()));
+  affine.translation() = Eigen::Vector3f(12.5f, -3.25f, 0.7f);
+  return affine.matrix();
+}
+
+// same bits, so NaN matches NaN
+void expectSamePoints(const pcl::PointXYZI & a, const pcl::PointXYZI & b)
+{
+  EXPECT_EQ(0, std::memcmp(&a.x, &b.x, sizeof(float)));
+  EXPECT_EQ(0, std::memcmp(&a.y, &b.y, sizeof(float)));
+  EXPECT_EQ(0, std::memcmp(&a.z, &b.z, sizeof(float)));
+  EXPECT_EQ(0, std::memcmp(&a.intensity, &b.intensity, sizeof(float)));
+}
+
+}  // namespace
+
+TEST(PointKernels, VoxelKeysMatchScalar)
+{
+  const pcl::PointCloud<pcl::PointXYZI> cloud = makeCloud();
+  for (const double leaf_size : {0.2, 1.0}) {
+    std::vector<uint64_t> keys(cloud.size()), reference(cloud.size());
+    PointKernels::voxelKeys(cloud.points.data(), cloud.size(), 1.0 / leaf_size, keys.data());
+    PointKernels::voxelKeysScalar(
+      cloud.points.data(), cloud.size(), 1.0 / leaf_size, reference.data());
+    EXPECT_EQ(reference, keys) << PointKernels::isa() << " leaf " << leaf_size;
+  }
+}
+
+TEST(PointKernels, CropRangeMatchesScalar)
+{
+  const pcl::PointCloud<pcl::PointXYZI> cloud = makeCloud();
+  pcl::PointCloud<pcl::PointXYZI> cropped, reference;
+  PointKernels::cropRange(cloud, 1.0, 60.0, cropped);
+  PointKernels::cropRangeScalar(cloud, 1.0, 60.0, reference);
+  ASSERT_EQ(reference.size(), cropped.size()) << PointKernels::isa();
+  for (size_t i = 0; i < reference.size(); ++i) {
+    expectSamePoints(reference.points[i], cropped.points[i]);
+  }
+}
+
+TEST(PointKernels, TransformMatchesScalar)
+{
+  const pcl::PointCloud<pcl::PointXYZI> cloud = makeCloud();
+  const Eigen::Matrix4f matrix = makeMatrix();
+  pcl::PointCloud<pcl::PointXYZI> transformed, reference;
+  PointKernels::transform(cloud, matrix, transformed);
+  PointKernels::transformScalar(cloud, matrix, reference);
+  ASSERT_EQ(reference.size(), transformed.size());
+  for (size_t i = 0; i < reference.size(); ++i) {
+    expectSamePoints(reference.points[i], transformed.points[i]);
+  }
+
+  // in place
+  pcl::PointCloud<pcl::PointXYZI> in_place = cloud;
+  PointKernels::transform(in_place, matrix, in_place);
+  for (size_t i = 0; i < reference.size(); ++i) {
+    expectSamePoints(reference.points[i], in_place.points[i]);
+  }
+}
+
+TEST(PointKernels, AzimuthsMatchAtan2)
+{
+  pcl::PointCloud<pcl::PointXYZI> cloud;
+  for (const auto & p : makeCloud().points) {
+    if (std::isfinite(p.x) && std::isfinite(p.y)) {cloud.push_back(p);}
+  }
+  std::vector<float> azimuths(cloud.size()), reference(cloud.size());
+  PointKernels::azimuths(cloud.points.data(), cloud.size(), azimuths.data());
+  PointKernels::azimuthsScalar(cloud.points.data(), cloud.size(), reference.data());
+  for (size_t i = 0; i < cloud.size(); ++i) {
+    // -pi and pi are the same direction
+    EXPECT_NEAR(0.0, std::remainder(azimuths[i] - reference[i], 2.0 * M_PI), 3e-7);
+  }
+}
+
+TEST(PointKernels, AccumulateNdtMatchesScalar)
+{
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<double> value(-1.0, 1.0);
+  // a full batch, and one leaving a tail for the scalar loop
+  for (const int size : {PointKernels::kNdtBatchSize, 37}) {
+    PointKernels::NdtTerms terms;
+    for (int i = 0; i < size; ++i) {
+      Eigen::Matrix3d a = Eigen::Matrix3d::Random();
+      const Eigen::Matrix3d icov = a * a.transpose() + Eigen::Matrix3d::Identity();
+      const Eigen::Vector3d q(20.0 * value(rng), 20.0 * value(rng), value(rng));
+      terms.add(std::abs(value(rng)), q, icov, icov * Eigen::Vector3d::Random());
+    }
+    double sums[PointKernels::kNdtSums] = {};
+    double reference[PointKernels::kNdtSums] = {};
+    PointKernels::accumulateNdt(terms, 0.3, sums);
+    PointKernels::accumulateNdtScalar(terms, 0.3, reference);
+    // only the summation order differs
+    for (int k = 0; k < PointKernels::kNdtSums; ++k) {
+      EXPECT_NEAR(reference[k], sums[k], 1e-9 * (1.0 + std::abs(reference[k])))
+        << PointKernels::isa() << " sum " << k << " of " << size << " terms";
+    }
+  }
+}
+
+#ifdef LIDAR_LOCALIZATION_X86
+// Every instruction set the CPU supports, not only the one picked at runtime.
+TEST(PointKernels, EachX86IsaMatchesScalar)
+{
+  const pcl::PointCloud<pcl::PointXYZI> cloud = makeCloud();
+  const Eigen::Matrix4f matrix = makeMatrix();
+  const double inv_leaf_size = 1.0 / 0.2;
+  std::vector<uint64_t> reference_keys(cloud.size());
+  PointKernels::voxelKeysScalar(
+    cloud.points.data(), cloud.size(), inv_leaf_size, reference_keys.data());
+  pcl::PointCloud<pcl::PointXYZI> reference_points;
+  PointKernels::transformScalar(cloud, matrix, reference_points);
+
+  using Isa = PointKernels::Isa;
+  for (const Isa isa : {Isa::kSse42, Isa::kAvx2, Isa::kAvx512}) {
+    if (PointKernels::getIsa() < isa) {continue;}
+    std::vector<uint64_t> keys(cloud.size());
+    std::vector<pcl::PointXYZI> points(cloud.size());
+    size_t num_keys = 0;
+    size_t num_points = 0;
+    switch (isa) {
+      case Isa::kSse42:
+        num_keys = PointKernelsX86::voxelKeysSse42(
+          cloud.points.data(), cloud.size(), inv_leaf_size, keys.data());
+        num_points = PointKernelsX86::transformSse42(
+          cloud.points.data(), cloud.size(), matrix, points.data());
+        break;
+      case Isa::kAvx2:
+        num_keys = PointKernelsX86::voxelKeysAvx2(
+          cloud.points.data(), cloud.size(), inv_leaf_size, keys.data());
+        num_points = PointKernelsX86::transformAvx2(
+          cloud.points.data(), cloud.size(), matrix, points.data());
+        break;
+      default:
+        num_keys = PointKernelsX86::voxelKeysAvx512(
+          cloud.points.data(), cloud.size(), inv_leaf_size, keys.data());
+        num_points = PointKernelsX86::transformAvx512(
+          cloud.points.data(), cloud.size(), matrix, points.data());
+        break;
+    }
+    EXPECT_GT(num_keys, 0u);
+    EXPECT_GT(num_points, 0u);
+    for (size_t i = 0; i < num_keys; ++i) {
+      EXPECT_EQ(reference_keys[i], keys[i]) << "isa " << static_cast<int>(isa) << " key " << i;
+    }
+    for (size_t i = 0; i < num_points; ++i) {
+      expectSamePoints(reference_points.points[i], points[i]);
+    }
+  }
+}
+#endif
@@ -0,0 +1,140 @@
+#include <gtest/gtest.h>
+
+#include <Eigen/Geometry>
+#include <cmath>
+
+#include "lidar_localization/pose_graph_smoother.hpp"
+
+namespace
+{
+
+Eigen::Matrix4d makePose(const double x, const double y, const double yaw)
+{
+  Eigen::Affine3d pose(Eigen::AngleAxisd(yaw, Eigen::Vector3d::UnitZ()));
+  pose.translation() = Eigen::Vector3d(x, y, 0.0);
+  return pose.matrix();
+}
+
+double getYaw(const Eigen::Matrix4d & pose)
+{
+  return std::atan2(pose(1, 0), pose(0, 0));
+}
+
+// A robot driving along x at 1 m per scan while turning, with an exact odometry expressed in
+// an odom frame away from the map frame.
+PoseGraphSmoother::Node makeNode(const int i, const bool has_odometry)
+{
+  const Eigen::Matrix4d map_to_odom = makePose(5.0, -3.0, 0.7);
+  PoseGraphSmoother::Node node;
+  node.stamp = 0.1 * i;
+  node.registered_pose = makePose(i, 0.0, 0.01 * i);
+  node.odometry_pose = map_to_odom.inverse() * node.registered_pose;
+  node.has_odometry = has_odometry;
+  return node;
+}
+
+}  // namespace
+
+// A registration slipping away is pulled back by the odometry and its neighbours.
+TEST(PoseGraphSmoother, PullsBackAnOutlier)
+{
+  PoseGraphSmoother smoother;
+  smoother.setWindowSize(10);
+  for (int i = 0; i < 10; ++i) {
+    PoseGraphSmoother::Node node = makeNode(i, true);
+    if (i == 5) {node.registered_pose = makePose(i, 0.5, 0.01 * i + 0.05);}
+    PoseGraphSmoother::Node removed;
+    EXPECT_FALSE(smoother.addNode(node, removed));
+  }
+  smoother.optimize();
+
+  ASSERT_EQ(10u, smoother.size());
+  for (size_t i = 0; i < smoother.size(); ++i) {
+    const Eigen::Matrix4d truth = makeNode(static_cast<int>(i), true).registered_pose;
+    const Eigen::Matrix4d & pose = smoother.getNode(i).pose;
+    EXPECT_LT((pose.block<3, 1>(0, 3) - truth.block<3, 1>(0, 3)).norm(), 0.1) << "node " << i;
+    EXPECT_NEAR(getYaw(truth), getYaw(pose), 0.01) << "node " << i;
+  }
+}
+
+// Without odometry there is nothing to smooth with.
+TEST(PoseGraphSmoother, KeepsTheRegisteredPosesWithoutOdometry)
+{
+  PoseGraphSmoother smoother;
+  for (int i = 0; i < 5; ++i) {
+    PoseGraphSmoother::Node node = makeNode(i, false);
+    if (i == 2) {node.registered_pose = makePose(i, 0.5, 0.2);}
+    PoseGraphSmoother::Node removed;
+    smoother.addNode(node, removed);
+  }
+  smoother.optimize();
+
+  for (size_t i = 0; i < smoother.size(); ++i) {
+    const PoseGraphSmoother::Node & node = smoother.getNode(i);
+    EXPECT_TRUE(node.pose.isApprox(node.registered_pose, 1e-6)) << "node " << i;
+  }
+}
+
+TEST(PoseGraphSmoother, SlidesTheWindow)
+{
+  PoseGraphSmoother smoother;
+  smoother.setWindowSize(3);
+  PoseGraphSmoother::Node removed;
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_FALSE(smoother.addNode(makeNode(i, true), removed));
+  }
+  ASSERT_TRUE(smoother.addNode(makeNode(3, true), removed));
+  EXPECT_DOUBLE_EQ(0.0, removed.stamp);
+  EXPECT_EQ(3u, smoother.size());
+  EXPECT_DOUBLE_EQ(0.1, smoother.getNode(0).stamp);
+}
+
+TEST(OdometryBuffer, InterpolatesBetweenSamples)
+{
+  OdometryBuffer buffer;
+  buffer.add(1.0, makePose(0.0, 0.0, 0.0));
+  buffer.add(2.0, makePose(2.0, 1.0, 0.4));
+
+  Eigen::Matrix4d pose;
+  ASSERT_TRUE(buffer.interpolate(1.5, 0.1, pose));
+  EXPECT_TRUE(pose.isApprox(makePose(1.0, 0.5, 0.2), 1e-9));
+  ASSERT_TRUE(buffer.interpolate(1.25, 0.1, pose));
+  EXPECT_NEAR(0.1, getYaw(pose), 1e-9);
+}
+
+// Outside of the samples, the nearest one is only used up to max_gap away.
+TEST(OdometryBuffer, RejectsStampsPastTheMaxGap)
+{
+  OdometryBuffer buffer;
+  Eigen::Matrix4d pose;
+  EXPECT_FALSE(buffer.interpolate(1.0, 0.1, pose));
+
+  buffer.add(1.0, makePose(0.0, 0.0, 0.0));
+  buffer.add(2.0, makePose(2.0, 1.0, 0.4));
+  ASSERT_TRUE(buffer.interpolate(2.05, 0.1, pose));
+  EXPECT_TRUE(pose.isApprox(makePose(2.0, 1.0, 0.4), 1e-9));
+  ASSERT_TRUE(buffer.interpolate(0.95, 0.1, pose));
+  EXPECT_TRUE(pose.isApprox(makePose(0.0, 0.0, 0.0), 1e-9));
+  EXPECT_FALSE(buffer.interpolate(2.2, 0.1, pose));
+  EXPECT_FALSE(buffer.interpolate(0.8, 0.1, pose));
+}
+
+TEST(OdometryBuffer, DropsOldAndReplacedSamples)
+{
+  OdometryBuffer buffer;
+  buffer.setMaxAge(1.0);
+  buffer.add(1.0, makePose(0.0, 0.0, 0.0));
+  buffer.add(2.0, makePose(1.0, 0.0, 0.0));
+  buffer.add(3.0, makePose(2.0, 0.0, 0.0));
+
+  Eigen::Matrix4d pose;
+  EXPECT_FALSE(buffer.interpolate(1.0, 0.1, pose));
+  ASSERT_TRUE(buffer.interpolate(2.5, 0.1, pose));
+  EXPECT_NEAR(1.5, pose(0, 3), 1e-9);
+
+  // an older sample replaces the newer ones
+  buffer.add(2.5, makePose(5.0, 0.0, 0.0));
+  ASSERT_TRUE(buffer.interpolate(2.5, 0.1, pose));
+  EXPECT_NEAR(5.0, pose(0, 3), 1e-9);
+  EXPECT_FALSE(buffer.interpolate(3.0, 0.1, pose));
+}
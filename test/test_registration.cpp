@@ -0,0 +1,160 @@
+#include <gtest/gtest.h>
+
+#include <pcl/common/transforms.h>
+#include <Eigen/Geometry>
+#include <cmath>
+#include <random>
+
+#include "lidar_localization/lazy_ndt.hpp"
+#include "lidar_localization/loam_registration.hpp"
+
+namespace
+{
+
+using Cloud = pcl::PointCloud<pcl::PointXYZI>;
+
+// with the roughness of the surfaces of a real map
+void addPoint(Cloud & cloud, const double x, const double y, const double z)
+{
+  static std::mt19937 rng(0);
+  std::normal_distribution<double> noise(0.0, 0.03);
+  pcl::PointXYZI p;
+  p.x = static_cast<float>(x + noise(rng));
+  p.y = static_cast<float>(y + noise(rng));
+  p.z = static_cast<float>(z + noise(rng));
+  p.intensity = 1.0f;
+  cloud.push_back(p);
+}
+
+// A 30 m square room with a floor, four walls, pillars and a box, which constrain the six
+// degrees of freedom, sampled every 0.1 m.
+Cloud::Ptr makeMap()
+{
+  Cloud::Ptr map(new Cloud);
+  const double step = 0.1;
+  for (double a = -15.0; a < 15.0; a += step) {
+    for (double b = -15.0; b < 15.0; b += step) {
+      addPoint(*map, a, b, 0.0);
+    }
+    for (double z = step; z < 4.0; z += step) {
+      addPoint(*map, a, -15.0, z);
+      addPoint(*map, a, 15.0, z);
+      addPoint(*map, -15.0, a, z);
+      addPoint(*map, 15.0, a, z);
+    }
+  }
+  const double pillars[][2] = {{-6.0, 4.0}, {3.0, -7.0}, {8.0, 6.0}, {-4.0, -9.0}};
+  for (const auto & pillar : pillars) {
+    for (double z = step; z < 4.0; z += step) {
+      for (int k = 0; k < 16; ++k) {
+        const double angle = 2.0 * M_PI * k / 16;
+        addPoint(*map, pillar[0] + 0.2 * std::cos(angle), pillar[1] + 0.2 * std::sin(angle), z);
+      }
+    }
+  }
+  for (double a = 0.0; a < 2.0; a += step) {
+    for (double z = step; z < 1.5; z += step) {
+      addPoint(*map, 4.0 + a, 2.0, z);
+      addPoint(*map, 4.0, 2.0 + a, z);
+    }
+  }
+  return map;
+}
+
+Eigen::Matrix4f makePose()
+{
+  Eigen::Affine3f pose(Eigen::AngleAxisf(0.02f, Eigen::Vector3f::UnitZ()));
+  pose.translation() = Eigen::Vector3f(0.2f, -0.1f, 0.05f);
+  return pose.matrix();
+}
+
+// The map points within 20 m of the pose, a few of them with noise, in the frame of the pose.
+Cloud::Ptr makeScan(const Cloud & map, const Eigen::Matrix4f & pose)
+{
+  std::mt19937 rng(1);
+  std::normal_distribution<float> noise(0.0f, 0.01f);
+  Cloud scan;
+  for (size_t i = 0; i < map.size(); i += 7) {
+    pcl::PointXYZI p = map.points[i];
+    if (std::hypot(p.x - pose(0, 3), p.y - pose(1, 3)) > 20.0f) {continue;}
+    p.x += noise(rng);
+    p.y += noise(rng);
+    p.z += noise(rng);
+    scan.push_back(p);
+  }
+  Cloud::Ptr local(new Cloud);
+  pcl::transformPointCloud(scan, *local, Eigen::Matrix4f(pose.inverse()));
+  return local;
+}
+
+// as configured by param/localization.yaml
+template<typename Registration>
+void configure(Registration & registration)
+{
+  registration.setResolution(1.0);
+  registration.setMaximumIterations(35);
+  registration.setTransformationEpsilon(0.01);
+}
+
+template<typename Registration>
+void expectAligned(Registration & registration)
+{
+  configure(registration);
+  const Cloud::Ptr map = makeMap();
+  const Eigen::Matrix4f pose = makePose();
+  registration.setInputTarget(map);
+  registration.setInputSource(makeScan(*map, pose));
+
+  Cloud output;
+  registration.align(output, Eigen::Matrix4f::Identity());
+  EXPECT_TRUE(registration.hasConverged());
+  const Eigen::Affine3f error(pose.inverse() * registration.getFinalTransformation());
+  EXPECT_LT(error.translation().norm(), 0.05f);
+  EXPECT_LT(Eigen::AngleAxisf(error.rotation()).angle(), 0.01f);
+  EXPECT_LT(registration.getFitnessScore(), 0.05);
+}
+
+// A scan placed off the map has nothing to match: it must not converge, and its fitness must
+// fail the score threshold so the pose is reported lost.
+template<typename Registration>
+void expectLost(Registration & registration)
+{
+  configure(registration);
+  const Cloud::Ptr map = makeMap();
+  registration.setInputTarget(map);
+  registration.setInputSource(makeScan(*map, makePose()));
+
+  Eigen::Matrix4f guess = Eigen::Matrix4f::Identity();
+  guess(0, 3) = 500.0f;
+  Cloud output;
+  registration.align(output, guess);
+  EXPECT_FALSE(registration.hasConverged());
+  EXPECT_GT(registration.getFitnessScore(), 2.0);
+}
+
+}  // namespace
+
+TEST(LazyNDT, ConvergesOnMap)
+{
+  LazyNDT ndt;
+  ndt.setStepSize(0.1);
+  expectAligned(ndt);
+}
+
+TEST(LazyNDT, ReportsScanOffMapAsLost)
+{
+  LazyNDT ndt;
+  expectLost(ndt);
+}
+
+TEST(LoamRegistration, ConvergesOnMap)
+{
+  LoamRegistration loam;
+  expectAligned(loam);
+}
+
+TEST(LoamRegistration, ReportsScanOffMapAsLost)
+{
+  LoamRegistration loam;
+  expectLost(loam);
+}
@@ -0,0 +1,94 @@
+#include <gtest/gtest.h>
+
+#include <lidar_localization/lidar_localization_component.hpp>
+
+#include <memory>
+#include <vector>
+
+namespace
+{
+
+// a flat grid of size x size points, spaced by step
+sensor_msgs::msg::PointCloud2::ConstSharedPtr makeMap(
+  const int size, const double step, const float z)
+{
+  pcl::PointCloud<pcl::PointXYZI> cloud;
+  for (int ix = 0; ix < size; ++ix) {
+    for (int iy = 0; iy < size; ++iy) {
+      pcl::PointXYZI p;
+      p.x = static_cast<float>(ix * step);
+      p.y = static_cast<float>(iy * step);
+      p.z = z + 0.1f * static_cast<float>((ix + iy) % 3);
+      p.intensity = 1.0f;
+      cloud.push_back(p);
+    }
+  }
+  auto msg = std::make_shared<sensor_msgs::msg::PointCloud2>();
+  pcl::toROSMsg(cloud, *msg);
+  msg->header.frame_id = "map";
+  return msg;
+}
+
+class TargetGeneration : public testing::Test
+{
+protected:
+  static void SetUpTestCase()
+  {
+    rclcpp::init(0, nullptr);
+  }
+
+  static void TearDownTestCase()
+  {
+    rclcpp::shutdown();
+  }
+
+  std::shared_ptr<PCLLocalization> makeNode()
+  {
+    rclcpp::NodeOptions options;
+    options.parameter_overrides(
+      std::vector<rclcpp::Parameter>{
+        rclcpp::Parameter("registration_method", "NDT"),
+        rclcpp::Parameter("enable_map_delta", true),
+        rclcpp::Parameter("use_pcd_map", false),
+        rclcpp::Parameter("set_initial_pose", false)});
+    auto node = std::make_shared<PCLLocalization>(options);
+    EXPECT_EQ(lifecycle_msgs::msg::State::PRIMARY_STATE_INACTIVE, node->configure().id());
+    return node;
+  }
+};
+
+}  // namespace
+
+// A map received while the target of a map delta is being built makes that build stale: the
+// build must neither replace the target of the new map nor be cached under its generation.
+TEST_F(TargetGeneration, MapReceivedDuringRebuildWins)
+{
+  auto node = makeNode();
+  node->mapReceived(makeMap(200, 0.25, 0.0f));
+  // large enough for its build to still run when the next map arrives
+  node->mapDeltaReceived(makeMap(600, 0.05, 1.0f));
+  const auto map = makeMap(100, 0.5, 2.0f);
+  node->mapReceived(map);
+  node->waitForTargetBuild();
+
+  std::lock_guard<std::mutex> lock(node->registration_mutex_);
+  ASSERT_TRUE(node->registration_);
+  EXPECT_EQ(map->width * map->height, node->registration_->getInputTarget()->size());
+  EXPECT_EQ(node->registration_, node->findCachedTarget(node->getTargetKey()));
+}
+
+// Without a map in between, the rebuilt target holds the tiles replaced by the delta.
+TEST_F(TargetGeneration, DeltaRebuildsTheTarget)
+{
+  auto node = makeNode();
+  node->mapReceived(makeMap(30, 0.5, 0.0f));
+  const auto delta = makeMap(10, 0.5, 1.0f);
+  node->mapDeltaReceived(delta);
+  node->waitForTargetBuild();
+
+  std::lock_guard<std::mutex> lock(node->registration_mutex_);
+  ASSERT_TRUE(node->registration_);
+  // the delta replaces the single tile holding the whole map
+  EXPECT_EQ(delta->width * delta->height, node->registration_->getInputTarget()->size());
+  EXPECT_EQ(node->registration_, node->findCachedTarget(node->getTargetKey()));
+}